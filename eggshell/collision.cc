@@ -632,7 +632,7 @@ TEST_FUNCTION(IntersectBoxAndRectangle) {
     // Create a random box and rectangle. Sometimes axes are shared, to check
     // for degeneracies.
     Box B, R;
-    SetRandomBox(&B, false, Vector3d());
+    SetRandomBox(&B, false, Vector3d::Zero());
     // Occasionally make the first or second axis of R the same as the first
     // axis of B.
     SetRandomBox(&R, (i & 1) == 0, B.R.col(0));
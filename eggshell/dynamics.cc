@@ -0,0 +1,672 @@
+
+#include "dynamics.h"
+#include "lcp.h"
+
+using Eigen::Vector3d;
+using Eigen::Matrix3d;
+using Eigen::Quaterniond;
+using Eigen::AngleAxisd;
+using Eigen::VectorXd;
+using Eigen::MatrixXd;
+using std::vector;
+using std::pair;
+
+namespace {
+
+// Constraint stabilization: the fraction of the position error (penetration
+// depth or joint separation) that is corrected in each step, and the depth
+// that contacts are allowed to penetrate without correction, to avoid jitter.
+const double kERP = 0.2;
+const double kSlop = 0.001;
+
+// Constraint force mixing, relative to the LCP matrix diagonal. This keeps
+// the matrix positive definite when there are redundant constraints, e.g. for
+// the four contacts between a box and the ground.
+const double kCFM = 1e-6;
+
+// Islands with more constraint rows than this are solved iteratively, with
+// this many iterations. The LCP solver time grows as the cube of the rows,
+// e.g. a stack of ten boxes has about 150 rows and its LCPs take about 20
+// times as long as the iterations.
+const int kMaxLCPRows = 64;
+const int kIterations = 50;
+
+// Contacts that move less than this between steps (relative to one of the
+// bodies) start the iterative solver from their last impulses.
+const double kWarmStartDistance = 0.01;
+
+const double kInfinity = __DBL_MAX__;
+
+inline double sqr(double x) { return x * x; }
+
+}  // anonymous namespace
+
+World::World() {
+  dt_ = 0.01;
+  mu_ = 0.5;
+  time_ = 0;
+  gravity_ = Vector3d(0, 0, -9.81);
+}
+
+int World::AddBox(const Vector3d &position, const Matrix3d &rotation,
+                  const Vector3d &side_lengths, double density) {
+  Body b;
+  b.position = position;
+  b.rotation = rotation;
+  b.velocity.setZero();
+  b.angular_velocity.setZero();
+  b.side_lengths = side_lengths;
+  const Vector3d &s = side_lengths;
+  b.mass = density * s[0] * s[1] * s[2];
+  b.inertia[0] = b.mass / 12 * (s[1] * s[1] + s[2] * s[2]);
+  b.inertia[1] = b.mass / 12 * (s[0] * s[0] + s[2] * s[2]);
+  b.inertia[2] = b.mass / 12 * (s[0] * s[0] + s[1] * s[1]);
+  bodies_.push_back(b);
+  // The broadphase box is set properly by the next step.
+  CHECK(broadphase_.Add(collision::AABB<3>()) == NumBodies() - 1);
+  return bodies_.size() - 1;
+}
+
+void World::AddBallJoint(int body1, int body2, const Vector3d &anchor) {
+  CHECK(body1 >= -1 && body1 < NumBodies());
+  CHECK(body2 >= -1 && body2 < NumBodies());
+  CHECK(body1 != body2);
+  Joint joint;
+  joint.body[0] = body1;
+  joint.body[1] = body2;
+  for (int k = 0; k < 2; k++) {
+    if (joint.body[k] >= 0) {
+      const Body &b = bodies_[joint.body[k]];
+      joint.anchor[k] = b.rotation.transpose() * (anchor - b.position);
+    } else {
+      joint.anchor[k] = anchor;
+    }
+  }
+  joints_.push_back(joint);
+  jointed_.insert(std::make_pair(std::min(body1, body2),
+                                 std::max(body1, body2)));
+}
+
+bool World::Step() {
+  stats_ = Statistics();
+
+  // External forces.
+  for (int i = 0; i < NumBodies(); i++) {
+    bodies_[i].velocity += dt_ * gravity_;
+  }
+
+  // Create the constraint rows.
+  rows_.clear();
+  FindContacts();
+  for (size_t i = 0; i < joints_.size(); i++) {
+    AddJointRows(joints_[i]);
+  }
+  for (size_t i = 0; i < rows_.size(); i++) {
+    FinishRow(&rows_[i]);
+  }
+
+  // Find islands, i.e. groups of bodies that are connected by constraints.
+  // The world is not part of any island.
+  island_.resize(bodies_.size());
+  for (size_t i = 0; i < island_.size(); i++) {
+    island_[i] = i;
+  }
+  for (size_t i = 0; i < rows_.size(); i++) {
+    const Row &row = rows_[i];
+    if (row.body[0] >= 0 && row.body[1] >= 0) {
+      island_[FindIsland(row.body[0])] = FindIsland(row.body[1]);
+    }
+  }
+  vector<vector<int> > island_rows(bodies_.size());
+  for (size_t i = 0; i < rows_.size(); i++) {
+    const Row &row = rows_[i];
+    island_rows[FindIsland(row.body[row.body[1] >= 0])].push_back(i);
+  }
+
+  // Solve each island.
+  bool ok = true;
+  double start_time = Now();
+  for (size_t i = 0; i < island_rows.size(); i++) {
+    const vector<int> &rows = island_rows[i];
+    if (rows.empty()) {
+      continue;
+    }
+    if (rows.size() <= kMaxLCPRows) {
+      ok &= SolveIsland(rows);
+    } else {
+      SolveIslandIteratively(rows);
+      stats_.num_iterative_islands++;
+    }
+    stats_.num_islands++;
+    stats_.max_island_rows = std::max<int>(stats_.max_island_rows,
+                                           rows.size());
+  }
+  stats_.solver_time = Now() - start_time;
+
+  // Keep the contact impulses for the next step.
+  impulses_.clear();
+  for (size_t i = 0; i < rows_.size(); i++) {
+    const Row &row = rows_[i];
+    if (row.type == NORMAL) {
+      ContactImpulse ci;
+      ci.local_position = row.local_position;
+      ci.impulse = Vector3d(row.lambda, rows_[i + 1].lambda,
+                            rows_[i + 2].lambda);
+      impulses_[std::make_pair(row.body[0], row.body[1])].push_back(ci);
+    }
+  }
+
+  // Move the bodies with their new velocities.
+  for (int i = 0; i < NumBodies(); i++) {
+    Body &b = bodies_[i];
+    b.position += dt_ * b.velocity;
+    double speed = b.angular_velocity.norm();
+    if (speed > 0) {
+      AngleAxisd rotation(speed * dt_, b.angular_velocity / speed);
+      Matrix3d R = rotation.toRotationMatrix() * b.rotation;
+      b.rotation = Quaterniond(R).normalized().toRotationMatrix();
+    }
+  }
+  time_ += dt_;
+  return ok;
+}
+
+void World::FindContacts() {
+  contacts_.clear();
+  for (int i = 0; i < NumBodies(); i++) {
+    const Body &b = bodies_[i];
+    Vector3d half = b.rotation.cwiseAbs() * b.side_lengths * 0.5;
+    collision::AABB<3> box;
+    for (int j = 0; j < 3; j++) {
+      box.min[j] = b.position[j] - half[j];
+      box.max[j] = b.position[j] + half[j];
+    }
+    broadphase_.Update(i, box);
+  }
+  broadphase_.FindOverlaps(&pairs_);
+  for (size_t i = 0; i < pairs_.size(); i++) {
+    if (jointed_.count(pairs_[i])) {
+      continue;
+    }
+    const Body &b1 = bodies_[pairs_[i].first];
+    const Body &b2 = bodies_[pairs_[i].second];
+    size_t start = contacts_.size();
+    CollideBoxes(b1.position, b1.rotation, b1.side_lengths,
+                 b2.position, b2.rotation, b2.side_lengths, 0, &contacts_);
+    for (size_t j = start; j < contacts_.size(); j++) {
+      AddContactRows(pairs_[i].first, pairs_[i].second, contacts_[j]);
+    }
+  }
+  for (int i = 0; i < NumBodies(); i++) {
+    bool jointed_to_world = jointed_.count(pair<int, int>(-1, i));
+    if (broadphase_.Box(i).min[2] <= 0 && !jointed_to_world) {
+      const Body &b = bodies_[i];
+      size_t start = contacts_.size();
+      CollideBoxAndGround(b.position, b.rotation, b.side_lengths, &contacts_);
+      for (size_t j = start; j < contacts_.size(); j++) {
+        AddContactRows(-1, i, contacts_[j]);
+      }
+    }
+  }
+  stats_.num_contacts = contacts_.size();
+}
+
+void World::AddContactRows(int body1, int body2, const ContactGeometry &c) {
+  // The contact normal points out of body1, so a positive normal impulse
+  // pushes body2 along the normal. Two friction directions are perpendicular
+  // to the normal.
+  Vector3d dir[3];
+  dir[0] = c.normal;
+  if (fabs(c.normal[0]) < 0.6) {
+    dir[1] = c.normal.cross(Vector3d(1, 0, 0)).normalized();
+  } else {
+    dir[1] = c.normal.cross(Vector3d(0, 1, 0)).normalized();
+  }
+  dir[2] = c.normal.cross(dir[1]);
+  // Start from the impulse of the nearest contact between the same bodies in
+  // the last step, if there was one close enough.
+  const Body &b2 = bodies_[body2];
+  Vector3d local = b2.rotation.transpose() * (c.position - b2.position);
+  const Vector3d *warm = 0;
+  auto it = impulses_.find(std::make_pair(body1, body2));
+  if (it != impulses_.end()) {
+    double best = sqr(kWarmStartDistance);
+    for (const ContactImpulse &ci : it->second) {
+      double d2 = (ci.local_position - local).squaredNorm();
+      if (d2 < best) {
+        best = d2;
+        warm = &ci.impulse;
+      }
+    }
+  }
+  int normal = rows_.size();
+  for (int i = 0; i < 3; i++) {
+    Row row;
+    row.type = (i == 0) ? NORMAL : FRICTION;
+    row.body[0] = body1;
+    row.body[1] = body2;
+    for (int k = 0; k < 2; k++) {
+      double sign = k ? 1 : -1;
+      if (row.body[k] >= 0) {
+        Vector3d r = c.position - bodies_[row.body[k]].position;
+        row.linear[k] = sign * dir[i];
+        row.angular[k] = sign * r.cross(dir[i]);
+      } else {
+        row.linear[k].setZero();
+        row.angular[k].setZero();
+      }
+    }
+    row.rhs = (i == 0) ? kERP / dt_ * std::max(c.depth - kSlop, 0.0) : 0;
+    row.normal = normal;
+    row.lambda = warm ? (*warm)[i] : 0;
+    row.local_position = local;
+    rows_.push_back(row);
+  }
+}
+
+void World::AddJointRows(const Joint &joint) {
+  // The two anchor points in global coordinates, and their offsets from the
+  // body centers.
+  Vector3d p[2], r[2];
+  for (int k = 0; k < 2; k++) {
+    if (joint.body[k] >= 0) {
+      const Body &b = bodies_[joint.body[k]];
+      r[k] = b.rotation * joint.anchor[k];
+      p[k] = b.position + r[k];
+    } else {
+      p[k] = joint.anchor[k];
+    }
+  }
+  for (int i = 0; i < 3; i++) {
+    Row row;
+    row.type = JOINT;
+    Vector3d axis = Vector3d::Unit(i);
+    for (int k = 0; k < 2; k++) {
+      double sign = k ? 1 : -1;
+      row.body[k] = joint.body[k];
+      if (row.body[k] >= 0) {
+        row.linear[k] = sign * axis;
+        row.angular[k] = sign * r[k].cross(axis);
+      } else {
+        row.linear[k].setZero();
+        row.angular[k].setZero();
+      }
+    }
+    row.rhs = -kERP / dt_ * (p[1][i] - p[0][i]);
+    row.normal = -1;
+    row.lambda = 0;
+    rows_.push_back(row);
+  }
+}
+
+void World::FinishRow(Row *row) const {
+  for (int k = 0; k < 2; k++) {
+    if (row->body[k] >= 0) {
+      const Body &b = bodies_[row->body[k]];
+      row->minv_linear[k] = row->linear[k] / b.mass;
+      row->minv_angular[k] = b.rotation * (b.rotation.transpose() *
+          row->angular[k]).cwiseQuotient(b.inertia);
+    } else {
+      row->minv_linear[k].setZero();
+      row->minv_angular[k].setZero();
+    }
+  }
+}
+
+int World::FindIsland(int body) {
+  while (island_[body] != body) {
+    island_[body] = island_[island_[body]];
+    body = island_[body];
+  }
+  return body;
+}
+
+bool World::SolveIsland(const vector<int> &rows) {
+  // The velocities after the impulses lambda are v + M^-1*J'*lambda, so the
+  // constraint J*v >= rhs is the LCP A*lambda = b + w with A = J*M^-1*J' and
+  // b = rhs - J*v. Only the lower triangle of A is needed. Each row of J has
+  // at most two bodies, so A is formed from the rows that share each body.
+  const int n = rows.size();
+  body_rows_.resize(bodies_.size());
+  vector<int> touched;
+  for (int i = 0; i < n; i++) {
+    const Row &row = rows_[rows[i]];
+    for (int k = 0; k < 2; k++) {
+      if (row.body[k] >= 0) {
+        vector<int> &list = body_rows_[row.body[k]];
+        if (list.empty()) {
+          touched.push_back(row.body[k]);
+        }
+        list.push_back(i * 2 + k);
+      }
+    }
+  }
+  MatrixXd A = MatrixXd::Zero(n, n);
+  for (int body : touched) {
+    vector<int> &list = body_rows_[body];
+    for (size_t p = 0; p < list.size(); p++) {
+      const Row &row1 = rows_[rows[list[p] / 2]];
+      int k1 = list[p] % 2;
+      for (size_t q = 0; q <= p; q++) {
+        const Row &row2 = rows_[rows[list[q] / 2]];
+        int k2 = list[q] % 2;
+        A(list[p] / 2, list[q] / 2) +=
+            row1.linear[k1].dot(row2.minv_linear[k2]) +
+            row1.angular[k1].dot(row2.minv_angular[k2]);
+      }
+    }
+    list.clear();
+  }
+  VectorXd b(n);
+  for (int i = 0; i < n; i++) {
+    const Row &row = rows_[rows[i]];
+    A(i, i) *= 1 + kCFM;
+    b[i] = row.rhs;
+    for (int k = 0; k < 2; k++) {
+      if (row.body[k] >= 0) {
+        const Body &body = bodies_[row.body[k]];
+        b[i] -= row.linear[k].dot(body.velocity) +
+                row.angular[k].dot(body.angular_velocity);
+      }
+    }
+  }
+
+  // The box LCP needs constant bounds but the friction bounds depend on the
+  // normal impulses. So first solve without friction, then solve again with
+  // the friction impulses bounded by mu times the first normal impulses.
+  // Friction rows with a zero bound are left out.
+  lcp::Settings settings;
+  settings.algorithm = lcp::COTTLE_DANTZIG;     // Faster than MURTY here
+  VectorXd lambda = VectorXd::Zero(n);
+  bool ok = true;
+  for (int pass = 0; pass < 2; pass++) {
+    vector<int> subset;
+    vector<double> lo, hi;
+    for (int i = 0; i < n; i++) {
+      const Row &row = rows_[rows[i]];
+      if (row.type == NORMAL) {
+        subset.push_back(i);
+        lo.push_back(0);
+        hi.push_back(kInfinity);
+      } else if (row.type == JOINT) {
+        subset.push_back(i);
+        lo.push_back(-kInfinity);
+        hi.push_back(kInfinity);
+      } else if (pass == 1) {
+        // The normal row comes before its friction rows.
+        double bound = mu_ * lambda[i - (rows[i] - row.normal)];
+        if (bound > 0) {
+          subset.push_back(i);
+          lo.push_back(-bound);
+          hi.push_back(bound);
+        }
+      }
+    }
+    const int m = subset.size();
+    MatrixXd Asub(m, m);
+    VectorXd bsub(m), losub(m), hisub(m), x, w;
+    for (int p = 0; p < m; p++) {
+      for (int q = 0; q <= p; q++) {
+        Asub(p, q) = A(subset[p], subset[q]);
+      }
+      bsub[p] = b[subset[p]];
+      losub[p] = lo[p];
+      hisub[p] = hi[p];
+    }
+    if (!lcp::SolveLCP(settings, Asub, bsub, losub, hisub, &x, &w)) {
+      // Keep the impulses from the first pass if there were any.
+      ok = false;
+      break;
+    }
+    lambda.setZero();
+    for (int p = 0; p < m; p++) {
+      lambda[subset[p]] = x[p];
+    }
+  }
+
+  // Apply the impulses.
+  for (int i = 0; i < n; i++) {
+    Row &row = rows_[rows[i]];
+    row.lambda = lambda[i];
+    for (int k = 0; k < 2; k++) {
+      if (row.body[k] >= 0) {
+        Body &body = bodies_[row.body[k]];
+        body.velocity += lambda[i] * row.minv_linear[k];
+        body.angular_velocity += lambda[i] * row.minv_angular[k];
+      }
+    }
+  }
+  return ok;
+}
+
+void World::SolveIslandIteratively(const vector<int> &island_rows) {
+  // Projected Gauss-Seidel: solve for each impulse in turn with the others
+  // held fixed, clamp it to its bounds and apply the change to the body
+  // velocities straight away. The friction bounds use the current normal
+  // impulses. The rows are visited from the top down (against gravity), so
+  // that in a stack the weight of each body reaches the ground within one
+  // iteration. The sort is stable so each contact's rows stay together.
+  const int n = island_rows.size();
+  vector<pair<double, int> > order(n);
+  for (int i = 0; i < n; i++) {
+    const Row &row = rows_[island_rows[i]];
+    double height = 0;
+    int count = 0;
+    for (int k = 0; k < 2; k++) {
+      if (row.body[k] >= 0) {
+        height -= gravity_.dot(bodies_[row.body[k]].position);
+        count++;
+      }
+    }
+    order[i] = std::make_pair(-height / count, island_rows[i]);
+  }
+  std::stable_sort(order.begin(), order.end(),
+      [](const pair<double, int> &a, const pair<double, int> &b) {
+        return a.first < b.first;
+      });
+  vector<int> rows(n);
+  for (int i = 0; i < n; i++) {
+    rows[i] = order[i].second;
+  }
+  vector<double> lambda(n, 0), inverse_diagonal(n);
+  for (int i = 0; i < n; i++) {
+    const Row &row = rows_[rows[i]];
+    double diagonal = 0;
+    for (int k = 0; k < 2; k++) {
+      diagonal += row.linear[k].dot(row.minv_linear[k]) +
+                  row.angular[k].dot(row.minv_angular[k]);
+      if (row.body[k] >= 0) {
+        Body &body = bodies_[row.body[k]];
+        body.velocity += row.lambda * row.minv_linear[k];
+        body.angular_velocity += row.lambda * row.minv_angular[k];
+      }
+    }
+    inverse_diagonal[i] = 1 / (diagonal * (1 + kCFM));
+    lambda[i] = row.lambda;
+  }
+  for (int iteration = 0; iteration < kIterations; iteration++) {
+    for (int i = 0; i < n; i++) {
+      const Row &row = rows_[rows[i]];
+      double jv = 0;
+      for (int k = 0; k < 2; k++) {
+        if (row.body[k] >= 0) {
+          const Body &body = bodies_[row.body[k]];
+          jv += row.linear[k].dot(body.velocity) +
+                row.angular[k].dot(body.angular_velocity);
+        }
+      }
+      double lo = -kInfinity, hi = kInfinity;
+      if (row.type == NORMAL) {
+        lo = 0;
+      } else if (row.type == FRICTION) {
+        hi = mu_ * lambda[i - (rows[i] - row.normal)];
+        lo = -hi;
+      }
+      double new_lambda = std::max(lo, std::min(hi,
+          lambda[i] + (row.rhs - jv) * inverse_diagonal[i]));
+      double delta = new_lambda - lambda[i];
+      lambda[i] = new_lambda;
+      for (int k = 0; k < 2; k++) {
+        if (row.body[k] >= 0) {
+          Body &body = bodies_[row.body[k]];
+          body.velocity += delta * row.minv_linear[k];
+          body.angular_velocity += delta * row.minv_angular[k];
+        }
+      }
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    rows_[rows[i]].lambda = lambda[i];
+  }
+}
+
+//***************************************************************************
+// Testing.
+
+#include <stdio.h>
+#include "testing.h"
+#include "random.h"
+
+namespace {
+
+// Step the world for the given time, checking that every step succeeds.
+void Simulate(World *world, double duration) {
+  while (world->Time() < duration) {
+    CHECK(world->Step());
+  }
+}
+
+TEST_FUNCTION(WorldBoxRestsOnGround) {
+  // A box dropped onto the ground should come to rest at the right height.
+  World world;
+  Matrix3d R = AngleAxisd(0.3, Vector3d(0, 0, 1)).toRotationMatrix();
+  int box = world.AddBox(Vector3d(0, 0, 0.5), R, Vector3d(1, 0.5, 0.4), 1000);
+  Simulate(&world, 2);
+  const World::Body &b = world.body(box);
+  printf("Position = %g,%g,%g, speed = %g\n", b.position[0], b.position[1],
+         b.position[2], b.velocity.norm());
+  CHECK(fabs(b.position[2] - 0.2) < 2e-3);
+  CHECK(Vector3d(b.position[0], b.position[1], 0).norm() < 1e-6);
+  CHECK(b.velocity.norm() < 1e-3 && b.angular_velocity.norm() < 1e-3);
+  CHECK(world.stats().num_contacts == 4);
+}
+
+TEST_FUNCTION(WorldFriction) {
+  // A box sliding on the ground with speed v stops in distance v^2/(2*mu*g).
+  const double kSpeed = 2, kMu = 0.5;
+  World world;
+  world.SetFriction(kMu);
+  int box = world.AddBox(Vector3d(0, 0, 0.25), Matrix3d::Identity(),
+                         Vector3d(0.5, 0.5, 0.5), 1000);
+  Simulate(&world, 0.1);
+  world.body(box).velocity = Vector3d(kSpeed, 0, 0);
+  Simulate(&world, 2);
+  double distance = world.body(box).position[0];
+  double expected = kSpeed * kSpeed / (2 * kMu * 9.81);
+  printf("Stopping distance = %g, expected %g\n", distance, expected);
+  CHECK(fabs(distance - expected) < 0.05 * expected);
+  CHECK(world.body(box).velocity.norm() < 1e-3);
+}
+
+TEST_FUNCTION(WorldPendulum) {
+  // A chain of boxes hanging from the world by ball joints, released from
+  // horizontal. The joints should stay close to together (the position
+  // errors are only corrected gradually), and the chain should swing to
+  // nearly the same height on the other side.
+  World world;
+  const int kLinks = 5;
+  const double kLength = 0.4;
+  int last = -1;
+  for (int i = 0; i < kLinks; i++) {
+    int link = world.AddBox(Vector3d((i + 0.5) * kLength, 0, 3),
+                            Matrix3d::Identity(),
+                            Vector3d(kLength * 0.9, 0.1, 0.1), 1000);
+    world.AddBallJoint(last, link, Vector3d(i * kLength, 0, 3));
+    last = link;
+  }
+  double min_x = 0, max_error = 0;
+  while (world.Time() < 3) {
+    CHECK(world.Step());
+    min_x = std::min(min_x, world.body(last).position[0]);
+    double error = 0;
+    for (int i = 1; i < kLinks; i++) {
+      const World::Body &b1 = world.body(i - 1), &b2 = world.body(i);
+      Vector3d p1 = b1.position + b1.rotation * Vector3d(kLength / 2, 0, 0);
+      Vector3d p2 = b2.position + b2.rotation * Vector3d(-kLength / 2, 0, 0);
+      error = std::max(error, (p1 - p2).norm());
+    }
+    max_error = std::max(max_error, error);
+  }
+  printf("Chain end swung to x = %g, max joint error = %g\n", min_x,
+         max_error);
+  CHECK(max_error < 0.1 * kLength);
+  CHECK(min_x < -0.75 * kLinks * kLength);
+}
+
+// Step a world for a number of steps and print the steps per second.
+void Benchmark(const char *name, World *world, int steps) {
+  double start_time = Now();
+  double solver_time = 0;
+  int max_island_rows = 0, max_iterative_islands = 0;
+  for (int i = 0; i < steps; i++) {
+    CHECK(world->Step());
+    solver_time += world->stats().solver_time;
+    max_island_rows = std::max(max_island_rows,
+                               world->stats().max_island_rows);
+    max_iterative_islands = std::max(max_iterative_islands,
+                                     world->stats().num_iterative_islands);
+  }
+  double time = Now() - start_time;
+  printf("%s: %d bodies, %d contacts, largest island %d rows, up to %d "
+         "iterative islands: %.1f steps/s (%.0f%% solving)\n", name,
+         world->NumBodies(), world->stats().num_contacts, max_island_rows,
+         max_iterative_islands, steps / time, solver_time / time * 100);
+}
+
+TEST_FUNCTION(WorldBenchmark) {
+  RandomSeed(1);
+  const double kSide = 0.5;
+  const Vector3d kBoxSize(kSide, kSide, kSide);
+
+  // Stacks of boxes on a grid. They should remain standing.
+  {
+    World world;
+    const int kGrid = 5, kHeight = 10;
+    for (int i = 0; i < kGrid * kGrid; i++) {
+      for (int j = 0; j < kHeight; j++) {
+        world.AddBox(Vector3d(i % kGrid * 2 * kSide, i / kGrid * 2 * kSide,
+                              (j + 0.5) * kSide), Matrix3d::Identity(),
+                     kBoxSize, 1000);
+      }
+    }
+    Benchmark("Stacks", &world, 200);
+    for (int i = 0; i < world.NumBodies(); i++) {
+      const World::Body &b = world.body(i);
+      int stack = i / kHeight;
+      Vector3d home(stack % kGrid * 2 * kSide, stack / kGrid * 2 * kSide, 0);
+      CHECK((b.position - home).head(2).norm() < 0.02 * kSide);
+    }
+  }
+
+  // Boxes of random sizes and orientations dropped from layers of a grid,
+  // which land on each other in a pile.
+  {
+    World world;
+    const int kGrid = 6, kCount = 300;
+    for (int i = 0; i < kCount; i++) {
+      Vector3d p(i % kGrid + 0.2 * RandomDouble(),
+                 i / kGrid % kGrid + 0.2 * RandomDouble(),
+                 1 + i / (kGrid * kGrid));
+      Quaterniond q(RandomDouble() - 0.5, RandomDouble() - 0.5,
+                    RandomDouble() - 0.5, RandomDouble() - 0.5);
+      world.AddBox(p, q.normalized().toRotationMatrix(),
+                   kBoxSize * (0.5 + 0.5 * RandomDouble()), 1000);
+    }
+    Benchmark("Pile", &world, 300);
+    for (int i = 0; i < world.NumBodies(); i++) {
+      CHECK(world.body(i).position[2] > 0);
+    }
+  }
+}
+
+}  // anonymous namespace
@@ -0,0 +1,139 @@
+#ifndef __DYNAMICS_H__
+#define __DYNAMICS_H__
+
+// A time stepping rigid body world. Bodies are boxes that collide with each
+// other and with the ground plane z=0, and that can be connected by ball
+// joints. Each step finds the contacts with a broadphase and the box collision
+// functions, then solves for the constraint impulses of each group of
+// connected bodies as a box LCP, with friction bounded by the normal impulses.
+// Larger groups (e.g. a stack or pile of boxes) are instead solved with
+// projected Gauss-Seidel iterations, since the LCP solver time grows as the
+// cube of the number of constraints. The iterations start from the contact
+// impulses of the previous step.
+// A World does no drawing, so it can be stepped without a user interface.
+
+#include <vector>
+#include <set>
+#include <map>
+#include <utility>
+#include <Eigen/Dense>
+#include "collision.h"
+#include "../toolkit/collision.h"
+#include "error.h"
+
+class World {
+ public:
+  struct Body {
+    Eigen::Vector3d position;           // Center of mass, global coordinates
+    Eigen::Matrix3d rotation;           // Body to global rotation
+    Eigen::Vector3d velocity;           // Linear velocity of the center
+    Eigen::Vector3d angular_velocity;   // Global coordinates
+    Eigen::Vector3d side_lengths;       // Box size
+    double mass;
+    Eigen::Vector3d inertia;            // Principal moments, body coordinates
+  };
+
+  struct Statistics {
+    int num_contacts = 0;
+    int num_islands = 0;                // Groups of bodies solved together
+    int num_iterative_islands = 0;      // Islands too big for the LCP
+    int max_island_rows = 0;            // Constraint rows in largest island
+    double solver_time = 0;             // Seconds finding the impulses
+  };
+
+  World();
+
+  // Parameters.
+  void SetTimeStep(double dt) { dt_ = dt; }
+  void SetGravity(const Eigen::Vector3d &g) { gravity_ = g; }
+  void SetFriction(double mu) { mu_ = mu; }
+
+  // Add a box with the given density and return its body index.
+  int AddBox(const Eigen::Vector3d &position, const Eigen::Matrix3d &rotation,
+             const Eigen::Vector3d &side_lengths, double density);
+
+  // Connect two bodies at the global point 'anchor', so that the bodies can
+  // rotate around it. Either body can be -1 to attach the other one to the
+  // world at that point. Bodies that are connected by a joint do not collide.
+  void AddBallJoint(int body1, int body2, const Eigen::Vector3d &anchor);
+
+  // Advance the world by one time step. Return false if the constraint
+  // impulses could not be found, in which case the bodies are still moved
+  // but without some of their constraints.
+  bool Step() MUST_USE_RESULT;
+
+  // Accessors.
+  int NumBodies() const { return bodies_.size(); }
+  Body &body(int i) { return bodies_[i]; }
+  const Body &body(int i) const { return bodies_[i]; }
+  double Time() const { return time_; }
+  const Statistics &stats() const { return stats_; }
+
+  // The contacts found by the last step, for drawing.
+  const std::vector<ContactGeometry> &Contacts() const { return contacts_; }
+
+ private:
+  struct Joint {
+    int body[2];                        // Body indexes or -1 for the world
+    Eigen::Vector3d anchor[2];          // In body coordinates (or global)
+  };
+
+  // One row of the constraint Jacobian J, for a contact direction or a joint
+  // axis. The row constrains the velocities of at most two bodies.
+  enum RowType { NORMAL, FRICTION, JOINT };
+  struct Row {
+    RowType type;
+    int body[2];                        // Body indexes or -1 for the world
+    Eigen::Vector3d linear[2];          // Jacobian for each body's velocity
+    Eigen::Vector3d angular[2];         // Jacobian for each body's ang.vel.
+    Eigen::Vector3d minv_linear[2];     // M^-1 J' for each body
+    Eigen::Vector3d minv_angular[2];
+    double rhs;                         // Target or minimum J*v
+    int normal;                         // For FRICTION, the NORMAL row
+    double lambda;                      // Impulse
+    Eigen::Vector3d local_position;     // Contact point in body[1]
+  };
+
+  // The impulses found for a contact, to start the next step from.
+  struct ContactImpulse {
+    Eigen::Vector3d local_position;     // Contact in body[1] coordinates
+    Eigen::Vector3d impulse;            // Normal and two friction impulses
+  };
+
+  double dt_, mu_, time_;
+  Eigen::Vector3d gravity_;
+  std::vector<Body> bodies_;
+  std::vector<Joint> joints_;
+  std::set<std::pair<int, int> > jointed_;      // Body pairs not to collide
+  collision::Broadphase<3> broadphase_;         // IDs are body indexes
+  std::vector<ContactGeometry> contacts_;
+  std::vector<Row> rows_;
+  Statistics stats_;
+  // The contact impulses of the last step, by body pair.
+  std::map<std::pair<int, int>, std::vector<ContactImpulse> > impulses_;
+
+  // Temporaries for Step(), kept to avoid reallocating them.
+  std::vector<std::pair<int, int> > pairs_;
+  std::vector<int> island_;                     // Union-find parent of body
+  std::vector<std::vector<int> > body_rows_;    // Rows of island, by body
+
+  // Find the contacts and add their rows.
+  void FindContacts();
+  void AddContactRows(int body1, int body2, const ContactGeometry &c);
+  void AddJointRows(const Joint &joint);
+
+  // Fill in the M^-1 J' parts of a row.
+  void FinishRow(Row *row) const;
+
+  // Solve for the impulses of one island and apply them to the body
+  // velocities. Return false if the LCP could not be solved.
+  bool SolveIsland(const std::vector<int> &rows);
+
+  // Approximately solve for the impulses of a large island and apply them to
+  // the body velocities.
+  void SolveIslandIteratively(const std::vector<int> &rows);
+
+  int FindIsland(int body);
+};
+
+#endif
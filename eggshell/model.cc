@@ -1,48 +1,54 @@
 
 #include "model.h"
-#include "collision.h"
+#include "dynamics.h"
 
 using Eigen::Vector3d;
-using Eigen::Vector3f;
 using Eigen::Matrix3d;
-using Eigen::Matrix4d;
-using Eigen::Quaterniond;
+using Eigen::AngleAxisd;
 
-static double angle1 = 0.5;
-static double angle2 = 0;
+static World world;
 
 void SimulationInitialization() {
+  // A stack of boxes.
+  const Vector3d size(0.5, 0.5, 0.5);
+  for (int i = 0; i < 6; i++) {
+    world.AddBox(Vector3d(1, 0, 0.25 + i * 0.5), Matrix3d::Identity(), size,
+                 1000);
+  }
+
+  // A chain of boxes hanging from a point above the stack, released to the
+  // side so that it swings into the stack.
+  int last = -1;
+  for (int i = 0; i < 4; i++) {
+    int link = world.AddBox(Vector3d(-0.3 - i * 0.4, 0, 3.5),
+                            Matrix3d::Identity(), Vector3d(0.35, 0.1, 0.1),
+                            1000);
+    world.AddBallJoint(last, link, Vector3d(-0.1 - i * 0.4, 0, 3.5));
+    last = link;
+  }
+
+  // Some tilted boxes dropped next to the stack.
+  for (int i = 0; i < 5; i++) {
+    Matrix3d R = AngleAxisd(0.3 * i, Vector3d(1, 1, 0).normalized())
+                 .toRotationMatrix();
+    world.AddBox(Vector3d(2, 0.1 * i, 1 + i * 0.8), R,
+                 Vector3d(0.6, 0.4, 0.3), 500);
+  }
 }
 
 bool SimulationStep() {
-  Eigen::AngleAxisd Raa1(angle1, Vector3d(0, 0, 1));
-  Eigen::AngleAxisd Raa2(angle2, Vector3d(0, 1, 0));
-  Quaterniond q = Raa1 * Raa2;
-  Matrix3d R = q.matrix();
-  DrawBox(Vector3d(1, 0, 0.5), R, Vector3d(1, 0.5, 0.5));
-  DrawBox(Vector3d(1.65, 0, 0.5), Matrix3d::Identity(), Vector3d(0.3, 1, 1));
-
-  DrawCapsule(Vector3d(-1, 0, 0.5), R, 0.2, 0.6);
-
-  DrawSphere(Vector3d(0, 0, 0.5), R, 0.3);
-
-  DrawPoint(Vector3d(0, 0, 0));
-  DrawLine(Vector3d(0, 0, 0), Vector3d(0, 0, 1));
-
-  // Generate contact points and normals from a box and render them.
-  std::vector<ContactGeometry> contacts;
-  CollideBoxAndGround(Vector3d(1, 0, 0.5), R, Vector3d(1, 0.5, 0.5),
-                      &contacts);
-  CollideBoxes(Vector3d(1, 0, 0.5), R, Vector3d(1, 0.5, 0.5),
-               Vector3d(1.65, 0, 0.5), Matrix3d::Identity(),
-               Vector3d(0.3, 1, 1), 0, &contacts);
+  bool ok = world.Step();
+  for (int i = 0; i < world.NumBodies(); i++) {
+    const World::Body &b = world.body(i);
+    DrawBox(b.position, b.rotation, b.side_lengths);
+  }
+
+  // Draw the contact points and normals.
+  const std::vector<ContactGeometry> &contacts = world.Contacts();
   for (int i = 0; i < contacts.size(); i++) {
     DrawPoint(contacts[i].position);
     DrawLine(contacts[i].position,
              contacts[i].position + contacts[i].normal * 0.1);
   }
-
-  angle1 += 0.01;
-  angle2 += 0.002;
-  return true;
+  return ok;
 }
@@ -0,0 +1,592 @@
+// Rama Simulator, Copyright (C) 2014-2020 Russell Smith.
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+
+// Headless batch runner for Rama scripts. This runs a script without Qt or
+// OpenGL, optionally sweeping a parameter, and writes the results to
+// text files. It starts quickly, so large numbers of jobs can be run on a
+// compute farm.
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <map>
+#include "../script_runner.h"
+#include "../version.h"
+#include "../../toolkit/error.h"
+#include "../../toolkit/crash_handler.h"
+#include "../../toolkit/testing.h"
+#include "../../toolkit/mystring.h"
+#include "../../toolkit/optimizer.h"
+#include "../../toolkit/thread.h"
+#include "../../toolkit/trace.h"
+
+using std::string;
+using std::vector;
+using std::map;
+
+static const char *kUsage =
+"Rama " __APP_VERSION__ " batch runner. Usage:\n"
+"\n"
+"  rama-batch [options] [-key=value ...] script.lua\n"
+"\n"
+"Arguments of the form -key=value are passed to the script in the FLAGS\n"
+"table. Options are:\n"
+"\n"
+"  --param=LABEL=VALUE    Set a parameter value (can be repeated)\n"
+"  --sweep=LABEL,START,END,STEPS\n"
+"                         Sweep a parameter from START to END in STEPS steps\n"
+"  --frequency=N          Frequency index for optimize, test and field\n"
+"                         outputs (default 0)\n"
+"  --optimize=LABEL       Optimize a parameter to minimize the errors\n"
+"                         returned by config.optimize() (can be repeated)\n"
+"  --optimizer=NAME       Optimizer to use: lm (Levenberg-Marquardt, the\n"
+"                         default), dogleg or nelder-mead\n"
+"  --field                Write the mesh and solution to a .mat file\n"
+"  --output=PREFIX        Prefix of output files (default: script name)\n"
+"  --threads=N            Number of sweep points or optimizer derivative\n"
+"                         runs to compute at once. Scripts that set\n"
+"                         config.thread_safe=false use 1.\n"
+"  --trace=FILE           Write a timeline of where the time was spent to\n"
+"                         FILE, in the Chrome trace event JSON format\n"
+"  -test                  Run config.test(), exit with status 1 on errors\n"
+"  -unittest              Run all unit tests\n"
+"\n"
+"The swept outputs (port powers or mode cutoff frequencies) are written to\n"
+"PREFIX.txt, one line per sweep point and frequency. The optimized parameter\n"
+"values and the config.optimize() errors for them are written to\n"
+"PREFIX_optimize.txt.\n";
+
+void LuaPanic(const char *message) {
+  Panic("%s", message);
+}
+
+// Everything parsed from the command line.
+struct Options {
+  string script_filename;
+  map<string, string> flags;
+  map<string, double> parameters;
+  string sweep_label;                   // Empty if there is no sweep
+  double sweep_start, sweep_end;
+  int sweep_steps;
+  int frequency;
+  bool field, test;
+  string output;
+  int threads;
+  string trace_filename;                // Empty for no trace
+  vector<string> optimize_labels;       // Empty if not optimizing
+  OptimizerType optimizer_type;
+
+  Options() : sweep_start(0), sweep_end(0), sweep_steps(0), frequency(0),
+              field(false), test(false),
+              threads(IdealThreadCount()),
+              optimizer_type(OptimizerType::LEVENBERG_MARQUARDT) {}
+};
+
+// The results computed for one sweep point.
+struct PointResult {
+  bool ok;
+  vector<string> messages;
+  vector<double> frequencies;           // One per solution
+  vector<vector<JetComplex>> outputs;   // One per solution
+  vector<JetNum> test_output;
+  bool thread_safe;                     // config.thread_safe
+};
+
+static bool ParseOptions(int argc, char **argv, Options *opt) {
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    const char *equals = strchr(arg, '=');
+    if (strncmp(arg, "--param=", 8) == 0) {
+      const char *value = strchr(arg + 8, '=');
+      double v;
+      if (!value || value == arg + 8 || !StrToDouble(value + 1, &v)) {
+        Error("Bad argument '%s', expecting --param=LABEL=VALUE", arg);
+        return false;
+      }
+      opt->parameters[string(arg + 8, value - arg - 8)] = v;
+    } else if (strncmp(arg, "--sweep=", 8) == 0) {
+      // Split at the last three commas, as the label may contain commas.
+      string s = arg + 8;
+      size_t c3 = s.rfind(',');
+      size_t c2 = (c3 == string::npos || c3 == 0) ? c3 : s.rfind(',', c3 - 1);
+      size_t c1 = (c2 == string::npos || c2 == 0) ? c2 : s.rfind(',', c2 - 1);
+      if (c1 == string::npos || c1 == 0 || c2 == string::npos ||
+          !StrToDouble(s.substr(c1 + 1, c2 - c1 - 1).c_str(),
+                       &opt->sweep_start) ||
+          !StrToDouble(s.substr(c2 + 1, c3 - c2 - 1).c_str(),
+                       &opt->sweep_end) ||
+          !StrToInt(s.substr(c3 + 1).c_str(), &opt->sweep_steps) ||
+          opt->sweep_steps < 1) {
+        Error("Bad argument '%s', expecting --sweep=LABEL,START,END,STEPS",
+              arg);
+        return false;
+      }
+      opt->sweep_label = s.substr(0, c1);
+    } else if (strncmp(arg, "--frequency=", 12) == 0) {
+      if (!StrToInt(arg + 12, &opt->frequency) || opt->frequency < 0) {
+        Error("Bad argument '%s'", arg);
+        return false;
+      }
+    } else if (strncmp(arg, "--threads=", 10) == 0) {
+      if (!StrToInt(arg + 10, &opt->threads) || opt->threads < 1) {
+        Error("Bad argument '%s'", arg);
+        return false;
+      }
+    } else if (strncmp(arg, "--optimize=", 11) == 0 && arg[11]) {
+      opt->optimize_labels.push_back(arg + 11);
+    } else if (strncmp(arg, "--optimizer=", 12) == 0) {
+      if (strcmp(arg + 12, "lm") == 0) {
+        opt->optimizer_type = OptimizerType::LEVENBERG_MARQUARDT;
+      } else if (strcmp(arg + 12, "dogleg") == 0) {
+        opt->optimizer_type = OptimizerType::SUBSPACE_DOGLEG;
+      } else if (strcmp(arg + 12, "nelder-mead") == 0) {
+        opt->optimizer_type = OptimizerType::NELDER_MEAD;
+      } else {
+        Error("Bad argument '%s', expecting lm, dogleg or nelder-mead", arg);
+        return false;
+      }
+    } else if (strncmp(arg, "--output=", 9) == 0) {
+      opt->output = arg + 9;
+    } else if (strncmp(arg, "--trace=", 8) == 0 && arg[8]) {
+      opt->trace_filename = arg + 8;
+    } else if (strcmp(arg, "--field") == 0) {
+      opt->field = true;
+    } else if (strcmp(arg, "-test") == 0) {
+      opt->test = true;
+    } else if (arg[0] == '-' && arg[1] != '-' && equals && equals >= arg + 2) {
+      opt->flags[string(arg + 1, equals - arg - 1)] = equals + 1;
+    } else if (arg[0] == '-') {
+      Error("Unknown option '%s'", arg);
+      return false;
+    } else if (!opt->script_filename.empty()) {
+      Error("Only one script can be specified on the command line");
+      return false;
+    } else {
+      opt->script_filename = arg;
+    }
+  }
+  if (opt->script_filename.empty()) {
+    Error("No script was specified");
+    return false;
+  }
+  if (!opt->optimize_labels.empty() &&
+      (!opt->sweep_label.empty() || opt->test || opt->field)) {
+    Error("--optimize can not be used with --sweep, --field or -test");
+    return false;
+  }
+  if (opt->output.empty()) {
+    opt->output = opt->script_filename;
+    if (opt->output.size() > 4 &&
+        opt->output.compare(opt->output.size() - 4, 4, ".lua") == 0) {
+      opt->output.resize(opt->output.size() - 4);
+    }
+  }
+  return true;
+}
+
+static bool ReadFile(const string &filename, string *contents) {
+  FILE *fin = fopen(filename.c_str(), "rb");
+  if (!fin) {
+    Error("Can not open '%s' (%s)", filename.c_str(), strerror(errno));
+    return false;
+  }
+  contents->clear();
+  char buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), fin)) > 0) {
+    contents->append(buffer, n);
+  }
+  bool ok = !ferror(fin);
+  fclose(fin);
+  if (!ok) {
+    Error("Can not read '%s'", filename.c_str());
+  }
+  return ok;
+}
+
+// Give the runner the FLAGS and parameter values from the command line.
+static void SetFlagsAndParameters(const Options &opt, ScriptRunner *runner) {
+  for (auto &it : opt.flags) {
+    runner->SetFlag(it.first, it.second);
+  }
+  for (auto &it : opt.parameters) {
+    runner->SetParameter(it.first, it.second);
+  }
+}
+
+// Run the script for one sweep point, with an optional parameter override.
+static void ComputePoint(const Options &opt, const string &script,
+                         const char *sweep_label, double sweep_value,
+                         const string &field_filename, PointResult *result) {
+  Trace trace(__func__);
+  ScriptRunner runner;
+  SetFlagsAndParameters(opt, &runner);
+  if (sweep_label) {
+    runner.SetParameter(sweep_label, sweep_value);
+  }
+  bool ok = runner.Run(script) && runner.CreateSolver();
+  string error;
+  if (ok && opt.frequency >= runner.solvers().Size()) {
+    StringPrintf(&error, "There is no frequency index %d", opt.frequency);
+    ok = false;
+  }
+  if (ok && opt.test) {
+    runner.SetDisplayedSolution(opt.frequency);
+    ok = runner.CallTest(&result->test_output);
+  } else if (ok) {
+    for (int i = 0; ok && i < runner.solvers().Size(); i++) {
+      runner.SetDisplayedSolution(i);
+      result->frequencies.push_back(runner.config().TypeIsElectrodynamic() ?
+                                    runner.config().frequencies[i] : 0);
+      result->outputs.resize(i + 1);
+      ok = runner.ComputeSweptOutput(&result->outputs[i]);
+    }
+    runner.SetDisplayedSolution(opt.frequency);
+    if (ok && opt.field) {
+      runner.solvers().At(opt.frequency)->
+          SaveMeshAndSolutionToMatlab(field_filename.c_str());
+    }
+  }
+  result->ok = ok && !runner.ThereWereErrors();
+  result->thread_safe = runner.ThreadSafe();
+  result->messages = runner.Messages();
+  if (!error.empty()) {
+    result->messages.push_back(error);
+  }
+}
+
+static FILE *OpenOutput(const string &filename) {
+  FILE *fout = fopen(filename.c_str(), "wt");
+  if (!fout) {
+    Error("Can not write '%s' (%s)", filename.c_str(), strerror(errno));
+  }
+  return fout;
+}
+
+// Write the trace events recorded since TraceStart().
+static bool WriteTrace(const string &filename) {
+  string json;
+  TraceChromeJSON(&json);
+  FILE *fout = OpenOutput(filename);
+  if (!fout) {
+    return false;
+  }
+  fputs(json.c_str(), fout);
+  fclose(fout);
+  return true;
+}
+
+// Run the script with the given values of the parameters being optimized and
+// call config.optimize(). The parameters first..first+kJetWidth-1 are given
+// unit derivatives, so the derivatives of the errors are those columns of the
+// Jacobian. Use first=-1 for no derivatives.
+static bool ComputeOptimizeErrors(const Options &opt, const string &script,
+                                  const vector<double> &values, int first,
+                                  vector<JetNum> *errors,
+                                  vector<string> *messages) {
+  Trace trace(__func__);
+  ScriptRunner runner;
+  SetFlagsAndParameters(opt, &runner);
+  for (int i = 0; i < values.size(); i++) {
+    int k = first < 0 ? -1 : i - first;
+    runner.SetParameter(opt.optimize_labels[i], values[i],
+                        k < kJetWidth ? k : -1);
+  }
+  bool ok = runner.Run(script) && runner.CreateSolver();
+  string error;
+  if (ok && opt.frequency >= runner.solvers().Size()) {
+    StringPrintf(&error, "There is no frequency index %d", opt.frequency);
+    ok = false;
+  }
+  runner.SetDisplayedSolution(opt.frequency);
+  ok = ok && runner.CallOptimize(errors) && !runner.ThereWereErrors();
+  *messages = runner.Messages();
+  if (!error.empty()) {
+    messages->push_back(error);
+  }
+  return ok;
+}
+
+static void PrintMessages(const vector<string> &messages) {
+  for (const string &message : messages) {
+    printf("%s\n", message.c_str());
+  }
+}
+
+// Optimize the --optimize parameters to minimize the errors returned by
+// config.optimize(), as LuaModelViewer::Optimize() does. Each evaluation runs
+// the script once for every kJetWidth parameters to get the Jacobian from the
+// parameter derivatives, and those runs are computed concurrently. The best
+// parameters found are written to PREFIX_optimize.txt. Return true on
+// success.
+static bool Optimize(const Options &opt, const string &script) {
+  // Run the script once to find the parameter bounds, the number of errors
+  // and if the script is thread safe.
+  const int num_parameters = opt.optimize_labels.size();
+  vector<AbstractOptimizer::ParameterInformation> start(num_parameters);
+  int num_errors = 0, threads = 1;
+  {
+    vector<JetNum> errors;
+    ScriptRunner runner;
+    SetFlagsAndParameters(opt, &runner);
+    runner.SetDisplayedSolution(opt.frequency);
+    bool ok = runner.Run(script) && runner.CreateSolver();
+    if (ok && opt.frequency >= runner.solvers().Size()) {
+      Error("There is no frequency index %d", opt.frequency);
+      ok = false;
+    }
+    ok = ok && runner.CallOptimize(&errors) && !runner.ThereWereErrors();
+    PrintMessages(runner.Messages());
+    if (!ok) {
+      return false;
+    }
+    if (errors.empty()) {
+      Error("The config.optimize() function must return one or more error "
+            "values.");
+      return false;
+    }
+    num_errors = errors.size();
+    threads = runner.ThreadSafe() ? opt.threads : 1;
+    for (int i = 0; i < num_parameters; i++) {
+      const string &label = opt.optimize_labels[i];
+      auto it = runner.ScriptParameters().find(label);
+      if (it == runner.ScriptParameters().end()) {
+        Error("The script has no parameter '%s'.", label.c_str());
+        return false;
+      }
+      if (it->second.integer) {
+        Error("Can not optimize the integer parameter '%s'.", label.c_str());
+        return false;
+      }
+      auto value = opt.parameters.find(label);
+      start[i].starting_value = value != opt.parameters.end() ?
+                                value->second : it->second.the_default;
+      start[i].min_value = it->second.the_min;
+      start[i].max_value = it->second.the_max;
+      start[i].gradient_step = 0;       // Numerical jacobians disallowed
+    }
+  }
+
+  // Create the optimizer, with the same settings as the GUI.
+  AbstractOptimizer *optimizer = OptimizerFactory(opt.optimizer_type);
+  if (!optimizer) {
+    Error("The lm and dogleg optimizers need Ceres, which is not in this "
+          "build.");
+    return false;
+  }
+  #ifdef __TOOLKIT_USE_CERES__
+    if (opt.optimizer_type != OptimizerType::NELDER_MEAD) {
+      CeresInteractiveOptimizer::Settings settings;
+      settings.function_tolerance = 1e-6;
+      settings.parameter_tolerance = 1e-4;
+      // Gradients computed from mesh derivatives are not perfectly accurate,
+      // so:
+      settings.gradient_tolerance = 0;
+      optimizer->SetSettings(settings);
+    }
+  #endif
+  if (opt.optimizer_type == OptimizerType::NELDER_MEAD) {
+    optimizer->SetSettings(NelderMeadOptimizer::Settings());
+  }
+  optimizer->Initialize(start, num_errors);
+  if (optimizer->Parameters().empty()) {
+    Error("Optimizer interrupted (could not initialize)");
+    delete optimizer;
+    return false;
+  }
+
+  // Evaluate config.optimize() wherever the optimizer asks until it is done.
+  //    jacobians[j*num_parameters + i] = d error[j] / d parameter[i]
+  bool done = false;
+  int evaluations = 0;
+  while (!done) {
+    const vector<double> &params = optimizer->Parameters();
+    int num_runs = !optimizer->JacobianRequested() ? 1 :
+                   (num_parameters + kJetWidth - 1) / kJetWidth;
+    vector<vector<JetNum>> errors(num_runs);
+    vector<vector<string>> messages(num_runs);
+    vector<char> ok(num_runs);
+    ParallelFor(0, num_runs - 1, threads, [&](int r) {
+      ok[r] = ComputeOptimizeErrors(opt, script, params, r * kJetWidth,
+                                    &errors[r], &messages[r]);
+    });
+    for (int r = 0; r < num_runs; r++) {
+      if (!ok[r] || errors[r].size() != num_errors) {
+        PrintMessages(messages[r]);
+        Error("Optimizer interrupted (script failed)");
+        delete optimizer;
+        return false;
+      }
+    }
+    vector<double> jacobians;
+    if (optimizer->JacobianRequested()) {
+      jacobians.resize(num_parameters * num_errors);
+      for (int i = 0; i < num_parameters; i++) {
+        for (int j = 0; j < num_errors; j++) {
+          jacobians[j*num_parameters + i] =
+            errors[i / kJetWidth][j].Derivative(i % kJetWidth);
+        }
+      }
+    }
+    vector<double> errors_d(num_errors);
+    double sum = 0;
+    for (int j = 0; j < num_errors; j++) {
+      errors_d[j] = ToDouble(errors[0][j]);
+      sum += errors_d[j] * errors_d[j];
+    }
+    evaluations++;
+    printf("Evaluation %d: error %.10g\n", evaluations, sum);
+    done = optimizer->DoOneIteration(errors_d, jacobians);
+  }
+  bool succeeded = optimizer->OptimizerSucceeded();
+  vector<double> best = optimizer->BestParameters();
+  delete optimizer;
+  if (!succeeded) {
+    Error("Optimizer failed, writing the best parameters found");
+  }
+
+  // The last parameters evaluated are not necessarily the best ones, so
+  // evaluate the best ones again to get the errors to write.
+  vector<JetNum> errors;
+  vector<string> messages;
+  bool ok = ComputeOptimizeErrors(opt, script, best, -1, &errors, &messages);
+  PrintMessages(messages);
+  if (!ok) {
+    return false;
+  }
+  FILE *fout = OpenOutput(opt.output + "_optimize.txt");
+  if (!fout) {
+    return false;
+  }
+  fprintf(fout, "# Optimizer %s after %d evaluations\n",
+          succeeded ? "succeeded" : "failed", evaluations);
+  fprintf(fout, "# parameter value\n");
+  for (int i = 0; i < num_parameters; i++) {
+    fprintf(fout, "%s %.10g\n", opt.optimize_labels[i].c_str(), best[i]);
+  }
+  fprintf(fout, "# config.optimize() errors\n");
+  for (const JetNum &value : errors) {
+    fprintf(fout, "%.10g\n", ToDouble(value));
+  }
+  fclose(fout);
+  return succeeded;
+}
+
+int main(int argc, char **argv) {
+  #if !defined(__WINNT__)
+    SetupCrashHandling();
+  #endif
+
+  // If the -unittest flag is given on the command line, run all tests and exit.
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-unittest") == 0) {
+      testing::RunAll();
+      exit(0);
+    }
+  }
+
+  Options opt;
+  if (argc < 2 || !ParseOptions(argc, argv, &opt)) {
+    fprintf(stderr, "\n%s", kUsage);
+    return 1;
+  }
+  string script;
+  if (!ReadFile(opt.script_filename, &script)) {
+    return 1;
+  }
+
+  if (!opt.optimize_labels.empty()) {
+    TraceStart();
+    bool ok = Optimize(opt, script);
+    if (!opt.trace_filename.empty() && !WriteTrace(opt.trace_filename)) {
+      return 1;
+    }
+    return ok ? 0 : 1;
+  }
+
+  // Compute all sweep points. Each point has its own ScriptRunner so they can
+  // be computed concurrently. The first point is computed alone to find out
+  // if the script allows that, as config.thread_safe is only known after the
+  // script has run.
+  int num_points = opt.sweep_label.empty() ? 1 : opt.sweep_steps + 1;
+  vector<PointResult> results(num_points);
+  vector<double> sweep_values(num_points, 0);
+  TraceStart();
+  auto compute_point = [&](int i) {
+    const char *label = 0;
+    string field_filename = opt.output + "_field.mat";
+    if (!opt.sweep_label.empty()) {
+      label = opt.sweep_label.c_str();
+      sweep_values[i] = opt.sweep_start +
+          (opt.sweep_end - opt.sweep_start) * i / opt.sweep_steps;
+      StringPrintf(&field_filename, "%s_field_%d.mat", opt.output.c_str(), i);
+    }
+    ComputePoint(opt, script, label, sweep_values[i], field_filename,
+                 &results[i]);
+  };
+  compute_point(0);
+  int threads = results[0].thread_safe ? opt.threads : 1;
+  ParallelFor(1, num_points - 1, threads, compute_point);
+  if (!opt.trace_filename.empty() && !WriteTrace(opt.trace_filename)) {
+    return 1;
+  }
+
+  // Show all messages and write the outputs.
+  bool ok = true;
+  for (int i = 0; i < num_points; i++) {
+    for (const string &message : results[i].messages) {
+      if (num_points > 1) {
+        printf("[%d] %s\n", i, message.c_str());
+      } else {
+        printf("%s\n", message.c_str());
+      }
+    }
+    ok &= results[i].ok;
+  }
+  if (opt.test) {
+    // The config.test() outputs are only shown, as in the GUI's test mode.
+    for (int i = 0; i < num_points; i++) {
+      if (results[i].test_output.empty()) {
+        continue;
+      }
+      printf("test:");
+      for (const JetNum &value : results[i].test_output) {
+        printf(" %.10g", ToDouble(value));
+      }
+      printf("\n");
+    }
+    return ok ? 0 : 1;
+  }
+  FILE *fout = OpenOutput(opt.output + ".txt");
+  if (!fout) {
+    return 1;
+  }
+  fprintf(fout, "# %sfrequency outputs(real imag)...\n",
+          opt.sweep_label.empty() ? "" : "sweep_value ");
+  for (int i = 0; i < num_points; i++) {
+    for (int j = 0; j < results[i].outputs.size(); j++) {
+      if (!opt.sweep_label.empty()) {
+        fprintf(fout, "%.10g ", sweep_values[i]);
+      }
+      fprintf(fout, "%.10g", results[i].frequencies[j]);
+      for (const JetComplex &value : results[i].outputs[j]) {
+        fprintf(fout, " %.10g %.10g", ToDouble(value.real()),
+                ToDouble(value.imag()));
+      }
+      fprintf(fout, "\n");
+    }
+  }
+  fclose(fout);
+  return ok ? 0 : 1;
+}
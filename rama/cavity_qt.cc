@@ -12,6 +12,7 @@
 
 #include "cavity_qt.h"
 #include "mesh.h"
+#include "script_runner.h"
 #include "../toolkit/mat_file.h"
 #include "../toolkit/gl_font.h"
 #include "../toolkit/plot_gui.h"
@@ -58,6 +59,7 @@ Cavity::Cavity(QWidget *parent)
 }
 
 Cavity::~Cavity() {
+  ShutdownParallelSweeps();
 }
 
 bool Cavity::IsModelEmpty() {
@@ -142,7 +144,7 @@ void Cavity::ScriptJustRan(bool only_compute_derivatives) {
     // field solution derived from it are no longer valid.
     if (GetLua()->ThereWereErrors() ||
         (solver_.Valid() && !solver_.SameAs(cd_, config_, GetLua()))) {
-      solver_.Clear();
+      solver_.ClearKeepingMesh();
     }
   }
 
@@ -153,23 +155,11 @@ void Cavity::ScriptJustRan(bool only_compute_derivatives) {
 }
 
 void Cavity::CreatePortPowerAndPhase(int solution_index) {
-  vector<JetComplex> port_powers;
-  if (CreateSolver() && solver_.At(solution_index)->
-      ComputePortOutgoingPower(&port_powers)) {
-    // Create port_power and port_phase argument tables.
-    lua_newtable(GetLua()->L());
-    for (int i = 0; i < port_powers.size(); i++) {
-      lua_pushnumber(GetLua()->L(), abs(port_powers[i]));
-      lua_rawseti(GetLua()->L(), -2, i + 1);
-    }
-    lua_newtable(GetLua()->L());
-    for (int i = 0; i < port_powers.size(); i++) {
-      lua_pushnumber(GetLua()->L(), arg(port_powers[i]));
-      lua_rawseti(GetLua()->L(), -2, i + 1);
-    }
-  } else {
-    // If CreateSolver() fails it should emit an error, but we emit one
-    // more here just to be safe.
+  // If CreateSolver() fails it should emit an error, but we emit one more
+  // here just to be safe. Zero tables are pushed in that case.
+  CreateSolver();
+  if (!LuaSolverPushPortPowerAndPhase(GetLua()->L(), &solver_,
+                                      solution_index)) {
     GetLua()->Error("Can not compute a solution");
   }
 }
@@ -583,6 +573,41 @@ bool Cavity::ComputeSweptOutput(std::vector<JetComplex> *output) {
   return true;
 }
 
+void Cavity::PrepareSweepPoint(SweepPoint *point) {
+  point->solution_index = displayed_soln_;
+}
+
+bool Cavity::ComputeSweptOutputInParallel(const SweepPoint &point,
+                                          vector<JetComplex> *output,
+                                          vector<string> *messages) {
+  // Run a separate copy of the script, as OnInvisibleHandSweep() and
+  // ComputeSweptOutput() would.
+  ScriptRunner runner;
+  for (auto &it : point.flags) {
+    runner.SetFlag(it.first, it.second);
+  }
+  for (auto &it : point.parameters) {
+    auto d = point.derivatives.find(it.first);
+    runner.SetParameter(it.first, it.second,
+                        d == point.derivatives.end() ? -1 : d->second);
+  }
+  runner.SetDisplayedSolution(point.solution_index);
+  output->clear();
+  bool ok = runner.Run(point.script);
+  if (ok && point.test_output) {
+    vector<JetNum> test_output;
+    ok = runner.CallTest(&test_output);
+    for (int i = 0; i < test_output.size(); i++) {
+      output->push_back(JetComplex(test_output[i]));
+    }
+  }
+  if (ok && output->empty()) {
+    ok = runner.ComputeSweptOutput(output);
+  }
+  *messages = runner.Messages();
+  return ok;
+}
+
 void Cavity::PrepareForOptimize() {
   // Clear solver in case we already have a solution for this shape but with
   // wrong derivative.
@@ -808,100 +833,29 @@ int Cavity::LuaDraw(lua_State *L) {
 }
 
 int Cavity::LuaGetField(lua_State *L) {
-  if (lua_gettop(L) != 2) {
-    LuaError(L, "Usage: _GetField(x,y)");
-  }
-  if (!solver_.Valid()) {
-    // Likely config.optimize is being called with dummy arguments without the
-    // field having been solved for. Just return zeros.
-    lua_pushnumber(L, 0);
-    lua_pushnumber(L, 0);
-    return 2;
-  }
-  JetComplex value;
-  solver_.At(optimizer_soln_)->
-        GetField(luaL_checknumber(L, 1), luaL_checknumber(L, 2), &value);
-  lua_pushnumber(L, value.real());
-  lua_pushnumber(L, value.imag());
-  return 2;
+  return LuaSolverGetField(L, &solver_, optimizer_soln_);
 }
 
 int Cavity::LuaPattern(lua_State *L) {
-  if (lua_gettop(L) != 1) {
-    LuaError(L, "Usage: _Pattern(theta)");
-  }
-  JetNum theta = luaL_checknumber(L, 1) * M_PI / 180.0;         // To radians
-  if (!solver_.Valid()) {
-    // If there is no solver_ it's likely config.optimize is being called with
-    // dummy arguments without the field having been solved for.
-    lua_pushnumber(L, 0);
-  } else {
-    JetNum value;
-    if (solver_.At(optimizer_soln_)->LookupAntennaPattern(theta, &value)) {
-      lua_pushnumber(L, sqr(abs(value)));
-    } else {
-      lua_pushnumber(L, 0);
-    }
-  }
-  return 1;
+  return LuaSolverPattern(L, &solver_, optimizer_soln_);
 }
 
 int Cavity::LuaDirectivity(lua_State *L) {
-  if (lua_gettop(L) != 0) {
-    LuaError(L, "Usage: _Directivity()");
-  }
-  if (!solver_.Valid()) {
-    // If there is no solver_ it's likely config.optimize is being called with
-    // dummy arguments without the field having been solved for.
-    lua_pushnumber(L, 0);
-  } else {
-    lua_pushnumber(L, ComputeAntennaDirectivity(optimizer_soln_));
-  }
-  return 1;
+  return LuaSolverDirectivity(L, &solver_, optimizer_soln_);
 }
 
 int Cavity::LuaGetFieldPoynting(lua_State *L) {
-  if (lua_gettop(L) != 2) {
-    LuaError(L, "Usage: _GetFieldPoynting(x,y)");
-  }
-  if (!solver_.Valid()) {
-    // Likely config.optimize is being called with dummy arguments without the
-    // field having been solved for. Just return zeros.
-    lua_pushnumber(L, 0);
-    lua_pushnumber(L, 0);
-    return 2;
-  }
-  JetPoint poynting;
-  solver_.At(optimizer_soln_)->
-    GetFieldPoynting(luaL_checknumber(L, 1), luaL_checknumber(L, 2), &poynting);
-  lua_pushnumber(L, poynting[0]);
-  lua_pushnumber(L, poynting[1]);
-  return 2;
+  return LuaSolverGetFieldPoynting(L, &solver_, optimizer_soln_);
 }
 
 int Cavity::LuaSelect(lua_State *L) {
-  if (lua_gettop(L) != 1) {
-    LuaError(L, "Usage: _Select(n)");
-  }
-  int n = ToDouble(lua_tonumber(L, 1));
-  if (n < 1 || n > config_.frequencies.size()) {
-    LuaError(L, "Usage: _Select(n), invalid n");
-  }
-  optimizer_soln_ = n - 1;
-  return 0;
+  return LuaSolverSelect(L, config_, &optimizer_soln_);
 }
 
 int Cavity::LuaSolveAll(lua_State *L) {
-  if (lua_gettop(L) != 0) {
-    LuaError(L, "Usage: _SolveAll()");
-  }
-  if (solver_.Solve()) {
-    // Ignore result.
-  }
-  return 0;
+  return LuaSolverSolveAll(L, &solver_);
 }
 
-
 int Cavity::LuaPorts(lua_State *) {
   CreatePortPowerAndPhase(optimizer_soln_);
   return 2;
@@ -917,7 +871,8 @@ bool Cavity::CreateSolver() {
     if (cd_.IsEmpty()) {
       return false;
     }
-    solver_.PushBack(new Solver(cd_, config_, GetLua(), 0));
+    solver_.PushBack(new Solver(cd_, config_, GetLua(), 0,
+                                solver_.PreviousMesh()));
     if (config_.TypeIsElectrodynamic()) {
       for (int i = 1; i < config_.frequencies.size(); i++) {
         solver_.PushBack(new Solver(solver_.First(), i));
@@ -928,6 +883,14 @@ bool Cavity::CreateSolver() {
       solver_.Clear();
     }
 
+    // A fast sweep solves all frequencies together, so do it now rather than
+    // letting each solver solve its own frequency on demand.
+    if (solver_.Valid() && config_.fast_sweep > 0) {
+      if (!solver_.Solve()) {
+        // Ignore result, errors are reported when solutions are used.
+      }
+    }
+
     // Check for errors to display. These errors might come from the callbacks
     // if they were not caught in the initial run of the script.
     if (SelectScriptMessagesIfErrors()) {
@@ -994,145 +957,7 @@ void Cavity::DrawGrid() {
 }
 
 void Cavity::SetConfigFromTable() {
-  #define GET_FIELD(fieldname, required, fn1, fn2, ltype, minval, def) \
-    lua_getfield(L, -1, #fieldname); \
-    if (lua_type(L, -1) == LUA_TNIL) { \
-      /* Field not available, set to the default value (usually -1). */ \
-      config_.fieldname = static_cast<typeof(config_.fieldname)>(def); \
-      if (required) { \
-        GetLua()->Error("config." #fieldname " is required"); \
-      } \
-    } else { \
-      if (lua_tonumber(L, -1).Derivative() != 0) { \
-        GetLua()->Error("config." #fieldname " can not depend on " \
-                        "parameters as this will confuse the optimizer"); \
-      } \
-      config_.fieldname = fn1(fn2(L, -1)); \
-      if (lua_type(L, -1) != ltype || config_.fieldname < minval || \
-          config_.fieldname != fn1(fn2(L, -1))) { \
-        config_.fieldname = static_cast<typeof(config_.fieldname)>(-1); \
-        GetLua()->Error("config." #fieldname " is not valid"); \
-      } \
-    } \
-    lua_pop(L, 1);
-  lua_State *L = GetLua()->L();
-  GET_FIELD(type, true, ScriptConfig::StringToType, lua_tostring,
-            LUA_TSTRING, 0, -1)
-  GET_FIELD(unit, true, DistanceScale, lua_tostring, LUA_TSTRING, 0, -1)
-  GET_FIELD(mesh_edge_length, true, ToDouble, lua_tonumber, LUA_TNUMBER, 0, -1)
-  GET_FIELD(depth, config_.type == ScriptConfig::EXY, ToDouble, lua_tonumber,
-            LUA_TNUMBER, 0, -1)
-  GET_FIELD(boresight, false, ToDouble, lua_tonumber, LUA_TNUMBER, -1e99, 0)
-  GET_FIELD(max_modes, config_.TypeIsWaveguideMode(), ToDouble, lua_tonumber,
-            LUA_TNUMBER, 1, 1)
-  GET_FIELD(dxf_arc_dist, false, ToDouble, lua_tonumber, LUA_TNUMBER, 0, 0)
-  GET_FIELD(dxf_arc_angle, false, ToDouble, lua_tonumber, LUA_TNUMBER, 0, 0)
-  #undef GET_FIELD
-  config_.schrodinger = false;                  // Default
-  if (config_.type == ScriptConfig::SCHRODINGER) {
-    config_.type = ScriptConfig::EZ;
-    config_.schrodinger = true;
-  }
-
-  // Handle wideband_window specially because it is an enumeration.
-  config_.wideband_window = config_.RECTANGLE;  // Default
-  lua_getfield(L, -1, "wideband_window");       // Stack: wideband_window
-  if (lua_type(L, -1) != LUA_TNIL) {
-    if (strcmp(lua_tostring(L, -1), "rectangle") == 0) {
-      config_.wideband_window = config_.RECTANGLE;
-    } else if (strcmp(lua_tostring(L, -1), "hamming") == 0) {
-      config_.wideband_window = config_.HAMMING;
-    } else {
-      GetLua()->Error("config.wideband_window is not valid");
-    }
-  }
-  lua_pop(L, 1);
-
-  // Handle antenna_pattern specially because it is an enumeration.
-  config_.antenna_pattern = config_.AT_ABC;     // Default
-  lua_getfield(L, -1, "antenna_pattern");       // Stack: antenna_pattern
-  if (lua_type(L, -1) != LUA_TNIL) {
-    if (strcmp(lua_tostring(L, -1), "at_ABC") == 0) {
-      config_.antenna_pattern = config_.AT_ABC;
-    } else if (strcmp(lua_tostring(L, -1), "at_far_field_material") == 0) {
-      config_.antenna_pattern = config_.AT_FF_MATERIAL;
-    } else if (strcmp(lua_tostring(L, -1), "at_boundary") == 0) {
-      config_.antenna_pattern = config_.AT_BOUNDARY;
-    } else {
-      GetLua()->Error("config.antenna_pattern is not valid");
-    }
-  }
-  lua_pop(L, 1);
-
-  // Handle excited_port specially because it can be a number or a table.
-  config_.port_excitation.clear();
-  lua_getfield(L, -1, "excited_port");  // Stack: excited_port
-  if (lua_type(L, -1) == LUA_TNIL) {
-    if (config_.TypeIsElectrodynamic()) {
-      GetLua()->Error("config.excited_port is required");
-    }
-  } else if (lua_type(L, -1) == LUA_TNUMBER) {
-    double excited_port_d = ToDouble(lua_tonumber(L, -1));
-    int excited_port = excited_port_d;
-    if (excited_port < 1 || excited_port != excited_port_d) {
-      GetLua()->Error("config.excited_port is not valid");
-    }
-    config_.port_excitation.resize(excited_port * 2);
-    config_.port_excitation[excited_port * 2 - 2] = 1;
-  } else if (lua_type(L, -1) == LUA_TTABLE) {
-    lua_len(L, -1);                     // Stack: T len
-    int length = lua_tointeger(L, -1);
-    lua_pop(L, 1);                      // Stack: T
-    for (int i = 1; i <= length; i++) {
-      lua_geti(L, -1, i);               // Stack: T T[i]
-      config_.port_excitation.push_back(lua_tonumber(L, -1));
-      lua_pop(L, 1);                    // Stack: T
-    }
-  } else {
-    GetLua()->Error("config.excited_port is not valid");
-  }
-  lua_pop(L, 1);
-
-  // Handle config.frequency specially because it can be a number or a table.
-  config_.frequencies.clear();
-  lua_getfield(L, -1, "frequency");     // Stack: frequencies
-  if (lua_type(L, -1) == LUA_TNIL) {
-    if (config_.TypeIsElectrodynamic()) {
-      GetLua()->Error("config.frequency is required");
-    }
-  } else {
-    if (config_.TypeIsWaveguideMode()) {
-      GetLua()->Error("config.frequency is not used for mode solutions");
-    }
-    if (lua_type(L, -1) == LUA_TNUMBER) {
-      int ok = 0;
-      config_.frequencies.push_back(ToDouble(lua_tonumberx(L, -1, &ok)));
-      if (!ok || config_.frequencies.back() < 0) {
-        GetLua()->Error("config.frequency has invalid frequency "
-                        "(not a number or < 0)");
-      }
-    } else if (lua_type(L, -1) == LUA_TTABLE) {
-      lua_len(L, -1);                     // Stack: T len
-      int length = lua_tointeger(L, -1);
-      if (length <= 0) {
-        GetLua()->Error("config.frequency must contain at least one entry");
-      }
-      lua_pop(L, 1);                      // Stack: T
-      for (int i = 1; i <= length; i++) {
-        lua_geti(L, -1, i);               // Stack: T T[i]
-        int ok = 0;
-        config_.frequencies.push_back(ToDouble(lua_tonumberx(L, -1, &ok)));
-        lua_pop(L, 1);                    // Stack: T
-        if (!ok || config_.frequencies.back() < 0) {
-          GetLua()->Error("config.frequency has invalid frequency "
-                          "(not a number or < 0)");
-        }
-      }
-    } else {
-      GetLua()->Error("config.frequency is not valid");
-    }
-  }
-  lua_pop(L, 1);
+  config_.SetFromTable(GetLua());
 
   // Make sure solution indexes are in the correct range.
   displayed_soln_ = std::max(0,
@@ -1152,46 +977,30 @@ void Cavity::OnAnimationTimeout() {
 }
 
 JetNum Cavity::ComputeAntennaDirectivity(int solution_index) {
-  vector<double> azimuth;
-  vector<JetComplex> field;
   CreateSolver();
-  if (solver_.Valid() && solver_.At(solution_index)->
-                            ComputeAntennaPattern(&azimuth, &field)) {
-    CHECK(azimuth.size() == field.size());
-    vector<JetNum> magnitude(field.size());
-    for (int i = 0; i < field.size(); i++) {
-      magnitude[i] = abs(field[i]);
-    }
-    JetNum power_avg = 0, power_max = 0;
-    for (int i = 0; i < magnitude.size(); i++) {
-      int inext = (i + 1) % magnitude.size();
-      int iprev = (i + magnitude.size() - 1) % magnitude.size();
-      double delta_angle = azimuth[inext] - azimuth[iprev];
-      if (delta_angle < 0) {
-        delta_angle += 2 * M_PI;
-      }
-      delta_angle /= 2.0;
-      power_avg += sqr(magnitude[i]) * delta_angle / (2 * M_PI);
-      power_max = std::max(power_max, sqr(magnitude[i]));
-    }
-    return power_max / power_avg;
+  if (solver_.Valid()) {
+    return solver_.At(solution_index)->ComputeAntennaDirectivity();
   }
   return 0;
 }
 
 void Cavity::PlotAntennaPattern() {
-  vector<double> azimuth;
-  vector<JetComplex> field;
   vector<Plot::Axis> axis_stack;
   axis_stack = antenna_pattern_plot_->plot().GetAxisStack();
   antenna_pattern_plot_->plot().Clear();
   CreateSolver();
+  // The patterns for all frequencies are computed together and stored in the
+  // solvers, so changing the displayed frequency does not recompute them.
   if (!antenna_show_ || !solver_.Valid() ||
-      !solver_.At(displayed_soln_)->ComputeAntennaPattern(&azimuth, &field)) {
+      !solver_.ComputeAntennaPatterns()) {
     // The antenna pattern can't be (or should not be) computed, e.g. because
     // there is no valid solution, no useful boundary, or the effective k
     // doesn't support propagating waves.
   } else {
+    const vector<double> &azimuth =
+        solver_.At(displayed_soln_)->AntennaAzimuth();
+    const vector<JetComplex> &field =
+        solver_.At(displayed_soln_)->AntennaField();
     vector<double> x(azimuth.size()), y(azimuth.size());
     double maxy = -1e99;
     for (int i = 0; i < azimuth.size(); i++) {
@@ -1228,14 +1037,14 @@ void Cavity::PlotAntennaPattern() {
 }
 
 void Cavity::ExportAntennaPatternMatlab(const char *filename) {
-  vector<double> azimuth;
-  vector<JetComplex> field;
   CreateSolver();
-  if (!solver_.Valid() ||
-      !solver_.At(displayed_soln_)->ComputeAntennaPattern(&azimuth, &field)) {
+  Solver *solver = solver_.Valid() ? solver_.At(displayed_soln_) : 0;
+  if (!solver || !solver->ComputeAntennaPattern()) {
     Error("Antenna pattern can't be computed");
     return;
   }
+  const vector<double> &azimuth = solver->AntennaAzimuth();
+  const vector<JetComplex> &field = solver->AntennaField();
   CHECK(azimuth.size() == field.size());
 
   // Compute phase center correction factors.
@@ -1244,10 +1053,10 @@ void Cavity::ExportAntennaPatternMatlab(const char *filename) {
     xcorrection[i] = 1;
     ycorrection[i] = 1;
   }
-  solver_.At(displayed_soln_)->AdjustAntennaPhaseCenter(
-      JetPoint(config_.unit, 0), azimuth, &xcorrection);
-  solver_.At(displayed_soln_)->AdjustAntennaPhaseCenter(
-      JetPoint(0, config_.unit), azimuth, &ycorrection);
+  solver->AdjustAntennaPhaseCenter(JetPoint(config_.unit, 0), azimuth,
+                                   &xcorrection);
+  solver->AdjustAntennaPhaseCenter(JetPoint(0, config_.unit), azimuth,
+                                   &ycorrection);
 
   // Export to matlab file.
   MatFile mat(filename);
@@ -37,6 +37,11 @@ class Cavity : public LuaModelViewer {
       const std::vector<std::vector<JetComplex> > &sweep_output);
   bool ComputeSweptOutput(std::vector<JetComplex> *output);
   void PrepareForOptimize();
+  bool CanSweepInParallel() { return true; }
+  void PrepareSweepPoint(SweepPoint *point);
+  bool ComputeSweptOutputInParallel(const SweepPoint &point,
+                                    std::vector<JetComplex> *output,
+                                    std::vector<std::string> *messages);
 
   // Define virtual functions from GLViewer.
   void GetBoundingBox(double bounds[6]);
@@ -57,6 +57,22 @@ void LuaCallback::Push(lua_State *L) const {
   CHECK(lua_gettop(L) == top + 1);              // One return value
 }
 
+void LuaCallback::Hash(md5_state_t *ms) const {
+  md5_append(ms, (const md5_byte_t*) &index_, sizeof(index_));
+  md5_append(ms, (const md5_byte_t*) hash_.data(), hash_.size());
+}
+
+void HashValue(const JetNum &x, md5_state_t *ms) {
+  // Adding zero turns -0 into +0, as they compare equal.
+  double value = ToDouble(x) + 0.0;
+  md5_append(ms, (const md5_byte_t*) &value, sizeof(value));
+}
+
+void HashValue(const JetComplex &x, md5_state_t *ms) {
+  HashValue(x.real(), ms);
+  HashValue(x.imag(), ms);
+}
+
 bool ToJetComplex(lua_State *L, int index, JetComplex *value) {
   int top = lua_gettop(L);
   if (lua_type(L, index) == LUA_TNUMBER) {
@@ -125,6 +141,47 @@ bool ToJetComplexVector(lua_State *L, int index,
   return false;
 }
 
+bool ToJetNumVectors(lua_State *L, std::vector<JetNum> *x,
+                     std::vector<JetNum> *y) {
+  LuaVector *vx = LuaCastTo<LuaVector>(L, 1);
+  LuaVector *vy = LuaCastTo<LuaVector>(L, 2);
+  if (!vx && !vy) {
+    return false;
+  }
+  if (!vx || !vy) {
+    LuaError(L, "Arguments should both be numbers or both be vectors");
+  }
+  if (vx->size() != vy->size()) {
+    LuaError(L, "Vector arguments should have the same size");
+  }
+  x->resize(vx->size());
+  y->resize(vy->size());
+  for (int i = 0; i < vx->size(); i++) {
+    (*x)[i] = (*vx)[i];
+    (*y)[i] = (*vy)[i];
+  }
+  return true;
+}
+
+void LuaPushVector(lua_State *L, const std::vector<JetNum> &v) {
+  LuaVector *result = LuaUserClassCreateObj<LuaVector>(L);
+  result->resize(v.size());
+  for (int i = 0; i < v.size(); i++) {
+    (*result)[i] = v[i];
+  }
+}
+
+void LuaPushComplexVector(lua_State *L, const std::vector<JetComplex> &v) {
+  LuaVector *re = LuaUserClassCreateObj<LuaVector>(L);
+  LuaVector *im = LuaUserClassCreateObj<LuaVector>(L);
+  re->resize(v.size());
+  im->resize(v.size());
+  for (int i = 0; i < v.size(); i++) {
+    (*re)[i] = v[i].real();
+    (*im)[i] = v[i].imag();
+  }
+}
+
 void LuaErrorIfNaNOrInfs(lua_State *L) {
   int n = lua_gettop(L);
   for (int i = 1; i <= n; i++) {
@@ -182,4 +239,9 @@ void CreateStandardFonts(double content_scale_factor) {
   }
 }
 
-#endif
+#else  // QT_CORE_LIB
+
+void CreateStandardFonts(double content_scale_factor) {
+}
+
+#endif  // QT_CORE_LIB
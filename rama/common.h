@@ -93,11 +93,20 @@ class LuaCallback {
   // Push this function to the Lua stack. Valid() must be true.
   void Push(lua_State *L) const;
 
+  // Append a representation of this reference (not the function's upvalues)
+  // to 'ms', consistent with operator==().
+  void Hash(md5_state_t *ms) const;
+
  private:
   std::string hash_;            // Hash of function dump
   int64_t index_ = 0;           // Index into Registry "rama" table
 };
 
+// Append the value of 'x' to 'ms', consistent with operator==(), i.e. ignoring
+// the derivatives so that equal values always have the same hash.
+void HashValue(const JetNum &x, md5_state_t *ms);
+void HashValue(const JetComplex &x, md5_state_t *ms);
+
 // Set 'value' to the real or complex lua value at position 'index' on the
 // stack. Return true on success or false if the stack value can not be
 // interpreted as a complex value. Leave the stack unchanged on exit.
@@ -109,6 +118,18 @@ bool ToJetComplex(lua_State *L, int index, JetComplex *value);
 bool ToJetComplexVector(lua_State *L, int index,
                         std::vector<JetComplex> *value);
 
+// If the Lua function arguments 1 and 2 are vectors then copy them to 'x' and
+// 'y' and return true. Return false if neither argument is a vector. It is a
+// Lua error if only one is a vector or if they have different sizes.
+bool ToJetNumVectors(lua_State *L, std::vector<JetNum> *x,
+                     std::vector<JetNum> *y);
+
+// Push a new Lua vector containing the values in 'v'.
+void LuaPushVector(lua_State *L, const std::vector<JetNum> &v);
+
+// Push two new Lua vectors containing the real and imaginary parts of 'v'.
+void LuaPushComplexVector(lua_State *L, const std::vector<JetComplex> &v);
+
 // Check that any numbers in a Lua function argument list are not NaNs or
 // infinity. These likely indicate a problem building the model, and will make
 // a mess of our algorithms if stored in shapes or materials because they
@@ -13,6 +13,8 @@
 #ifndef __EDGE_TYPE_H__
 #define __EDGE_TYPE_H__
 
+#include "my_jet.h"
+
 // The different kinds of edges.
 class EdgeKind {
  public:
@@ -100,27 +102,43 @@ struct EdgeInfo {
   bool SetUnused(EdgeKind new_kind, float new_dist);
 };
 
-// This struct will be part of Clipper's IntPoint. Include the derivative of
-// the *unscaled* point coordinates with respect to some parameter.
+// This struct will be part of Clipper's IntPoint. Include the derivatives of
+// the *unscaled* point coordinates with respect to the kJetWidth parameters.
 struct ClipperEdgeInfo : public EdgeInfo {
-  double derivative_x, derivative_y;
+  double derivative_x[kJetWidth], derivative_y[kJetWidth];
   ClipperEdgeInfo() {
-    derivative_x = derivative_y = 0;
+    SetDerivativesToZero();
   }
-  ClipperEdgeInfo(const EdgeInfo &e, double dx, double dy) : EdgeInfo(e) {
-    derivative_x = dx;
-    derivative_y = dy;
+  ClipperEdgeInfo(const EdgeInfo &e, const JetNum &x, const JetNum &y)
+      : EdgeInfo(e) {
+    for (int i = 0; i < kJetWidth; i++) {
+      derivative_x[i] = x.Derivative(i);
+      derivative_y[i] = y.Derivative(i);
+    }
   }
   bool IsDefault() const {
-    return kind[0].IsDefault() && kind[1].IsDefault() && dist[0] == 0 &&
-           dist[1] == 0 && derivative_x == 0 && derivative_y == 0;
+    if (!(kind[0].IsDefault() && kind[1].IsDefault() && dist[0] == 0 &&
+          dist[1] == 0)) {
+      return false;
+    }
+    for (int i = 0; i < kJetWidth; i++) {
+      if (derivative_x[i] != 0 || derivative_y[i] != 0) {
+        return false;
+      }
+    }
+    return true;
   }
   void SetDefault() {
     kind[0].SetDefault();
     kind[1].SetDefault();
     dist[0] = 0;
     dist[1] = 0;
-    derivative_x = derivative_y = 0;
+    SetDerivativesToZero();
+  }
+  void SetDerivativesToZero() {
+    for (int i = 0; i < kJetWidth; i++) {
+      derivative_x[i] = derivative_y[i] = 0;
+    }
   }
 };
 
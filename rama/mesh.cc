@@ -14,6 +14,9 @@
 #include <algorithm>
 #include <setjmp.h>
 #include <map>
+#include <set>
+#include <tuple>
+#include "Eigen/Sparse"
 #include "common.h"
 #include "mesh.h"
 #include "../toolkit/gl_utils.h"
@@ -21,10 +24,12 @@
 #include "../toolkit/colormaps.h"
 #include "../toolkit/testing.h"
 #include "../toolkit/shaders.h"
+#include "../toolkit/thread.h"
 extern "C" {
   #include "triangle.h"
 }
 
+using Eigen::Vector2d;
 using Eigen::Vector3f;
 using Eigen::Vector3d;
 using Eigen::Vector4f;
@@ -32,11 +37,16 @@ using Eigen::Matrix4d;
 
 static const bool kDebugMesh = false;           // Render debug stuff on mesh
 static const double kSharpestAllowableAngle = 1e-4;
+static const double kMorphMinAngle = 15;        // In degrees, see Morph()
+static const double kMorphMaxEdge = 1.25;       // Times longest edge permitted
 
 //***************************************************************************
 // Triangle library support. We use nasty globals here because the triangle
 // library does not support passing user data to the triunsuitable() callback.
+// The triangle library also has some global state of its own, so all calls to
+// it are serialized with triangle_mutex.
 
+static std::mutex triangle_mutex;
 static double square_of_longest_edge_permitted;
 
 // Function called by the triangle library to see if a triangle is too big and
@@ -160,10 +170,65 @@ static void DumpTriangulateIO(const struct triangulateio &t, const char *msg) {
   // Ignored, we don't use: t.numberofedges, edgelist, edgemarkerlist, normlist
 };
 
+// Set the EdgeInfo and original piece and edge of a point that the triangle
+// library output with the given marker. The markers and 'index_map' (which
+// maps unique point indexes to shape pieces and edges) are described in
+// Mesh::Mesh(). The point's coordinates must already be set.
+
+static void SetPointFromMarker(const Shape &s,
+                               const vector<std::pair<int, int>> &index_map,
+                               int marker, RPoint *point) {
+  // Output points that are copied from input points (i.e. are the vertices
+  // of boundaries) use the same EdgeInfo. Output points that are created on
+  // input segments (i.e. boundary segments) are assigned an EdgeInfo that
+  // contains the correct slot information for that edge. The EdgeInfo of
+  // output points in the interior of the mesh will never be checked, so we
+  // don't do anything regarding those points.
+  EdgeInfo e;
+  if (marker >= 2) {
+    // Output point was copied from input point. Copy EdgeInfo of input. Here
+    // we rely on the fact, checked by Mesh::Mesh(), that duplicate points
+    // have consistent EdgeInfo, because we are copying the EdgeInfo from just
+    // one of those points.
+    int upi = marker - 2;
+    CHECK(upi < index_map.size());
+    int piece = index_map[upi].first;
+    int piece_index = index_map[upi].second;
+    e = s.Piece(piece)[piece_index].e;
+    point->original_piece = piece;
+    point->original_edge = piece_index;
+  } else if (marker < 0) {
+    // Output point was created on boundary segment. Set both slots of
+    // EdgeInfo to the edge kind of the boundary segment.
+    int upi = -marker - 1;
+    CHECK(upi < index_map.size());
+    int piece = index_map[upi].first;
+    int piece_index1 = index_map[upi].second;
+    int piece_index2 = (piece_index1 + 1) % s.Piece(piece).size();
+    float d1, d2;
+    const RPoint &p1 = s.Piece(piece)[piece_index1];
+    const RPoint &p2 = s.Piece(piece)[piece_index2];
+    e.kind[0] = p1.e.SharedKind(p2.e, &d1, &d2);
+    // Linearly interpolate distance values.
+    JetNum len1 = (point->p - p1.p).squaredNorm();
+    JetNum len2 = (p2.p - p1.p).squaredNorm();
+    double alpha = ToDouble(sqrt(len1 / len2));
+    e.dist[0] = alpha * (d2 - d1) + d1;
+    point->original_piece = piece;
+    point->original_edge = piece_index1;
+  } else if (marker == 1) {
+    // A marker value of 1 has a reserved meaning in the triangle library.
+    // A marker value of 0 will be assigned to interior points.
+    Panic("Internal error, marker==1 found");
+  }
+  point->e = e;
+}
+
 //***************************************************************************
 // Mesh.
 
-Mesh::Mesh(const Shape &s_arg, double longest_edge_permitted, Lua *lua) {
+Mesh::Mesh(const Shape &s_arg, double longest_edge_permitted, Lua *lua,
+           const Mesh *previous, int remesh) {
   Trace trace(__func__);
 
   // Find shape polygons with zero-width necks and split those into multiple
@@ -190,6 +255,7 @@ Mesh::Mesh(const Shape &s_arg, double longest_edge_permitted, Lua *lua) {
   }
   frexp(longest_edge_permitted, &cell_size_);
   cell_size_ -= 2;
+  longest_edge_permitted_ = longest_edge_permitted;
 
   // If we are asked to make a mesh from shapes with extremely short line
   // segments or extremely small interior angles then the mesher will consume a
@@ -428,104 +494,77 @@ Mesh::Mesh(const Shape &s_arg, double longest_edge_permitted, Lua *lua) {
     tin.holelist[i*2 + 1] = ToDouble(hole_points[i].p[1]);
   }
 
-  // Call 'Triangle' library. Use setjmp/longjmp based error handling to catch
-  // if the library calls triexit. If this happens then we will leak some
-  // memory (no telling what the triangle library was doing internally), but oh
-  // well.
-  if (setjmp(triangle_jmp_buf) != 0) {
-    // triangulate() called triexit.
-    return;
-  }
-  square_of_longest_edge_permitted = sqr(longest_edge_permitted);
-  // Useful options to 'triangulate' are:
-  //   * z: Index from zero
-  //   * p: Triangulate a PSLG
-  //   * A: Assign regional attribute to triangles
-  //   * Q: Quiet
-  //   * V: Verbose (for debugging)
-  //   * q: Quality mesh generation by Delaunay refinement
-  //   * u: Use triunsuitable function
-  //   * n: Create a triangle neighbor list
-  if (longest_edge_permitted > 0) {
-    triangulate("zpAQqun", &tin, &tout, NULL);
+  // Try to morph or keep most of the previous mesh, otherwise triangulate the
+  // whole shape.
+  if (previous && (remesh & REMESH_MORPH) && Morph(s, *previous)) {
+    DeleteTriangulateIO(&tin);
+  } else if (previous && (remesh & REMESH_INCREMENTAL) &&
+             TriangulateIncrementally(s, *previous, index_map, tin)) {
+    DeleteTriangulateIO(&tin);
   } else {
-    triangulate("zpAQn", &tin, &tout, NULL);
-  }
-
-  // Feed output arrays.
-  points_.resize(tout.numberofpoints);
-  for (int i = 0; i < tout.numberofpoints; i++) {
-    points_[i].p[0] = tout.pointlist[i*2 + 0];
-    points_[i].p[1] = tout.pointlist[i*2 + 1];
-
-    // Output points that are copied from input points (i.e. are the vertices
-    // of boundaries) use the same EdgeInfo. Output points that are created on
-    // input segments (i.e. boundary segments) are assigned an EdgeInfo that
-    // contains the correct slot information for that edge. The EdgeInfo of
-    // output points in the interior of the mesh will never be checked, so we
-    // don't do anything regarding those points.
-    EdgeInfo e;
-    int marker = tout.pointmarkerlist[i];
-    if (marker >= 2) {
-      // Output point was copied from input point. Copy EdgeInfo of input. Here
-      // we rely on the fact, checked above, that duplicate points have
-      // consistent EdgeInfo, because we are copying the EdgeInfo from just one
-      // of those points.
-      int upi = marker - 2;
-      CHECK(upi < index_map.size());
-      int piece = index_map[upi].first;
-      int piece_index = index_map[upi].second;
-      e = s.Piece(piece)[piece_index].e;
-      points_[i].original_piece = piece;
-      points_[i].original_edge = piece_index;
-    } else if (marker < 0) {
-      // Output point was created on boundary segment. Set both slots of
-      // EdgeInfo to the edge kind of the boundary segment.
-      int upi = -marker - 1;
-      CHECK(upi < index_map.size());
-      int piece = index_map[upi].first;
-      int piece_index1 = index_map[upi].second;
-      int piece_index2 = (piece_index1 + 1) % s.Piece(piece).size();
-      float d1, d2;
-      const RPoint &p1 = s.Piece(piece)[piece_index1];
-      const RPoint &p2 = s.Piece(piece)[piece_index2];
-      EdgeKind s = p1.e.SharedKind(p2.e, &d1, &d2);
-      e.kind[0] = s;
-      // Linearly interpolate distance values.
-      JetNum len1 = (points_[i].p - p1.p).squaredNorm();
-      JetNum len2 = (p2.p - p1.p).squaredNorm();
-      double alpha = ToDouble(sqrt(len1 / len2));
-      e.dist[0] = alpha * (d2 - d1) + d1;
-      points_[i].original_piece = piece;
-      points_[i].original_edge = piece_index1;
-    } else if (marker == 1) {
-      // A marker value of 1 has a reserved meaning in the triangle library.
-      // A marker value of 0 will be assigned to interior points.
-      Panic("Internal error, marker==1 found");
-    }
-    points_[i].e = e;
-  }
-  CHECK(tout.numberofcorners == 3);
-  CHECK(tout.numberoftriangleattributes == 1);  // 1 attr from input regions
-  CHECK(tout.triangleattributelist);
-  triangles_.resize(tout.numberoftriangles);
-  for (int i = 0; i < tout.numberoftriangles; i++) {
-    int polygon_index = tout.triangleattributelist[i];
-    CHECK(polygon_index == tout.triangleattributelist[i]);       // Is integer?
-    CHECK(polygon_index >= 0 && polygon_index < s.NumPieces());  // In range?
-    triangles_[i].material = polygon_index;     // Index into materials_
-    for (int j = 0; j < 3; j++) {
-      triangles_[i].index[j] = tout.trianglelist[i*3 + j];
+    // Call 'Triangle' library. Use setjmp/longjmp based error handling to
+    // catch if the library calls triexit. If this happens then we will leak
+    // some memory (no telling what the triangle library was doing
+    // internally), but oh well.
+    {
+      MutexLock lock(&triangle_mutex);
+      if (setjmp(triangle_jmp_buf) != 0) {
+        // triangulate() called triexit.
+        return;
+      }
+      square_of_longest_edge_permitted = sqr(longest_edge_permitted);
+      // Useful options to 'triangulate' are:
+      //   * z: Index from zero
+      //   * p: Triangulate a PSLG
+      //   * A: Assign regional attribute to triangles
+      //   * Q: Quiet
+      //   * V: Verbose (for debugging)
+      //   * q: Quality mesh generation by Delaunay refinement
+      //   * u: Use triunsuitable function
+      //   * n: Create a triangle neighbor list
+      if (longest_edge_permitted > 0) {
+        triangulate("zpAQqun", &tin, &tout, NULL);
+      } else {
+        triangulate("zpAQn", &tin, &tout, NULL);
+      }
+    }
 
-      // If this edge of the triangle does not have another triangle as a
-      // neighbor then it is a boundary edge (indicated by -1 in neighborlist).
-      // Note that is it not sufficient to identify boundary edges as ones
-      // where both vertices are on the boundary. Interior segments will not
-      // end up as accidental boundary edges, so we will not get interior ports
-      // in the final mesh.
-      triangles_[i].neighbor[j] =
-          tout.neighborlist[i*3 + (j + 2) % 3];
+    // Feed output arrays.
+    points_.resize(tout.numberofpoints);
+    for (int i = 0; i < tout.numberofpoints; i++) {
+      points_[i].p[0] = tout.pointlist[i*2 + 0];
+      points_[i].p[1] = tout.pointlist[i*2 + 1];
+      SetPointFromMarker(s, index_map, tout.pointmarkerlist[i], &points_[i]);
     }
+    CHECK(tout.numberofcorners == 3);
+    CHECK(tout.numberoftriangleattributes == 1);  // 1 attr from input regions
+    CHECK(tout.triangleattributelist);
+    triangles_.resize(tout.numberoftriangles);
+    for (int i = 0; i < tout.numberoftriangles; i++) {
+      int polygon_index = tout.triangleattributelist[i];
+      CHECK(polygon_index == tout.triangleattributelist[i]);     // Is integer?
+      CHECK(polygon_index >= 0 && polygon_index < s.NumPieces());  // In range?
+      triangles_[i].material = polygon_index;   // Index into materials_
+      for (int j = 0; j < 3; j++) {
+        triangles_[i].index[j] = tout.trianglelist[i*3 + j];
+
+        // If this edge of the triangle does not have another triangle as a
+        // neighbor then it is a boundary edge (indicated by -1 in
+        // neighborlist). Note that is it not sufficient to identify boundary
+        // edges as ones where both vertices are on the boundary. Interior
+        // segments will not end up as accidental boundary edges, so we will
+        // not get interior ports in the final mesh.
+        triangles_[i].neighbor[j] =
+            tout.neighborlist[i*3 + (j + 2) % 3];
+      }
+    }
+
+    // Free heap allocated data. Note that holelist and regionlist are copied
+    // from tin to tout so make sure not to free them twice.
+    DeleteTriangulateIO(&tin);
+    tout.holelist = 0;
+    tout.regionlist = 0;
+    FreeTriangulateIO(&tout);
   }
 
   // Copy shape materials and port callbacks.
@@ -534,13 +573,7 @@ Mesh::Mesh(const Shape &s_arg, double longest_edge_permitted, Lua *lua) {
     materials_[i] = s.GetMaterial(i);
   }
   port_callbacks_ = s.PortCallbacks();
-
-  // Free heap allocated data. Note that holelist and regionlist are copied
-  // from tin to tout so make sure not to free them twice.
-  DeleteTriangulateIO(&tin);
-  tout.holelist = 0;
-  tout.regionlist = 0;
-  FreeTriangulateIO(&tout);
+  meshed_shape_ = s;
 
   valid_mesh_ = true;
   UpdateDerivatives(s);
@@ -548,12 +581,115 @@ Mesh::Mesh(const Shape &s_arg, double longest_edge_permitted, Lua *lua) {
   if (lua) {
     DeterminePointMaterial(lua, &mat_params_);
     DetermineBoundaryParameters(lua, &boundary_params_);
+    if (!CallbackKey(lua, &callback_key_)) {
+      callback_key_.clear();
+    }
   }
 
   // 3D setup.
   SetupTriNormal();
 }
 
+// The mesh points and the triangle and edge indexes for OpenGL drawing. The
+// values array holds the per-point values given to DrawPointValues().
+class Mesh::DrawBuffers {
+ public:
+  explicit DrawBuffers(const Mesh &mesh)
+      : positions(Positions(mesh)), values(mesh.points_.size()),
+        triangle_indexes(TriangleIndexes(mesh)),
+        edge_indexes(EdgeIndexes(mesh)),
+        vertex_buffer(positions.size(), positions.data(), values.data()),
+        triangle_buffer(triangle_indexes.size(), triangle_indexes.data()),
+        edge_buffer(edge_indexes.size(), edge_indexes.data()) {}
+  ~DrawBuffers() { delete colormap_texture; }
+
+  vector<Vector3f> positions;           // One per mesh point
+  vector<float> values;                 // One per mesh point
+  vector<GLint> triangle_indexes;       // Three per triangle
+  vector<GLint> edge_indexes;           // Two per edge, each edge once
+  gl::VertexBuffer<Vector3f, float> vertex_buffer;
+  gl::IndexBuffer triangle_buffer, edge_buffer;
+  ColorMap::Function colormap = 0;      // The colormap in colormap_texture
+  gl::Texture1D *colormap_texture = 0;
+
+ private:
+  static vector<Vector3f> Positions(const Mesh &mesh) {
+    vector<Vector3f> positions(mesh.points_.size());
+    for (int i = 0; i < positions.size(); i++) {
+      positions[i] = Vector3f(ToDouble(mesh.points_[i].p[0]),
+                              ToDouble(mesh.points_[i].p[1]), 0);
+    }
+    return positions;
+  }
+  static vector<GLint> TriangleIndexes(const Mesh &mesh) {
+    vector<GLint> indexes;
+    indexes.reserve(mesh.triangles_.size() * 3);
+    for (int i = 0; i < mesh.triangles_.size(); i++) {
+      for (int j = 0; j < 3; j++) {
+        indexes.push_back(mesh.triangles_[i].index[j]);
+      }
+    }
+    return indexes;
+  }
+  // Interior edges are shared by two triangles, take them from the triangle
+  // with the lower index.
+  static vector<GLint> EdgeIndexes(const Mesh &mesh) {
+    vector<GLint> indexes;
+    for (int i = 0; i < mesh.triangles_.size(); i++) {
+      const Triangle &t = mesh.triangles_[i];
+      for (int j = 0; j < 3; j++) {
+        if (t.neighbor[j] == -1 || t.neighbor[j] > i) {
+          indexes.push_back(t.index[j]);
+          indexes.push_back(t.index[(j + 1) % 3]);
+        }
+      }
+    }
+    return indexes;
+  }
+
+  DISALLOW_COPY_AND_ASSIGN(DrawBuffers);
+};
+
+void Mesh::DrawBuffersOwner::Reset() {
+  delete buffers;
+  buffers = 0;
+}
+
+Mesh::DrawBuffers *Mesh::GetDrawBuffers() {
+  if (!draw_buffers_.buffers) {
+    draw_buffers_.buffers = new DrawBuffers(*this);
+  }
+  return draw_buffers_.buffers;
+}
+
+void Mesh::DrawPointValues(const vector<float> &values, double minval,
+                           double maxval, ColorMap::Function colormap) {
+  CHECK(values.size() == points_.size());
+  if (triangles_.empty()) {
+    return;
+  }
+  DrawBuffers *b = GetDrawBuffers();
+  if (b->colormap != colormap) {
+    uint8_t palette[256][3];
+    ColorMap::ComputePalette(colormap, palette);
+    delete b->colormap_texture;
+    b->colormap_texture = new gl::Texture1D(256, palette[0]);
+    b->colormap = colormap;
+  }
+  gl::PushShader push_shader(gl::ColormapShader());
+  GL(ActiveTexture)(GL_TEXTURE0);
+  b->colormap_texture->Bind();
+  gl::SetUniformi("colormap", 0);
+  gl::SetUniform("minval", minval);
+  gl::SetUniform("maxval", maxval);
+  b->vertex_buffer.Update2(values.data());
+  // The attribute locations depend on the current program so they are
+  // specified for every draw.
+  b->vertex_buffer.Specify1("vertex", 0, 3, GL_FLOAT);
+  b->vertex_buffer.Specify2("value", 0, 1, GL_FLOAT);
+  b->vertex_buffer.DrawIndexed(GL_TRIANGLES, &b->triangle_buffer);
+}
+
 void Mesh::DrawMesh(MeshDrawType draw_type, ColorMap::Function colormap,
                     int brightness, const Matrix4d &camera_transform) {
   if (draw_type == MESH_HIDE) {
@@ -565,57 +701,29 @@ void Mesh::DrawMesh(MeshDrawType draw_type, ColorMap::Function colormap,
     if (mat_params_.empty()) {
       return;                             // Nothing to show
     }
-    // Create color map.
-    const int kNumColors = 256;           // Should be even
-    float rgb[kNumColors][3];
-    for (int i = 0; i < kNumColors; i++) {
-      colormap(float(i) / (kNumColors - 1), rgb[i]);
-    }
-
     // Map the brightness to a scale used for min/max values.
     double scale = pow(10, -(brightness - 500.0) / 500.0);
-    const double minval = -scale;
-    const double maxval = +scale;
-
-    gl::PushShader push_shader(gl::SmoothShader());
-    vector<Vector3f> points, colors;
-    for (int i = 0; i < triangles_.size(); i++) {
-      for (int j = 0; j < 3; j++) {
-        int k = triangles_[i].index[j];
-        double value;
-        if (draw_type == MESH_DIELECTRIC_REAL) {
-          value = ToDouble(mat_params_[k].epsilon.real());
-        } else if (draw_type == MESH_DIELECTRIC_IMAG) {
-          value = ToDouble(mat_params_[k].epsilon.imag());
-        } else {
-          value = ToDouble(abs(mat_params_[k].epsilon));
-        }
-        int c = std::max(0, std::min(kNumColors - 1,
-          int(round((value - minval) * (kNumColors / (maxval-minval))))));
-        colors.push_back(Vector3f(rgb[c][0], rgb[c][1], rgb[c][2]));
-        points.push_back(Vector3f(ToDouble(points_[k].p[0]),
-                                  ToDouble(points_[k].p[1]), 0));
+    vector<float> values(points_.size());
+    for (int i = 0; i < points_.size(); i++) {
+      if (draw_type == MESH_DIELECTRIC_REAL) {
+        values[i] = ToDouble(mat_params_[i].epsilon.real());
+      } else if (draw_type == MESH_DIELECTRIC_IMAG) {
+        values[i] = ToDouble(mat_params_[i].epsilon.imag());
+      } else {
+        values[i] = ToDouble(abs(mat_params_[i].epsilon));
       }
     }
-    gl::Draw(points, colors, GL_TRIANGLES);
+    DrawPointValues(values, -scale, scale, colormap);
     return;
   }
 
   // Drawing regular mesh, not dielectric.
-  gl::SetUniform("color", 1, 0, 0);
-  vector<Vector3f> points;
-  for (int i = 0; i < triangles_.size(); i++) {
-    for (int j = 0; j < 3; j++) {
-      int k1 = triangles_[i].index[j];
-      int k2 = triangles_[i].index[(j + 1) % 3];
-      points.push_back(Vector3f(ToDouble(points_[k1].p[0]),
-                                ToDouble(points_[k1].p[1]), 0));
-      points.push_back(Vector3f(ToDouble(points_[k2].p[0]),
-                                ToDouble(points_[k2].p[1]), 0));
-    }
+  if (!triangles_.empty()) {
+    gl::SetUniform("color", 1, 0, 0);
+    DrawBuffers *b = GetDrawBuffers();
+    b->vertex_buffer.Specify1("vertex", 0, 3, GL_FLOAT);
+    b->vertex_buffer.DrawIndexed(GL_LINES, &b->edge_buffer);
   }
-  // @@@ Do GL_LINE_LOOP with element drawing and primitive restarting?
-  gl::Draw(points, GL_LINES);
 
   // Print mesh statistics.
   char s[100];
@@ -679,8 +787,115 @@ void Mesh::DrawPointDerivatives(double scale) {
   gl::Draw(p, GL_LINES);
 }
 
+// The system matrix is the usual piecewise linear finite element stiffness
+// matrix, which is positive definite as long as every connected part of the
+// mesh has a boundary point. It is split into the part A that couples the
+// interior points to each other and the part B that couples them to the
+// boundary points, so that the interior values x solve A*x = -B*values.
+struct Mesh::LaplaceSystem {
+  bool valid = false;
+  vector<int> free_index;               // Row of each interior point, or -1
+  Eigen::SparseMatrix<double> B;        // Columns for boundary points only
+  Eigen::SimplicialLDLT<Eigen::SparseMatrix<double>> A_factorization;
+};
+
+const Mesh::LaplaceSystem *Mesh::GetLaplaceSystem() const {
+  if (laplace_) {
+    return laplace_.get();
+  }
+  std::shared_ptr<LaplaceSystem> ls(new LaplaceSystem);
+  laplace_ = ls;
+
+  // Number the interior points.
+  ls->free_index.resize(points_.size(), -1);
+  int num_free = 0;
+  for (int i = 0; i < points_.size(); i++) {
+    if (points_[i].original_piece < 0) {
+      ls->free_index[i] = num_free++;
+    }
+  }
+
+  // Assemble the stiffness matrix. The entry for points i,j of a triangle is
+  // the dot product of the triangle edges opposite those points, divided by
+  // four times the triangle area.
+  typedef Eigen::Triplet<double> Triplet;
+  vector<Triplet> a_triplets, b_triplets;
+  a_triplets.reserve(triangles_.size() * 9);
+  for (const Triangle &t : triangles_) {
+    Vector2d p[3], d[3];
+    for (int j = 0; j < 3; j++) {
+      p[j] = ToVector2d(points_[t.index[j]].p);
+    }
+    for (int j = 0; j < 3; j++) {
+      d[j] = p[(j + 2) % 3] - p[(j + 1) % 3];
+    }
+    double area4 = 2 * (d[0][0] * d[1][1] - d[0][1] * d[1][0]);
+    if (area4 <= 0) {
+      return ls.get();
+    }
+    for (int j = 0; j < 3; j++) {
+      int row = ls->free_index[t.index[j]];
+      if (row < 0) {
+        continue;
+      }
+      for (int k = 0; k < 3; k++) {
+        double value = d[j].dot(d[k]) / area4;
+        int col = ls->free_index[t.index[k]];
+        if (col >= 0) {
+          a_triplets.push_back(Triplet(row, col, value));
+        } else {
+          b_triplets.push_back(Triplet(row, t.index[k], value));
+        }
+      }
+    }
+  }
+  ls->B.resize(num_free, points_.size());
+  ls->B.setFromTriplets(b_triplets.begin(), b_triplets.end());
+  if (num_free > 0) {
+    Eigen::SparseMatrix<double> A(num_free, num_free);
+    A.setFromTriplets(a_triplets.begin(), a_triplets.end());
+    ls->A_factorization.compute(A);
+    if (ls->A_factorization.info() != Eigen::Success) {
+      return ls.get();
+    }
+  }
+  ls->valid = true;
+  return ls.get();
+}
+
+bool Mesh::HarmonicExtension(Eigen::MatrixXd *values) const {
+  // If the boundary values are all zero then so is the solution. This is the
+  // usual case for shapes without derivatives, so the system is not created.
+  bool all_zero = true;
+  for (int i = 0; i < points_.size() && all_zero; i++) {
+    all_zero = points_[i].original_piece < 0 || values->row(i).isZero(0);
+  }
+  if (all_zero) {
+    values->setZero();
+    return true;
+  }
+
+  const LaplaceSystem *ls = GetLaplaceSystem();
+  if (!ls->valid) {
+    return false;
+  }
+  if (ls->B.rows() == 0) {
+    return true;
+  }
+  Eigen::MatrixXd x = ls->A_factorization.solve(-(ls->B * (*values)));
+  if (ls->A_factorization.info() != Eigen::Success) {
+    return false;
+  }
+  for (int i = 0; i < points_.size(); i++) {
+    if (ls->free_index[i] >= 0) {
+      values->row(i) = x.row(ls->free_index[i]);
+    }
+  }
+  return true;
+}
+
 void Mesh::UpdateDerivatives(const Shape &s) {
-  // Update point derivatives.
+  // Update boundary point derivatives.
   for (int i = 0; i < points_.size(); i++) {
     int p = points_[i].original_piece;
     int e = points_[i].original_edge;
@@ -690,10 +905,37 @@ void Mesh::UpdateDerivatives(const Shape &s) {
       const RPoint &p2 = s.Piece(p)[(e + 1) % s.Piece(p).size()];
       double alpha = ToVector2d(points_[i].p - p1.p).norm() /
                      ToVector2d(p2.p - p1.p).norm();
-      points_[i].p[0].Derivative() =
-          (1 - alpha)*p1.p[0].Derivative() + alpha*p2.p[0].Derivative();
-      points_[i].p[1].Derivative() =
-          (1 - alpha)*p1.p[1].Derivative() + alpha*p2.p[1].Derivative();
+      points_[i].p[0].v() = (1 - alpha)*p1.p[0].v() + alpha*p2.p[0].v();
+      points_[i].p[1].v() = (1 - alpha)*p1.p[1].v() + alpha*p2.p[1].v();
+    }
+  }
+
+  // Propagate the boundary point derivatives into the interior. If interior
+  // points did not move then the derivatives would be those of a mesh where
+  // only the layer of triangles next to the boundary is distorted, which is
+  // quite different from the mesh that would be created for a slightly
+  // different shape, and so computed shape derivatives would be inaccurate.
+  // Instead each derivative component is a harmonic function over the mesh.
+  {
+    Eigen::MatrixXd d = Eigen::MatrixXd::Zero(points_.size(), 2 * kJetWidth);
+    for (int i = 0; i < points_.size(); i++) {
+      if (points_[i].original_piece >= 0) {
+        for (int k = 0; k < kJetWidth; k++) {
+          d(i, k) = points_[i].p[0].Derivative(k);
+          d(i, kJetWidth + k) = points_[i].p[1].Derivative(k);
+        }
+      }
+    }
+    if (!HarmonicExtension(&d)) {
+      d.setZero();
+    }
+    for (int i = 0; i < points_.size(); i++) {
+      if (points_[i].original_piece < 0) {
+        for (int k = 0; k < kJetWidth; k++) {
+          points_[i].p[0].Derivative(k) = d(i, k);
+          points_[i].p[1].Derivative(k) = d(i, kJetWidth + k);
+        }
+      }
     }
   }
 
@@ -709,67 +951,905 @@ static inline uint64 GridIndex(int32 ix, int32 iy) {
   return (uint64(uint32(ix)) << 32) | uint32(iy);
 }
 
-int Mesh::FindTriangle(double x, double y) {
-  // Build the spatial index the first time through. We use a
-  // "longest_edge_permitted" constraint in meshing, so the triangles we're
-  // indexing will not have large aspect ratios and are all roughly the same
-  // size. Therefore the spatial index is a grid of cells of side comparable to
-  // "longest_edge_permitted" where we just record all triangles that intersect
-  // each grid cell.
-  const double cell = ldexp(1, cell_size_);
-  if (spatial_index_.empty()) {
-    for (int i = 0; i < triangles_.size(); i++) {
-      // Compute the bounding box of the triangle.
-      const JetPoint *tp[3];            // Triangle points
-      for (int j = 0; j < 3; j++) {
-        tp[j] = &points_[triangles_[i].index[j]].p;
-      }
-      double xmin = __DBL_MAX__, xmax = -__DBL_MAX__;
-      double ymin = __DBL_MAX__, ymax = -__DBL_MAX__;
-      for (int j = 0; j < 3; j++) {
-        xmin = std::min(xmin, ToDouble((*tp[j])[0]));
-        xmax = std::max(xmax, ToDouble((*tp[j])[0]));
-        ymin = std::min(ymin, ToDouble((*tp[j])[1]));
-        ymax = std::max(ymax, ToDouble((*tp[j])[1]));
-      }
-      // Determine the grid cells occupied by the triangle's bounding box. Add
-      // all grid cells occupied by the triangle to the index.
-      int ixmin = floor(xmin / cell);
-      int ixmax = floor(xmax / cell);
-      int iymin = floor(ymin / cell);
-      int iymax = floor(ymax / cell);
+// A double precision version of PointInTriangle(). Return true if (x,y) is
+// in or on the boundary of the triangle a,b,c. This gives exactly the same
+// result as PointInTriangle() but is faster as it ignores derivatives.
+static inline bool PointInTriangle(double x, double y, const JetPoint &a,
+                                   const JetPoint &b, const JetPoint &c) {
+  double ax = ToDouble(a[0]), ay = ToDouble(a[1]);
+  double q0 = ToDouble(b[0]) - ax, q1 = ToDouble(b[1]) - ay;
+  double r0 = ToDouble(c[0]) - ax, r1 = ToDouble(c[1]) - ay;
+  double det = 1.0 / (q0 * r1 - q1 * r0);
+  double alpha = ( r1 * (x - ax) - r0 * (y - ay)) * det;
+  double beta  = (-q1 * (x - ax) + q0 * (y - ay)) * det;
+  return !(alpha < 0 || beta < 0 || (alpha + beta) > 1);
+}
+
+void Mesh::BuildSpatialIndex() {
+  // We use a "longest_edge_permitted" constraint in meshing, so the triangles
+  // we're indexing will not have large aspect ratios and are all roughly the
+  // same size. Therefore the spatial index is a grid of cells of side
+  // comparable to "longest_edge_permitted" where we just record all triangles
+  // that intersect each grid cell. The grid covers the bounding box of the
+  // mesh. If the cells are very small compared to the triangles (e.g. if there
+  // was no edge length constraint) then they are enlarged so that the grid
+  // size stays proportional to the number of triangles.
+  if (points_.empty()) {
+    // An empty grid, so FindTriangle() finds nothing.
+    grid_x_ = grid_y_ = grid_width_ = grid_height_ = 0;
+    cell_start_.assign(1, 0);
+    cell_triangles_.clear();
+    return;
+  }
+  double xmin = __DBL_MAX__, xmax = -__DBL_MAX__;
+  double ymin = __DBL_MAX__, ymax = -__DBL_MAX__;
+  for (int i = 0; i < points_.size(); i++) {
+    xmin = std::min(xmin, ToDouble(points_[i].p[0]));
+    xmax = std::max(xmax, ToDouble(points_[i].p[0]));
+    ymin = std::min(ymin, ToDouble(points_[i].p[1]));
+    ymax = std::max(ymax, ToDouble(points_[i].p[1]));
+  }
+  double cell;
+  for (;;) {
+    cell = ldexp(1, cell_size_);
+    grid_x_ = floor(xmin / cell);
+    grid_y_ = floor(ymin / cell);
+    grid_width_ = int(floor(xmax / cell)) - grid_x_ + 1;
+    grid_height_ = int(floor(ymax / cell)) - grid_y_ + 1;
+    if (double(grid_width_) * grid_height_ <= 16.0 * triangles_.size() + 256) {
+      break;
+    }
+    cell_size_++;
+  }
+
+  // Find the (cell, triangle) pairs for all triangles, then sort them by cell
+  // with a counting sort to create the cell_start_ and cell_triangles_ arrays.
+  // The sort is stable so the triangles in each cell are in index order.
+  vector<std::pair<int, int>> entries;
+  entries.reserve(triangles_.size() * 4);
+  for (int i = 0; i < triangles_.size(); i++) {
+    // Compute the bounding box of the triangle.
+    const JetPoint *tp[3];              // Triangle points
+    for (int j = 0; j < 3; j++) {
+      tp[j] = &points_[triangles_[i].index[j]].p;
+    }
+    double txmin = __DBL_MAX__, txmax = -__DBL_MAX__;
+    double tymin = __DBL_MAX__, tymax = -__DBL_MAX__;
+    for (int j = 0; j < 3; j++) {
+      txmin = std::min(txmin, ToDouble((*tp[j])[0]));
+      txmax = std::max(txmax, ToDouble((*tp[j])[0]));
+      tymin = std::min(tymin, ToDouble((*tp[j])[1]));
+      tymax = std::max(tymax, ToDouble((*tp[j])[1]));
+    }
+    // Determine the grid cells occupied by the triangle's bounding box. Add
+    // all grid cells occupied by the triangle to the index.
+    int ixmin = floor(txmin / cell);
+    int ixmax = floor(txmax / cell);
+    int iymin = floor(tymin / cell);
+    int iymax = floor(tymax / cell);
+    for (int iy = iymin; iy <= iymax; iy++) {
       for (int ix = ixmin; ix <= ixmax; ix++) {
-        for (int iy = iymin; iy <= iymax; iy++) {
-          if (TriangleIntersectsBox(tp, ix * cell, (ix + 1) * cell,
-                                    iy * cell, (iy + 1) * cell)) {
-            spatial_index_[GridIndex(ix, iy)].push_back(i);
-          }
+        if (TriangleIntersectsBox(tp, ix * cell, (ix + 1) * cell,
+                                  iy * cell, (iy + 1) * cell)) {
+          int c = (iy - grid_y_) * grid_width_ + (ix - grid_x_);
+          entries.push_back(std::make_pair(c, i));
         }
       }
     }
   }
+  cell_start_.clear();
+  cell_start_.resize(grid_width_ * grid_height_ + 1);
+  for (int i = 0; i < entries.size(); i++) {
+    cell_start_[entries[i].first + 1]++;
+  }
+  for (int c = 0; c < grid_width_ * grid_height_; c++) {
+    cell_start_[c + 1] += cell_start_[c];
+  }
+  vector<int> next(cell_start_.begin(), cell_start_.end() - 1);
+  cell_triangles_.resize(entries.size());
+  for (int i = 0; i < entries.size(); i++) {
+    cell_triangles_[next[entries[i].first]++] = entries[i].second;
+  }
+}
+
+int Mesh::FindTriangle(double x, double y) {
+  // Build the spatial index the first time through.
+  if (cell_start_.empty()) {
+    BuildSpatialIndex();
+  }
 
   // Query the spatial index.
-  int32 ix = floor(x / cell);
-  int32 iy = floor(y / cell);
-  SpatialIndex::const_iterator it = spatial_index_.find(GridIndex(ix, iy));
-  if (it == spatial_index_.end()) {
-    return -1;
-  }
-  JetPoint test_point;
-  test_point[0] = x;
-  test_point[1] = y;
-  for (int i = 0; i < it->second.size(); i++) {
-    const Triangle &tri = triangles_[it->second[i]];
-    if (PointInTriangle(test_point, points_[tri.index[0]].p,
+  const double cell = ldexp(1, cell_size_);
+  double ix = floor(x / cell) - grid_x_;
+  double iy = floor(y / cell) - grid_y_;
+  if (!(ix >= 0 && ix < grid_width_ && iy >= 0 && iy < grid_height_)) {
+    return -1;                          // Outside the grid, or NaN
+  }
+  int c = int(iy) * grid_width_ + int(ix);
+  for (int i = cell_start_[c]; i < cell_start_[c + 1]; i++) {
+    const Triangle &tri = triangles_[cell_triangles_[i]];
+    if (PointInTriangle(x, y, points_[tri.index[0]].p,
                         points_[tri.index[1]].p, points_[tri.index[2]].p)) {
-      return it->second[i];
+      return cell_triangles_[i];
     }
   }
   // No intersecting triangle found.
   return -1;
 }
 
+int Mesh::WalkToTriangle(int t, double x, double y) const {
+  // Triangles have counterclockwise vertices, so (x,y) is outside a triangle
+  // if it is to the right of any edge. In that case step to the neighbor
+  // across that edge. Limit the number of steps as a long walk is slower than
+  // a spatial index lookup.
+  const int kMaxSteps = 50;
+  for (int step = 0; step < kMaxSteps && t >= 0; step++) {
+    const Triangle &tri = triangles_[t];
+    int outside_edge = -1;
+    for (int j = 0; j < 3; j++) {
+      const JetPoint &a = points_[tri.index[j]].p;
+      const JetPoint &b = points_[tri.index[(j + 1) % 3]].p;
+      double ax = ToDouble(a[0]), ay = ToDouble(a[1]);
+      double cross = (ToDouble(b[0]) - ax) * (y - ay) -
+                     (ToDouble(b[1]) - ay) * (x - ax);
+      if (!(cross >= 0)) {              // Also true if x or y is NaN
+        outside_edge = j;
+        break;
+      }
+    }
+    if (outside_edge == -1) {
+      return t;
+    }
+    t = tri.neighbor[outside_edge];
+  }
+  return -1;
+}
+
+void Mesh::FindTriangles(const vector<double> &x, const vector<double> &y,
+                         vector<int> *triangles) {
+  CHECK(x.size() == y.size());
+  triangles->resize(x.size());
+  int last = -1;                        // Last triangle found
+  for (int i = 0; i < x.size(); i++) {
+    int t = -1;
+    if (last >= 0) {
+      t = WalkToTriangle(last, x[i], y[i]);
+    }
+    if (t < 0) {
+      t = FindTriangle(x[i], y[i]);
+    }
+    (*triangles)[i] = t;
+    if (t >= 0) {
+      last = t;
+    }
+  }
+}
+
+//***************************************************************************
+// Incremental meshing.
+
+// A shape segment, identified by the coordinates x1,y1,x2,y2 of its end
+// points.
+typedef std::tuple<double, double, double, double> SegmentKey;
+
+static SegmentKey MakeSegmentKey(const JetPoint &p1, const JetPoint &p2) {
+  return SegmentKey(ToDouble(p1[0]), ToDouble(p1[1]),
+                    ToDouble(p2[0]), ToDouble(p2[1]));
+}
+
+// The key of a segment regardless of its direction.
+static SegmentKey UndirectedSegmentKey(const SegmentKey &k) {
+  SegmentKey reversed(std::get<2>(k), std::get<3>(k),
+                      std::get<0>(k), std::get<1>(k));
+  return std::min(k, reversed);
+}
+
+// The distance from x,y to the segment 'k'.
+static double DistanceToSegment(double x, double y, const SegmentKey &k) {
+  double x1 = std::get<0>(k), y1 = std::get<1>(k);
+  double dx = std::get<2>(k) - x1, dy = std::get<3>(k) - y1;
+  double len2 = dx*dx + dy*dy;
+  double t = (len2 > 0) ? ((x - x1)*dx + (y - y1)*dy) / len2 : 0;
+  t = std::max(0.0, std::min(1.0, t));
+  return hypot(x - x1 - t*dx, y - y1 - t*dy);
+}
+
+// Return true if x,y is on the segment 'k', to within rounding error.
+static bool PointOnSegment(double x, double y, const SegmentKey &k) {
+  const double kTolerance = 1e-9;
+  double x1 = std::get<0>(k), y1 = std::get<1>(k);
+  double dx = std::get<2>(k) - x1, dy = std::get<3>(k) - y1;
+  double len2 = dx*dx + dy*dy;
+  double cross = (x - x1)*dy - (y - y1)*dx;
+  double dot = (x - x1)*dx + (y - y1)*dy;
+  return fabs(cross) <= kTolerance * len2 && dot >= -kTolerance * len2 &&
+         dot <= (1 + kTolerance) * len2;
+}
+
+bool Mesh::TriangulateIncrementally(const Shape &s, const Mesh &previous,
+                                  const vector<std::pair<int, int>> &index_map,
+                                  const triangulateio &tin) {
+  Trace trace(__func__);
+  const double max_edge = longest_edge_permitted_;
+  if (!previous.IsValidMesh() || max_edge <= 0 ||
+      previous.longest_edge_permitted_ != max_edge) {
+    return false;
+  }
+  const Shape &ps = previous.meshed_shape_;
+  const vector<RPoint> &ppoints = previous.points_;
+  const vector<Triangle> &ptriangles = previous.triangles_;
+  typedef std::pair<double, double> XY;
+  auto xy = [](const RPoint &p) {
+    return XY(ToDouble(p.p[0]), ToDouble(p.p[1]));
+  };
+
+  // Index the segments of both shapes by their end points. This maps segment
+  // keys to (piece, edge) indexes.
+  typedef std::map<SegmentKey, std::pair<int, int>> SegmentMap;
+  SegmentMap old_segments, new_segments;
+  for (int pass = 0; pass < 2; pass++) {
+    const Shape &shape = pass ? s : ps;
+    SegmentMap &segments = pass ? new_segments : old_segments;
+    for (int i = 0; i < shape.NumPieces(); i++) {
+      const vector<RPoint> &piece = shape.Piece(i);
+      for (int j = 0; j < piece.size(); j++) {
+        segments.insert(std::make_pair(
+            MakeSegmentKey(piece[j].p, piece[(j + 1) % piece.size()].p),
+            std::make_pair(i, j)));
+      }
+    }
+  }
+
+  // A segment is unchanged if it is in both shapes with the same end point
+  // edge info and the same material. Find the changed segments (in both
+  // directions if either direction has changed). Map previous pieces to the
+  // pieces of 's' that they have unchanged segments in common with.
+  std::set<SegmentKey> changed;         // Undirected keys
+  vector<SegmentKey> changed_list;      // Directed keys, old and new
+  vector<int> piece_map(ps.NumPieces(), -1);
+  for (auto &it : old_segments) {
+    int op = it.second.first, oe = it.second.second;
+    auto it2 = new_segments.find(it.first);
+    bool same = false;
+    if (it2 != new_segments.end()) {
+      int np = it2->second.first, ne = it2->second.second;
+      const vector<RPoint> &a = ps.Piece(op);
+      const vector<RPoint> &b = s.Piece(np);
+      same = a[oe].e == b[ne].e &&
+             a[(oe + 1) % a.size()].e == b[(ne + 1) % b.size()].e &&
+             ps.GetMaterial(op) == s.GetMaterial(np);
+      if (same) {
+        piece_map[op] = np;
+      }
+    }
+    if (!same) {
+      changed.insert(UndirectedSegmentKey(it.first));
+      changed_list.push_back(it.first);
+    }
+  }
+  for (auto &it : new_segments) {
+    if (old_segments.count(it.first) == 0) {
+      changed.insert(UndirectedSegmentKey(it.first));
+      changed_list.push_back(it.first);
+    }
+  }
+
+  // Mark previous triangles as dirty if they are within max_edge of any
+  // changed segment. Use a grid of cells of side 2*max_edge to find nearby
+  // changed segments quickly.
+  const double cell = 2 * max_edge;
+  std::map<uint64, vector<int>> grid;
+  for (int i = 0; i < changed_list.size(); i++) {
+    const SegmentKey &k = changed_list[i];
+    int ixmin = floor((std::min(std::get<0>(k), std::get<2>(k)) - cell) / cell);
+    int ixmax = floor((std::max(std::get<0>(k), std::get<2>(k)) + cell) / cell);
+    int iymin = floor((std::min(std::get<1>(k), std::get<3>(k)) - cell) / cell);
+    int iymax = floor((std::max(std::get<1>(k), std::get<3>(k)) + cell) / cell);
+    for (int ix = ixmin; ix <= ixmax; ix++) {
+      for (int iy = iymin; iy <= iymax; iy++) {
+        grid[GridIndex(ix, iy)].push_back(i);
+      }
+    }
+  }
+  const int num_old = ptriangles.size();
+  vector<char> dirty(num_old, 0);
+  vector<XY> centroid(num_old);
+  int num_retained = 0;
+  for (int i = 0; i < num_old; i++) {
+    Eigen::Vector2d v[3];
+    for (int j = 0; j < 3; j++) {
+      v[j] = ToVector2d(ppoints[ptriangles[i].index[j]].p);
+    }
+    Eigen::Vector2d c = (v[0] + v[1] + v[2]) / 3;
+    centroid[i] = XY(c[0], c[1]);
+    double radius = 0;
+    for (int j = 0; j < 3; j++) {
+      radius = std::max(radius, (v[j] - c).norm());
+    }
+    auto it = grid.find(GridIndex(floor(c[0] / cell), floor(c[1] / cell)));
+    if (it != grid.end()) {
+      for (int k : it->second) {
+        if (DistanceToSegment(c[0], c[1], changed_list[k]) <
+            radius + max_edge) {
+          dirty[i] = true;
+          break;
+        }
+      }
+    }
+    num_retained += !dirty[i];
+  }
+  if (num_retained == 0) {
+    return false;
+  }
+
+  // Find the previous shape segment that the previous mesh edge a,b lies on.
+  // Candidates are the segments of a and b given by their original piece and
+  // edge, and the segments incident to the vertices of those. Return false if
+  // there is no such segment.
+  std::map<XY, vector<std::pair<int, int>>> incident;   // Vertex -> segments
+  for (int i = 0; i < ps.NumPieces(); i++) {
+    const vector<RPoint> &piece = ps.Piece(i);
+    for (int j = 0; j < piece.size(); j++) {
+      incident[xy(piece[j])].push_back(std::make_pair(i, j));
+      incident[xy(piece[(j + 1) % piece.size()])].push_back(
+          std::make_pair(i, j));
+    }
+  }
+  auto find_segment = [&](int a, int b, SegmentKey *key) -> bool {
+    vector<std::pair<int, int>> candidates;
+    for (int v : {a, b}) {
+      const RPoint &pt = ppoints[v];
+      vector<XY> vertices(1, xy(pt));
+      if (pt.original_piece >= 0) {
+        candidates.push_back(std::make_pair(pt.original_piece,
+                                            pt.original_edge));
+        vertices.push_back(xy(ps.Piece(pt.original_piece)[pt.original_edge]));
+      }
+      for (const XY &vertex : vertices) {
+        auto it = incident.find(vertex);
+        if (it != incident.end()) {
+          candidates.insert(candidates.end(), it->second.begin(),
+                            it->second.end());
+        }
+      }
+    }
+    for (auto &c : candidates) {
+      const vector<RPoint> &piece = ps.Piece(c.first);
+      SegmentKey k = MakeSegmentKey(piece[c.second].p,
+                                    piece[(c.second + 1) % piece.size()].p);
+      if (PointOnSegment(xy(ppoints[a]).first, xy(ppoints[a]).second, k) &&
+          PointOnSegment(xy(ppoints[b]).first, xy(ppoints[b]).second, k)) {
+        *key = UndirectedSegmentKey(k);
+        return true;
+      }
+    }
+    return false;
+  };
+
+  // Map the coordinates of the unique points of 's' to their indexes, and
+  // the undirected segments of 's' to their markers in 'tin'.
+  std::map<XY, int> upi_of;
+  for (int i = 0; i < tin.numberofpoints; i++) {
+    upi_of[XY(tin.pointlist[i*2], tin.pointlist[i*2 + 1])] = i;
+  }
+  std::map<SegmentKey, int> segment_marker;
+  for (int i = 0; i < tin.numberofsegments; i++) {
+    int u1 = tin.segmentlist[i*2], u2 = tin.segmentlist[i*2 + 1];
+    SegmentKey k(tin.pointlist[u1*2], tin.pointlist[u1*2 + 1],
+                 tin.pointlist[u2*2], tin.pointlist[u2*2 + 1]);
+    segment_marker[UndirectedSegmentKey(k)] = tin.segmentmarkerlist[i];
+  }
+
+  // Build the triangle library input for the part of the domain that is not
+  // covered by retained triangles. Input points are the unique points of 's'
+  // (marked as in the constructor) and previous mesh points (marked with
+  // 2 + num_upi + their index), and points that subdivide changed segments.
+  // The segments are:
+  //   * Seam edges between retained and dirty triangles (marker 0). The
+  //     retained triangles are all carved away as holes, and the 'Y' option
+  //     stops the seam edges from being split, so the new triangles will
+  //     conform to the retained ones.
+  //   * Edges of dirty triangles that lie on unchanged segments of 's'. These
+  //     are also already short enough.
+  //   * The changed segments of 's', subdivided so that no piece is longer
+  //     than max_edge, as 'Y' stops them from being split if they are on the
+  //     boundary.
+  const int num_upi = tin.numberofpoints;
+  vector<double> in_points;
+  vector<int> in_markers, in_segments, in_segment_markers;
+  std::map<XY, int> in_index;                 // Coordinates -> input point
+  std::map<int, int> upi_to_old;              // UPI -> coincident old point
+  vector<char> old_in_input(ppoints.size(), 0);
+  auto add_point = [&](const XY &p, int marker) {
+    auto it = in_index.find(p);
+    if (it != in_index.end()) {
+      return it->second;
+    }
+    int index = in_markers.size();
+    in_index[p] = index;
+    in_points.push_back(p.first);
+    in_points.push_back(p.second);
+    in_markers.push_back(marker);
+    return index;
+  };
+  auto add_old_point = [&](int k) {
+    XY p = xy(ppoints[k]);
+    auto it = upi_of.find(p);
+    if (it != upi_of.end()) {
+      upi_to_old[it->second] = k;
+      return add_point(p, 2 + it->second);
+    }
+    old_in_input[k] = true;
+    return add_point(p, 2 + num_upi + k);
+  };
+  std::set<std::pair<int, int>> edges_added;  // Undirected input point pairs
+  std::set<std::pair<int, int>> upi_edges_added;  // Undirected UPI pairs
+  auto add_segment = [&](int a, int b, int marker) {
+    if (edges_added.insert(std::make_pair(std::min(a, b),
+                                          std::max(a, b))).second) {
+      in_segments.push_back(a);
+      in_segments.push_back(b);
+      in_segment_markers.push_back(marker);
+    }
+  };
+  std::set<std::pair<int, int>> pure_seams;   // Old point pairs
+  for (int i = 0; i < num_old; i++) {
+    const Triangle &t = ptriangles[i];
+    for (int j = 0; j < 3; j++) {
+      int a = t.index[j], b = t.index[(j + 1) % 3];
+      int n = t.neighbor[j];
+      if (!dirty[i]) {
+        if (n >= 0 && dirty[n]) {
+          add_segment(add_old_point(a), add_old_point(b), 0);
+          if (ptriangles[n].material == t.material) {
+            pure_seams.insert(std::make_pair(std::min(a, b), std::max(a, b)));
+          }
+        }
+      } else if (n == -1 || ptriangles[n].material != t.material) {
+        if (n >= 0 && !dirty[n]) {
+          continue;                           // Seam, added above
+        }
+        SegmentKey key;
+        if (!find_segment(a, b, &key)) {
+          return false;
+        }
+        if (changed.count(key) == 0) {
+          auto it = segment_marker.find(key);
+          if (it == segment_marker.end()) {
+            return false;
+          }
+          add_segment(add_old_point(a), add_old_point(b), it->second);
+        }
+      }
+    }
+  }
+  for (int i = 0; i < tin.numberofsegments; i++) {
+    int u1 = tin.segmentlist[i*2], u2 = tin.segmentlist[i*2 + 1];
+    XY p1(tin.pointlist[u1*2], tin.pointlist[u1*2 + 1]);
+    XY p2(tin.pointlist[u2*2], tin.pointlist[u2*2 + 1]);
+    SegmentKey k(p1.first, p1.second, p2.first, p2.second);
+    if (changed.count(UndirectedSegmentKey(k)) == 0 ||
+        !upi_edges_added.insert(std::make_pair(std::min(u1, u2),
+                                               std::max(u1, u2))).second) {
+      continue;
+    }
+    int marker = tin.segmentmarkerlist[i];
+    int n = ceil(hypot(p2.first - p1.first, p2.second - p1.second) / max_edge);
+    int last = add_point(p1, 2 + u1);
+    for (int j = 1; j <= n; j++) {
+      int next = (j == n) ? add_point(p2, 2 + u2) :
+          add_point(XY(p1.first + (p2.first - p1.first) * j / n,
+                       p1.second + (p2.second - p1.second) * j / n), marker);
+      add_segment(last, next, marker);
+      last = next;
+    }
+  }
+
+  // One hole point inside each connected group of retained triangles, and
+  // the hole points of 's'.
+  vector<double> holes(tin.holelist, tin.holelist + tin.numberofholes * 2);
+  {
+    vector<char> seen(num_old, 0);
+    for (int i = 0; i < num_old; i++) {
+      if (dirty[i] || seen[i]) {
+        continue;
+      }
+      holes.push_back(centroid[i].first);
+      holes.push_back(centroid[i].second);
+      vector<int> stack(1, i);
+      seen[i] = true;
+      while (!stack.empty()) {
+        int t = stack.back();
+        stack.pop_back();
+        for (int j = 0; j < 3; j++) {
+          int n = ptriangles[t].neighbor[j];
+          if (n >= 0 && !dirty[n] && !seen[n]) {
+            seen[n] = true;
+            stack.push_back(n);
+          }
+        }
+      }
+    }
+  }
+
+  // Call 'Triangle' library. Region attributes are polygon indexes plus one,
+  // so that triangles outside the regions (whose region points may be inside
+  // the carved away retained triangles) have an attribute of zero.
+  triangulateio tin2, tout;
+  memset(&tin2, 0, sizeof(tin2));
+  memset(&tout, 0, sizeof(tout));
+  tin2.numberofpoints = in_markers.size();
+  tin2.pointlist = new double[in_points.size()];
+  std::copy(in_points.begin(), in_points.end(), tin2.pointlist);
+  tin2.pointmarkerlist = new int[in_markers.size()];
+  std::copy(in_markers.begin(), in_markers.end(), tin2.pointmarkerlist);
+  tin2.numberofsegments = in_segment_markers.size();
+  tin2.segmentlist = new int[in_segments.size()];
+  std::copy(in_segments.begin(), in_segments.end(), tin2.segmentlist);
+  tin2.segmentmarkerlist = new int[in_segment_markers.size()];
+  std::copy(in_segment_markers.begin(), in_segment_markers.end(),
+            tin2.segmentmarkerlist);
+  tin2.numberofholes = holes.size() / 2;
+  tin2.holelist = new double[holes.size()];
+  std::copy(holes.begin(), holes.end(), tin2.holelist);
+  tin2.numberofregions = tin.numberofregions;
+  tin2.regionlist = new double[tin.numberofregions * 4];
+  for (int i = 0; i < tin.numberofregions * 4; i++) {
+    tin2.regionlist[i] = tin.regionlist[i] + ((i % 4) == 2);
+  }
+  {
+    MutexLock lock(&triangle_mutex);
+    if (setjmp(triangle_jmp_buf) != 0) {
+      // triangulate() called triexit.
+      return false;
+    }
+    square_of_longest_edge_permitted = sqr(max_edge);
+    // The options are as in the constructor, plus:
+    //   * Y: No new vertices on the boundary
+    triangulate("zpAQqunY", &tin2, &tout, NULL);
+  }
+  CHECK(tout.numberofcorners == 3);
+  CHECK(tout.numberoftriangleattributes == 1);
+  const int num_out_points = tout.numberofpoints;
+  const int num_out_triangles = tout.numberoftriangles;
+  vector<double> out_points(tout.pointlist,
+                            tout.pointlist + num_out_points * 2);
+  vector<int> out_markers(tout.pointmarkerlist,
+                          tout.pointmarkerlist + num_out_points);
+  vector<int> out_triangles(tout.trianglelist,
+                            tout.trianglelist + num_out_triangles * 3);
+  vector<int> out_neighbors(tout.neighborlist,
+                            tout.neighborlist + num_out_triangles * 3);
+  vector<double> out_attributes(tout.triangleattributelist,
+                        tout.triangleattributelist + num_out_triangles);
+  vector<int> out_segments(tout.segmentlist,
+                           tout.segmentlist + tout.numberofsegments * 2);
+  DeleteTriangulateIO(&tin2);
+  tout.holelist = 0;
+  tout.regionlist = 0;
+  FreeTriangulateIO(&tout);
+
+  // Create the points. First the previous mesh points that are retained,
+  // then the points created by the triangle library.
+  vector<RPoint> points;
+  vector<int> retained_points;
+  vector<int> old_to_new(ppoints.size(), -1);
+  vector<char> old_needed(old_in_input);
+  for (int i = 0; i < num_old; i++) {
+    for (int j = 0; j < 3 && !dirty[i]; j++) {
+      old_needed[ptriangles[i].index[j]] = true;
+    }
+  }
+  for (auto &it : upi_to_old) {
+    old_needed[it.second] = false;      // Created from the UPI instead
+  }
+  for (int i = 0; i < ppoints.size(); i++) {
+    if (!old_needed[i]) {
+      continue;
+    }
+    RPoint p = ppoints[i];
+    if (p.original_piece >= 0) {
+      // Point to the same segment in 's'.
+      const vector<RPoint> &piece = ps.Piece(p.original_piece);
+      SegmentKey k = MakeSegmentKey(piece[p.original_edge].p,
+                                 piece[(p.original_edge + 1) % piece.size()].p);
+      auto it = new_segments.find(k);
+      if (it == new_segments.end() || changed.count(UndirectedSegmentKey(k))) {
+        return false;
+      }
+      p.original_piece = it->second.first;
+      p.original_edge = it->second.second;
+    }
+    old_to_new[i] = points.size();
+    points.push_back(p);
+    retained_points.push_back(i);
+  }
+  vector<char> used(num_out_points, 0);
+  for (int i : out_triangles) {
+    used[i] = true;
+  }
+  vector<int> out_to_new(num_out_points, -1);
+  for (int i = 0; i < num_out_points; i++) {
+    int marker = out_markers[i];
+    if (!used[i]) {
+      continue;
+    }
+    if (marker >= 2 + num_upi) {
+      out_to_new[i] = old_to_new[marker - 2 - num_upi];
+      continue;
+    }
+    RPoint p;
+    p.p[0] = out_points[i*2 + 0];
+    p.p[1] = out_points[i*2 + 1];
+    SetPointFromMarker(s, index_map, marker, &p);
+    int old = -1;
+    if (marker >= 2 && upi_to_old.count(marker - 2)) {
+      old = upi_to_old[marker - 2];
+      old_to_new[old] = points.size();
+    }
+    out_to_new[i] = points.size();
+    points.push_back(p);
+    retained_points.push_back(old);
+  }
+
+  // Create the triangles. First the retained triangles, then the triangles
+  // created by the triangle library. Seam edges are linked up afterwards.
+  vector<Triangle> triangles;
+  vector<int> retained_triangles;
+  vector<int> old_tri_to_new(num_old, -1);
+  for (int i = 0; i < num_old; i++) {
+    if (!dirty[i]) {
+      old_tri_to_new[i] = retained_triangles.size();
+      retained_triangles.push_back(i);
+    }
+  }
+  std::map<std::pair<int, int>, int> seam_sides;  // Edge -> triangle*3 + side
+  for (int i : retained_triangles) {
+    Triangle t = ptriangles[i];
+    t.material = piece_map[t.material];
+    if (t.material < 0) {
+      return false;
+    }
+    for (int j = 0; j < 3; j++) {
+      int n = t.neighbor[j];
+      t.neighbor[j] = (n < 0) ? -1 : old_tri_to_new[n];
+      t.index[j] = old_to_new[t.index[j]];
+      if (t.index[j] < 0) {
+        return false;
+      }
+    }
+    for (int j = 0; j < 3; j++) {
+      if (t.neighbor[j] == -1 && ptriangles[i].neighbor[j] >= 0) {
+        seam_sides[std::make_pair(t.index[j], t.index[(j + 1) % 3])] =
+            triangles.size() * 3 + j;
+      }
+    }
+    triangles.push_back(t);
+  }
+  const int num_kept = triangles.size();
+  for (int i = 0; i < num_out_triangles; i++) {
+    Triangle t;
+    t.material = int(out_attributes[i]) - 1;    // -1 if unassigned
+    for (int j = 0; j < 3; j++) {
+      t.index[j] = out_to_new[out_triangles[i*3 + j]];
+      int n = out_neighbors[i*3 + (j + 2) % 3];
+      t.neighbor[j] = (n < 0) ? -1 : n + num_kept;
+      if (t.index[j] < 0) {
+        return false;
+      }
+    }
+    triangles.push_back(t);
+    retained_triangles.push_back(-1);
+  }
+  for (int i = num_kept; i < triangles.size(); i++) {
+    Triangle &t = triangles[i];
+    for (int j = 0; j < 3; j++) {
+      if (t.neighbor[j] == -1) {
+        auto it = seam_sides.find(std::make_pair(t.index[(j + 1) % 3],
+                                                 t.index[j]));
+        if (it != seam_sides.end()) {
+          t.neighbor[j] = it->second / 3;
+          triangles[it->second / 3].neighbor[it->second % 3] = i;
+          seam_sides.erase(it);
+        }
+      }
+    }
+  }
+  if (!seam_sides.empty()) {
+    return false;                       // Seam edges without new triangles
+  }
+
+  // Give triangles outside the regions the material of their neighbors
+  // across edges that are not segments, i.e. the edges between new triangles
+  // that are not output segments, and the pure seam edges (that have the
+  // same material on both sides in the previous mesh).
+  std::set<std::pair<int, int>> same_material_edges;
+  for (auto &it : pure_seams) {
+    int a = old_to_new[it.first], b = old_to_new[it.second];
+    same_material_edges.insert(std::make_pair(std::min(a, b), std::max(a, b)));
+  }
+  std::set<std::pair<int, int>> output_segments;
+  for (int i = 0; i < out_segments.size(); i += 2) {
+    int a = out_to_new[out_segments[i]];
+    int b = out_to_new[out_segments[i + 1]];
+    output_segments.insert(std::make_pair(std::min(a, b), std::max(a, b)));
+  }
+  auto same_material = [&](int i, int j) {
+    const Triangle &t = triangles[i];
+    int a = t.index[j], b = t.index[(j + 1) % 3];
+    std::pair<int, int> edge(std::min(a, b), std::max(a, b));
+    if (t.neighbor[j] < num_kept) {
+      return same_material_edges.count(edge) > 0;
+    }
+    return output_segments.count(edge) == 0;
+  };
+  for (bool again = true; again;) {
+    again = false;
+    for (int i = num_kept; i < triangles.size(); i++) {
+      for (int j = 0; j < 3 && triangles[i].material < 0; j++) {
+        int n = triangles[i].neighbor[j];
+        if (n >= 0 && triangles[n].material >= 0 && same_material(i, j)) {
+          triangles[i].material = triangles[n].material;
+          again = true;
+        }
+      }
+    }
+  }
+
+  // Check the result. All triangles need materials that match their
+  // retained neighbors across pure seam edges, and the triangles must
+  // exactly cover the shape. If not, something has moved in an unexpected
+  // way (e.g. a new hole inside the retained triangles), so give up.
+  double area = 0;
+  for (int i = 0; i < triangles.size(); i++) {
+    const Triangle &t = triangles[i];
+    if (t.material < 0 || t.material >= s.NumPieces()) {
+      return false;
+    }
+    for (int j = 0; j < 3 && i >= num_kept; j++) {
+      int n = t.neighbor[j];
+      if (n >= 0 && n < num_kept && same_material(i, j) &&
+          triangles[n].material != t.material) {
+        return false;
+      }
+    }
+    Eigen::Vector2d a = ToVector2d(points[t.index[0]].p);
+    Eigen::Vector2d b = ToVector2d(points[t.index[1]].p);
+    Eigen::Vector2d c = ToVector2d(points[t.index[2]].p);
+    double tri_area = ((b - a)[0] * (c - a)[1] - (b - a)[1] * (c - a)[0]) / 2;
+    if (tri_area <= 0) {
+      return false;
+    }
+    area += tri_area;
+  }
+  double shape_area = ToDouble(s.TotalArea());
+  if (fabs(area - shape_area) > 1e-9 * shape_area) {
+    return false;
+  }
+
+  points_.swap(points);
+  triangles_.swap(triangles);
+  retained_points_.swap(retained_points);
+  retained_triangles_.swap(retained_triangles);
+  return true;
+}
+
+//***************************************************************************
+// Mesh morphing.
+
+// Return the smallest angle of the triangle a,b,c in degrees.
+static double SmallestAngle(const Vector2d &a, const Vector2d &b,
+                            const Vector2d &c) {
+  const Vector2d *p[3] = {&a, &b, &c};
+  double smallest = 180;
+  for (int i = 0; i < 3; i++) {
+    Vector2d u = *p[(i + 1) % 3] - *p[i];
+    Vector2d v = *p[(i + 2) % 3] - *p[i];
+    double angle = atan2(fabs(u[0] * v[1] - u[1] * v[0]), u.dot(v));
+    smallest = std::min(smallest, angle * 180.0 / M_PI);
+  }
+  return smallest;
+}
+
+// Return the longest edge of the triangle a,b,c.
+static double LongestEdge(const Vector2d &a, const Vector2d &b,
+                          const Vector2d &c) {
+  return std::max((b - a).norm(), std::max((c - b).norm(), (a - c).norm()));
+}
+
+bool Mesh::Morph(const Shape &s, const Mesh &previous) {
+  const Shape &old = previous.meshed_shape_;
+  if (!previous.IsValidMesh() ||
+      previous.longest_edge_permitted_ != longest_edge_permitted_ ||
+      old.NumPieces() != s.NumPieces()) {
+    return false;
+  }
+
+  // The shapes must have the same pieces, materials and edge kinds, differing
+  // only in vertex positions. Vertices that coincide in one shape must also
+  // coincide in the other, otherwise the mesh topology would be wrong.
+  typedef std::pair<double, double> XY;
+  std::map<XY, XY> old_to_new, new_to_old;
+  for (int i = 0; i < s.NumPieces(); i++) {
+    if (old.Piece(i).size() != s.Piece(i).size() ||
+        !(old.GetMaterial(i) == s.GetMaterial(i))) {
+      return false;
+    }
+    for (int j = 0; j < s.Piece(i).size(); j++) {
+      const RPoint &p1 = old.Piece(i)[j];
+      const RPoint &p2 = s.Piece(i)[j];
+      if (p1.e != p2.e) {
+        return false;
+      }
+      XY xy1(ToDouble(p1.p[0]), ToDouble(p1.p[1]));
+      XY xy2(ToDouble(p2.p[0]), ToDouble(p2.p[1]));
+      auto it1 = old_to_new.insert(std::make_pair(xy1, xy2)).first;
+      auto it2 = new_to_old.insert(std::make_pair(xy2, xy1)).first;
+      if (it1->second != xy2 || it2->second != xy1) {
+        return false;
+      }
+    }
+  }
+
+  // Move each boundary point to the same relative position on its segment in
+  // the new shape, then propagate the displacements into the interior.
+  const vector<RPoint> &old_points = previous.points_;
+  Eigen::MatrixXd displacement = Eigen::MatrixXd::Zero(old_points.size(), 2);
+  for (int i = 0; i < old_points.size(); i++) {
+    int p = old_points[i].original_piece;
+    int e = old_points[i].original_edge;
+    if (p >= 0) {
+      int e2 = (e + 1) % s.Piece(p).size();
+      Vector2d p1 = ToVector2d(old.Piece(p)[e].p);
+      Vector2d p2 = ToVector2d(old.Piece(p)[e2].p);
+      Vector2d q1 = ToVector2d(s.Piece(p)[e].p);
+      Vector2d q2 = ToVector2d(s.Piece(p)[e2].p);
+      Vector2d x = ToVector2d(old_points[i].p);
+      double alpha = (x - p1).norm() / (p2 - p1).norm();
+      displacement.row(i) = ((1 - alpha) * q1 + alpha * q2 - x).transpose();
+    }
+  }
+  if (!previous.HarmonicExtension(&displacement)) {
+    return false;
+  }
+  vector<RPoint> points(old_points.size());
+  for (int i = 0; i < points.size(); i++) {
+    points[i] = old_points[i];
+    points[i].p[0] = ToDouble(old_points[i].p[0]) + displacement(i, 0);
+    points[i].p[1] = ToDouble(old_points[i].p[1]) + displacement(i, 1);
+  }
+
+  // Reject the morph if any triangle is inverted or has become too distorted,
+  // i.e. if it has a smaller angle or a longer edge than the mesher would
+  // create and is worse than it was before.
+  for (const Triangle &t : previous.triangles_) {
+    Vector2d a = ToVector2d(points[t.index[0]].p);
+    Vector2d b = ToVector2d(points[t.index[1]].p);
+    Vector2d c = ToVector2d(points[t.index[2]].p);
+    if ((b - a)[0] * (c - a)[1] - (b - a)[1] * (c - a)[0] <= 0) {
+      return false;
+    }
+    Vector2d a0 = ToVector2d(old_points[t.index[0]].p);
+    Vector2d b0 = ToVector2d(old_points[t.index[1]].p);
+    Vector2d c0 = ToVector2d(old_points[t.index[2]].p);
+    double angle = SmallestAngle(a, b, c);
+    if (angle < kMorphMinAngle && angle < SmallestAngle(a0, b0, c0)) {
+      return false;
+    }
+    if (longest_edge_permitted_ > 0) {
+      double edge = LongestEdge(a, b, c);
+      if (edge > kMorphMaxEdge * longest_edge_permitted_ &&
+          edge > LongestEdge(a0, b0, c0)) {
+        return false;
+      }
+    }
+  }
+
+  points_.swap(points);
+  triangles_ = previous.triangles_;
+  return true;
+}
+
 void Mesh::DeterminePointMaterial(Lua *lua,
                                   vector<MaterialParameters> *mat_params) {
   Trace trace(__func__);
@@ -783,60 +1863,96 @@ void Mesh::DeterminePointMaterial(Lua *lua,
   }
   mat_params->resize(0);
   mat_params->resize(points_.size());   // Sets material parameters to defaults
+
+  // Points on the boundary between two materials are shared by triangles of
+  // both, and a point takes its parameters from the last material with a
+  // callback that touches it. Find that material for every point in a single
+  // pass over the triangles, so that each point is given to only one callback.
+  vector<int> point_material(points_.size(), -1);
+  for (int i = 0; i < triangles_.size(); i++) {
+    int m = triangles_[i].material;
+    if (materials_[m].callback.Valid()) {
+      for (int k = 0; k < 3; k++) {
+        int &pm = point_material[triangles_[i].index[k]];
+        pm = std::max(pm, m);
+      }
+    }
+  }
+
+  // Bucket the points by material: the points of material i are
+  // material_points[start[i]] up to (but not including)
+  // material_points[start[i+1]].
+  vector<int> start(materials_.size() + 1, 0);
+  for (int i = 0; i < points_.size(); i++) {
+    if (point_material[i] >= 0) {
+      start[point_material[i] + 1]++;
+    }
+  }
   for (int i = 0; i < materials_.size(); i++) {
-    // Skip materials without parameter callback functions.
-    if (!materials_[i].callback.Valid()) {
+    start[i + 1] += start[i];
+  }
+  vector<int> material_points(start.back());
+  {
+    vector<int> next(start.begin(), start.end() - 1);
+    for (int i = 0; i < points_.size(); i++) {
+      if (point_material[i] >= 0) {
+        material_points[next[point_material[i]]++] = i;
+      }
+    }
+  }
+
+  for (int i = 0; i < materials_.size(); i++) {
+    int count = start[i + 1] - start[i];
+    if (count == 0) {
       continue;
     }
-    // Mark all points that are touched by this material.
-    vector<bool> mark(points_.size());
-    for (int j = 0; j < triangles_.size(); j++) {
-      if (triangles_[j].material == i) {
-        for (int k = 0; k < 3; k++) {
-          mark[triangles_[j].index[k]] = true;
-        }
-      }
+    const int *index = material_points.data() + start[i];
+    // Push the callback function to the lua stack.
+    materials_[i].callback.Push(lua->L());
+    // Push vectors of x,y coordinates for the points to the lua stack.
+    LuaVector *x = LuaUserClassCreateObj<LuaVector>(lua->L());
+    LuaVector *y = LuaUserClassCreateObj<LuaVector>(lua->L());
+    x->resize(count);
+    y->resize(count);
+    for (int j = 0; j < count; j++) {
+      (*x)[j] = points_[index[j]].p[0];
+      (*y)[j] = points_[index[j]].p[1];
     }
-    // Count points that are touched by this material.
-    int count = 0;
-    for (int j = 0; j < mark.size(); j++) {
-      count += mark[j];
-    }
-    if (count > 0) {
-      // Push the callback function to the lua stack.
-      materials_[i].callback.Push(lua->L());
-      // Push vectors of x,y coordinates for marked points to the lua stack.
-      LuaVector *x = LuaUserClassCreateObj<LuaVector>(lua->L());
-      LuaVector *y = LuaUserClassCreateObj<LuaVector>(lua->L());
-      x->resize(count);
-      y->resize(count);
-      count = 0;
-      for (int j = 0; j < mark.size(); j++) {
-        if (mark[j]) {
-          (*x)[count] = points_[j].p[0];
-          (*y)[count] = points_[j].p[1];
-        }
-        count += mark[j];
-      }
-      // Call the callback function. RunCallback() will pop the callback
-      // function and arguments.
-      vector<MaterialParameters> result;
-      if (!materials_[i].RunCallback(lua, false, &result)) {
-        // A lua error message will have been displayed at this point.
-        mat_params->clear();
-        return;
-      }
-      // Set point material properties from the callback function's results.
-      int index = 0;
-      for (int j = 0; j < mark.size(); j++) {
-        if (mark[j]) {
-          (*mat_params)[j] = result[index];
-        }
-        index += mark[j];
-      }
-      CHECK(index == count);
+    // Call the callback function. RunCallback() will pop the callback
+    // function and arguments.
+    vector<MaterialParameters> result;
+    if (!materials_[i].RunCallback(lua, false, &result)) {
+      // A lua error message will have been displayed at this point.
+      mat_params->clear();
+      return;
+    }
+    // Set point material properties from the callback function's results.
+    CHECK(result.size() == count);
+    for (int j = 0; j < count; j++) {
+      (*mat_params)[index[j]] = result[j];
+    }
+  }
+}
+
+bool Mesh::CallbackKey(Lua *lua, std::string *key) {
+  // Hash a table of all the callback functions together, so that the state
+  // they share (e.g. the globals) is only traversed once.
+  lua_State *L = lua->L();
+  lua_newtable(L);                              // T
+  int n = 0;
+  for (int i = 0; i < materials_.size(); i++) {
+    if (materials_[i].callback.Valid()) {
+      materials_[i].callback.Push(L);           // T fn
+      lua_rawseti(L, -2, ++n);                  // T
     }
   }
+  for (const auto &it : port_callbacks_) {
+    it.second.callback.Push(L);                 // T fn
+    lua_rawseti(L, -2, ++n);                    // T
+  }
+  bool ok = n > 0 && LuaHashValue(L, -1, key);
+  lua_pop(L, 1);
+  return ok;
 }
 
 void Mesh::DetermineBoundaryParameters(Lua *lua,
@@ -989,15 +2105,15 @@ TEST_FUNCTION(SpatialIndex) {
          (int)m.points_.size(), (int)m.triangles_.size());
   for (int y = -2; y <= 34; y++) {
     for (int x = -2; x <= 34; x++) {
-      uint64 index = GridIndex(x, y);
-      Mesh::SpatialIndex::const_iterator it = m.spatial_index_.find(index);
-      if (it == m.spatial_index_.end()) {
+      int gx = x - m.grid_x_, gy = y - m.grid_y_;
+      if (gx < 0 || gx >= m.grid_width_ || gy < 0 || gy >= m.grid_height_) {
         printf(" .");
       } else {
-        int n = it->second.size();
+        int c = gy * m.grid_width_ + gx;
+        int n = m.cell_start_[c + 1] - m.cell_start_[c];
         printf("%2d", n);
         for (int i = 0; i < n; i++) {
-          int index = it->second[i];
+          int index = m.cell_triangles_[m.cell_start_[c] + i];
           const JetPoint *p[3];
           for (int k = 0; k < 3; k++) {
             p[k] = &m.points_[m.triangles_[index].index[k]].p;
@@ -1034,4 +2150,332 @@ TEST_FUNCTION(SpatialIndex) {
     int t = m.FindTriangle(x, y);
     CHECK(t == -1);
   }
+
+  // An empty mesh has nothing to find.
+  Mesh empty(Shape(), kGridSize, NULL);
+  CHECK(empty.points_.empty());
+  CHECK(empty.FindTriangle(0, 0) == -1);
+}
+
+TEST_FUNCTION(FindTrianglesBenchmark) {
+  // Time random and coherent (raster order) point queries, and check that
+  // FindTriangles() gives triangles that contain the points.
+  Shape s, hole;
+  s.AddPoint(0, 0);
+  s.AddPoint(100, 0);
+  s.AddPoint(100, 100);
+  s.AddPoint(0, 100);
+  hole.AddPoint(30, 30);
+  hole.AddPoint(70, 30);
+  hole.AddPoint(50, 70);
+  s.SetDifference(s, hole);
+  Mesh m(s, 0.5, NULL);
+  CHECK(m.IsValidMesh());
+  double start_time = Now();
+  m.FindTriangle(0, 0);
+  printf("%d triangles, spatial index built in %.3fms\n",
+         (int) m.triangles_.size(), (Now() - start_time) * 1e3);
+
+  const int kN = 1000;
+  vector<double> x, y;
+  for (int i = 0; i < kN * kN; i++) {
+    x.push_back(RandDouble() * 110 - 5);
+    y.push_back(RandDouble() * 110 - 5);
+  }
+  start_time = Now();
+  int found = 0;
+  for (int i = 0; i < x.size(); i++) {
+    found += m.FindTriangle(x[i], y[i]) >= 0;
+  }
+  printf("Random FindTriangle(): %.1fns per query (%d found)\n",
+         (Now() - start_time) * 1e9 / x.size(), found);
+
+  for (int i = 0; i < kN; i++) {
+    for (int j = 0; j < kN; j++) {
+      x[i * kN + j] = j * 110.0 / kN - 5;
+      y[i * kN + j] = i * 110.0 / kN - 5;
+    }
+  }
+  start_time = Now();
+  vector<int> single(x.size());
+  for (int i = 0; i < x.size(); i++) {
+    single[i] = m.FindTriangle(x[i], y[i]);
+  }
+  double single_time = Now() - start_time;
+  start_time = Now();
+  vector<int> batch;
+  m.FindTriangles(x, y, &batch);
+  double batch_time = Now() - start_time;
+  printf("Raster FindTriangle(): %.1fns per query, FindTriangles(): %.1fns "
+         "per query\n", single_time * 1e9 / x.size(),
+         batch_time * 1e9 / x.size());
+  CHECK(batch.size() == x.size());
+  for (int i = 0; i < x.size(); i++) {
+    CHECK((single[i] >= 0) == (batch[i] >= 0));
+    if (batch[i] >= 0) {
+      const Triangle &t = m.triangles_[batch[i]];
+      JetPoint xy;
+      xy[0] = x[i];
+      xy[1] = y[i];
+      CHECK(PointInTriangle(xy, m.points_[t.index[0]].p,
+                            m.points_[t.index[1]].p,
+                            m.points_[t.index[2]].p) != 0);
+    }
+  }
+}
+
+TEST_FUNCTION(IncrementalMesh) {
+  // Mesh a section of waveguide with a post, an iris and a dielectric slab in
+  // it, then move the post and remesh incrementally. Check that the
+  // incremental mesh is consistent and compare its speed with meshing the
+  // changed shape from scratch. Then move the iris, which changes the
+  // waveguide wall.
+  const double kEdgeLength = 2;
+  auto waveguide = [](double post_x, double iris_y) {
+    Shape s, post, iris, slab;
+    s.AddPoint(0, 0);
+    s.AddPoint(500, 0);
+    s.AddPoint(500, 120);
+    s.AddPoint(0, 120);
+    CHECK(s.AssignPort(0, 3, EdgeKind(1)));
+    CHECK(s.AssignPort(0, 1, EdgeKind(2)));
+    post.AddPoint(post_x, 40);
+    post.AddPoint(post_x + 20, 40);
+    post.AddPoint(post_x + 20, 60);
+    post.AddPoint(post_x, 60);
+    s.SetDifference(s, post);
+    iris.AddPoint(100, iris_y);
+    iris.AddPoint(110, iris_y);
+    iris.AddPoint(110, 130);
+    iris.AddPoint(100, 130);
+    s.SetDifference(s, iris);
+    slab.AddPoint(350, 0);
+    slab.AddPoint(400, 0);
+    slab.AddPoint(400, 120);
+    slab.AddPoint(350, 120);
+    Material dielectric;
+    dielectric.epsilon = 2;
+    dielectric.color = 0x8080ff;
+    s.Paint(slab, dielectric);
+    return s;
+  };
+  // Return the total length of the mesh boundary, and check that triangle
+  // neighbors are consistent.
+  auto check_mesh = [](const Mesh &m) {
+    double length = 0;
+    for (int i = 0; i < m.triangles_.size(); i++) {
+      const Triangle &t = m.triangles_[i];
+      for (int j = 0; j < 3; j++) {
+        int a = t.index[j], b = t.index[(j + 1) % 3];
+        int n = t.neighbor[j];
+        if (n == -1) {
+          length += ToDouble((m.points_[a].p - m.points_[b].p).norm());
+        } else {
+          bool found = false;
+          for (int k = 0; k < 3; k++) {
+            found |= m.triangles_[n].index[k] == b &&
+                     m.triangles_[n].index[(k + 1) % 3] == a &&
+                     m.triangles_[n].neighbor[k] == i;
+          }
+          CHECK(found);
+        }
+      }
+    }
+    return length;
+  };
+  // Return the total area of triangles with the dielectric material.
+  auto dielectric_area = [](const Mesh &m) {
+    double area = 0;
+    for (const Triangle &t : m.triangles_) {
+      if (m.materials_[t.material].epsilon.real() == 2) {
+        Eigen::Vector2d a = ToVector2d(m.points_[t.index[0]].p);
+        Eigen::Vector2d b = ToVector2d(m.points_[t.index[1]].p);
+        Eigen::Vector2d c = ToVector2d(m.points_[t.index[2]].p);
+        area += ((b - a)[0] * (c - a)[1] - (b - a)[1] * (c - a)[0]) / 2;
+      }
+    }
+    return area;
+  };
+
+  Shape s1 = waveguide(240, 90), s2 = waveguide(243, 90);
+  Mesh m1(s1, kEdgeLength, NULL);
+  CHECK(m1.IsValidMesh() && m1.retained_points().empty());
+  double start_time = Now();
+  Mesh full(s2, kEdgeLength, NULL);
+  double full_time = Now() - start_time;
+  start_time = Now();
+  Mesh m2(s2, kEdgeLength, NULL, &m1);
+  double incremental_time = Now() - start_time;
+  CHECK(m2.IsValidMesh() && full.IsValidMesh());
+  CHECK(m2.retained_points().size() == m2.points_.size());
+  CHECK(m2.retained_triangles().size() == m2.triangles_.size());
+  int num_retained = 0;
+  for (int i = 0; i < m2.points_.size(); i++) {
+    int j = m2.retained_points()[i];
+    if (j >= 0) {
+      CHECK(m2.points_[i].p == m1.points_[j].p);
+      num_retained++;
+    }
+  }
+  printf("Full mesh: %d triangles in %.3fms, incremental mesh: %d triangles "
+         "(%d points retained) in %.3fms\n", (int) full.triangles_.size(),
+         full_time * 1e3, (int) m2.triangles_.size(), num_retained,
+         incremental_time * 1e3);
+  CHECK(num_retained > m2.points_.size() * 3 / 4);
+
+  // The boundary and materials of the incremental mesh should match the
+  // shape, and the ports should be intact.
+  double length = check_mesh(m2);
+  printf("Boundary length = %f, full mesh = %f\n", length, check_mesh(full));
+  CHECK(fabs(length - check_mesh(full)) < 1e-9);
+  CHECK(fabs(dielectric_area(m2) - 50 * 120) < 1e-9);
+  double port_length[3] = {0, 0, 0};
+  for (BoundaryIterator it(&m2); !it.done(); ++it) {
+    int p = it.kind().PortNumber();
+    CHECK(p >= 0 && p <= 2);
+    port_length[p] += ToDouble((m2.points_[it.pindex1()].p -
+                                m2.points_[it.pindex2()].p).norm());
+  }
+  CHECK(fabs(port_length[1] - 120) < 1e-9 && fabs(port_length[2] - 120) < 1e-9);
+
+  // Remeshing incrementally from an incremental mesh also works when the
+  // wall changes, and a different edge length needs a full remesh.
+  Shape s3 = waveguide(243, 85);
+  Mesh m3(s3, kEdgeLength, NULL, &m2);
+  Mesh full3(s3, kEdgeLength, NULL);
+  CHECK(m3.IsValidMesh() && !m3.retained_points().empty());
+  CHECK(fabs(check_mesh(m3) - check_mesh(full3)) < 1e-9);
+  CHECK(fabs(dielectric_area(m3) - 50 * 120) < 1e-9);
+  Mesh m4(s3, kEdgeLength * 2, NULL, &m3);
+  CHECK(m4.IsValidMesh() && m4.retained_points().empty());
+}
+
+TEST_FUNCTION(MeshMorph) {
+  // Derivatives of interior points are a smooth extension of the derivatives
+  // of boundary points. If the right side of a square moves then the x
+  // derivative of each point is proportional to its x coordinate, since that
+  // linear function is harmonic and is reproduced exactly by the mesh.
+  {
+    JetNum right = 10;
+    right.Derivative() = 1;
+    Shape s;
+    s.AddPoint(0, 0);
+    s.AddPoint(right, 0);
+    s.AddPoint(right, 10);
+    s.AddPoint(0, 10);
+    Mesh m(s, 0.5, NULL);
+    CHECK(m.IsValidMesh());
+    int num_interior = 0;
+    for (const RPoint &p : m.points_) {
+      CHECK(fabs(p.p[0].Derivative() - ToDouble(p.p[0]) / 10) < 1e-9);
+      CHECK(fabs(p.p[1].Derivative()) < 1e-9);
+      num_interior += p.original_piece < 0;
+    }
+    CHECK(num_interior > 0);
+  }
+
+  // Morph the mesh of a waveguide with a post for a small step of the post
+  // position. A large step distorts the mesh too much and gives the same
+  // mesh as meshing from scratch.
+  const double kEdgeLength = 1;
+  auto waveguide = [](JetNum post_x) {
+    Shape s, post;
+    s.AddPoint(0, 0);
+    s.AddPoint(100, 0);
+    s.AddPoint(100, 50);
+    s.AddPoint(0, 50);
+    CHECK(s.AssignPort(0, 3, EdgeKind(1)));
+    post.AddPoint(post_x, 20);
+    post.AddPoint(post_x + 10.0, 20);
+    post.AddPoint(post_x + 10.0, 30);
+    post.AddPoint(post_x, 30);
+    s.SetDifference(s, post);
+    return s;
+  };
+  auto mesh_area = [](const Mesh &m) {
+    double area = 0;
+    for (const Triangle &t : m.triangles_) {
+      Vector2d a = ToVector2d(m.points_[t.index[0]].p);
+      Vector2d b = ToVector2d(m.points_[t.index[1]].p);
+      Vector2d c = ToVector2d(m.points_[t.index[2]].p);
+      double twice_area = (b - a)[0] * (c - a)[1] - (b - a)[1] * (c - a)[0];
+      CHECK(twice_area > 0);
+      area += twice_area / 2;
+    }
+    return area;
+  };
+  auto same_triangles = [](const Mesh &m1, const Mesh &m2) {
+    if (m1.triangles_.size() != m2.triangles_.size()) {
+      return false;
+    }
+    for (int i = 0; i < m1.triangles_.size(); i++) {
+      for (int j = 0; j < 3; j++) {
+        if (m1.triangles_[i].index[j] != m2.triangles_[i].index[j] ||
+            m1.triangles_[i].neighbor[j] != m2.triangles_[i].neighbor[j]) {
+          return false;
+        }
+      }
+    }
+    return true;
+  };
+
+  // The derivatives of a moving post reach the whole mesh, not just the
+  // neighborhood of the post. Copies of a mesh share its Laplace system.
+  {
+    JetNum post_x = 40;
+    post_x.Derivative() = 1;
+    Mesh m(waveguide(post_x), kEdgeLength, NULL);
+    CHECK(m.IsValidMesh() && m.laplace_ && m.laplace_->valid);
+    Mesh copy(m);
+    CHECK(copy.laplace_ == m.laplace_);
+    int num_far = 0;
+    for (const RPoint &p : m.points_) {
+      if (p.original_piece < 0 && ToDouble(p.p[0]) > 80) {
+        CHECK(p.p[0].Derivative() > 1e-6);
+        num_far++;
+      }
+    }
+    CHECK(num_far > 0);
+  }
+
+  Shape s1 = waveguide(40), s2 = waveguide(40.5), s3 = waveguide(60);
+  Mesh m1(s1, kEdgeLength, NULL);
+  double start_time = Now();
+  Mesh full2(s2, kEdgeLength, NULL);
+  double full_time = Now() - start_time;
+  start_time = Now();
+  CHECK(m1.GetLaplaceSystem()->valid);
+  double laplace_time = Now() - start_time;
+  start_time = Now();
+  Mesh m2(s2, kEdgeLength, NULL, &m1, Mesh::REMESH_MORPH);
+  double morph_time = Now() - start_time;
+  printf("Full mesh: %d triangles in %.3fms, Laplace system in %.3fms, "
+         "morphed mesh: %d triangles in %.3fms\n",
+         (int) full2.triangles_.size(), full_time * 1e3, laplace_time * 1e3,
+         (int) m2.triangles_.size(), morph_time * 1e3);
+  CHECK(m1.IsValidMesh() && m2.IsValidMesh());
+  CHECK(same_triangles(m1, m2));
+  CHECK(fabs(mesh_area(m2) - ToDouble(s2.TotalArea())) < 1e-9);
+  for (int i = 0; i < m2.points_.size(); i++) {
+    // Points on the outer wall do not move, points on the post move with it.
+    Vector2d p1 = ToVector2d(m1.points_[i].p);
+    Vector2d p2 = ToVector2d(m2.points_[i].p);
+    if (m1.points_[i].original_piece >= 0) {
+      bool on_post = p1[0] >= 40 && p1[0] <= 50 && p1[1] >= 20 && p1[1] <= 30;
+      CHECK((p2 - p1 - Vector2d(on_post ? 0.5 : 0, 0)).norm() < 1e-9);
+    }
+  }
+  double port_length = 0;
+  for (BoundaryIterator it(&m2); !it.done(); ++it) {
+    if (it.kind().PortNumber() == 1) {
+      port_length += ToDouble((m2.points_[it.pindex1()].p -
+                               m2.points_[it.pindex2()].p).norm());
+    }
+  }
+  CHECK(fabs(port_length - 50) < 1e-9);
+
+  Mesh m3(s3, kEdgeLength, NULL, &m1, Mesh::REMESH_MORPH);
+  Mesh full3(s3, kEdgeLength, NULL);
+  CHECK(m3.IsValidMesh() && !same_triangles(m1, m3));
+  CHECK(same_triangles(m3, full3));
 }
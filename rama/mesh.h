@@ -17,6 +17,9 @@
 #include "../toolkit/lua_util.h"
 #include "../toolkit/colormaps.h"
 #include <map>
+#include <memory>
+
+struct triangulateio;
 
 class Mesh {
  public:
@@ -26,7 +29,28 @@ class Mesh {
   // triangles will be subdivided to satisfy this constraint, otherwise a
   // triangulation with a small number of triangles will be produced. If 'lua'
   // is provided the dielectric callback functions can be called.
-  explicit Mesh(const Shape &s, double longest_edge_permitted, Lua *lua);
+  //
+  // If 'previous' is given then the mesh can be created from it, which is
+  // much faster when the shape has only changed a little. The 'remesh' flags
+  // select how:
+  //   * REMESH_MORPH: If the shape has the same structure as the previous
+  //     shape (e.g. a parameter step has moved some vertices) then move the
+  //     points of 'previous' to fit the new boundary, propagating the boundary
+  //     displacement smoothly into the interior. The triangles are unchanged.
+  //     This is tried first, and fails if the moved triangles would be too
+  //     distorted.
+  //   * REMESH_INCREMENTAL: The triangles of 'previous' that are well away
+  //     from the boundary segments that differ between the two shapes are
+  //     kept, and only the rest of the domain is triangulated, with the edges
+  //     of the kept triangles as a seam that is not subdivided.
+  // If neither is possible (e.g. if longest_edge_permitted has changed or
+  // most of the shape is different) the whole shape is triangulated.
+  enum {
+    REMESH_INCREMENTAL = 1,
+    REMESH_MORPH = 2,
+  };
+  explicit Mesh(const Shape &s, double longest_edge_permitted, Lua *lua,
+                const Mesh *previous = 0, int remesh = REMESH_INCREMENTAL);
 
   // Did mesh creation succeed?
   bool IsValidMesh() const { return valid_mesh_; }
@@ -36,6 +60,15 @@ class Mesh {
   const vector<Triangle> &triangles() { return triangles_; }
   const vector<Material> &materials() { return materials_; }
 
+  // If the mesh was created incrementally from a previous mesh then these
+  // give, for each point and triangle, the index of the identical point or
+  // triangle in the previous mesh, or -1 if it is new. Otherwise they are
+  // empty. A retained triangle has the same points in the same order and the
+  // same material as its previous triangle, so its element matrices only
+  // differ if material callback functions give different values.
+  const vector<int> &retained_points() const { return retained_points_; }
+  const vector<int> &retained_triangles() const { return retained_triangles_; }
+
   // Draw the mesh to OpenGL. If the mesh is empty this does nothing.
   enum MeshDrawType {   // These enums match the 'mesh' choice box
     MESH_HIDE = 0,
@@ -47,18 +80,37 @@ class Mesh {
   void DrawMesh(MeshDrawType draw_type, ColorMap::Function colormap,
                 int brightness, const Eigen::Matrix4d &camera_transform);
 
+  // Draw the triangles of the mesh colored by a value at each point, looking
+  // up colors in the colormap so that values from minval to maxval span the
+  // whole colormap. The mesh geometry stays in OpenGL buffers between calls,
+  // so only the values are uploaded each time.
+  void DrawPointValues(const vector<float> &values, double minval,
+                       double maxval, ColorMap::Function colormap);
+
   // For debugging draw the derivative vectors at boundary points.
   void DrawPointDerivatives(double scale);
 
   // Update the derivatives of mesh points and materials from the derivatives
   // of points and materials in 's'. The shape 's' must have exactly the same
   // structure as the original 's' given to the constructor, only differing in
-  // the derivatives.
+  // the derivatives. The derivatives of boundary points are interpolated from
+  // the shape, and those of interior points are propagated smoothly from the
+  // boundary by solving Laplace's equation over the whole mesh, so the mesh
+  // morphs consistently with a change in the shape.
   void UpdateDerivatives(const Shape &s);
 
   // Return the triangle index that intersects (x,y), or return -1 if none.
   int FindTriangle(double x, double y);
 
+  // Set (*triangles)[i] to FindTriangle(x[i], y[i]) for all points. This is
+  // faster than calling FindTriangle() for each point when consecutive points
+  // are close together (e.g. along a line or in a raster), because each
+  // search starts by walking across the mesh from the previous triangle found.
+  // For points on triangle edges the triangle found may differ from the one
+  // FindTriangle() returns.
+  void FindTriangles(const vector<double> &x, const vector<double> &y,
+                     vector<int> *triangles);
+
   // Encapsulate arguments (i,j,k) and return values (alpha, beta) of the
   // solver's Robin() function. Return values are for Robin edge j of triangle
   // i, at point k.
@@ -72,19 +124,87 @@ class Mesh {
   vector<Material> materials_;          // Copies of shape piece materials
   std::map<int, Shape::CallbackInfo> port_callbacks_;  // Copied from shape
   double cd_width_=0, cd_height_=0;     // CD dimensions (in config units)
+  Shape meshed_shape_;                  // Shape split at necks, for remeshing
+  double longest_edge_permitted_ = 0;   // Constructor argument
+  vector<int> retained_points_;         // Previous mesh point, or -1
+  vector<int> retained_triangles_;      // Previous mesh triangle, or -1
   friend class BoundaryIterator;
   // Optional, material parameters at each point (size = 0 or points_.size()).
   vector<MaterialParameters> mat_params_;
   // Optional boundary parameters. This maps Robin() arguments to alpha, beta.
   std::map<RobinArg, RobinRet> boundary_params_;
-  // Spatial index that is built when FindTriangle() is called.
+  // CallbackKey() computed just after mat_params_ and boundary_params_, or
+  // empty if there is none.
+  std::string callback_key_;
+  // Spatial index that is built when FindTriangle() is called. This is a grid
+  // of square cells that covers the mesh, with cell (ix,iy) at grid position
+  // (ix - grid_x_, iy - grid_y_) in row major order. The triangles that
+  // intersect grid cell c are cell_triangles_[cell_start_[c]] up to (but not
+  // including) cell_triangles_[cell_start_[c+1]].
   int cell_size_;                       // Spatial index cell size is 2^this
-  typedef std::map<uint64, std::vector<int> > SpatialIndex;
-  SpatialIndex spatial_index_;
+  int grid_x_ = 0, grid_y_ = 0;         // Cell coordinates of grid origin
+  int grid_width_ = 0, grid_height_ = 0;
+  vector<int> cell_start_;              // Size is number of cells + 1
+  vector<int> cell_triangles_;
 
   // For drawing a 3D mesh:
  vector<Eigen::Vector3d> tri_normal1_, tri_normal2_;
 
+  // OpenGL buffers for drawing the mesh, created when first needed by
+  // GetDrawBuffers(). A copy of a mesh creates its own buffers.
+  class DrawBuffers;
+  struct DrawBuffersOwner {
+    DrawBuffers *buffers = 0;
+    DrawBuffersOwner() {}
+    DrawBuffersOwner(const DrawBuffersOwner &) {}
+    DrawBuffersOwner &operator=(const DrawBuffersOwner &) {
+      Reset();
+      return *this;
+    }
+    ~DrawBuffersOwner() { Reset(); }
+    void Reset();
+  };
+  DrawBuffersOwner draw_buffers_;
+  DrawBuffers *GetDrawBuffers();
+
+  // The factorized Laplace system solved by HarmonicExtension(), created by
+  // GetLaplaceSystem() when first needed. It only depends on the point
+  // positions and the triangles, so copies of the mesh share it.
+  struct LaplaceSystem;
+  mutable std::shared_ptr<const LaplaceSystem> laplace_;
+  const LaplaceSystem *GetLaplaceSystem() const;
+
+  // Given values at the boundary points (i.e. those with an original_piece),
+  // set the values at the interior points by solving Laplace's equation over
+  // the mesh with the boundary values as Dirichlet conditions. Each column of
+  // 'values' is a separate problem. Return false if the system can not be
+  // solved.
+  bool HarmonicExtension(Eigen::MatrixXd *values) const;
+
+  // Set points_ and triangles_ for the shape 's' (already split at necks) by
+  // keeping the triangles of 'previous' that are away from the changed
+  // boundary segments and triangulating the rest. 'tin' is the triangle
+  // library input for the whole of 's' and 'index_map' maps its point markers
+  // to pieces of 's', as created by the constructor. Return false if this is
+  // not possible, in which case the whole shape should be triangulated.
+  bool TriangulateIncrementally(const Shape &s, const Mesh &previous,
+                                const vector<std::pair<int, int>> &index_map,
+                                const triangulateio &tin);
+
+  // Set points_ and triangles_ for the shape 's' (already split at necks) by
+  // moving the points of 'previous' to fit the boundary of 's', keeping the
+  // same triangles. Return false if 's' does not have the same structure as
+  // the previous shape or if the moved triangles would be too distorted.
+  bool Morph(const Shape &s, const Mesh &previous);
+
+  // Create the spatial index used by FindTriangle().
+  void BuildSpatialIndex();
+
+  // Walk across the mesh from triangle t towards (x,y) and return the triangle
+  // that contains the point. Return -1 if the walk leaves the mesh (e.g.
+  // because the mesh is not convex) or is taking too long.
+  int WalkToTriangle(int t, double x, double y) const;
+
   // If any materials have callback functions to determine their material
   // parameters, call them and populate the epsilon and (optionally) sigma
   // values in mat_params. vectors. Otherwise clear mat_params.
@@ -95,6 +215,13 @@ class Mesh {
   void DetermineBoundaryParameters(Lua *lua,
                                  std::map<RobinArg, RobinRet> *boundary_params);
 
+  // Compute in 'key' a hash of the material and port callback functions and
+  // everything they can see in the Lua state (see LuaHashValue()). If the key
+  // is unchanged then calling the callbacks again for this mesh would give the
+  // same mat_params_ and boundary_params_. Return false if there are no
+  // callbacks or if the state they can see can not be hashed.
+  bool CallbackKey(Lua *lua, std::string *key);
+
   // Setup tri_normal1_ etc so that triangle normals can be computed from
   //   Vector3d v(z1,z2,z3);    // Triangle vertex Z values
   //   normal = Vector3d(tri_normal1_[i].dot(v), tri_normal2_[i].dot(v), 1);
@@ -103,6 +230,9 @@ class Mesh {
 
   // For testing:
   friend void __RunTest_SpatialIndex();
+  friend void __RunTest_FindTrianglesBenchmark();
+  friend void __RunTest_IncrementalMesh();
+  friend void __RunTest_MeshMorph();
 };
 
 // An iterator for mesh edges. If the color mask is zero, iterate over all
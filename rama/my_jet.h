@@ -294,15 +294,18 @@ struct Jet {
   // RAMA: We can't just use an eigen vector here since that has a non-trivial
   // default constructor, which would prevent us from putting Jets into unions
   // in Lua. Instead we reserve storage for v then allow it to be accessed as
-  // an eigen vector with the v() function.
+  // an eigen vector with the v() function. The storage is not aligned, so v()
+  // must not assume that it is.
   #undef v
-  typedef Eigen::Matrix<T, N, 1> VType;
+  typedef Eigen::Matrix<T, N, 1, Eigen::DontAlign> VType;
   T v_storage[sizeof(VType) / sizeof(T)];
   static_assert(sizeof(v_storage) == sizeof(VType), "Bad size for v_storage");
   const VType &v() const { return *((VType*)v_storage); }
   VType &v() { return *((VType*)v_storage); }
   const T &Derivative() const { return v()[0]; }
   T &Derivative() { return v()[0]; }
+  const T &Derivative(int i) const { return v()[i]; }
+  T &Derivative(int i) { return v()[i]; }
   #define v v()
 
   // This struct needs to have an Eigen aligned operator new as it contains
@@ -1166,9 +1169,20 @@ struct ScalarBinaryOpTraits<T, ceres::Jet<T, N>, BinaryOp> {
 
 // RAMA: The rest of this file is all new.
 
+// The number of derivatives carried by each JetNum, i.e. the number of
+// parameters that derivatives can be computed for in one run of a script. This
+// is also the size of every Lua number, so it is a build option rather than a
+// runtime one. The optimizer computes Jacobians kJetWidth parameters at a
+// time. The build files set a width of a few parameters, as models commonly
+// have that many, and this default of 1 is for builds that don't set it.
+#ifndef RAMA_JET_WIDTH
+#define RAMA_JET_WIDTH 1
+#endif
+const int kJetWidth = RAMA_JET_WIDTH;
+
 // We don't want rama::Jet in the global namespace as that could cause
 // confusion with ceres::Jet in the optimizer. Instead we use these types:
-typedef rama::Jet<double, 1> JetNum;
+typedef rama::Jet<double, kJetWidth> JetNum;
 typedef std::complex<JetNum> JetComplex;
 typedef Eigen::Matrix<JetNum, Eigen::Dynamic, 1> VectorJetNum;
 typedef Eigen::Matrix<JetComplex, Eigen::Dynamic, 1> VectorJetComplex;
@@ -1195,7 +1209,22 @@ inline bool IsNaNOrInfValue(const JetNum &f) {
   return std::isnan(f.a) || std::isinf(f.a);
 }
 inline bool IsNaNOrInfDerivative(const JetNum &f) {
-  return std::isnan(f.Derivative()) || std::isinf(f.Derivative());
+  for (int i = 0; i < kJetWidth; i++) {
+    if (std::isnan(f.Derivative(i)) || std::isinf(f.Derivative(i))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Return true if any derivative of f is nonzero.
+inline bool HasDerivative(const JetNum &f) {
+  for (int i = 0; i < kJetWidth; i++) {
+    if (f.Derivative(i) != 0) {
+      return true;
+    }
+  }
+  return false;
 }
 
 // Calling these likely means a bug, so declare but don't define them to ensure
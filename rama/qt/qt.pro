@@ -42,6 +42,8 @@ LIBS += -lBlasAndLapack
 DEFINES += EIGEN_DEFAULT_DENSE_INDEX_TYPE=int
 DEFINES += __TOOLKIT_USE_CERES__
 DEFINES += __TOOLKIT_MAT_FILE_USE_ZLIB__
+# The number of derivatives in each JetNum, see my_jet.h.
+DEFINES += RAMA_JET_WIDTH=4
 
 # Include paths.
 INCLUDEPATH += $$EIGEN_DIR
@@ -95,6 +97,7 @@ SOURCES += \
     ../shape.cc \
     ../mesh.cc \
     ../solver.cc \
+    ../script_runner.cc \
     ../clipper.cc \
     ../triangle.c \
     ../../toolkit/lua_model_viewer_qt.cc \
@@ -0,0 +1,657 @@
+// Rama Simulator, Copyright (C) 2014-2020 Russell Smith.
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+
+#include <stdio.h>
+#include "script_runner.h"
+#include "../toolkit/lua_vector.h"
+#include "../toolkit/si_prefix.h"
+#include "../toolkit/testing.h"
+#include "../toolkit/thread.h"
+
+using std::vector;
+using std::string;
+
+extern "C" char user_script_util_dot_lua;
+extern "C" int user_script_util_dot_lua_length;
+
+const double kMaxReasonableTriangles = 1e12;
+
+//***************************************************************************
+// Lua context and error capture.
+
+class ScriptRunner::RunnerLua : public Lua {
+ public:
+  explicit RunnerLua(ScriptRunner *runner) : runner_(runner) {}
+
+  void HandleStackBacktrace(const char *message) {
+    runner_->AddMessage(message);
+  }
+
+  void HandleError(const char *message) {
+    runner_->AddError(message);
+  }
+
+  int Print() {
+    string message;
+    int n = lua_gettop(L());
+    for (int i = 1; i <= n; i++) {
+      message += LuaToString(L(), i);
+      if (i < n) {
+        message += ' ';
+      }
+    }
+    runner_->AddMessage(message);
+    return 0;
+  }
+
+ private:
+  ScriptRunner *runner_;
+};
+
+// While one of these exists all errors emitted from the calling thread, e.g.
+// by the mesher and solver, are captured by the runner. Panics are passed
+// on to the previous error handler.
+
+class ScriptRunner::RunnerErrorHandler : public ErrorHandler {
+ public:
+  explicit RunnerErrorHandler(ScriptRunner *runner) : runner_(runner) {
+    previous_ = SetThreadErrorHandler(this);
+  }
+
+  ~RunnerErrorHandler() {
+    SetThreadErrorHandler(previous_);
+  }
+
+  void HandleError(Type type, const char *msg, va_list ap) {
+    if (type == ErrorHandler::Panic) {
+      SetThreadErrorHandler(previous_);
+      VPanic(msg, ap);
+    }
+    char buffer[1000];
+    vsnprintf(buffer, sizeof(buffer), msg, ap);
+    if (type == ErrorHandler::Error) {
+      runner_->AddError(buffer);
+    } else if (type == ErrorHandler::Warning) {
+      runner_->AddMessage(string("Warning: ") + buffer);
+    } else {
+      runner_->AddMessage(buffer);
+    }
+  }
+
+ private:
+  ScriptRunner *runner_;
+  ErrorHandler *previous_;
+};
+
+//***************************************************************************
+// ScriptRunner.
+
+ScriptRunner::ScriptRunner() {
+  lua_ = 0;
+  displayed_soln_ = 0;
+  optimizer_soln_ = 0;
+  there_were_errors_ = false;
+  thread_safe_ = true;
+}
+
+ScriptRunner::~ScriptRunner() {
+  // The solvers may refer to the Lua state, so delete them first.
+  solvers_.Clear();
+  delete lua_;
+}
+
+void ScriptRunner::SetFlag(const string &key, const string &value) {
+  flags_[key] = value;
+}
+
+void ScriptRunner::SetParameter(const string &label, double value,
+                                int derivative) {
+  Parameter &p = parameters_[label];
+  p.value = value;
+  p.derivative = derivative;
+}
+
+bool ScriptRunner::Run(const string &script) {
+  Trace trace(__func__);
+  RunnerErrorHandler capture(this);
+  solvers_.ClearKeepingMesh();
+  delete lua_;
+  lua_ = new RunnerLua(this);
+  messages_.clear();
+  script_parameters_.clear();
+  there_were_errors_ = false;
+  optimizer_soln_ = 0;
+  thread_safe_ = true;
+  cd_.Clear();
+  config_ = ScriptConfig();
+
+  // Set up the Lua context with the same globals that the GUI provides.
+  // Functions that only affect the display do nothing here.
+  lua_State *L = lua_->L();
+  lua_->UseStandardLibraries(true);
+  LuaVector::SetLuaGlobals(L);
+  Shape::SetLuaGlobals(L);
+  LuaUserClassRegister<Shape>(*lua_, "Shape");
+  LuaUserClassRegister<LuaVector>(*lua_, "Vector");
+  lua_->SetUserObject(1, this);
+  static const struct {
+    const char *name;
+    lua_CFunction fn;
+  } kFunctions[] = {
+    {"_CreateParameter",
+     LuaGlobalStub2<ScriptRunner, &ScriptRunner::LuaCreateParameter, 1>},
+    {"_CreateMarker",
+     LuaGlobalStub2<ScriptRunner, &ScriptRunner::LuaIgnore, 1>},
+    {"ParameterDivider",
+     LuaGlobalStub2<ScriptRunner, &ScriptRunner::LuaIgnore, 1>},
+    {"DrawText", LuaGlobalStub2<ScriptRunner, &ScriptRunner::LuaIgnore, 1>},
+    {"Draw", LuaGlobalStub2<ScriptRunner, &ScriptRunner::LuaIgnore, 1>},
+    {"_Jet", LuaGlobalStub2<ScriptRunner, &ScriptRunner::LuaJet, 1>},
+    {"_JetDerivative",
+     LuaGlobalStub2<ScriptRunner, &ScriptRunner::LuaJetDerivative, 1>},
+    {"_DistanceScale",
+     LuaGlobalStub2<ScriptRunner, &ScriptRunner::LuaDistanceScale, 1>},
+    {"_GetField", LuaGlobalStub2<ScriptRunner, &ScriptRunner::LuaGetField, 1>},
+    {"_Pattern", LuaGlobalStub2<ScriptRunner, &ScriptRunner::LuaPattern, 1>},
+    {"_Directivity",
+     LuaGlobalStub2<ScriptRunner, &ScriptRunner::LuaDirectivity, 1>},
+    {"_GetFieldPoynting",
+     LuaGlobalStub2<ScriptRunner, &ScriptRunner::LuaGetFieldPoynting, 1>},
+    {"_Select", LuaGlobalStub2<ScriptRunner, &ScriptRunner::LuaSelect, 1>},
+    {"_SolveAll", LuaGlobalStub2<ScriptRunner, &ScriptRunner::LuaSolveAll, 1>},
+    {"_Ports", LuaGlobalStub2<ScriptRunner, &ScriptRunner::LuaPorts, 1>},
+  };
+  for (int i = 0; i < sizeof(kFunctions) / sizeof(kFunctions[0]); i++) {
+    lua_pushcfunction(L, kFunctions[i].fn);
+    lua_setglobal(L, kFunctions[i].name);
+  }
+
+  // Populate the global 'FLAGS' table.
+  lua_newtable(L);                                              // stack: T
+  for (auto it = flags_.begin(); it != flags_.end(); ++it) {
+    lua_pushstring(L, it->first.c_str());                       // stack: T k
+    lua_pushstring(L, it->second.c_str());                      // stack: T k v
+    lua_rawset(L, -3);                                          // stack: T
+  }
+  lua_setglobal(L, "FLAGS");
+
+  // Run the script, after the lua utility functions.
+  string user_script_util(&user_script_util_dot_lua,
+                          user_script_util_dot_lua_length);
+  if (!lua_->RunString(user_script_util.c_str(), true, "user_script_util")) {
+    AddError("Internal error in script utility code");
+  } else if (!lua_->RunString(script.c_str(), true, "main script")) {
+    CHECK(there_were_errors_);
+  }
+  if (there_were_errors_) {
+    return false;
+  }
+
+  // Extract the computational domain and the other config values, as
+  // Cavity::ScriptJustRan() does.
+  LuaRawGetGlobal(L, "config");
+  if (lua_type(L, -1) != LUA_TTABLE) {
+    AddError("The script should leave behind a 'config' table");
+  } else {
+    lua_getfield(L, -1, "cd");
+    Shape *new_cd = LuaCastTo<Shape>(L, -1);
+    if (new_cd) {
+      cd_ = *new_cd;
+    } else {
+      AddError("The script should assign 'config.cd' to a Shape object");
+    }
+    lua_pop(L, 1);
+    config_.SetFromTable(lua_);
+    lua_getfield(L, -1, "thread_safe");
+    thread_safe_ = lua_type(L, -1) == LUA_TNIL || lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  if (there_were_errors_) {
+    return false;
+  }
+  displayed_soln_ = std::max(0,
+      std::min(displayed_soln_, int(config_.frequencies.size() - 1)));
+  {
+    JetNum h = sqrt(cd_.TotalArea() / kMaxReasonableTriangles);
+    cd_.Clean(ToDouble(h));
+  }
+  const char *err = cd_.GeometryError();
+  if (err) {
+    AddError(err);
+  }
+  return !there_were_errors_;
+}
+
+bool ScriptRunner::CreateSolver() {
+  RunnerErrorHandler capture(this);
+  if (!solvers_.Valid()) {
+    if (there_were_errors_ || cd_.IsEmpty()) {
+      return false;
+    }
+    solvers_.PushBack(new Solver(cd_, config_, lua_, 0,
+                                 solvers_.PreviousMesh()));
+    if (config_.TypeIsElectrodynamic()) {
+      for (int i = 1; i < config_.frequencies.size(); i++) {
+        solvers_.PushBack(new Solver(solvers_.First(), i));
+      }
+    }
+    if (!solvers_.IsValid()) {
+      solvers_.Clear();
+    }
+    if (solvers_.Valid() && config_.fast_sweep > 0) {
+      if (!solvers_.Solve()) {
+        // Ignore result, errors are reported when solutions are used.
+      }
+    }
+    // Errors might come from the Lua callbacks.
+    if (there_were_errors_) {
+      solvers_.Clear();
+    }
+  }
+  return solvers_.Valid();
+}
+
+bool ScriptRunner::ComputeSweptOutput(vector<JetComplex> *output) {
+  RunnerErrorHandler capture(this);
+  output->clear();
+  if (!CreateSolver()) {
+    AddError("Solver failed");
+    return false;
+  }
+  if (config_.TypeIsElectrodynamic() &&
+      !solvers_.At(displayed_soln_)->ComputePortOutgoingPower(output)) {
+    AddError("Failed to compute port powers");
+    return false;
+  }
+  if (config_.TypeIsWaveguideMode() && !solvers_.At(displayed_soln_)->
+      ComputeModeCutoffFrequencies(output)) {
+    AddError("Failed to compute cutoff frequencies");
+    return false;
+  }
+  return true;
+}
+
+bool ScriptRunner::CallOptimize(vector<JetNum> *output) {
+  return CallConfigFunction("optimize", output);
+}
+
+bool ScriptRunner::CallTest(vector<JetNum> *output) {
+  return CallConfigFunction("test", output);
+}
+
+bool ScriptRunner::CallConfigFunction(const char *name,
+                                      vector<JetNum> *output) {
+  RunnerErrorHandler capture(this);
+  output->clear();
+  if (!lua_ || there_were_errors_) {
+    return false;
+  }
+  lua_State *L = lua_->L();
+  LuaRawGetGlobal(L, "config");                 // Stack: config
+  lua_getfield(L, -1, name);                    // Stack: config fn
+  int top = lua_gettop(L);
+  if (lua_type(L, -1) != LUA_TFUNCTION) {
+    AddError(string("Script does not define the config.") + name +
+             "() function");
+  } else {
+    CreatePortPowerAndPhase(displayed_soln_);
+    LuaRawGetGlobal(L, "__Optimize3rdArg__");
+    if (!there_were_errors_) {
+      if (lua_->PCall(3, LUA_MULTRET) != LUA_OK) {
+        AddError(string("The config.") + name + "() function failed");
+      } else {
+        int n = lua_gettop(L) - top + 1;
+        for (int i = 0; i < n; i++) {
+          if (lua_type(L, top + i) != LUA_TNUMBER) {
+            AddError(string("Non-number return value of config.") + name +
+                     "()");
+          }
+          output->push_back(lua_tonumber(L, top + i));
+        }
+      }
+    }
+  }
+  lua_settop(L, top - 2);
+  return !there_were_errors_;
+}
+
+void ScriptRunner::CreatePortPowerAndPhase(int solution_index) {
+  if (!CreateSolver()) {
+    // Zero tables are pushed below, and the error is reported.
+  }
+  if (!LuaSolverPushPortPowerAndPhase(lua_->L(), &solvers_, solution_index)) {
+    AddError("Can not compute a solution");
+  }
+}
+
+void ScriptRunner::AddMessage(const string &message) {
+  messages_.push_back(message);
+}
+
+void ScriptRunner::AddError(const string &message) {
+  messages_.push_back(message);
+  there_were_errors_ = true;
+}
+
+int ScriptRunner::LuaCreateParameter(lua_State *L) {
+  // This is called during script execution as _CreateParameter(label, min,
+  // max, default, integer).
+  if (lua_gettop(L) != 5) {
+    LuaError(L, "Internal error: Expecting 5 arguments");
+  }
+  ScriptParameter &info = script_parameters_[lua_tostring(L, 1)];
+  info.the_min = ToDouble(lua_tonumber(L, 2));
+  info.the_max = ToDouble(lua_tonumber(L, 3));
+  info.the_default = ToDouble(lua_tonumber(L, 4));
+  info.integer = lua_toboolean(L, 5);
+  JetNum value = lua_tonumber(L, 4);
+  auto it = parameters_.find(lua_tostring(L, 1));
+  if (it != parameters_.end()) {
+    value = it->second.value;
+    int k = it->second.derivative;
+    if (k >= 0 && k < kJetWidth) {
+      value.Derivative(k) = 1;
+    }
+  }
+  lua_pushnumber(L, value);
+  return 1;
+}
+
+int ScriptRunner::LuaIgnore(lua_State *L) {
+  return 0;
+}
+
+int ScriptRunner::LuaJet(lua_State *L) {
+  if (lua_gettop(L) != 2) {
+    LuaError(L, "Usage: Jet(value, derivative)");
+  }
+  JetNum n;
+  n.a = ToDouble(luaL_checknumber(L, 1));
+  n.v()[0] = ToDouble(luaL_checknumber(L, 2));
+  lua_pushnumber(L, n);
+  return 1;
+}
+
+int ScriptRunner::LuaJetDerivative(lua_State *L) {
+  if (lua_gettop(L) != 2) {
+    LuaError(L, "Usage: JetDerivative(number, derivative_index)");
+  }
+  JetNum number = luaL_checknumber(L, 1);
+  double index = ToDouble(luaL_checknumber(L, 2));
+  if (int(index) != index || index < 1 || index > JetNum::DIMENSION) {
+    LuaError(L, "Invalid derivative index");
+  }
+  lua_pushnumber(L, number.v()[index - 1]);
+  return 1;
+}
+
+int ScriptRunner::LuaDistanceScale(lua_State *L) {
+  lua_pushnumber(L, DistanceScale(lua_tostring(L, 1)));
+  return 1;
+}
+
+int ScriptRunner::LuaGetField(lua_State *L) {
+  return LuaSolverGetField(L, &solvers_, optimizer_soln_);
+}
+
+int ScriptRunner::LuaPattern(lua_State *L) {
+  return LuaSolverPattern(L, &solvers_, optimizer_soln_);
+}
+
+int ScriptRunner::LuaDirectivity(lua_State *L) {
+  return LuaSolverDirectivity(L, &solvers_, optimizer_soln_);
+}
+
+int ScriptRunner::LuaGetFieldPoynting(lua_State *L) {
+  return LuaSolverGetFieldPoynting(L, &solvers_, optimizer_soln_);
+}
+
+int ScriptRunner::LuaSelect(lua_State *L) {
+  return LuaSolverSelect(L, config_, &optimizer_soln_);
+}
+
+int ScriptRunner::LuaSolveAll(lua_State *L) {
+  return LuaSolverSolveAll(L, &solvers_);
+}
+
+int ScriptRunner::LuaPorts(lua_State *) {
+  CreatePortPowerAndPhase(optimizer_soln_);
+  return 2;
+}
+
+//***************************************************************************
+// Testing.
+
+TEST_FUNCTION(ScriptRunnerConcurrent) {
+  // A waveguide with a stub whose length is swept. Each sweep point is
+  // evaluated sequentially and then concurrently in separate runners, and the
+  // results must be identical.
+  const char *script =
+    "config = {type='Ez', unit='mil', mesh_edge_length=10,\n"
+    "          excited_port=1, frequency=70e9, depth=122,\n"
+    "          test=function(power, phase, field)\n"
+    "            return power[1], power[2], field.Magnitude(300, 61)\n"
+    "          end,\n"
+    "          optimize=function(power, phase, field)\n"
+    "            return power[1] - 0.5\n"
+    "          end}\n"
+    "stub = Parameter{label='Stub', min=0, max=200, default=50}\n"
+    "cd = Rectangle(0, 0, 1000, 122) + Rectangle(450, 100, 550, 122 + stub)\n"
+    "cd:Port(cd:Select(0, 61), 1)\n"
+    "cd:Port(cd:Select(1000, 61), 2)\n"
+    "config.cd = cd\n";
+  const int kNumPoints = 6;
+  vector<vector<JetComplex>> serial(kNumPoints), parallel(kNumPoints);
+  vector<vector<JetNum>> serial_test(kNumPoints), parallel_test(kNumPoints);
+  auto evaluate = [&](int i, vector<JetComplex> *output,
+                      vector<JetNum> *test_output) {
+    ScriptRunner runner;
+    runner.SetParameter("Stub", 20 + 30 * i, 0);
+    CHECK(runner.Run(script));
+    CHECK(runner.ComputeSweptOutput(output));
+    CHECK(runner.CallTest(test_output));
+    CHECK(!runner.ThereWereErrors());
+
+    // config.optimize() sees the same solution as config.test(), and the
+    // parameter bounds are recorded.
+    vector<JetNum> optimize_output;
+    CHECK(runner.CallOptimize(&optimize_output));
+    CHECK(optimize_output.size() == 1);
+    CHECK(optimize_output[0].a == (*test_output)[0].a - 0.5);
+    CHECK(optimize_output[0].v() == (*test_output)[0].v());
+    CHECK(runner.ScriptParameters().size() == 1);
+    const ScriptRunner::ScriptParameter &p =
+        runner.ScriptParameters().at("Stub");
+    CHECK(p.the_min == 0 && p.the_max == 200 && p.the_default == 50 &&
+          !p.integer);
+  };
+  for (int i = 0; i < kNumPoints; i++) {
+    evaluate(i, &serial[i], &serial_test[i]);
+  }
+  ParallelFor(0, kNumPoints - 1, kNumPoints, [&](int i) {
+    evaluate(i, &parallel[i], &parallel_test[i]);
+  });
+  for (int i = 0; i < kNumPoints; i++) {
+    CHECK(serial[i].size() == 2);
+    CHECK(serial_test[i].size() == 3);
+    printf("Stub %d: |S11|^2 = %f, |S21|^2 = %f, d/dstub = %g\n", 20 + 30 * i,
+           ToDouble(abs(serial[i][0])), ToDouble(abs(serial[i][1])),
+           serial_test[i][0].v()[0]);
+    // The outputs, the parameter derivatives and the test() results should
+    // all be the same.
+    for (int j = 0; j < serial[i].size(); j++) {
+      CHECK(serial[i][j].real().a == parallel[i][j].real().a);
+      CHECK(serial[i][j].imag().a == parallel[i][j].imag().a);
+      CHECK(serial[i][j].real().v() == parallel[i][j].real().v());
+    }
+    for (int j = 0; j < serial_test[i].size(); j++) {
+      CHECK(serial_test[i][j].a == parallel_test[i][j].a);
+    }
+    CHECK(fabs(ToDouble(serial_test[i][0]) - ToDouble(abs(serial[i][0]))) <
+          1e-12);
+  }
+}
+
+TEST_FUNCTION(ScriptRunnerMorphMesh) {
+  // With morph_mesh the mesh for a small parameter step is the previous mesh
+  // with its points moved, in the same way that the mesh point derivatives
+  // describe. The parameter derivative of the output should therefore match
+  // a finite difference estimate closely, which it does not when the mesh is
+  // recreated for each step.
+  const char *script =
+    "config = {type='Ez', unit='mil', mesh_edge_length=10, morph_mesh=true,\n"
+    "          excited_port=1, frequency=70e9, depth=122}\n"
+    "stub = Parameter{label='Stub', min=0, max=200, default=50}\n"
+    "cd = Rectangle(0, 0, 1000, 122) + Rectangle(450, 100, 550, 122 + stub)\n"
+    "cd:Port(cd:Select(0, 61), 1)\n"
+    "cd:Port(cd:Select(1000, 61), 2)\n"
+    "config.cd = cd\n";
+  ScriptRunner runner;
+  auto evaluate = [&](double stub) {
+    runner.SetParameter("Stub", stub, 0);
+    CHECK(runner.Run(script));
+    vector<JetComplex> output;
+    CHECK(runner.ComputeSweptOutput(&output));
+    return output[0].real();
+  };
+  const double kStep = 0.5;
+  for (double stub = 45; stub <= 55; stub += 5) {
+    double derivative = evaluate(stub).Derivative();
+    double fd = ToDouble(evaluate(stub + kStep) - evaluate(stub - kStep)) /
+                (2 * kStep);
+    printf("Stub %g: d|S11|^2/dstub = %g, finite difference = %g\n", stub,
+           derivative, fd);
+    CHECK(fabs(derivative - fd) < 1e-3 * fabs(fd));
+  }
+}
+
+TEST_FUNCTION(ScriptRunnerFieldVectors) {
+  // The field functions passed to config.test() accept vector arguments. Check
+  // that they give the same results as calling them for one point at a time,
+  // and compare the speed.
+  const char *script =
+    "config = {type='Ez', unit='mil', mesh_edge_length=5,\n"
+    "          excited_port=1, frequency=70e9, depth=122,\n"
+    "          test=function(power, phase, field)\n"
+    "            local n = 100000\n"
+    "            local x, y = Vector():Resize(n), Vector():Resize(n)\n"
+    "            for i = 1,n do\n"
+    "              x[i] = 10 + (i % 100) * 9.8\n"
+    "              y[i] = 1 + (i // 100) * 0.12\n"
+    "            end\n"
+    "            local t1 = os.clock()\n"
+    "            local sum1, sum2 = 0, 0\n"
+    "            for i = 1,n do\n"
+    "              sum1 = sum1 + field.Magnitude(x[i], y[i])\n"
+    "              sum2 = sum2 + field.Power(x[i], y[i])\n"
+    "            end\n"
+    "            local t2 = os.clock()\n"
+    "            local m = field.Magnitude(x, y)\n"
+    "            local p = field.Power(x, y)\n"
+    "            local t3 = os.clock()\n"
+    "            print(string.format('%d points: %.3fms for single '..\n"
+    "                  'points, %.3fms for vectors', n, (t2-t1)*1e3,\n"
+    "                  (t3-t2)*1e3))\n"
+    "            local sum3, sum4 = 0, 0\n"
+    "            for i = 1,n do\n"
+    "              sum3 = sum3 + m[i]\n"
+    "              sum4 = sum4 + p[i]\n"
+    "            end\n"
+    "            local c = field.Complex(x, y)\n"
+    "            local px, py = field.Poynting(x, y)\n"
+    "            local re, im = _GetField(x[n], y[n])\n"
+    "            local qx, qy = field.Poynting(x[n], y[n])\n"
+    "            return sum1, sum2, sum3, sum4, c.re[n] - re, c.im[n] - im,\n"
+    "                   px[n] - qx, py[n] - qy\n"
+    "          end}\n"
+    "cd = Rectangle(0, 0, 1000, 122)\n"
+    "cd:Port(cd:Select(0, 61), 1)\n"
+    "cd:Port(cd:Select(1000, 61), 2)\n"
+    "config.cd = cd\n";
+  ScriptRunner runner;
+  CHECK(runner.Run(script));
+  vector<JetNum> output;
+  CHECK(runner.CallTest(&output));
+  for (int i = 0; i < runner.Messages().size(); i++) {
+    printf("%s\n", runner.Messages()[i].c_str());
+  }
+  CHECK(output.size() == 8);
+  CHECK(fabs(ToDouble(output[0] - output[2])) < 1e-9 * ToDouble(output[0]));
+  CHECK(fabs(ToDouble(output[1] - output[3])) < 1e-9 * ToDouble(output[1]));
+  for (int i = 4; i < 8; i++) {
+    CHECK(output[i] == 0);
+  }
+}
+
+TEST_FUNCTION(ScriptRunnerCallbackCache) {
+  // Material callbacks are given each mesh point once, even points on the
+  // boundary between two painted regions. Checking if the solver is the same
+  // for a rerun does not call the callbacks again unless some Lua state that
+  // they can see has changed.
+  const char *script =
+    "config = {type='Ez', unit='mil', mesh_edge_length=10,\n"
+    "          excited_port=1, frequency=70e9, depth=122}\n"
+    "eps = 2\n"
+    "function Record(x, y)\n"
+    "  for i = 1,#x do\n"
+    "    local key = tostring(x[i])..','..tostring(y[i])\n"
+    "    if calls.seen[key] then calls.duplicates = calls.duplicates + 1 end\n"
+    "    calls.seen[key] = true\n"
+    "  end\n"
+    "  calls.points = calls.points + #x\n"
+    "end\n"
+    "calls = {points=0, duplicates=0, seen={}}\n"
+    "cd = Rectangle(0, 0, 1000, 122)\n"
+    "cd:Paint(Rectangle(0, 0, 500, 122), 0xffc0c0, function(x, y)\n"
+    "  Record(x, y)\n"
+    "  return x*0 + eps\n"
+    "end)\n"
+    "cd:Paint(Rectangle(500, 0, 1000, 122), 0xc0c0ff, function(x, y)\n"
+    "  Record(x, y)\n"
+    "  return x*0 + eps * 1.5\n"
+    "end)\n"
+    "cd:Port(cd:Select(0, 61), 1)\n"
+    "cd:Port(cd:Select(1000, 61), 2)\n"
+    "config.cd = cd\n"
+    "calls = {points=0, duplicates=0, seen={}}\n";
+  ScriptRunner runner;
+  CHECK(runner.Run(script));
+  CHECK(runner.CreateSolver());
+  lua_State *L = runner.lua_->L();
+  auto count = [&](const char *field) {
+    CHECK(runner.lua_->RunString(std::string("return calls.") + field, false));
+    CHECK(lua_pcall(L, 0, 1, 0) == LUA_OK);
+    int n = ToInt64(lua_tonumber(L, -1));
+    lua_pop(L, 1);
+    return n;
+  };
+  int points = count("points");
+  printf("%d points evaluated, %d duplicates\n", points, count("duplicates"));
+  CHECK(points > 0 && count("duplicates") == 0);
+
+  // Nothing has changed so the callbacks are not called.
+  CHECK(runner.solvers().SameAs(runner.cd(), runner.config(), runner.lua_));
+  CHECK(count("points") == points);
+
+  // A global that the callbacks read has changed, so they are called again and
+  // give different results.
+  CHECK(runner.lua_->RunString("eps = 3"));
+  CHECK(!runner.solvers().SameAs(runner.cd(), runner.config(), runner.lua_));
+  CHECK(count("points") == 2 * points);
+
+  // Changing it back gives the original results, which are found by calling
+  // the callbacks because their state still differs from the original state.
+  CHECK(runner.lua_->RunString("eps = 2"));
+  CHECK(runner.solvers().SameAs(runner.cd(), runner.config(), runner.lua_));
+  CHECK(count("points") == 3 * points);
+}
@@ -0,0 +1,141 @@
+// Rama Simulator, Copyright (C) 2014-2020 Russell Smith.
+//
+// This program is free software: you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// This program is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+// more details.
+
+// Run a Rama script without a user interface and compute its solutions. This
+// does the same work as Cavity and LuaModelViewer but without any drawing or
+// parameter controls. Each ScriptRunner has its own Lua state and solvers, and
+// errors emitted while it is running are captured by a thread error handler,
+// so separate ScriptRunners can be used concurrently from different threads.
+
+#ifndef __SCRIPT_RUNNER_H__
+#define __SCRIPT_RUNNER_H__
+
+#include <map>
+#include <string>
+#include <vector>
+#include "shape.h"
+#include "solver.h"
+
+class ScriptRunner {
+ public:
+  ScriptRunner();
+  ~ScriptRunner();
+
+  // Set an entry in the script's global FLAGS table.
+  void SetFlag(const std::string &key, const std::string &value);
+
+  // Set the value returned for a script parameter (e.g. by Parameter()).
+  // Parameters that are not set take their default values. If derivative is
+  // in the range 0..kJetWidth-1 then the parameter value gets a unit
+  // derivative in that position.
+  void SetParameter(const std::string &label, double value,
+                    int derivative = -1);
+
+  // Run the script, which leaves behind the config table from which cd() and
+  // config() are set. Any previous solution is discarded. Return true on
+  // success or false if there were errors.
+  bool Run(const std::string &script) MUST_USE_RESULT;
+
+  // Create the solvers for cd() and config(), one per frequency, unless they
+  // already exist. Return true on success.
+  bool CreateSolver() MUST_USE_RESULT;
+
+  // Select the solution (i.e. frequency) index that ComputeSweptOutput() and
+  // the port arguments of config.optimize() and config.test() use, like the
+  // frequency displayed in the GUI. The default is 0.
+  void SetDisplayedSolution(int n) { displayed_soln_ = n; }
+
+  // Compute the outputs that are plotted for a sweep: port powers for
+  // electrodynamic cavities or mode cutoff frequencies for waveguides. Return
+  // true on success.
+  bool ComputeSweptOutput(std::vector<JetComplex> *output) MUST_USE_RESULT;
+
+  // Call config.optimize() or config.test() with real arguments and return
+  // their results. Return true on success.
+  bool CallOptimize(std::vector<JetNum> *output) MUST_USE_RESULT;
+  bool CallTest(std::vector<JetNum> *output) MUST_USE_RESULT;
+
+  // Return false if the last script run set config.thread_safe to false, i.e.
+  // separate ScriptRunners for it should not be used concurrently.
+  bool ThreadSafe() const { return thread_safe_; }
+
+  // The parameters created by the last script run, by label.
+  struct ScriptParameter {
+    double the_min, the_max, the_default;
+    bool integer;
+  };
+  const std::map<std::string, ScriptParameter> &ScriptParameters() const
+    { return script_parameters_; }
+
+  // Accessors.
+  const Shape &cd() const { return cd_; }
+  const ScriptConfig &config() const { return config_; }
+  Solvers &solvers() { return solvers_; }
+
+  // All output from print() and all messages, warnings and errors emitted
+  // since the last Run(), one per entry.
+  const std::vector<std::string> &Messages() const { return messages_; }
+  bool ThereWereErrors() const { return there_were_errors_; }
+
+ private:
+  class RunnerLua;
+  class RunnerErrorHandler;
+  struct Parameter {
+    double value;
+    int derivative;
+  };
+
+  RunnerLua *lua_;                // Lua context for last script, 0=none
+  std::map<std::string, std::string> flags_;
+  std::map<std::string, Parameter> parameters_;
+  std::map<std::string, ScriptParameter> script_parameters_;
+  ScriptConfig config_;
+  Shape cd_;
+  Solvers solvers_;               // One solver per frequency, for cd_
+  int displayed_soln_;            // Solution index for swept output
+  int optimizer_soln_;            // Solution index selected by _Select()
+  std::vector<std::string> messages_;
+  bool there_were_errors_;
+  bool thread_safe_;              // config.thread_safe from the last Run()
+
+  // Add a message, or an error message.
+  void AddMessage(const std::string &message);
+  void AddError(const std::string &message);
+
+  // Call the config table function 'name' with real arguments.
+  bool CallConfigFunction(const char *name, std::vector<JetNum> *output);
+
+  // Push the port power and phase tables that are the first two arguments of
+  // config.optimize() and config.test().
+  void CreatePortPowerAndPhase(int solution_index);
+
+  // Implement lua functions.
+  int LuaCreateParameter(lua_State *L);   // _CreateParameter()
+  int LuaIgnore(lua_State *L);            // _CreateMarker(), Draw() etc
+  int LuaJet(lua_State *L);               // _Jet()
+  int LuaJetDerivative(lua_State *L);     // _JetDerivative()
+  int LuaDistanceScale(lua_State *L);     // _DistanceScale()
+  int LuaGetField(lua_State *L);          // _GetField()
+  int LuaPattern(lua_State *L);           // _Pattern()
+  int LuaDirectivity(lua_State *L);       // _Directivity()
+  int LuaGetFieldPoynting(lua_State *L);  // _GetFieldPoynting()
+  int LuaSelect(lua_State *L);            // _Select()
+  int LuaSolveAll(lua_State *L);          // _SolveAll()
+  int LuaPorts(lua_State *L);             // _Ports()
+
+  // For testing:
+  friend void __RunTest_ScriptRunnerCallbackCache();
+
+  DISALLOW_COPY_AND_ASSIGN(ScriptRunner);
+};
+
+#endif
@@ -478,22 +478,26 @@ void MyZFillCallback(IntPoint &e1bot, IntPoint &e1top,
   JetPoint b(e2bot.X, e2bot.Y);
   JetPoint c(e1top.X, e1top.Y);
   JetPoint d(e2top.X, e2top.Y);
-  a[0].Derivative() = e1bot.Z.derivative_x;
-  b[0].Derivative() = e2bot.Z.derivative_x;
-  c[0].Derivative() = e1top.Z.derivative_x;
-  d[0].Derivative() = e2top.Z.derivative_x;
-  a[1].Derivative() = e1bot.Z.derivative_y;
-  b[1].Derivative() = e2bot.Z.derivative_y;
-  c[1].Derivative() = e1top.Z.derivative_y;
-  d[1].Derivative() = e2top.Z.derivative_y;
+  for (int i = 0; i < kJetWidth; i++) {
+    a[0].Derivative(i) = e1bot.Z.derivative_x[i];
+    b[0].Derivative(i) = e2bot.Z.derivative_x[i];
+    c[0].Derivative(i) = e1top.Z.derivative_x[i];
+    d[0].Derivative(i) = e2top.Z.derivative_x[i];
+    a[1].Derivative(i) = e1bot.Z.derivative_y[i];
+    b[1].Derivative(i) = e2bot.Z.derivative_y[i];
+    c[1].Derivative(i) = e1top.Z.derivative_y[i];
+    d[1].Derivative(i) = e2top.Z.derivative_y[i];
+  }
   JetPoint u = c - a, v = d - b;        // The two lines we're intersecting
   u = u / u.norm();                     // Their unit length vectors
   v = v / v.norm();
   JetNum k = ((b[0] - a[0]) * v[1] + (a[1] - b[1]) * v[0]) /
              (u[0]*v[1] - u[1]*v[0]);
   JetPoint p = a + u * k;
-  new_et.derivative_x = p[0].Derivative();
-  new_et.derivative_y = p[1].Derivative();
+  for (int i = 0; i < kJetWidth; i++) {
+    new_et.derivative_x[i] = p[0].Derivative(i);
+    new_et.derivative_y[i] = p[1].Derivative(i);
+  }
 
   pt.Z = new_et;
 }
@@ -724,6 +728,7 @@ void Shape::SetLuaGlobals(lua_State *L) {
 }
 
 void Shape::Clear() {
+  Changed();
   polys_.clear();
   port_callbacks_.clear();
 }
@@ -889,6 +894,7 @@ void Shape::DrawBoundary(const Eigen::Matrix4d &camera_transform,
 }
 
 void Shape::AddPoint(JetNum x, JetNum y, const EdgeInfo *e) {
+  Changed();
   if (polys_.empty()) {
     polys_.resize(1);
   }
@@ -899,6 +905,7 @@ void Shape::AddPoint(JetNum x, JetNum y, const EdgeInfo *e) {
 }
 
 void Shape::MakePolyline() {
+  Changed();
   if (!polys_.empty()) {
     int n = polys_.back().p.size();
     for (int i = n - 2; i > 0; i--) {
@@ -908,6 +915,7 @@ void Shape::MakePolyline() {
 }
 
 void Shape::SetToPiece(int n, const Shape &p) {
+  Changed();
   CHECK(n >= 0 && n < p.polys_.size());
   Clear();
   // Use swaps where possible to minimize the number of copies.
@@ -922,6 +930,7 @@ void Shape::SetToPiece(int n, const Shape &p) {
 }
 
 bool Shape::AssignPort(int piece, int edge, EdgeKind kind, PointMap *pmap) {
+  Changed();
   int n = polys_[piece].p.size();
   if (pmap) {
     bool valid = true;
@@ -1032,6 +1041,7 @@ void Shape::ExtremeSideLengths(double *ret_length_max,
 }
 
 void Shape::SetRectangle(JetNum x1, JetNum y1, JetNum x2, JetNum y2) {
+  Changed();
   Clear();
   polys_.resize(1);
   // Sort coordinates so that we always have a positive area:
@@ -1042,6 +1052,7 @@ void Shape::SetRectangle(JetNum x1, JetNum y1, JetNum x2, JetNum y2) {
 }
 
 void Shape::SetCircle(JetNum x, JetNum y, JetNum radius, int npoints) {
+  Changed();
   Clear();
   polys_.resize(1);
   for (int i = 0; i < npoints; i++) {
@@ -1067,6 +1078,7 @@ void Shape::SetXOR(const Shape &c1, const Shape &c2) {
 }
 
 void Shape::Paint(const Shape &s, const Material &mat) {
+  Changed();
   // We can't simply run the clipper to subtract 's' from all pieces of 'this',
   // since that would unrecoverably merge pieces with different materials
   // (since clipper doesn't understand anything about polygon materials).
@@ -1117,6 +1129,7 @@ void Shape::Paint(const Shape &s, const Material &mat) {
 }
 
 void Shape::SetMerge(const Shape &s) {
+  Changed();
   // This merges everything regardless of material:
   RunClipper(&s, NULL, ctUnion);
 }
@@ -1149,6 +1162,7 @@ int Shape::Contains(JetNum x, JetNum y) {
 }
 
 void Shape::Offset(JetNum dx, JetNum dy) {
+  Changed();
   for (int i = 0; i < polys_.size(); i++) {
     for (int j = 0; j < polys_[i].p.size(); j++) {
       polys_[i].p[j].p[0] += dx;
@@ -1158,6 +1172,7 @@ void Shape::Offset(JetNum dx, JetNum dy) {
 }
 
 void Shape::Scale(JetNum scalex, JetNum scaley) {
+  Changed();
   for (int i = 0; i < polys_.size(); i++) {
     for (int j = 0; j < polys_[i].p.size(); j++) {
       polys_[i].p[j].p[0] *= scalex;
@@ -1167,6 +1182,7 @@ void Shape::Scale(JetNum scalex, JetNum scaley) {
 }
 
 void Shape::Rotate(JetNum theta) {
+  Changed();
   theta *= M_PI / 180.0;                // Convert degrees to radians
   JetNum c = cos(theta), s = sin(theta);
   JetMatrix2d R;
@@ -1179,6 +1195,7 @@ void Shape::Rotate(JetNum theta) {
 }
 
 void Shape::MirrorX(JetNum x_coord) {
+  Changed();
   for (int i = 0; i < polys_.size(); i++) {
     for (int j = 0; j < polys_[i].p.size(); j++) {
       polys_[i].p[j].p[0] = 2.0*x_coord - polys_[i].p[j].p[0];
@@ -1188,6 +1205,7 @@ void Shape::MirrorX(JetNum x_coord) {
 }
 
 void Shape::MirrorY(JetNum y_coord) {
+  Changed();
   for (int i = 0; i < polys_.size(); i++) {
     for (int j = 0; j < polys_[i].p.size(); j++) {
       polys_[i].p[j].p[1] = 2.0*y_coord - polys_[i].p[j].p[1];
@@ -1197,6 +1215,7 @@ void Shape::MirrorY(JetNum y_coord) {
 }
 
 void Shape::Reverse() {
+  Changed();
   for (int i = 0; i < polys_.size(); i++) {
     std::reverse(polys_[i].p.begin(), polys_[i].p.end());
   }
@@ -1204,6 +1223,7 @@ void Shape::Reverse() {
 
 void Shape::Grow(JetNum delta, CornerStyle style, JetNum limit,
                  CornerStyle endcap_style) {
+  Changed();
   // We use similar definitions as the clipper library for miter, square and
   // round corners. We follow the clipper library's lead and use the algorithms
   // of:
@@ -1336,6 +1356,7 @@ void Shape::Grow(JetNum delta, CornerStyle style, JetNum limit,
 }
 
 void Shape::Clean(JetNum threshold, JetNum angle_threshold, int mode) {
+  Changed();
   CHECK(mode == 1 || mode == 2);
 
   // The default threshold is the maximum side length * kTolClean.
@@ -1398,6 +1419,7 @@ void Shape::Clean(JetNum threshold, JetNum angle_threshold, int mode) {
 }
 
 void Shape::SplitPolygonsAtNecks() {
+  Changed();
   // Make a stack of piece indices to process. We keep processing pieces until
   // there's nothing left on the stack.
   vector<int> stack(polys_.size());
@@ -1549,6 +1571,7 @@ bool Shape::APointInside(int i, double *x, double *y) {
 bool Shape::FilletVertex(JetNum x, JetNum y, JetNum radius, JetNum limit,
                          JetPoint *pstart, JetPoint *pend, JetPoint *center,
                          bool mutate) {
+  Changed();
   // Find the piece/vertex that is closest to x,y.
   int piece, index;
   FindClosestVertex(x, y, &piece, &index);
@@ -1659,6 +1682,7 @@ bool Shape::FilletVertex(JetNum x, JetNum y, JetNum radius, JetNum limit,
 
 void Shape::ChamferVertex(JetNum x, JetNum y, JetNum predist, JetNum postdist,
                           JetPoint *p1_ret, JetPoint *p2_ret) {
+  Changed();
   // Find the piece/vertex that is closest to x,y.
   int piece, index;
   FindClosestVertex(x, y, &piece, &index);
@@ -1728,6 +1752,7 @@ void Shape::SaveBoundaryAsXY(const char *filename) {
 }
 
 bool Shape::LoadSTL(const char *filename) {
+  Changed();
   // STL file parameters.
   const int kHeaderSize = 80;
   const int kVertexSize = 50;
@@ -1856,9 +1881,8 @@ void Shape::ToPaths(Paths *paths) const {
       // RPoint coordinate derivative information is not stored in Clipper's
       // IntPoint the same way it's stored in RPoint. Unpack it here. Note that
       // we store *unscaled* derivatives in IntPoint.
-      ClipperEdgeInfo e(polys_[i].p[j].e,
-                        polys_[i].p[j].p[0].Derivative(),     // derivative_x
-                        polys_[i].p[j].p[1].Derivative());    // derivative_y
+      ClipperEdgeInfo e(polys_[i].p[j].e, polys_[i].p[j].p[0],
+                        polys_[i].p[j].p[1]);
       path.push_back(IntPoint(
           ToInt64(round(kCoordScale * (polys_[i].p[j].p[0]))),
           ToInt64(round(kCoordScale * (polys_[i].p[j].p[1]))), e));
@@ -1867,6 +1891,7 @@ void Shape::ToPaths(Paths *paths) const {
 }
 
 void Shape::FromPaths(const Paths &paths) {
+  Changed();
   Clear();
   polys_.resize(paths.size());
   for (int i = 0; i < paths.size(); i++) {
@@ -1878,14 +1903,17 @@ void Shape::FromPaths(const Paths &paths) {
       RPoint &p = polys_[i].p[j];
       p.p[0] = JetNum(paths[i][j].X) / kCoordScale;
       p.p[1] = JetNum(paths[i][j].Y) / kCoordScale;
-      p.p[0].Derivative() = paths[i][j].Z.derivative_x;
-      p.p[1].Derivative() = paths[i][j].Z.derivative_y;
+      for (int k = 0; k < kJetWidth; k++) {
+        p.p[0].Derivative(k) = paths[i][j].Z.derivative_x[k];
+        p.p[1].Derivative(k) = paths[i][j].Z.derivative_y[k];
+      }
       p.e = paths[i][j].Z;
     }
   }
 }
 
 void Shape::RunClipper(const Shape *c1, const Shape *c2, ClipType clip_type) {
+  Changed();
   // Compute the clipper polygons in integer coordinates.
   Paths p1, p2;
   if (c1) {
@@ -1954,6 +1982,7 @@ void Shape::RunClipper(const Shape *c1, const Shape *c2, ClipType clip_type) {
 }
 
 bool Shape::CombinePortCallbacks(const Shape *c1, const Shape *c2) {
+  Changed();
   // Combine the port callbacks from both shapes. Generate an error if there
   // are conflicts.
   port_callbacks_.clear();
@@ -1997,6 +2026,55 @@ std::string Shape::CallbackDebugString() const {
   return s;
 }
 
+const std::string &Shape::Hash() const {
+  if (!hash_.empty()) {
+    return hash_;
+  }
+  // Represent everything that operator==() compares.
+  md5_state_t ms;
+  md5_init(&ms);
+  auto append = [&ms](const void *data, int size) {
+    md5_append(&ms, (const md5_byte_t*) data, size);
+  };
+  int n = polys_.size();
+  append(&n, sizeof(n));
+  for (const Polygon &poly : polys_) {
+    n = poly.p.size();
+    append(&n, sizeof(n));
+    for (const RPoint &p : poly.p) {
+      HashValue(p.p[0], &ms);
+      HashValue(p.p[1], &ms);
+      for (int k = 0; k < 2; k++) {
+        int kind = p.e.kind[k].IntegerForDebugging();
+        append(&kind, sizeof(kind));
+        append(&p.e.dist[k], sizeof(p.e.dist[k]));
+      }
+    }
+    const Material &m = poly.material;
+    for (const JetComplex &param : {m.epsilon, m.sigma_xx, m.sigma_yy,
+                                    m.sigma_xy, m.excitation}) {
+      HashValue(param, &ms);
+    }
+    append(&m.color, sizeof(m.color));
+    m.callback.Hash(&ms);
+  }
+  for (const auto &it : port_callbacks_) {
+    append(&it.first, sizeof(it.first));
+    it.second.callback.Hash(&ms);
+    HashValue(it.second.S11, &ms);
+  }
+  md5_byte_t digest[16];
+  md5_finish(&ms, digest);
+  hash_.assign((char*) digest, sizeof(digest));
+  return hash_;
+}
+
+bool Shape::HashContents(md5_state_t *ms) const {
+  const std::string &hash = Hash();
+  md5_append(ms, (const md5_byte_t*) hash.data(), hash.size());
+  return true;
+}
+
 //...........................................................................
 // Shape, lua interface.
 
@@ -2402,6 +2480,7 @@ int Shape::LuaSelectAll(lua_State *L) {
 enum { MAGIC_ABC_PORT = -15485863 };
 
 int Shape::LuaPort(lua_State *L) {
+  Changed();
   // This marks the edge from vertex e to vertex e+1 as a port. It is called
   // with the arguments:
   //   1: {p=#, e=#} table (piece and edge), or an array of such tables
@@ -2982,3 +3061,50 @@ TEST_FUNCTION(DoesLineIntersectLine) {
     CHECK(result1 == result2);
   }
 }
+
+TEST_FUNCTION(ShapeHash) {
+  // Shapes that are equal have equal hashes, and the cached hash follows
+  // every change to the shape.
+  Shape a, b;
+  a.SetRectangle(0, 0, 10, 5);
+  b.SetRectangle(0, 0, 10, 5);
+  CHECK(a == b && a.Hash() == b.Hash());
+  std::string original = a.Hash();
+
+  a.Offset(1, 0);
+  CHECK(a != b && a.Hash() != original);
+  a.Offset(-1, 0);
+  CHECK(a == b && a.Hash() == original);
+
+  CHECK(a.AssignPort(0, 0, EdgeKind(1)));
+  CHECK(a != b && a.Hash() != original);
+  CHECK(b.AssignPort(0, 0, EdgeKind(1)));
+  CHECK(a == b && a.Hash() == b.Hash());
+
+  Shape q;
+  q.SetRectangle(2, 0, 4, 5);
+  Material mat;
+  mat.epsilon = 2;
+  b.Paint(q, mat);
+  CHECK(a != b && a.Hash() != b.Hash());
+  Shape c = b;
+  CHECK(c == b && c.Hash() == b.Hash());
+  c.Swap(&a);
+  CHECK(a == b && a.Hash() == b.Hash());
+  CHECK(c != b && c.Hash() != b.Hash());
+
+  // Shapes that differ only in their derivatives are equal, e.g. when the
+  // same model is built with different parameters being optimized.
+  JetNum x2 = 10;
+  x2.Derivative() = 1;
+  Shape d, e;
+  d.SetRectangle(0, 0, 10, 5);
+  e.SetRectangle(0, 0, x2, 5);
+  CHECK(d == e && d.Hash() == e.Hash());
+  Material mat_d, mat_e;
+  mat_d.epsilon = JetComplex(10, -10);
+  mat_e.epsilon = JetComplex(x2, -x2);
+  d.Paint(q, mat_d);
+  e.Paint(q, mat_e);
+  CHECK(d == e && d.Hash() == e.Hash());
+}
@@ -192,6 +192,12 @@ class Shape : public LuaUserClass {
   }
   bool operator!=(const Shape &s) const { return !operator==(s); }
 
+  // Return a hash of everything that operator==() compares, so that shapes
+  // with equal hashes are equal (with overwhelming probability). This is
+  // computed when it is first needed and kept until the shape next changes,
+  // so comparing the hashes of unchanged shapes is cheap.
+  const std::string &Hash() const;
+
   // Return 0 if the shape geometry is well formed, otherwise return an error
   // message string. If enforce_positive_area is true then only positive area
   // shapes with negative area holes are allowed.
@@ -204,6 +210,7 @@ class Shape : public LuaUserClass {
   void Swap(Shape *s) {
     polys_.swap(s->polys_);
     port_callbacks_.swap(s->port_callbacks_);
+    hash_.swap(s->hash_);
   }
 
   // Set the empty shape.
@@ -414,6 +421,7 @@ class Shape : public LuaUserClass {
   int FunctionCall(lua_State *L);
   int Length(lua_State *L);
   bool Operator(lua_State *L, int op, int pos);
+  bool HashContents(md5_state_t *ms) const;
 
   int LuaClone(lua_State *L);
   int LuaAddPoint(lua_State *L);
@@ -463,6 +471,10 @@ class Shape : public LuaUserClass {
   };
   vector<Polygon> polys_;
   std::map<int, CallbackInfo> port_callbacks_;  // port num -> callback func
+  mutable std::string hash_;    // Cached Hash(), or empty if not computed
+
+  // Call this before any change to polys_ or port_callbacks_.
+  void Changed() { hash_.clear(); }
 
   int UpdateBounds(JetNum *min_x, JetNum *min_y, JetNum *max_x, JetNum *max_y)
       const;
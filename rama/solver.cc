@@ -18,7 +18,7 @@
 #include "../toolkit/femsolver.h"
 #include "../toolkit/shaders.h"
 #include "../toolkit/thread.h"
-#include <QThread>
+#include "../toolkit/si_prefix.h"
 
 const double kSpeedOfLight = 299792458;         // m/s
 const int kFarFieldPoints = 500;                // Pattern points to compute
@@ -242,6 +242,10 @@ struct HelmholtzFEMProblem : FEM::FEMProblem {
   MNumber Derivative(const Number &a) {
     return Complex(a.real().Derivative(), a.imag().Derivative());
   }
+  int NumDerivatives() const { return kJetWidth; }
+  MNumber Derivative(const Number &a, int k) {
+    return Complex(a.real().Derivative(k), a.imag().Derivative(k));
+  }
   typedef ::Trace DoTrace;
 };
 
@@ -293,6 +297,10 @@ struct WaveguideModeFEMProblem : FEM::FEMProblem {
   MNumber Derivative(const Number &a) {
     return a.Derivative();
   }
+  int NumDerivatives() const { return kJetWidth; }
+  MNumber Derivative(const Number &a, int k) {
+    return a.Derivative(k);
+  }
   typedef ::Trace DoTrace;
 };
 
@@ -377,6 +385,199 @@ ScriptConfig::Type ScriptConfig::StringToType(const char *name) {
   return UNKNOWN;
 }
 
+std::string ScriptConfig::Hash() const {
+  // Represent everything that operator==() compares.
+  md5_state_t ms;
+  md5_init(&ms);
+  auto append = [&ms](const void *data, int size) {
+    md5_append(&ms, (const md5_byte_t*) data, size);
+  };
+  const int ints[] = {type, schrodinger, antenna_pattern, max_modes,
+                      wideband_window, solver, fast_sweep, incremental_mesh,
+                      morph_mesh};
+  const double doubles[] = {unit, mesh_edge_length, depth, boresight,
+                            dxf_arc_dist, dxf_arc_angle};
+  append(ints, sizeof(ints));
+  append(doubles, sizeof(doubles));
+  int n = port_excitation.size();
+  append(&n, sizeof(n));
+  for (const JetNum &x : port_excitation) {
+    HashValue(x, &ms);
+  }
+  n = frequencies.size();
+  append(&n, sizeof(n));
+  append(frequencies.data(), n * sizeof(double));
+  md5_byte_t digest[16];
+  md5_finish(&ms, digest);
+  return std::string((char*) digest, sizeof(digest));
+}
+
+void ScriptConfig::SetFromTable(Lua *lua) {
+  #define GET_FIELD(fieldname, required, fn1, fn2, ltype, minval, def) \
+    lua_getfield(L, -1, #fieldname); \
+    if (lua_type(L, -1) == LUA_TNIL) { \
+      /* Field not available, set to the default value (usually -1). */ \
+      fieldname = static_cast<typeof(fieldname)>(def); \
+      if (required) { \
+        lua->Error("config." #fieldname " is required"); \
+      } \
+    } else { \
+      if (HasDerivative(lua_tonumber(L, -1))) { \
+        lua->Error("config." #fieldname " can not depend on " \
+                   "parameters as this will confuse the optimizer"); \
+      } \
+      fieldname = fn1(fn2(L, -1)); \
+      if (lua_type(L, -1) != ltype || fieldname < minval || \
+          fieldname != fn1(fn2(L, -1))) { \
+        fieldname = static_cast<typeof(fieldname)>(-1); \
+        lua->Error("config." #fieldname " is not valid"); \
+      } \
+    } \
+    lua_pop(L, 1);
+  lua_State *L = lua->L();
+  GET_FIELD(type, true, StringToType, lua_tostring,
+            LUA_TSTRING, 0, -1)
+  GET_FIELD(unit, true, DistanceScale, lua_tostring, LUA_TSTRING, 0, -1)
+  GET_FIELD(mesh_edge_length, true, ToDouble, lua_tonumber, LUA_TNUMBER, 0, -1)
+  GET_FIELD(depth, type == EXY, ToDouble, lua_tonumber,
+            LUA_TNUMBER, 0, -1)
+  GET_FIELD(boresight, false, ToDouble, lua_tonumber, LUA_TNUMBER, -1e99, 0)
+  GET_FIELD(max_modes, TypeIsWaveguideMode(), ToDouble, lua_tonumber,
+            LUA_TNUMBER, 1, 1)
+  GET_FIELD(dxf_arc_dist, false, ToDouble, lua_tonumber, LUA_TNUMBER, 0, 0)
+  GET_FIELD(dxf_arc_angle, false, ToDouble, lua_tonumber, LUA_TNUMBER, 0, 0)
+  GET_FIELD(fast_sweep, false, ToDouble, lua_tonumber, LUA_TNUMBER, 0, 0)
+  #undef GET_FIELD
+  schrodinger = false;                          // Default
+  if (type == SCHRODINGER) {
+    type = EZ;
+    schrodinger = true;
+  }
+
+  // Handle wideband_window specially because it is an enumeration.
+  wideband_window = RECTANGLE;                  // Default
+  lua_getfield(L, -1, "wideband_window");       // Stack: wideband_window
+  if (lua_type(L, -1) != LUA_TNIL) {
+    if (strcmp(lua_tostring(L, -1), "rectangle") == 0) {
+      wideband_window = RECTANGLE;
+    } else if (strcmp(lua_tostring(L, -1), "hamming") == 0) {
+      wideband_window = HAMMING;
+    } else {
+      lua->Error("config.wideband_window is not valid");
+    }
+  }
+  lua_pop(L, 1);
+
+  // Handle antenna_pattern specially because it is an enumeration.
+  antenna_pattern = AT_ABC;                     // Default
+  lua_getfield(L, -1, "antenna_pattern");       // Stack: antenna_pattern
+  if (lua_type(L, -1) != LUA_TNIL) {
+    if (strcmp(lua_tostring(L, -1), "at_ABC") == 0) {
+      antenna_pattern = AT_ABC;
+    } else if (strcmp(lua_tostring(L, -1), "at_far_field_material") == 0) {
+      antenna_pattern = AT_FF_MATERIAL;
+    } else if (strcmp(lua_tostring(L, -1), "at_boundary") == 0) {
+      antenna_pattern = AT_BOUNDARY;
+    } else {
+      lua->Error("config.antenna_pattern is not valid");
+    }
+  }
+  lua_pop(L, 1);
+
+  // Handle solver specially because it is an enumeration.
+  solver = DIRECT;                              // Default
+  lua_getfield(L, -1, "solver");                // Stack: solver
+  if (lua_type(L, -1) != LUA_TNIL) {
+    if (strcmp(lua_tostring(L, -1), "direct") == 0) {
+      solver = DIRECT;
+    } else if (strcmp(lua_tostring(L, -1), "iterative") == 0) {
+      solver = ITERATIVE;
+    } else {
+      lua->Error("config.solver is not valid");
+    }
+  }
+  lua_pop(L, 1);
+
+  // Handle incremental_mesh and morph_mesh specially because they are
+  // booleans.
+  lua_getfield(L, -1, "incremental_mesh");      // Stack: incremental_mesh
+  incremental_mesh = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  lua_getfield(L, -1, "morph_mesh");            // Stack: morph_mesh
+  morph_mesh = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+
+  // Handle excited_port specially because it can be a number or a table.
+  port_excitation.clear();
+  lua_getfield(L, -1, "excited_port");  // Stack: excited_port
+  if (lua_type(L, -1) == LUA_TNIL) {
+    if (TypeIsElectrodynamic()) {
+      lua->Error("config.excited_port is required");
+    }
+  } else if (lua_type(L, -1) == LUA_TNUMBER) {
+    double excited_port_d = ToDouble(lua_tonumber(L, -1));
+    int excited_port = excited_port_d;
+    if (excited_port < 1 || excited_port != excited_port_d) {
+      lua->Error("config.excited_port is not valid");
+    }
+    port_excitation.resize(excited_port * 2);
+    port_excitation[excited_port * 2 - 2] = 1;
+  } else if (lua_type(L, -1) == LUA_TTABLE) {
+    lua_len(L, -1);                     // Stack: T len
+    int length = lua_tointeger(L, -1);
+    lua_pop(L, 1);                      // Stack: T
+    for (int i = 1; i <= length; i++) {
+      lua_geti(L, -1, i);               // Stack: T T[i]
+      port_excitation.push_back(lua_tonumber(L, -1));
+      lua_pop(L, 1);                    // Stack: T
+    }
+  } else {
+    lua->Error("config.excited_port is not valid");
+  }
+  lua_pop(L, 1);
+
+  // Handle config.frequency specially because it can be a number or a table.
+  frequencies.clear();
+  lua_getfield(L, -1, "frequency");     // Stack: frequencies
+  if (lua_type(L, -1) == LUA_TNIL) {
+    if (TypeIsElectrodynamic()) {
+      lua->Error("config.frequency is required");
+    }
+  } else {
+    if (TypeIsWaveguideMode()) {
+      lua->Error("config.frequency is not used for mode solutions");
+    }
+    if (lua_type(L, -1) == LUA_TNUMBER) {
+      int ok = 0;
+      frequencies.push_back(ToDouble(lua_tonumberx(L, -1, &ok)));
+      if (!ok || frequencies.back() < 0) {
+        lua->Error("config.frequency has invalid frequency "
+                   "(not a number or < 0)");
+      }
+    } else if (lua_type(L, -1) == LUA_TTABLE) {
+      lua_len(L, -1);                     // Stack: T len
+      int length = lua_tointeger(L, -1);
+      if (length <= 0) {
+        lua->Error("config.frequency must contain at least one entry");
+      }
+      lua_pop(L, 1);                      // Stack: T
+      for (int i = 1; i <= length; i++) {
+        lua_geti(L, -1, i);               // Stack: T T[i]
+        int ok = 0;
+        frequencies.push_back(ToDouble(lua_tonumberx(L, -1, &ok)));
+        lua_pop(L, 1);                    // Stack: T
+        if (!ok || frequencies.back() < 0) {
+          lua->Error("config.frequency has invalid frequency "
+                     "(not a number or < 0)");
+        }
+      }
+    } else {
+      lua->Error("config.frequency is not valid");
+    }
+  }
+  lua_pop(L, 1);
+}
+
 //***************************************************************************
 // 3D graphics.
 
@@ -495,6 +696,9 @@ void Solver::Setup(int frequencies_index) {
 
   if (config_.TypeIsElectrodynamic()) {
     ed_solver_ = new EDSolverType;
+    ed_solver_->num_threads = IdealThreadCount();
+    ed_solver_->use_iterative_solver =
+        (config_.solver == ScriptConfig::ITERATIVE);
     solver_ = ed_solver_;
     ed_solver_->LinkToSolver(this);
   } else {
@@ -520,12 +724,13 @@ void Solver::Setup(int frequencies_index) {
   }
   for (int i = 1; i < port_lengths_.size(); i++) {
     port_lengths_[i] *= config_.unit;
-    if (fabs(port_lengths_[i].Derivative()) > 1e-9) {
+    double derivative = port_lengths_[i].v().cwiseAbs().maxCoeff();
+    if (derivative > 1e-9) {
       // The derivative is often not precisely zero when it's intended to be
       // due to numerical imprecision.
       ERROR_ONCE("Port length %d can not currently depend on optimized "
                  "parameters (len=%f,d/dp=%f).", i,
-                 ToDouble(port_lengths_[i]), port_lengths_[i].Derivative());
+                 ToDouble(port_lengths_[i]), derivative);
     }
   }
 
@@ -541,14 +746,19 @@ void Solver::Setup(int frequencies_index) {
 }
 
 Solver::Solver(const Shape &s, const ScriptConfig &config, Lua *lua,
-               int frequencies_index)
-    : Mesh(s, config.mesh_edge_length, lua), shape_(s), config_(config)
+               int frequencies_index, const Mesh *previous)
+    : Mesh(s, config.mesh_edge_length, lua, previous,
+           (config.incremental_mesh ? REMESH_INCREMENTAL : 0) |
+           (config.morph_mesh ? REMESH_MORPH : 0)),
+      shape_(s), config_(config), config_hash_(config.Hash())
 {
+  shape_.Hash();                        // Compute it now, it is cached
   Setup(frequencies_index);
 }
 
 Solver::Solver(Solver *solver, int frequencies_index)
-    : Mesh(*solver), shape_(solver->shape_), config_(solver->config_)
+    : Mesh(*solver), shape_(solver->shape_), config_(solver->config_),
+      config_hash_(solver->config_hash_)
 {
   Setup(frequencies_index);
 }
@@ -566,8 +776,10 @@ bool Solver::IsValid() const {
          solver_->SystemSize() > 0;             // System size must be > 0
 }
 
-bool Solver::SameAs(const Shape &s, const ScriptConfig &config, Lua *lua) {
-  if (s != shape_ || config != config_) {
+bool Solver::SameAs(const std::string &shape_hash,
+                    const std::string &config_hash,
+                    const std::string &callback_key, Lua *lua) {
+  if (shape_hash != shape_.Hash() || config_hash != config_hash_) {
     return false;
   }
   // At this point the shape and config are the same. The material values and
@@ -578,7 +790,11 @@ bool Solver::SameAs(const Shape &s, const ScriptConfig &config, Lua *lua) {
   // we can't see here. Similarly for the port callbacks. Therefore build a new
   // material parameters field and a new boundary parameters map, and compare
   // them with the existing ones. If the functions compute the same values,
-  // then everything is actually the same.
+  // then everything is actually the same. That is skipped if neither the
+  // callbacks nor any Lua state that they can see has changed.
+  if (!callback_key_.empty() && callback_key == callback_key_) {
+    return true;
+  }
   if (!mat_params_.empty()) {
     vector<MaterialParameters> d;
     DeterminePointMaterial(lua, &d);
@@ -608,13 +824,15 @@ bool Solver::UpdateDerivatives(const Shape &s) {
 
   // Recreate the system (this will use the updated derivatives in the mesh
   // points and materials).
-  solver_->UnCreateSystem();            // Resets triplets and rhs
+  solver_->UnCreateSystem();            // Resets system matrix and rhs
   if (!solver_->CreateSystem()) {
     return false;
   }
 
-  // Recompute derivatives.
-  solution_derivative_.resize(0);
+  // Recompute derivatives, and the antenna pattern that depends on them.
+  solution_derivative_.resize(0, 0);
+  antenna_azimuth_.clear();
+  antenna_field_.clear();
   if (!ComputeDerivatives()) {
     return false;
   }
@@ -750,139 +968,145 @@ void Solver::DrawSolution(DrawMode draw_mode, ColorMap::Function colormap,
     gl::Draw(points, GL_LINES);
     #undef DRAWVECTOR
   } else {
-    // Create color map.
-    const int kNumColors = 256;           // Should be even
-    float rgb[kNumColors][3];
-    for (int i = 0; i < kNumColors; i++) {
-      colormap(float(i) / (kNumColors - 1), rgb[i]);
-    }
-
     // Map the brightness to a scale used for min/max values.
     double scale = in_3D ? 1.0 / ZScaleFromBrightness(brightness)
                          : pow(10, -(brightness - 500.0) / 500.0);
+    if (draw_mode == DRAW_GRADIENT_AMPLITUDE ||
+        draw_mode == DRAW_GRADIENT_AMPLITUDE_REAL) {
+      scale *= est_max_gradient;
+    }
+    vector<float> values;
+    if (!ComputeDrawValues(draw_mode, phase_offset, solvers, &values)) {
+      return;
+    }
 
-    // Draw all mesh triangles. Vertex normals and boundary lines only needed
-    // for 3D.
-    gl::PushShader push_shader(in_3D ? MultilightShader() : gl::SmoothShader());
-    vector<Vector3f> points, colors, vertex_normals, boundary_lines;
-    if (in_3D) {
-      vertex_normals.resize(points_.size());
-      for (int i = 0; i < vertex_normals.size(); i++) {
-        vertex_normals[i].setZero();
-      }
+    if (!in_3D) {
+      DrawPointValues(values, draw_mode == DRAW_REAL ? -scale : 0, scale,
+                      colormap);
+      return;
     }
 
-    #define DRAWLOOP_2D(compute_value, minval, maxval) \
-      for (int i = 0; i < triangles_.size(); i++) { \
-        for (int j = 0; j < 3; j++) { \
-          int k = triangles_[i].index[j]; \
-          double value = compute_value; \
-          int c = std::max(0, std::min(kNumColors - 1, \
-            int(round((value - minval) * (kNumColors / (maxval-minval)))))); \
-          colors.push_back(Vector3f(rgb[c][0], rgb[c][1], rgb[c][2])); \
-          points.push_back(Vector3f(ToDouble(points_[k].p[0]), \
-                                    ToDouble(points_[k].p[1]), 0)); \
-        } \
+    // 3D rendering. Vertex normals and boundary lines are computed from the
+    // values, which are the Z coordinates.
+    gl::PushShader push_shader(MultilightShader());
+    vector<Vector3f> points, vertex_normals(points_.size()), boundary_lines;
+    for (int i = 0; i < vertex_normals.size(); i++) {
+      vertex_normals[i].setZero();
+    }
+    for (int i = 0; i < triangles_.size(); i++) {
+      Vector3d value;
+      for (int j = 0; j < 3; j++) {
+        value[j] = values[triangles_[i].index[j]] / scale;
       }
-    #define DRAWLOOP_3D(compute_value, minval, maxval) \
-      for (int i = 0; i < triangles_.size(); i++) { \
-        Vector3d value; \
-        for (int j = 0; j < 3; j++) { \
-          int k = triangles_[i].index[j]; \
-          value[j] = (compute_value) / scale; \
-        } \
-        Vector3f normal(tri_normal1_[i].dot(value), tri_normal2_[i].dot(value), 1); \
-        normal.normalize(); \
-        for (int j = 0; j < 3; j++) { \
-          int k = triangles_[i].index[j]; \
-          points.push_back(Vector3f(ToDouble(points_[k].p[0]), \
-                                    ToDouble(points_[k].p[1]), value[j])); \
-          vertex_normals[k] += normal; \
-        } \
-        for (int j = 0; j < 3; j++) { \
-          if (triangles_[i].neighbor[j] == -1) { \
-            boundary_lines.push_back(points[points.size() - 3 + j]); \
-            boundary_lines.push_back(points[points.size() - 3 + (j+1)%3]); \
-          } \
-        } \
+      Vector3f normal(tri_normal1_[i].dot(value), tri_normal2_[i].dot(value),
+                      1);
+      normal.normalize();
+      for (int j = 0; j < 3; j++) {
+        int k = triangles_[i].index[j];
+        points.push_back(Vector3f(ToDouble(points_[k].p[0]),
+                                  ToDouble(points_[k].p[1]), value[j]));
+        vertex_normals[k] += normal;
       }
-    #define DRAWLOOP(compute_value, minval, maxval) \
-      if (in_3D) { \
-        DRAWLOOP_3D(compute_value, minval, maxval) \
-      } else { \
-        DRAWLOOP_2D(compute_value, minval, maxval) \
+      for (int j = 0; j < 3; j++) {
+        if (triangles_[i].neighbor[j] == -1) {
+          boundary_lines.push_back(points[points.size() - 3 + j]);
+          boundary_lines.push_back(points[points.size() - 3 + (j+1)%3]);
+        }
       }
-    if (draw_mode == DRAW_REAL) {
-      CREATE_SOLUTION
-      DRAWLOOP(phasor.real() * solution[k].real() -
-               phasor.imag() * solution[k].imag(), -scale, scale)
-    } else if (draw_mode == DRAW_AMPLITUDE) {
-      CREATE_SOLUTION
-      DRAWLOOP(abs(solution[k]), 0.0, scale)
-    } else if (draw_mode == DRAW_AMPLITUDE_REAL) {
-      CREATE_SOLUTION
-      DRAWLOOP(fabs(phasor.real() * solution[k].real() -
-                    phasor.imag() * solution[k].imag()), 0.0, scale)
-    } else if (draw_mode == DRAW_GRADIENT_AMPLITUDE) {
-      scale *= est_max_gradient;
-      CREATE_SPATIAL_GRADIENT_MAX_AMPLITUDE
-      DRAWLOOP( Mgradient[k], 0.0, scale)
-    } else if (draw_mode == DRAW_GRADIENT_AMPLITUDE_REAL) {
-      scale *= est_max_gradient;
-      CREATE_SPATIAL_GRADIENT
-      DRAWLOOP( sqrt(sqr(phasor.real() * Pgradient(k, 0).real() -
-                         phasor.imag() * Pgradient(k, 0).imag()) +
-                     sqr(phasor.real() * Pgradient(k, 1).real() -
-                         phasor.imag() * Pgradient(k, 1).imag())), 0.0, scale)
-    } else {
-      Panic("Unsupported DrawMode");
     }
-
-    if (!in_3D) {
-      gl::Draw(points, colors, GL_TRIANGLES);
-    } else {
-      // 3D rendering.
-      for (int i = 0; i < vertex_normals.size(); i++) {
-        vertex_normals[i].normalize();
-      }
-      vector<Vector3f> tri_normals;
-      for (int i = 0; i < triangles_.size(); i++) {
-        for (int j = 0; j < 3; j++) {
-          int k = triangles_[i].index[j];
-          tri_normals.push_back(vertex_normals[k]);
-        }
+    for (int i = 0; i < vertex_normals.size(); i++) {
+      vertex_normals[i].normalize();
+    }
+    vector<Vector3f> tri_normals;
+    for (int i = 0; i < triangles_.size(); i++) {
+      for (int j = 0; j < 3; j++) {
+        int k = triangles_[i].index[j];
+        tri_normals.push_back(vertex_normals[k]);
       }
-      gl::VertexBuffer<Eigen::Vector3f, Eigen::Vector3f>
-          buffer(points, tri_normals);
+    }
+    gl::VertexBuffer<Eigen::Vector3f, Eigen::Vector3f>
+        buffer(points, tri_normals);
+    buffer.Specify1("vertex", 0, 3, GL_FLOAT);
+    buffer.Specify2("normal", 0, 3, GL_FLOAT);
+    gl::SetUniform("color", 1, 1, 1);
+    buffer.Draw(GL_TRIANGLES);
+
+    // Draw boundary lines.
+    gl::PushShader push_shader2(LineDrawingShader());
+    {
+      gl::VertexBuffer<Eigen::Vector3f, Eigen::Vector3f> buffer(boundary_lines);
       buffer.Specify1("vertex", 0, 3, GL_FLOAT);
-      buffer.Specify2("normal", 0, 3, GL_FLOAT);
-      gl::SetUniform("color", 1, 1, 1);
-      buffer.Draw(GL_TRIANGLES);
-
-      // Draw boundary lines.
-      gl::PushShader push_shader(LineDrawingShader());
-      {
-        gl::VertexBuffer<Eigen::Vector3f, Eigen::Vector3f> buffer(boundary_lines);
-        buffer.Specify1("vertex", 0, 3, GL_FLOAT);
-        buffer.Draw(GL_LINES);
+      buffer.Draw(GL_LINES);
+    }
+
+    // Draw mesh on top of solution if requested.
+    if (show_mesh) {
+      vector<Vector3f> points2(points.size()*2);
+      for (int i = 0; i < points.size(); i++) {
+        points2[i*2] = points[i];
+        points2[i*2+1] = points[(i - i%3) + ((i+1) % 3)];
       }
+      gl::VertexBuffer<Eigen::Vector3f, Eigen::Vector3f> buffer(points2);
+      buffer.Specify1("vertex", 0, 3, GL_FLOAT);
+      buffer.Draw(GL_LINES);
+    }
+  }
+}
 
-      // Draw mesh on top of solution if requested.
-      if (show_mesh) {
-        vector<Vector3f> points2(points.size()*2);
-        for (int i = 0; i < points.size(); i++) {
-          points2[i*2] = points[i];
-          points2[i*2+1] = points[(i - i%3) + ((i+1) % 3)];
-        }
-        gl::VertexBuffer<Eigen::Vector3f, Eigen::Vector3f> buffer(points2);
-        buffer.Specify1("vertex", 0, 3, GL_FLOAT);
-        buffer.Draw(GL_LINES);
+bool Solver::ComputeDrawValues(DrawMode draw_mode, double phase_offset,
+                               Solvers *solvers, vector<float> *values) {
+  // This follows DrawSolution(): if there are multiple solvers then use their
+  // combined field, which already includes the phase_offset.
+  Complex phasor = exp(Complex(0, phase_offset));
+  values->resize(points_.size());
+  if (draw_mode == DRAW_REAL || draw_mode == DRAW_AMPLITUDE ||
+      draw_mode == DRAW_AMPLITUDE_REAL) {
+    VectorXcd multi_solution;
+    if (solvers) {
+      solvers->CombinedField(&multi_solution, phase_offset);
+      phasor = 1;
+    }
+    const VectorXcd &solution = solvers ? multi_solution : *solver_solution_;
+    if (solution.size() != points_.size()) {
+      return false;
+    }
+    for (int i = 0; i < points_.size(); i++) {
+      Complex z = solution[i] * phasor;
+      (*values)[i] = (draw_mode == DRAW_REAL) ? z.real() :
+                     (draw_mode == DRAW_AMPLITUDE) ? abs(z) : fabs(z.real());
+    }
+  } else if (draw_mode == DRAW_GRADIENT_AMPLITUDE) {
+    Eigen::VectorXd multi_Mgradient;
+    if (solvers) {
+      if (!solvers->CombinedSpatialGradientMaxAmplitude(&multi_Mgradient)) {
+        return false;
       }
+    } else if (!ComputeSpatialGradientMaxAmplitude()) {
+      return false;
+    }
+    const auto &Mgradient = solvers ? multi_Mgradient : Mgradient_;
+    for (int i = 0; i < points_.size(); i++) {
+      (*values)[i] = Mgradient[i];
+    }
+  } else if (draw_mode == DRAW_GRADIENT_AMPLITUDE_REAL) {
+    Eigen::MatrixXcd multi_Pgradient;
+    if (solvers) {
+      if (!solvers->CombinedSpatialGradient(&multi_Pgradient, phase_offset)) {
+        return false;
+      }
+      phasor = 1;
+    } else if (!ComputeSpatialGradient()) {
+      return false;
+    }
+    const auto &Pgradient = solvers ? multi_Pgradient : Pgradient_;
+    for (int i = 0; i < points_.size(); i++) {
+      (*values)[i] = sqrt(sqr((phasor * Pgradient(i, 0)).real()) +
+                          sqr((phasor * Pgradient(i, 1)).real()));
     }
-    #undef DRAWLOOP
-    #undef DRAWLOOP_2D
-    #undef DRAWLOOP_3D
+  } else {
+    Panic("Unsupported DrawMode");
   }
+  return true;
 }
 
 bool Solver::ComputePortOutgoingField1(vector<JetComplex> *result) {
@@ -1064,7 +1288,88 @@ bool Solver::ComputePortOutgoingPower(vector<JetComplex> *result) {
 void Solver::GetField(JetNum x, JetNum y, JetComplex *value) {
   CHECK(Solve());
   CHECK(ComputeDerivatives());          // For SolutionJet()
-  int t = FindTriangle(ToDouble(x), ToDouble(y));
+  GetFieldInTriangle(FindTriangle(ToDouble(x), ToDouble(y)), x, y, value);
+}
+
+void Solver::GetFieldGradient(JetNum x, JetNum y,
+                              JetComplex *dx, JetComplex *dy) {
+  CHECK(ComputeSpatialGradient());
+  GetFieldGradientInTriangle(FindTriangle(ToDouble(x), ToDouble(y)), x, y,
+                             dx, dy);
+}
+
+void Solver::GetFieldPoynting(JetNum x, JetNum y, JetPoint *poynting) {
+  CHECK(Solve());
+  CHECK(ComputeDerivatives());
+  GetFieldPoyntingInTriangle(FindTriangle(ToDouble(x), ToDouble(y)), x, y,
+                             poynting);
+}
+
+// Call fn(i) for i in the range [0..n-1] using multiple threads. Each thread
+// processes blocks of consecutive i, as the work for each i is small.
+static void ParallelForPoints(int n, std::function<void(int)> fn) {
+  const int kBlockSize = 1024;
+  int num_blocks = (n + kBlockSize - 1) / kBlockSize;
+  ParallelFor(0, num_blocks - 1, IdealThreadCount(), [&](int block) {
+    int end = std::min(n, (block + 1) * kBlockSize);
+    for (int i = block * kBlockSize; i < end; i++) {
+      fn(i);
+    }
+  });
+}
+
+void Solver::GetField(const vector<JetNum> &x, const vector<JetNum> &y,
+                      vector<JetComplex> *value) {
+  CHECK(Solve());
+  CHECK(ComputeDerivatives());          // For SolutionJet()
+  vector<int> triangles;
+  LocatePoints(x, y, &triangles);
+  value->resize(x.size());
+  ParallelForPoints(x.size(), [&](int i) {
+    GetFieldInTriangle(triangles[i], x[i], y[i], &(*value)[i]);
+  });
+}
+
+void Solver::GetFieldGradient(const vector<JetNum> &x,
+                              const vector<JetNum> &y,
+                              vector<JetComplex> *dx, vector<JetComplex> *dy) {
+  CHECK(ComputeSpatialGradient());
+  vector<int> triangles;
+  LocatePoints(x, y, &triangles);
+  dx->resize(x.size());
+  dy->resize(x.size());
+  ParallelForPoints(x.size(), [&](int i) {
+    GetFieldGradientInTriangle(triangles[i], x[i], y[i], &(*dx)[i],
+                               &(*dy)[i]);
+  });
+}
+
+void Solver::GetFieldPoynting(const vector<JetNum> &x,
+                              const vector<JetNum> &y,
+                              vector<JetPoint> *poynting) {
+  CHECK(Solve());
+  CHECK(ComputeDerivatives());
+  vector<int> triangles;
+  LocatePoints(x, y, &triangles);
+  poynting->resize(x.size());
+  ParallelForPoints(x.size(), [&](int i) {
+    GetFieldPoyntingInTriangle(triangles[i], x[i], y[i], &(*poynting)[i]);
+  });
+}
+
+void Solver::LocatePoints(const vector<JetNum> &x, const vector<JetNum> &y,
+                          vector<int> *triangles) {
+  CHECK(x.size() == y.size());
+  vector<double> dx(x.size()), dy(y.size());
+  for (int i = 0; i < x.size(); i++) {
+    dx[i] = ToDouble(x[i]);
+    dy[i] = ToDouble(y[i]);
+  }
+  FindTriangles(dx, dy, triangles);
+}
+
+void Solver::GetFieldInTriangle(int t, JetNum x, JetNum y,
+                                JetComplex *value) const {
   if (t < 0) {
     *value = 0;
     return;
@@ -1082,8 +1387,8 @@ void Solver::GetField(JetNum x, JetNum y, JetComplex *value) {
        value0, value1, value2, value);
 }
 
-void Solver::GetFieldGradient(JetNum x, JetNum y,
-                              JetComplex *dx, JetComplex *dy) {
+void Solver::GetFieldGradientInTriangle(int t, JetNum x, JetNum y,
+                                        JetComplex *dx, JetComplex *dy) const {
   // @@@ Derivatives of the gradient are not computed correctly here!
   // Pgradient_ is a point gradient that contains a mix of gradients in
   // adjacent triangles. It is smooth and convenient for visualization but
@@ -1093,8 +1398,6 @@ void Solver::GetFieldGradient(JetNum x, JetNum y,
   // compute the gradient from just the triangle vertices. This would result in
   // a discontinuous gradient that is less accurate but easier to compute
   // derivatives for.
-  CHECK(ComputeSpatialGradient());
-  int t = FindTriangle(ToDouble(x), ToDouble(y));
   if (t < 0) {
     *dx = 0;
     *dy = 0;
@@ -1113,14 +1416,12 @@ void Solver::GetFieldGradient(JetNum x, JetNum y,
        Pgradient_(i0, 1), Pgradient_(i1, 1), Pgradient_(i2 ,1), dy);
 }
 
-void Solver::GetFieldPoynting(JetNum x, JetNum y, JetPoint *poynting) {
-  // @@@ See the comment for GetFieldGradient(). We compute the gradient within
-  // a single triangle only, so that derivatives come along with the ride. This
-  // produces a somewhat noisier poynting vector than if we had used a
-  // Pgradient_-style gradient.
-  CHECK(Solve());
-  CHECK(ComputeDerivatives());
-  int t = FindTriangle(ToDouble(x), ToDouble(y));
+void Solver::GetFieldPoyntingInTriangle(int t, JetNum x, JetNum y,
+                                        JetPoint *poynting) const {
+  // @@@ See the comment for GetFieldGradientInTriangle(). We compute the
+  // gradient within a single triangle only, so that derivatives come along
+  // with the ride. This produces a somewhat noisier poynting vector than if we
+  // had used a Pgradient_-style gradient.
   if (t < 0) {
     poynting->setZero();
     return;
@@ -1140,8 +1441,98 @@ void Solver::GetFieldPoynting(JetNum x, JetNum y, JetPoint *poynting) {
   (*poynting)[1] = (conj(Dy) * value / k).imag();
 }
 
-bool Solver::ComputeAntennaPattern(vector<double> *azimuth,
-                                   vector<JetComplex> *field) {
+// The far field radiators gathered from the boundary triangles by
+// ComputeAntennaPattern(). Each quantity is stored as separate arrays for the
+// value and for each derivative lane, so the loops over radiators are simple
+// arithmetic on contiguous doubles rather than JetNum operations.
+class FarFieldSources {
+ public:
+  int size() const { return data_[0][0].size(); }
+
+  // Working space for Field(), so that it can be reused for many angles.
+  struct Scratch {
+    vector<double> wr, wi, awr, awi;    // w and i*a*w for each radiator
+  };
+
+  // Add a radiator whose contribution to the far field at angle phi is
+  //   (p*cos(phi) + q*sin(phi) + r) * exp(i*k*(c[0]*cos(phi) + c[1]*sin(phi)))
+  void Add(const JetPoint &c, const JetComplex &p, const JetComplex &q,
+           const JetComplex &r) {
+    const JetNum values[kNumQuantities] = {c[0], c[1], p.real(), p.imag(),
+        q.real(), q.imag(), r.real(), r.imag()};
+    for (int i = 0; i < kNumQuantities; i++) {
+      data_[i][0].push_back(values[i].a);
+      for (int j = 0; j < kJetWidth; j++) {
+        data_[i][j + 1].push_back(values[i].Derivative(j));
+      }
+    }
+  }
+
+  // Return the sum of all radiator contributions at angle phi, given
+  // cos_phi=cos(phi) and sin_phi=sin(phi).
+  JetComplex Field(double k, double cos_phi, double sin_phi,
+                   Scratch *scratch) const {
+    // The phase factor w=exp(i*psi), with psi=k*(cx*cos(phi)+cy*sin(phi)), is
+    // computed once per radiator from the values alone. The derivative of
+    // a*w is da*w + i*a*w*dpsi so the derivative lanes need no further
+    // transcendental functions.
+    const int n = size();
+    scratch->wr.resize(n);
+    scratch->wi.resize(n);
+    scratch->awr.resize(n);
+    scratch->awi.resize(n);
+    double *wr = scratch->wr.data(), *wi = scratch->wi.data();
+    double *awr = scratch->awr.data(), *awi = scratch->awi.data();
+    double sum_r = 0, sum_i = 0;
+    {
+      const double *cx = data_[CX][0].data(), *cy = data_[CY][0].data();
+      const double *pr = data_[PR][0].data(), *pi = data_[PI][0].data();
+      const double *qr = data_[QR][0].data(), *qi = data_[QI][0].data();
+      const double *rr = data_[RR][0].data(), *ri = data_[RI][0].data();
+      for (int e = 0; e < n; e++) {
+        double psi = k * (cx[e] * cos_phi + cy[e] * sin_phi);
+        wr[e] = cos(psi);
+        wi[e] = sin(psi);
+        double ar = pr[e] * cos_phi + qr[e] * sin_phi + rr[e];
+        double ai = pi[e] * cos_phi + qi[e] * sin_phi + ri[e];
+        double tr = ar * wr[e] - ai * wi[e];
+        double ti = ar * wi[e] + ai * wr[e];
+        sum_r += tr;
+        sum_i += ti;
+        awr[e] = -ti;
+        awi[e] = tr;
+      }
+    }
+    JetComplex result(sum_r, sum_i);
+    for (int j = 1; j <= kJetWidth; j++) {
+      const double *cx = data_[CX][j].data(), *cy = data_[CY][j].data();
+      const double *pr = data_[PR][j].data(), *pi = data_[PI][j].data();
+      const double *qr = data_[QR][j].data(), *qi = data_[QI][j].data();
+      const double *rr = data_[RR][j].data(), *ri = data_[RI][j].data();
+      double dsum_r = 0, dsum_i = 0;
+      for (int e = 0; e < n; e++) {
+        double dpsi = k * (cx[e] * cos_phi + cy[e] * sin_phi);
+        double dar = pr[e] * cos_phi + qr[e] * sin_phi + rr[e];
+        double dai = pi[e] * cos_phi + qi[e] * sin_phi + ri[e];
+        dsum_r += dar * wr[e] - dai * wi[e] + awr[e] * dpsi;
+        dsum_i += dar * wi[e] + dai * wr[e] + awi[e] * dpsi;
+      }
+      // std::complex<JetNum> only gives access to copies of its parts.
+      JetNum re = result.real(), im = result.imag();
+      re.Derivative(j - 1) = dsum_r;
+      im.Derivative(j - 1) = dsum_i;
+      result = JetComplex(re, im);
+    }
+    return result;
+  }
+
+ private:
+  // Center, p, q and r split into real and imaginary parts.
+  enum { CX, CY, PR, PI, QR, QI, RR, RI, kNumQuantities };
+  vector<double> data_[kNumQuantities][kJetWidth + 1];  // Lane 0 = value
+};
+
+bool Solver::ComputeAntennaPattern() {
   Trace trace(__func__);
   if (!config_.TypeIsElectrodynamic() || !ComputeSpatialGradient()) {
     return false;
@@ -1162,17 +1553,15 @@ bool Solver::ComputeAntennaPattern(vector<double> *azimuth,
   }
   const double k = sqrt(k2);
 
-  // Return a previously cached result.
+  // Keep a previously stored result.
   if (!antenna_field_.empty()) {
-    *azimuth = antenna_azimuth_;
-    *field = antenna_field_;
     return true;
   }
 
   // Precompute equally spaced azimuths for far field result.
-  azimuth->resize(kFarFieldPoints);
+  vector<double> azimuth(kFarFieldPoints);
   for (int i = 0; i < kFarFieldPoints ; i++) {
-    (*azimuth)[i] = (2.0 * M_PI * double(i)) / kFarFieldPoints - M_PI;
+    azimuth[i] = (2.0 * M_PI * double(i)) / kFarFieldPoints - M_PI;
   }
 
   // For all boundary triangles find field values and field gradients, then
@@ -1184,9 +1573,7 @@ bool Solver::ComputeAntennaPattern(vector<double> *azimuth,
   // obtained when both kinds of radiators are positioned at the centroid of
   // boundary triangles, with field values and gradients computed from the
   // solution values at the triangle vertices.
-  field->clear();
-  field->resize(kFarFieldPoints);       // Far field values over angle
-  int radiator_count = 0;
+  FarFieldSources sources;
   bool use_ff_material = (config_.antenna_pattern == config_.AT_FF_MATERIAL);
   uint32_t color_mask = use_ff_material ? Material::FAR_FIELD : 0;
   for (BoundaryIterator it(this, color_mask); !it.done(); ++it) {
@@ -1194,7 +1581,6 @@ bool Solver::ComputeAntennaPattern(vector<double> *azimuth,
            (config_.antenna_pattern == config_.AT_BOUNDARY) )) {
       continue;
     }
-    radiator_count++;
 
     // Triangle vertices scaled to meters.
     JetPoint p1 = points_[it.pindex1()].p * config_.unit;
@@ -1223,27 +1609,40 @@ bool Solver::ComputeAntennaPattern(vector<double> *azimuth,
     if (normal.dot(p3 - p1) > 0) {
       normal *= -1;
     }
-    JetNum nangle = atan2(normal[1], normal[0]);
 
-    // Update far field values.
-    for (int i = 0; i < kFarFieldPoints; i++) {
-      double phi = -(*azimuth)[i] + config_.boresight * M_PI / 180.0;
-      (*field)[i] += (k*cos(phi - nangle)*z +
-                JetComplex(0,1) * (sin(nangle)*gradY + cos(nangle)*gradX)) *
-          exp(JetComplex(0, k * (center[0] * cos(phi) + center[1] * sin(phi))));
+    // The far field contribution of this radiator at angle phi is
+    //   (k*cos(phi - nangle)*z + i*(sin(nangle)*gradY + cos(nangle)*gradX)) *
+    //   exp(i*k*(center[0]*cos(phi) + center[1]*sin(phi)))
+    // where nangle is the angle of the normal. Expanding cos(phi - nangle)
+    // makes the first factor p*cos(phi) + q*sin(phi) + r.
+    sources.Add(center, z * (k * normal[0]), z * (k * normal[1]),
+                JetComplex(0, 1) * (normal[1] * gradY + normal[0] * gradX));
+  }
+  const int radiator_count = sources.size();
+
+  // Update far field values. The angles are independent so they are computed
+  // by multiple threads, each taking a contiguous block of angles so that the
+  // working space of Field() is allocated once per block.
+  const double boresight = config_.boresight * M_PI / 180.0;
+  const int num_blocks = IdealThreadCount();
+  vector<JetComplex> field(kFarFieldPoints);    // Far field values over angle
+  ParallelFor(0, num_blocks - 1, num_blocks, [&](int block) {
+    FarFieldSources::Scratch scratch;
+    for (int i = block * kFarFieldPoints / num_blocks;
+         i < (block + 1) * kFarFieldPoints / num_blocks; i++) {
+      double phi = -azimuth[i] + boresight;
+      field[i] = sources.Field(k, cos(phi), sin(phi), &scratch);
     }
-  }
+  });
 
   // Scale field by the number of radiators, i.e. the number of times we added
   // to each element of field[] in the inner loop.
   for (int i = 0; i < kFarFieldPoints; i++) {
-    (*field)[i] /= double(radiator_count);
+    field[i] /= double(radiator_count);
   }
 
-  // Cache the result (note that the return vectors might already be the cache
-  // vectors).
-  antenna_azimuth_ = *azimuth;
-  antenna_field_ = *field;
+  antenna_azimuth_.swap(azimuth);
+  antenna_field_.swap(field);
   return true;
 }
 
@@ -1263,8 +1662,34 @@ void Solver::AdjustAntennaPhaseCenter(JetPoint phase_center,
   }
 }
 
+JetNum Solver::ComputeAntennaDirectivity() {
+  if (!ComputeAntennaPattern()) {
+    return 0;
+  }
+  const vector<double> &azimuth = antenna_azimuth_;
+  const vector<JetComplex> &field = antenna_field_;
+  CHECK(azimuth.size() == field.size());
+  vector<JetNum> magnitude(field.size());
+  for (int i = 0; i < field.size(); i++) {
+    magnitude[i] = abs(field[i]);
+  }
+  JetNum power_avg = 0, power_max = 0;
+  for (int i = 0; i < magnitude.size(); i++) {
+    int inext = (i + 1) % magnitude.size();
+    int iprev = (i + magnitude.size() - 1) % magnitude.size();
+    double delta_angle = azimuth[inext] - azimuth[iprev];
+    if (delta_angle < 0) {
+      delta_angle += 2 * M_PI;
+    }
+    delta_angle /= 2.0;
+    power_avg += sqr(magnitude[i]) * delta_angle / (2 * M_PI);
+    power_max = std::max(power_max, sqr(magnitude[i]));
+  }
+  return power_max / power_avg;
+}
+
 bool Solver::LookupAntennaPattern(JetNum theta, JetNum *magnitude) {
-  if (!ComputeAntennaPattern(&antenna_azimuth_, &antenna_field_)) {
+  if (!ComputeAntennaPattern()) {
     return false;
   }
   CHECK(antenna_azimuth_.size() == kFarFieldPoints);
@@ -1358,19 +1783,19 @@ void Solver::SaveMeshAndSolutionToMatlab(const char *filename) {
   // Write the (sparse, complex) system matrix.
   if (ed_solver_) {
     int n = ed_solver_->rhs.size();
-    CHECK(ed_solver_->Ctriplets.size() == 0);
-    Eigen::SparseMatrix<JetComplex> A(n, n);
-    A.setFromTriplets(ed_solver_->triplets.begin(), ed_solver_->triplets.end());
-    CHECK(A.isCompressed());
-
-    vector<double> real_data(A.nonZeros());
-    vector<double> imag_data(A.nonZeros());
-    for (int i = 0; i < A.nonZeros(); i++) {
-      real_data[i] = ToDouble(A.valuePtr()[i].real());
-      imag_data[i] = ToDouble(A.valuePtr()[i].imag());
-    }
-    mat.WriteSparseMatrix("A", n, n, MatFile::mxDOUBLE_CLASS, A.nonZeros(),
-                         A.innerIndexPtr(), A.outerIndexPtr(),
+    CHECK(ed_solver_->Cvalues.size() == 0);
+    const auto &A = ed_solver_->Avalues;
+    CHECK(A.size() == ed_solver_->system_inner.size());
+
+    vector<double> real_data(A.size());
+    vector<double> imag_data(A.size());
+    for (int i = 0; i < A.size(); i++) {
+      real_data[i] = ToDouble(A[i].real());
+      imag_data[i] = ToDouble(A[i].imag());
+    }
+    mat.WriteSparseMatrix("A", n, n, MatFile::mxDOUBLE_CLASS, A.size(),
+                         ed_solver_->system_inner.data(),
+                         ed_solver_->system_outer.data(),
                          real_data.data(), imag_data.data());
   }
 
@@ -1421,6 +1846,43 @@ bool Solver::Solve() {
   }
 }
 
+const Eigen::VectorXcd *Solver::Solution() {
+  return Solve() ? solver_solution_ : NULL;
+}
+
+bool Solver::SolutionWithDerivatives(vector<JetComplex> *solution) {
+  if (!Solve() || !ComputeDerivatives()) {
+    return false;
+  }
+  solution->resize(points_.size());
+  for (int i = 0; i < points_.size(); i++) {
+    (*solution)[i] = SolutionJet(i);
+  }
+  return true;
+}
+
+const Eigen::MatrixXcd *Solver::SpatialGradient() {
+  return ComputeSpatialGradient() ? &Pgradient_ : NULL;
+}
+
+bool Solver::IterativeSolveStatistics(int *iterations, double *residual) {
+  if (!ed_solver_ || !ed_solver_->iterative_solver) {
+    return false;
+  }
+  const auto &A = ed_solver_->iterative_A;
+  const vector<int> &reverse_index_map = ed_solver_->reverse_index_map;
+  VectorXcd x(A.cols()), b(A.rows());
+  for (int i = 0; i < x.size(); i++) {
+    x[i] = ed_solver_->solution[reverse_index_map[i]];
+  }
+  for (int i = 0; i < b.size(); i++) {
+    b[i] = ToComplex(ed_solver_->rhs[i]);
+  }
+  *iterations = ed_solver_->iterative_solver->iterations();
+  *residual = (A * x - b).norm() / b.norm();
+  return true;
+}
+
 void Solver::SelectWaveguideMode(int n) {
   // Make sure we have an eigen solution available. Don't do anything if we're
   // not computing waveguide modes or if the mode solver has failed.
@@ -1586,7 +2048,7 @@ bool Solver::ComputeDerivatives() {
     // Derivatives already computed.
     return true;
   }
-  if (!ed_solver_->ComputeSolutionDerivative(&solution_derivative_)) {
+  if (!ed_solver_->ComputeSolutionJacobian(&solution_derivative_)) {
     return false;
   }
 
@@ -1599,8 +2061,10 @@ bool Solver::ComputeDerivatives() {
 JetComplex Solver::SolutionJet(int i) const {
   JetNum realpart = (*solver_solution_)[i].real();
   JetNum imagpart = (*solver_solution_)[i].imag();
-  realpart.Derivative() = solution_derivative_[i].real();
-  imagpart.Derivative() = solution_derivative_[i].imag();
+  for (int k = 0; k < kJetWidth; k++) {
+    realpart.Derivative(k) = solution_derivative_(i, k).real();
+    imagpart.Derivative(k) = solution_derivative_(i, k).imag();
+  }
   return JetComplex(realpart, imagpart);
 }
 
@@ -1613,9 +2077,37 @@ bool Solvers::Solve() {
   // the thread setup overhead, and it seems acceptable compared to the other
   // overheads. If it becomes a problem we might want to first check if there
   // is any actual solving work to do before launching all these threads.
-  const int kNumThreads = QThread::idealThreadCount();
-  bool ok = true;
-  ParallelFor(0, solvers_.size()-1, kNumThreads, [&](int i) mutable {
+  //
+  // All solvers are copies of the first one so they share its mesh, and
+  // therefore the sparsity pattern of the system matrix. Solve the first
+  // solver by itself then let the others reuse its symbolic analysis, so that
+  // they only need a numeric factorization. The first solver gets all the
+  // threads for system assembly, the others split them between them so the
+  // machine is not oversubscribed.
+  if (solvers_.empty()) {
+    return true;
+  }
+  const ScriptConfig &config = solvers_[0]->config_;
+  if (config.TypeIsElectrodynamic() && config.fast_sweep > 0 &&
+      config.fast_sweep < solvers_.size()) {
+    return FastSweep(config.fast_sweep);
+  }
+  const int kNumThreads = IdealThreadCount();
+  if (solvers_[0]->ed_solver_) {
+    solvers_[0]->ed_solver_->num_threads = kNumThreads;
+  }
+  bool ok = solvers_[0]->Solve();
+  if (solvers_[0]->ed_solver_) {
+    const int assembly_threads =
+        std::max(1, kNumThreads / std::max(1, int(solvers_.size()) - 1));
+    for (int i = 1; i < solvers_.size(); i++) {
+      if (solvers_[i]->ed_solver_) {
+        solvers_[i]->ed_solver_->ShareAnalysis(solvers_[0]->ed_solver_);
+        solvers_[i]->ed_solver_->num_threads = assembly_threads;
+      }
+    }
+  }
+  ParallelFor(1, solvers_.size()-1, kNumThreads, [&](int i) mutable {
     if (!solvers_[i]->Solve()) {
       ok = false;
     }
@@ -1623,8 +2115,85 @@ bool Solvers::Solve() {
   return ok;
 }
 
+bool Solvers::FastSweep(int num_anchors) {
+  // The anchor frequencies are solved in full, sharing the symbolic analysis
+  // as in Solve(). All other frequencies assemble their own system matrix but
+  // solve it projected onto the span of the anchor solutions. This is a
+  // multi-point Galerkin reduced order model. Assembly is cheap compared to
+  // factorization, and we don't rely on an affine split of the system matrix
+  // like K - k^2*C because the port boundary conditions depend on k in more
+  // complicated ways.
+  Trace trace(__func__);
+  const int n = solvers_.size();
+  CHECK(num_anchors > 0 && num_anchors < n);
+  vector<bool> is_anchor(n);
+  vector<int> anchors;
+  for (int i = 0; i < num_anchors; i++) {
+    int index = (num_anchors == 1) ? n / 2 :
+        int(round(double(i) * (n - 1) / (num_anchors - 1)));
+    if (!is_anchor[index]) {
+      is_anchor[index] = true;
+      anchors.push_back(index);
+    }
+  }
+
+  // Solve the anchor frequencies.
+  const int kNumThreads = IdealThreadCount();
+  Solver *first = solvers_[anchors[0]];
+  first->ed_solver_->num_threads = kNumThreads;
+  if (!first->Solve()) {
+    return false;
+  }
+  bool ok = true;
+  ParallelFor(1, anchors.size() - 1, kNumThreads, [&](int i) mutable {
+    solvers_[anchors[i]]->ed_solver_->ShareAnalysis(first->ed_solver_);
+    if (!solvers_[anchors[i]]->Solve()) {
+      ok = false;
+    }
+  });
+  if (!ok) {
+    return false;
+  }
+
+  // Create the basis from the anchor solutions. Don't recreate it if this has
+  // been called before, since the reduced solutions refer to it.
+  if (basis_.cols() == 0) {
+    for (int i = 0; i < anchors.size(); i++) {
+      solvers_[anchors[i]]->ed_solver_->AddSolutionToBasis(&basis_);
+    }
+  }
+  if (basis_.cols() == 0) {
+    Error("Fast sweep could not create a reduced order basis");
+    return false;
+  }
+
+  // Solve all other frequencies with the reduced order model.
+  const int assembly_threads =
+      std::max(1, kNumThreads / (n - int(anchors.size())));
+  double max_residual = 0;
+  std::mutex mutex;             // Protects max_residual
+  ParallelFor(0, n - 1, kNumThreads, [&](int i) mutable {
+    if (is_anchor[i]) {
+      return;
+    }
+    auto *ed_solver = solvers_[i]->ed_solver_;
+    ed_solver->num_threads = assembly_threads;
+    if (!ed_solver->SolveReducedSystem(&basis_) || !solvers_[i]->Solve()) {
+      ok = false;
+      return;
+    }
+    MutexLock lock(&mutex);
+    max_residual = std::max(max_residual, ed_solver->reduced_residual);
+  });
+  if (max_residual > 1e-3) {
+    Warning("Fast sweep relative residual is %e, more full solves might be "
+            "needed", max_residual);
+  }
+  return ok;
+}
+
 bool Solvers::UpdateDerivatives(const Shape &s) {
-  const int kNumThreads = QThread::idealThreadCount();
+  const int kNumThreads = IdealThreadCount();
   bool ok = true;
   ParallelFor(0, solvers_.size()-1, kNumThreads, [&](int i) mutable {
     if (!solvers_[i]->UpdateDerivatives(s)) {
@@ -1634,6 +2203,64 @@ bool Solvers::UpdateDerivatives(const Shape &s) {
   return ok;
 }
 
+bool Solvers::ComputeAntennaPatterns() {
+  // Solve first so that the symbolic analysis is shared, as in Solve().
+  if (!Solve()) {
+    return false;
+  }
+  bool ok = true;
+  ParallelFor(0, solvers_.size()-1, IdealThreadCount(), [&](int i) mutable {
+    if (!solvers_[i]->ComputeAntennaPattern()) {
+      ok = false;
+    }
+  });
+  return ok;
+}
+
+void Solvers::PulseBasis::Create(const vector<const Complex*> &vectors,
+                                 int n) {
+  // Classical Gram-Schmidt, where the projection onto the basis is repeated
+  // for vectors that add to the basis so that it stays orthonormal to working
+  // precision ("twice is enough"). Vectors whose residual is tiny compared to
+  // their size do not add to the basis, and for a frequency sweep that is most
+  // of them.
+  Trace trace(__func__);
+  const double kTolerance = 1e-9;
+  basis.resize(n, std::min<int>(16, vectors.size()));
+  coefficients = Eigen::MatrixXcd::Zero(vectors.size(), vectors.size());
+  int rank = 0;
+  for (int i = 0; i < vectors.size(); i++) {
+    VectorXcd v = Eigen::Map<const VectorXcd>(vectors[i], n);
+    double norm = v.norm();
+    for (int pass = 0; pass < 2 && rank > 0; pass++) {
+      VectorXcd h = basis.leftCols(rank).adjoint() * v;
+      v -= basis.leftCols(rank) * h;
+      coefficients.col(i).head(rank) += h;
+      if (v.norm() <= kTolerance * norm) {
+        break;
+      }
+    }
+    double residual = v.norm();
+    if (residual > kTolerance * norm) {
+      if (rank == basis.cols()) {
+        basis.conservativeResize(n, std::min<int>(rank * 2, vectors.size()));
+      }
+      basis.col(rank) = v / residual;
+      coefficients(rank, i) = residual;
+      rank++;
+    }
+  }
+  basis.conservativeResize(n, rank);
+  coefficients.conservativeResize(rank, vectors.size());
+}
+
+void Solvers::PulseBasis::Combine(const vector<Complex> &phasors,
+                                  Complex *result) const {
+  VectorXcd weights = coefficients *
+      Eigen::Map<const VectorXcd>(phasors.data(), phasors.size());
+  Eigen::Map<VectorXcd>(result, basis.rows()) = basis * weights;
+}
+
 void Solvers::CombinedField(VectorXcd *f, double phase_offset) {
   if (solvers_.empty() || solvers_[0]->solver_solution_->size() == 0) {
     return;
@@ -1641,10 +2268,23 @@ void Solvers::CombinedField(VectorXcd *f, double phase_offset) {
   vector<Complex> phasors;
   Phasors(phase_offset, &phasors);
   f->resize(solvers_[0]->solver_solution_->size());
-  f->setZero();
-  for (int i = 0; i < solvers_.size(); i++) {
-    *f += *solvers_[i]->solver_solution_ * phasors[i];
+  if (!solvers_[0]->config_.TypeIsElectrodynamic()) {
+    // Waveguide mode solutions can change, so don't cache them.
+    f->setZero();
+    for (int i = 0; i < solvers_.size(); i++) {
+      *f += *solvers_[i]->solver_solution_ * phasors[i];
+    }
+    return;
   }
+  if (field_basis_.basis.size() == 0) {
+    vector<const Complex*> vectors;
+    for (int i = 0; i < solvers_.size(); i++) {
+      CHECK(solvers_[i]->solver_solution_->size() == f->size());
+      vectors.push_back(solvers_[i]->solver_solution_->data());
+    }
+    field_basis_.Create(vectors, f->size());
+  }
+  field_basis_.Combine(phasors, f->data());
 }
 
 bool Solvers::CombinedSpatialGradient(Eigen::MatrixXcd *f,
@@ -1660,10 +2300,24 @@ bool Solvers::CombinedSpatialGradient(Eigen::MatrixXcd *f,
     }
   }
   f->resize(solvers_[0]->Pgradient_.rows(), solvers_[0]->Pgradient_.cols());
-  f->setZero();
-  for (int i = 0; i < solvers_.size(); i++) {
-    *f += solvers_[i]->Pgradient_ * phasors[i];
+  if (!solvers_[0]->config_.TypeIsElectrodynamic()) {
+    f->setZero();
+    for (int i = 0; i < solvers_.size(); i++) {
+      *f += solvers_[i]->Pgradient_ * phasors[i];
+    }
+    return true;
   }
+  // Each Pgradient_ is stored in column major order, so it is treated as a
+  // single vector of both gradient components.
+  if (gradient_basis_.basis.size() == 0) {
+    vector<const Complex*> vectors;
+    for (int i = 0; i < solvers_.size(); i++) {
+      CHECK(solvers_[i]->Pgradient_.size() == f->size());
+      vectors.push_back(solvers_[i]->Pgradient_.data());
+    }
+    gradient_basis_.Create(vectors, f->size());
+  }
+  gradient_basis_.Combine(phasors, f->data());
   return true;
 }
 
@@ -1706,6 +2360,143 @@ void Solvers::Phasors(double phase_offset, vector<Complex> *n) {
   }
 }
 
+//***************************************************************************
+// Lua functions.
+
+int LuaSolverGetField(lua_State *L, Solvers *solvers, int solution_index) {
+  if (lua_gettop(L) != 2) {
+    LuaError(L, "Usage: _GetField(x,y)");
+  }
+  vector<JetNum> x, y;
+  if (ToJetNumVectors(L, &x, &y)) {
+    vector<JetComplex> value(x.size(), JetComplex(0));
+    if (solvers->Valid()) {
+      solvers->At(solution_index)->GetField(x, y, &value);
+    }
+    LuaPushComplexVector(L, value);
+    return 2;
+  }
+  if (!solvers->Valid()) {
+    lua_pushnumber(L, 0);
+    lua_pushnumber(L, 0);
+    return 2;
+  }
+  JetComplex value;
+  solvers->At(solution_index)->
+        GetField(luaL_checknumber(L, 1), luaL_checknumber(L, 2), &value);
+  lua_pushnumber(L, value.real());
+  lua_pushnumber(L, value.imag());
+  return 2;
+}
+
+int LuaSolverGetFieldPoynting(lua_State *L, Solvers *solvers,
+                              int solution_index) {
+  if (lua_gettop(L) != 2) {
+    LuaError(L, "Usage: _GetFieldPoynting(x,y)");
+  }
+  vector<JetNum> x, y;
+  if (ToJetNumVectors(L, &x, &y)) {
+    vector<JetNum> px(x.size(), JetNum(0)), py(x.size(), JetNum(0));
+    if (solvers->Valid()) {
+      vector<JetPoint> poynting;
+      solvers->At(solution_index)->GetFieldPoynting(x, y, &poynting);
+      for (int i = 0; i < poynting.size(); i++) {
+        px[i] = poynting[i][0];
+        py[i] = poynting[i][1];
+      }
+    }
+    LuaPushVector(L, px);
+    LuaPushVector(L, py);
+    return 2;
+  }
+  if (!solvers->Valid()) {
+    lua_pushnumber(L, 0);
+    lua_pushnumber(L, 0);
+    return 2;
+  }
+  JetPoint poynting;
+  solvers->At(solution_index)->
+    GetFieldPoynting(luaL_checknumber(L, 1), luaL_checknumber(L, 2), &poynting);
+  lua_pushnumber(L, poynting[0]);
+  lua_pushnumber(L, poynting[1]);
+  return 2;
+}
+
+int LuaSolverPattern(lua_State *L, Solvers *solvers, int solution_index) {
+  if (lua_gettop(L) != 1) {
+    LuaError(L, "Usage: _Pattern(theta)");
+  }
+  JetNum theta = luaL_checknumber(L, 1) * M_PI / 180.0;         // To radians
+  // Scripts usually look up the pattern at every frequency, so compute the
+  // patterns for all frequencies together.
+  JetNum value;
+  if (solvers->Valid() && solvers->ComputeAntennaPatterns() &&
+      solvers->At(solution_index)->LookupAntennaPattern(theta, &value)) {
+    lua_pushnumber(L, sqr(abs(value)));
+  } else {
+    lua_pushnumber(L, 0);
+  }
+  return 1;
+}
+
+int LuaSolverDirectivity(lua_State *L, Solvers *solvers, int solution_index) {
+  if (lua_gettop(L) != 0) {
+    LuaError(L, "Usage: _Directivity()");
+  }
+  if (!solvers->Valid()) {
+    lua_pushnumber(L, 0);
+  } else {
+    lua_pushnumber(L, solvers->At(solution_index)->
+                      ComputeAntennaDirectivity());
+  }
+  return 1;
+}
+
+int LuaSolverSolveAll(lua_State *L, Solvers *solvers) {
+  if (lua_gettop(L) != 0) {
+    LuaError(L, "Usage: _SolveAll()");
+  }
+  if (solvers->Solve()) {
+    // Ignore result.
+  }
+  return 0;
+}
+
+int LuaSolverSelect(lua_State *L, const ScriptConfig &config,
+                    int *solution_index) {
+  if (lua_gettop(L) != 1) {
+    LuaError(L, "Usage: _Select(n)");
+  }
+  int n = ToDouble(lua_tonumber(L, 1));
+  if (n < 1 || n > config.frequencies.size()) {
+    LuaError(L, "Usage: _Select(n), invalid n");
+  }
+  *solution_index = n - 1;
+  return 0;
+}
+
+bool LuaSolverPushPortPowerAndPhase(lua_State *L, Solvers *solvers,
+                                    int solution_index) {
+  vector<JetComplex> port_powers;
+  if (!solvers->Valid() ||
+      !solvers->At(solution_index)->ComputePortOutgoingPower(&port_powers)) {
+    LuaRawGetGlobal(L, "__ZeroTable__");
+    LuaRawGetGlobal(L, "__ZeroTable__");
+    return false;
+  }
+  lua_newtable(L);
+  for (int i = 0; i < port_powers.size(); i++) {
+    lua_pushnumber(L, abs(port_powers[i]));
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_newtable(L);
+  for (int i = 0; i < port_powers.size(); i++) {
+    lua_pushnumber(L, arg(port_powers[i]));
+    lua_rawseti(L, -2, i + 1);
+  }
+  return true;
+}
+
 //***************************************************************************
 // Testing.
 
@@ -1733,21 +2524,26 @@ TEST_FUNCTION(InterpolateTriangle) {
   }
 }
 
+// Set up a short section of WR-12 waveguide, 500 by 120 mils, excited from
+// port 1 at the left end with port 2 at the right end. The caller adds the
+// frequencies.
+static void WR12Waveguide(double mesh_edge_length, Shape *s,
+                          ScriptConfig *config) {
+  s->SetRectangle(0, 0, 500, 120);
+  CHECK(s->AssignPort(0, 3, EdgeKind(1)));      // Edge 3 has port number 1
+  CHECK(s->AssignPort(0, 1, EdgeKind(2)));      // Edge 1 has port number 2
+  config->type = ScriptConfig::EZ;
+  config->unit = 2.54e-5;
+  config->mesh_edge_length = mesh_edge_length;
+  config->port_excitation.resize(2);
+  config->port_excitation[0] = 1;
+}
+
 TEST_FUNCTION(GetField_and_Friends) {
   // Create a simple simulation: a short section of WR-12 waveguide at 70 GHz.
   Shape s;
-  s.AddPoint(0, 0);
-  s.AddPoint(500, 0);
-  s.AddPoint(500, 120);
-  s.AddPoint(0, 120);
-  CHECK(s.AssignPort(0, 3, EdgeKind(1)));       // Edge 3 has port number 1
-  CHECK(s.AssignPort(0, 1, EdgeKind(2)));       // Edge 1 has port number 2
   ScriptConfig config;
-  config.type = ScriptConfig::EZ;
-  config.unit = 2.54e-5;
-  config.mesh_edge_length = 10;
-  config.port_excitation.resize(2);
-  config.port_excitation[0] = 1;
+  WR12Waveguide(10, &s, &config);
   config.frequencies.push_back(70e9);
 
   // Solve.
@@ -1795,3 +2591,630 @@ TEST_FUNCTION(GetField_and_Friends) {
   CHECK(max_perror_x < 120);    //@@@ Can tighten up these limits if
   CHECK(max_perror_y < 120);    //    GetFieldPoynting() uses smoother gradient
 }
+
+TEST_FUNCTION(GetFieldBatch) {
+  // Check that the batch versions of GetField() etc give the same results as
+  // the single point versions, and compare their speed. The waveguide length
+  // has a derivative so that the derivatives are compared too.
+  Shape s;
+  ScriptConfig config;
+  WR12Waveguide(2, &s, &config);
+  JetNum scale = 1;
+  scale.Derivative(0) = 1;
+  s.Scale(scale, 1);
+  config.frequencies.push_back(70e9);
+  Solver solver(s, config, NULL, 0);
+
+  // Points along lines across the waveguide, plus some outside it.
+  const int kNumPoints = 100000;
+  vector<JetNum> x(kNumPoints), y(kNumPoints);
+  for (int i = 0; i < kNumPoints; i++) {
+    x[i] = 10 + (i / 1000) * 4.9 + RandDouble() * 1e-3;
+    y[i] = (i % 1000) * 0.13 - 1;
+  }
+  JetComplex value;
+  solver.GetField(0, 0, &value);        // Solve outside the timed code
+  vector<JetComplex> value1(kNumPoints), dx1(kNumPoints), dy1(kNumPoints);
+  vector<JetPoint> poynting1(kNumPoints);
+  double start_time = Now();
+  for (int i = 0; i < kNumPoints; i++) {
+    solver.GetField(x[i], y[i], &value1[i]);
+    solver.GetFieldGradient(x[i], y[i], &dx1[i], &dy1[i]);
+    solver.GetFieldPoynting(x[i], y[i], &poynting1[i]);
+  }
+  double single_time = Now() - start_time;
+  vector<JetComplex> value2, dx2, dy2;
+  vector<JetPoint> poynting2;
+  start_time = Now();
+  solver.GetField(x, y, &value2);
+  solver.GetFieldGradient(x, y, &dx2, &dy2);
+  solver.GetFieldPoynting(x, y, &poynting2);
+  double batch_time = Now() - start_time;
+  printf("%d points: single point functions take %.3fms, batch functions "
+         "take %.3fms\n", kNumPoints, single_time * 1e3, batch_time * 1e3);
+
+  CHECK(value2.size() == kNumPoints && dx2.size() == kNumPoints &&
+        dy2.size() == kNumPoints && poynting2.size() == kNumPoints);
+  // Compare the values and all derivatives.
+  auto same = [](JetNum a, JetNum b) {
+    const double tolerance = 1e-9 * std::max(1.0, fabs(ToDouble(a)));
+    if (fabs(ToDouble(a - b)) > tolerance) {
+      return false;
+    }
+    for (int k = 0; k < kJetWidth; k++) {
+      if (fabs(a.Derivative(k) - b.Derivative(k)) > tolerance) {
+        return false;
+      }
+    }
+    return true;
+  };
+  auto same_complex = [&](const JetComplex &a, const JetComplex &b) {
+    return same(a.real(), b.real()) && same(a.imag(), b.imag());
+  };
+  for (int i = 0; i < kNumPoints; i++) {
+    CHECK(same_complex(value1[i], value2[i]));
+    CHECK(same_complex(dx1[i], dx2[i]));
+    CHECK(same_complex(dy1[i], dy2[i]));
+    CHECK(same(poynting1[i][0], poynting2[i][0]));
+    CHECK(same(poynting1[i][1], poynting2[i][1]));
+  }
+}
+
+TEST_FUNCTION(SharedAnalysisBenchmark) {
+  // A wideband run of a section of WR-12 waveguide. Solve all frequencies one
+  // at a time, each with its own symbolic analysis of the system matrix,
+  // reporting the analyze/factorize/solve split for each frequency. Then solve
+  // them with Solvers::Solve(), which shares the symbolic analysis of the
+  // first frequency with the others, and check that the solutions agree.
+  Shape s;
+  ScriptConfig config;
+  WR12Waveguide(4, &s, &config);
+  const int kNumFrequencies = 8;
+  for (int i = 0; i < kNumFrequencies; i++) {
+    config.frequencies.push_back(60e9 + i * 30e9 / (kNumFrequencies - 1));
+  }
+  Solvers separate, shared;
+  for (Solvers *solvers : {&separate, &shared}) {
+    solvers->PushBack(new Solver(s, config, NULL, 0));
+    for (int i = 1; i < kNumFrequencies; i++) {
+      solvers->PushBack(new Solver(solvers->First(), i));
+    }
+  }
+  printf("%d mesh points\n", int(separate.First()->points().size()));
+
+  double separate_time = 0;
+  for (int i = 0; i < kNumFrequencies; i++) {
+    TraceStart();
+    double start_time = Now();
+    CHECK(separate.At(i)->Solution());
+    double time = Now() - start_time;
+    std::string report;
+    TraceReport(&report);
+    printf("Frequency %d (%.3f GHz) took %.3fms. %s", i,
+           separate.At(i)->Frequency() / 1e9, time * 1e3, report.c_str());
+    separate_time += time;
+  }
+  TraceStart();
+  double start_time = Now();
+  CHECK(shared.Solve());
+  double shared_time = Now() - start_time;
+  std::string report;
+  TraceReport(&report);
+  printf("Shared analysis: %s", report.c_str());
+  printf("Total time: %.3fms one at a time, %.3fms by Solvers::Solve()\n",
+         separate_time * 1e3, shared_time * 1e3);
+
+  // Check that the shared analysis gives the same solutions.
+  for (int i = 0; i < kNumFrequencies; i++) {
+    const VectorXcd &solution1 = *separate.At(i)->Solution();
+    const VectorXcd &solution2 = *shared.At(i)->Solution();
+    double error = (solution1 - solution2).norm() / solution1.norm();
+    CHECK(error < 1e-9);
+  }
+}
+
+TEST_FUNCTION(HelmholtzIterativeSolver) {
+  // Solve a section of WR-12 waveguide with the direct and iterative solvers
+  // and check that they agree.
+  Shape s;
+  ScriptConfig config;
+  WR12Waveguide(4, &s, &config);
+  config.frequencies.push_back(60e9);
+  config.frequencies.push_back(90e9);
+
+  Eigen::VectorXcd solutions[2][2];
+  for (int iterative = 0; iterative < 2; iterative++) {
+    config.solver = iterative ? ScriptConfig::ITERATIVE : ScriptConfig::DIRECT;
+    for (int i = 0; i < config.frequencies.size(); i++) {
+      Solver solver(s, config, NULL, i);
+      double start_time = Now();
+      const VectorXcd *solution = solver.Solution();
+      CHECK(solution);
+      printf("%s solver at %.3f GHz took %.3fms\n",
+             iterative ? "Iterative" : "Direct", solver.Frequency() / 1e9,
+             (Now() - start_time) * 1e3);
+      int iterations;
+      double residual;
+      CHECK(solver.IterativeSolveStatistics(&iterations, &residual) ==
+            bool(iterative));
+      if (iterative) {
+        // The preconditioner should be a real approximation, not an exact LU
+        // factorization that solves the system in a single iteration.
+        printf("Iterations = %d, relative residual = %e\n", iterations,
+               residual);
+        CHECK(iterations > 1);
+        CHECK(residual < 1e-8);
+      }
+      solutions[iterative][i] = *solution;
+    }
+  }
+  for (int i = 0; i < config.frequencies.size(); i++) {
+    double error = (solutions[0][i] - solutions[1][i]).norm() /
+                   solutions[0][i].norm();
+    printf("Relative error at frequency %d = %e\n", i, error);
+    CHECK(error < 1e-6);
+  }
+}
+
+TEST_FUNCTION(BatchedDerivativeBenchmark) {
+  // The solution derivatives for all kJetWidth lanes are computed together in
+  // one batched solve. Compare that with computing the derivatives of each
+  // parameter in a separate solver, one at a time, and check that they agree.
+  // The parameters scale the waveguide in x and move it in x and y. Scaling in
+  // y would change the port lengths, which can not have derivatives.
+  const int kNumParameters = 3;
+  auto derivatives = [](const int lanes[kNumParameters], double *time,
+                        vector<JetComplex> *solution) {
+    Shape s;
+    ScriptConfig config;
+    WR12Waveguide(4, &s, &config);
+    config.frequencies.push_back(60e9);
+    JetNum p[kNumParameters] = {1, 0, 0};
+    for (int i = 0; i < kNumParameters; i++) {
+      if (lanes[i] >= 0) {
+        p[i].Derivative(lanes[i]) = 1;
+      }
+    }
+    s.Scale(p[0], 1);
+    s.Offset(p[1], p[2]);
+    Solver solver(s, config, NULL, 0);
+    CHECK(solver.Solution());           // Solve outside the timed code
+    double start_time = Now();
+    CHECK(solver.SolutionWithDerivatives(solution));
+    *time += Now() - start_time;
+  };
+
+  int lanes[kNumParameters];
+  for (int i = 0; i < kNumParameters; i++) {
+    lanes[i] = i % kJetWidth;
+  }
+  double batched_time = 0, single_time = 0;
+  vector<vector<JetComplex>> single(kNumParameters);
+  for (int i = 0; i < kNumParameters; i++) {
+    int one_lane[kNumParameters] = {-1, -1, -1};
+    one_lane[i] = 0;
+    derivatives(one_lane, &single_time, &single[i]);
+  }
+  vector<JetComplex> batched;
+  derivatives(lanes, &batched_time, &batched);
+  for (int i = 0; i < kNumParameters; i++) {
+    CHECK(single[i].size() == batched.size());
+  }
+  printf("%d points, %d parameters: %.3fms one at a time, %.3fms batched\n",
+         int(batched.size()), kNumParameters, single_time * 1e3,
+         batched_time * 1e3);
+
+  double max_derivative = 0, max_error = 0;
+  for (int j = 0; j < batched.size(); j++) {
+    for (int k = 0; k < kJetWidth; k++) {
+      Complex expected = 0;
+      for (int i = 0; i < kNumParameters; i++) {
+        if (lanes[i] == k) {
+          expected += Complex(single[i][j].real().Derivative(),
+                              single[i][j].imag().Derivative());
+        }
+      }
+      Complex got(batched[j].real().Derivative(k),
+                  batched[j].imag().Derivative(k));
+      max_derivative = std::max(max_derivative, abs(expected));
+      max_error = std::max(max_error, abs(got - expected));
+    }
+  }
+  printf("Relative error = %e\n", max_error / max_derivative);
+  CHECK(max_derivative > 0);
+  CHECK(max_error <= 1e-9 * max_derivative);
+}
+
+TEST_FUNCTION(JetLanes) {
+  // Give each of several shape parameters a derivative in one of the kJetWidth
+  // JetNum lanes and check that each lane of the port powers is the sum of the
+  // derivatives of the parameters in that lane, computed one at a time.
+  const int kNumParameters = 3;
+  const double values[kNumParameters] = {300, 20, 120};
+  auto port_powers = [&](const int lanes[kNumParameters],
+                         vector<JetComplex> *powers) {
+    JetNum p[kNumParameters];
+    for (int i = 0; i < kNumParameters; i++) {
+      p[i] = values[i];
+      if (lanes[i] >= 0) {
+        p[i].Derivative(lanes[i]) = 1;
+      }
+    }
+    Shape s;
+    s.AddPoint(0, 0);
+    s.AddPoint(p[0], 0);
+    s.AddPoint(p[0], 100);
+    s.AddPoint(p[1], p[2]);             // Top corner
+    s.AddPoint(0, 96);
+    CHECK(s.AssignPort(0, 4, EdgeKind(1)));
+    CHECK(s.AssignPort(0, 1, EdgeKind(2)));
+    ScriptConfig config;
+    config.type = ScriptConfig::EZ;
+    config.unit = 2.54e-5;
+    config.mesh_edge_length = 10;
+    config.port_excitation.resize(2);
+    config.port_excitation[0] = 1;
+    config.frequencies.push_back(60e9);
+    Solver solver(s, config, NULL, 0);
+    CHECK(solver.ComputePortOutgoingPower(powers));
+  };
+
+  int lanes[kNumParameters];
+  for (int i = 0; i < kNumParameters; i++) {
+    lanes[i] = i % kJetWidth;
+  }
+  vector<JetComplex> combined;
+  port_powers(lanes, &combined);
+  vector<vector<JetComplex>> single(kNumParameters);
+  for (int i = 0; i < kNumParameters; i++) {
+    int one_lane[kNumParameters] = {-1, -1, -1};
+    one_lane[i] = 0;
+    port_powers(one_lane, &single[i]);
+    CHECK(single[i].size() == combined.size());
+  }
+  for (int j = 0; j < combined.size(); j++) {
+    for (int k = 0; k < kJetWidth; k++) {
+      Complex expected = 0;
+      for (int i = 0; i < kNumParameters; i++) {
+        if (lanes[i] == k) {
+          expected += Complex(single[i][j].real().Derivative(),
+                              single[i][j].imag().Derivative());
+        }
+      }
+      Complex got(combined[j].real().Derivative(k),
+                  combined[j].imag().Derivative(k));
+      printf("Port %d lane %d: d/dp = %g%+gi, expecting %g%+gi\n", j, k,
+             got.real(), got.imag(), expected.real(), expected.imag());
+      CHECK(abs(got - expected) <= 1e-9 * abs(expected) + 1e-12);
+    }
+  }
+}
+
+TEST_FUNCTION(FastSweepBenchmark) {
+  // Sweep a section of WR-12 waveguide with a post in it, solving all
+  // frequencies in full and with the reduced order model, and compare the
+  // port powers.
+  Shape s, post;
+  ScriptConfig config;
+  WR12Waveguide(8, &s, &config);
+  post.AddPoint(240, 40);
+  post.AddPoint(260, 40);
+  post.AddPoint(260, 60);
+  post.AddPoint(240, 60);
+  s.SetDifference(s, post);
+  const int kNumFrequencies = 41;
+  for (int i = 0; i < kNumFrequencies; i++) {
+    config.frequencies.push_back(60e9 + i * 30e9 / (kNumFrequencies - 1));
+  }
+
+  vector<vector<JetComplex>> power[2];
+  for (int fast = 0; fast < 2; fast++) {
+    config.fast_sweep = fast ? 8 : 0;
+    Solvers solvers;
+    solvers.PushBack(new Solver(s, config, NULL, 0));
+    for (int i = 1; i < kNumFrequencies; i++) {
+      solvers.PushBack(new Solver(solvers.First(), i));
+    }
+    double start_time = Now();
+    CHECK(solvers.Solve());
+    double time = Now() - start_time;
+    printf("%s sweep of %d frequencies took %.3fms\n", fast ? "Fast" : "Full",
+           kNumFrequencies, time * 1e3);
+    for (int i = 0; i < kNumFrequencies; i++) {
+      power[fast].push_back(vector<JetComplex>());
+      CHECK(solvers.At(i)->ComputePortOutgoingPower(&power[fast].back()));
+    }
+  }
+  double max_error = 0;
+  for (int i = 0; i < kNumFrequencies; i++) {
+    CHECK(power[0][i].size() == power[1][i].size());
+    for (int j = 0; j < power[0][i].size(); j++) {
+      max_error = std::max(max_error,
+                           ToDouble(abs(power[0][i][j] - power[1][i][j])));
+    }
+  }
+  printf("Max port power error = %e\n", max_error);
+  CHECK(max_error < 1e-3);
+}
+
+TEST_FUNCTION(SameAsBenchmark) {
+  // Check if a wideband model is unchanged, as is done for every rerun of a
+  // script, comparing the shape and config with each frequency's solver in
+  // full and by hash.
+  ScriptConfig config;
+  auto make_shape = [&config]() {
+    Shape s, hole;
+    WR12Waveguide(20, &s, &config);
+    hole.SetCircle(250, 60, 30, 2000);
+    s.SetDifference(s, hole);
+    return s;
+  };
+  Shape s = make_shape();
+  const int kNumFrequencies = 200;
+  for (int i = 0; i < kNumFrequencies; i++) {
+    config.frequencies.push_back(60e9 + i * 30e9 / (kNumFrequencies - 1));
+  }
+  Solvers solvers;
+  solvers.PushBack(new Solver(s, config, NULL, 0));
+  for (int i = 1; i < kNumFrequencies; i++) {
+    solvers.PushBack(new Solver(solvers.First(), i));
+  }
+
+  // Each rerun of the script creates a new shape with no cached hash. The
+  // full comparison is with a copy of the shape and config for each
+  // frequency, as each solver keeps its own.
+  vector<Shape> shapes(kNumFrequencies, s);
+  vector<ScriptConfig> configs(kNumFrequencies, config);
+  const int kNumReruns = 20;
+  double full_time = 0, hash_time = 0;
+  for (int i = 0; i < kNumReruns; i++) {
+    Shape t = make_shape();
+    double start_time = Now();
+    for (int j = 0; j < kNumFrequencies; j++) {
+      CHECK(t == shapes[j] && config == configs[j]);
+    }
+    full_time += Now() - start_time;
+    start_time = Now();
+    CHECK(solvers.SameAs(t, config, NULL));
+    hash_time += Now() - start_time;
+  }
+  printf("%d frequencies, per rerun: %.3fms full comparison, %.3fms by hash\n",
+         kNumFrequencies, full_time / kNumReruns * 1e3,
+         hash_time / kNumReruns * 1e3);
+
+  // Changes to the shape or config are detected.
+  Shape t = make_shape();
+  t.Offset(1e-9, 0);
+  CHECK(!solvers.SameAs(t, config, NULL));
+  ScriptConfig c = config;
+  c.frequencies.back() += 1;
+  CHECK(!solvers.SameAs(make_shape(), c, NULL));
+}
+
+TEST_FUNCTION(AntennaPatternBenchmark) {
+  // Compare antenna patterns with the direct evaluation of every radiator at
+  // every angle, which is how they used to be computed.
+  Shape s;
+  ScriptConfig config;
+  WR12Waveguide(5, &s, &config);
+  JetNum scale = 1;
+  scale.Derivative(kJetWidth - 1) = 1;
+  s.Scale(scale, 1);
+  config.antenna_pattern = ScriptConfig::AT_BOUNDARY;
+  config.boresight = 30;
+  const int kNumFrequencies = 8;
+  for (int i = 0; i < kNumFrequencies; i++) {
+    config.frequencies.push_back(60e9 + i * 10e9);
+  }
+  Solvers solvers;
+  solvers.PushBack(new Solver(s, config, NULL, 0));
+  for (int i = 1; i < kNumFrequencies; i++) {
+    solvers.PushBack(new Solver(solvers.First(), i));
+  }
+  CHECK(solvers.Solve());
+
+  auto direct = [&config](Solver *solver, vector<JetComplex> *field) {
+    vector<JetComplex> solution;
+    CHECK(solver->SolutionWithDerivatives(&solution));
+    const vector<RPoint> &points = solver->points();
+    const double k = 2.0 * M_PI * solver->Frequency() / kSpeedOfLight;
+    const double unit = config.unit;
+    const double boresight = config.boresight * M_PI / 180.0;
+    field->clear();
+    field->resize(kFarFieldPoints);
+    int radiator_count = 0;
+    for (BoundaryIterator it(solver); !it.done(); ++it) {
+      radiator_count++;
+      JetPoint p1 = points[it.pindex1()].p * unit;
+      JetPoint p2 = points[it.pindex2()].p * unit;
+      JetPoint p3 = points[it.pindex3()].p * unit;
+      JetPoint center = (p1 + p2 + p3) / 3.0;
+      JetComplex z1 = solution[it.pindex1()];
+      JetComplex z2 = solution[it.pindex2()];
+      JetComplex z3 = solution[it.pindex3()];
+      JetComplex z = (z1 + z2 + z3) / JetComplex(3.0);
+      JetComplex gradX, gradY;
+      TriangleGradient(p1, p2, p3, z1, z2, z3, &gradX, &gradY);
+      JetPoint normal(p1[1] - p2[1], p2[0] - p1[0]);
+      normal.normalize();
+      if (normal.dot(p3 - p1) > 0) {
+        normal *= -1;
+      }
+      JetNum nangle = atan2(normal[1], normal[0]);
+      for (int i = 0; i < kFarFieldPoints; i++) {
+        double azimuth = (2.0 * M_PI * double(i)) / kFarFieldPoints - M_PI;
+        double phi = -azimuth + boresight;
+        (*field)[i] += (k*cos(phi - nangle)*z +
+                JetComplex(0,1) * (sin(nangle)*gradY + cos(nangle)*gradX)) *
+          exp(JetComplex(0, k * (center[0] * cos(phi) + center[1] * sin(phi))));
+      }
+    }
+    for (int i = 0; i < kFarFieldPoints; i++) {
+      (*field)[i] /= double(radiator_count);
+    }
+  };
+
+  double direct_time = 0, pattern_time = 0;
+  for (int i = 0; i < kNumFrequencies; i++) {
+    Solver *solver = solvers.At(i);
+    vector<JetComplex> expected;
+    double start_time = Now();
+    direct(solver, &expected);
+    direct_time += Now() - start_time;
+    start_time = Now();
+    CHECK(solver->ComputeAntennaPattern());
+    pattern_time += Now() - start_time;
+    const vector<JetComplex> &field = solver->AntennaField();
+    CHECK(field.size() == expected.size());
+    double max_field = 0, max_error = 0;
+    double max_derivative = 0, max_derivative_error = 0;
+    for (int j = 0; j < field.size(); j++) {
+      max_field = std::max(max_field, abs(ToComplex(expected[j])));
+      max_error = std::max(max_error,
+                           abs(ToComplex(field[j] - expected[j])));
+      for (int k = 0; k < kJetWidth; k++) {
+        Complex d(expected[j].real().Derivative(k),
+                  expected[j].imag().Derivative(k));
+        Complex e(field[j].real().Derivative(k) - d.real(),
+                  field[j].imag().Derivative(k) - d.imag());
+        max_derivative = std::max(max_derivative, abs(d));
+        max_derivative_error = std::max(max_derivative_error, abs(e));
+      }
+    }
+    CHECK(max_field > 0 && max_derivative > 0);
+    CHECK(max_error <= 1e-9 * max_field);
+    CHECK(max_derivative_error <= 1e-9 * max_derivative);
+  }
+  printf("Antenna pattern for %d frequencies: %.3fms direct, %.3fms now\n",
+         kNumFrequencies, direct_time * 1e3, pattern_time * 1e3);
+
+  // Updating the derivatives discards the stored patterns.
+  CHECK(solvers.UpdateDerivatives(s));
+  CHECK(solvers.At(0)->AntennaField().empty());
+  double start_time = Now();
+  CHECK(solvers.ComputeAntennaPatterns());
+  printf("Antenna patterns for all frequencies together: %.3fms\n",
+         (Now() - start_time) * 1e3);
+  for (int i = 0; i < kNumFrequencies; i++) {
+    CHECK(solvers.At(i)->AntennaAzimuth().size() == kFarFieldPoints);
+    CHECK(solvers.At(i)->AntennaField().size() == kFarFieldPoints);
+  }
+}
+
+TEST_FUNCTION(WidebandPulse) {
+  // Animate a wideband pulse and compare the fields and gradients combined
+  // from the bases with the direct sum of all solutions. There are more
+  // frequencies than the initial basis size, so the basis grows.
+  Shape s, hole;
+  ScriptConfig config;
+  WR12Waveguide(10, &s, &config);
+  hole.SetCircle(250, 60, 30, 100);
+  s.SetDifference(s, hole);
+  config.wideband_window = ScriptConfig::HAMMING;
+  const int kNumFrequencies = 20;
+  for (int i = 0; i < kNumFrequencies; i++) {
+    config.frequencies.push_back(60e9 + i * 30e9 / (kNumFrequencies - 1));
+  }
+  Solvers solvers;
+  solvers.PushBack(new Solver(s, config, NULL, 0));
+  for (int i = 1; i < kNumFrequencies; i++) {
+    solvers.PushBack(new Solver(solvers.First(), i));
+  }
+  CHECK(solvers.Solve());
+
+  const int kNumFrames = 4;
+  VectorXcd f;
+  Eigen::MatrixXcd g;
+  for (int frame = 0; frame < kNumFrames; frame++) {
+    double phase_offset = 2.0 * M_PI * frame / kNumFrames;
+    vector<Complex> phasors;
+    solvers.Phasors(phase_offset, &phasors);
+    solvers.CombinedField(&f, phase_offset);
+    CHECK(solvers.CombinedSpatialGradient(&g, phase_offset));
+    VectorXcd expected_f = VectorXcd::Zero(f.size());
+    Eigen::MatrixXcd expected_g = Eigen::MatrixXcd::Zero(g.rows(), g.cols());
+    for (int i = 0; i < kNumFrequencies; i++) {
+      expected_f += *solvers.At(i)->Solution() * phasors[i];
+      expected_g += *solvers.At(i)->SpatialGradient() * phasors[i];
+    }
+    double f_error = (f - expected_f).cwiseAbs().maxCoeff();
+    double g_error = (g - expected_g).cwiseAbs().maxCoeff();
+    printf("Frame %d: field error %g, gradient error %g\n", frame,
+           f_error / expected_f.cwiseAbs().maxCoeff(),
+           g_error / expected_g.cwiseAbs().maxCoeff());
+    CHECK(f_error <= 1e-6 * expected_f.cwiseAbs().maxCoeff());
+    CHECK(g_error <= 1e-6 * expected_g.cwiseAbs().maxCoeff());
+  }
+}
+
+// Check Solver::ComputeDrawValues() for the DRAW_REAL mode, which is what is
+// animated, on a WR-12 waveguide mesh. If 'timing' is true then also compare
+// the time per frame with how it used to be done: building position and color
+// arrays with three vertices per triangle.
+static void CheckDrawPreparation(double edge_length, bool timing) {
+  const int kNumColors = 256;
+  float rgb[kNumColors][3];
+  for (int i = 0; i < kNumColors; i++) {
+    ColorMap::Jet(float(i) / (kNumColors - 1), rgb[i]);
+  }
+  Shape s;
+  ScriptConfig config;
+  WR12Waveguide(edge_length, &s, &config);
+  config.frequencies.push_back(60e9);
+  Solver solver(s, config, NULL, 0);
+  CHECK(solver.Solution());
+  const vector<RPoint> &points = solver.points();
+  const vector<Triangle> &triangles = solver.triangles();
+  const int kNumFrames = 10;
+  const double scale = 1;
+  double old_time = 0, new_time = 0;
+  for (int frame = 0; frame < kNumFrames; frame++) {
+    double phase_offset = 2.0 * M_PI * frame / kNumFrames;
+    Complex phasor = exp(Complex(0, phase_offset));
+    const VectorXcd &solution = *solver.Solution();
+    if (timing) {
+      double start_time = Now();
+      vector<Vector3f> positions, colors;
+      for (int i = 0; i < triangles.size(); i++) {
+        for (int j = 0; j < 3; j++) {
+          int k = triangles[i].index[j];
+          double value = phasor.real() * solution[k].real() -
+                         phasor.imag() * solution[k].imag();
+          int c = std::max(0, std::min(kNumColors - 1,
+              int(round((value + scale) * (kNumColors / (2 * scale))))));
+          colors.push_back(Vector3f(rgb[c][0], rgb[c][1], rgb[c][2]));
+          positions.push_back(Vector3f(ToDouble(points[k].p[0]),
+                                       ToDouble(points[k].p[1]), 0));
+        }
+      }
+      old_time += Now() - start_time;
+    }
+
+    double start_time = Now();
+    vector<float> values;
+    CHECK(solver.ComputeDrawValues(Solver::DRAW_REAL, phase_offset, NULL,
+                                   &values));
+    new_time += Now() - start_time;
+    CHECK(values.size() == points.size());
+    for (int i = 0; i < values.size(); i++) {
+      CHECK(fabs(values[i] - (solution[i] * phasor).real()) <= 1e-6);
+    }
+  }
+  if (timing) {
+    printf("%7d triangles: %8.3fms per frame before, %8.3fms now\n",
+           int(triangles.size()), old_time / kNumFrames * 1e3,
+           new_time / kNumFrames * 1e3);
+  }
+}
+
+TEST_FUNCTION(DrawPreparation) {
+  for (double edge_length = 16; edge_length >= 8; edge_length /= 2) {
+    CheckDrawPreparation(edge_length, false);
+  }
+}
+
+MANUAL_TEST_FUNCTION(DrawPreparationBenchmark) {
+  for (double edge_length = 16; edge_length >= 1; edge_length /= 2) {
+    CheckDrawPreparation(edge_length, true);
+  }
+}
@@ -48,8 +48,7 @@ struct ScriptConfig {
     ELECTROSTATICS,             // Electrodynamic low f, E field in XY direction
     TE,                         // Waveguide TE modes
     TM,                         // Waveguide TM modes
-    // Returned by StringToType but changed to EZ in
-    // Cavity::SetConfigFromTable():
+    // Returned by StringToType but changed to EZ in SetFromTable():
     SCHRODINGER,
   };
 
@@ -59,6 +58,9 @@ struct ScriptConfig {
   // Values for antenna_pattern.
   enum AntennaPattern { AT_ABC, AT_FF_MATERIAL, AT_BOUNDARY };
 
+  // Values for solver.
+  enum LinearSolver { DIRECT, ITERATIVE };
+
   Type type;                    // Cavity type: EZ, EXY etc.
   bool schrodinger;             // EZ cavities for Schrodinger simulation
   double unit;                  // One script-distance-unit is this many meters
@@ -72,6 +74,10 @@ struct ScriptConfig {
   Window wideband_window;       // A WINDOW_nnn constant
   double dxf_arc_dist;          // For DXF export
   double dxf_arc_angle;         // For DXF export
+  LinearSolver solver;          // How electrodynamic systems are solved
+  int fast_sweep;               // Number of full solves in a sweep, or 0
+  bool incremental_mesh;        // Remesh incrementally from previous mesh
+  bool morph_mesh;              // Morph previous mesh for small changes
 
   ScriptConfig() {
     type = UNKNOWN;
@@ -85,6 +91,10 @@ struct ScriptConfig {
     wideband_window = RECTANGLE;
     dxf_arc_dist = 0;
     dxf_arc_angle = 0;
+    solver = DIRECT;
+    fast_sweep = 0;
+    incremental_mesh = false;
+    morph_mesh = false;
   }
 
   bool operator==(const ScriptConfig &c) const {
@@ -100,13 +110,25 @@ struct ScriptConfig {
         && max_modes        == c.max_modes
         && wideband_window  == c.wideband_window
         && dxf_arc_dist     == c.dxf_arc_dist
-        && dxf_arc_angle    == c.dxf_arc_angle;
+        && dxf_arc_angle    == c.dxf_arc_angle
+        && solver           == c.solver
+        && fast_sweep       == c.fast_sweep
+        && incremental_mesh == c.incremental_mesh
+        && morph_mesh       == c.morph_mesh;
   }
   bool operator!=(const ScriptConfig &c) const { return !operator==(c); }
 
+  // Return a hash of everything that operator==() compares, so that configs
+  // with equal hashes are equal (with overwhelming probability).
+  std::string Hash() const;
+
   // Convert a cavity type name into a type constant, or UNKNOWN if none.
   static Type StringToType(const char *name);
 
+  // Set all values from the script's config table, which is at the top of the
+  // Lua stack. Emit lua errors for bad values.
+  void SetFromTable(Lua *lua);
+
   // Convenience functions to test the type. Note that electrostatics is
   // regarded as electrodynamics with very low frequency, so that we can easily
   // reuse the computational machinery of electrodynamics.
@@ -135,9 +157,10 @@ class Solver : public Mesh {
   // The constructor creates the mesh for the shape and computes some auxiliary
   // data but does not yet compute the full solution. That's done on demand by
   // other functions. If 'lua' is provided the dielectric and port callback
-  // functions can be called.
+  // functions can be called. If config.incremental_mesh or config.morph_mesh
+  // is set and 'previous' is given then the mesh is created from it, see Mesh.
   Solver(const Shape &s, const ScriptConfig &config, Lua *lua,
-         int frequencies_index);
+         int frequencies_index, const Mesh *previous = 0);
   ~Solver();
 
   // This constructor creates a copy of the given solver, but with a different
@@ -148,11 +171,14 @@ class Solver : public Mesh {
   bool IsValid() const;
 
   // Return true if this solver is compatible with (i.e. will compute the same
-  // solution as) another shape and config. This does not consider if any
-  // derivatives are the same. This considers if dielectric and port callback
-  // functions are the same and if the values returned by those functions are
-  // the same.
-  bool SameAs(const Shape &s, const ScriptConfig &config, Lua *lua);
+  // solution as) another shape and config, given by their Hash() values. This
+  // does not consider if any derivatives are the same. This considers if
+  // dielectric and port callback functions are the same and if the values
+  // returned by those functions are the same. The 'callback_key' is
+  // CallbackKey() computed for the current Lua state, or empty if there is
+  // none. Solvers::SameAs() computes all of these just once for all solvers.
+  bool SameAs(const std::string &shape_hash, const std::string &config_hash,
+              const std::string &callback_key, Lua *lua);
 
   // Update the derivatives from the new derivatives of points in 's'. This
   // allows e.g. new field and port derivatives to be computed. The shape 's'
@@ -180,6 +206,34 @@ class Solver : public Mesh {
                     int brightness, double phase_offset, Solvers *solvers,
                     bool in_3D, bool show_mesh);
 
+  // Compute the value at each mesh point that DrawSolution() maps to colors
+  // (or to Z in 3D) for the given draw_mode, which must not be one of the
+  // vector modes. Return false on failure.
+  bool ComputeDrawValues(DrawMode draw_mode, double phase_offset,
+                         Solvers *solvers, vector<float> *values)
+                         MUST_USE_RESULT;
+
+  // The frequency that this solver simulates.
+  double Frequency() const { return frequency_; }
+
+  // Return the solution at each mesh point, computing it on demand, or NULL if
+  // the solve failed. For waveguide mode cavities this is the selected mode.
+  const Eigen::VectorXcd *Solution();
+
+  // Set 'solution' to the solution at each mesh point together with its
+  // derivatives, computing them on demand. Return false on failure.
+  bool SolutionWithDerivatives(vector<JetComplex> *solution) MUST_USE_RESULT;
+
+  // Return the spatial gradient of the solution, computing it on demand, or
+  // NULL on failure. Row i has the x and y derivatives at mesh point i.
+  const Eigen::MatrixXcd *SpatialGradient();
+
+  // If the system was solved with the iterative solver (config.solver is
+  // ITERATIVE) return the number of iterations it took and the relative
+  // residual |A*x-b|/|b| of the solution. Otherwise return false.
+  bool IterativeSolveStatistics(int *iterations, double *residual)
+                                MUST_USE_RESULT;
+
   // Compute the (complex) amplitudes of the outgoing waves at each port by
   // fitting to a TE10 field. Return true on success. This computes the
   // solution on demand. Note that port 1's field is returned in index 0, etc.
@@ -204,18 +258,36 @@ class Solver : public Mesh {
   void GetFieldGradient(JetNum x, JetNum y, JetComplex *dx, JetComplex *dy);
   void GetFieldPoynting(JetNum x, JetNum y, JetPoint *poynting);
 
-  // Compute the radiation pattern at the ABC. Return arrays of azimuth (in
-  // radians) and associated complex field. Field phase is computed relative to
-  // a phase center at the origin. The azimuth angles will be monotonically
-  // increasing and in the range -pi..pi.
-  bool ComputeAntennaPattern(vector<double> *azimuth,
-                             vector<JetComplex> *field) MUST_USE_RESULT;
+  // Versions of the above functions that compute values for all the points
+  // (x[i],y[i]). These are much faster than calling the single point versions
+  // for many points, because the points are located in the mesh together (see
+  // Mesh::FindTriangles) and the values are interpolated by multiple threads.
+  void GetField(const vector<JetNum> &x, const vector<JetNum> &y,
+                vector<JetComplex> *value);
+  void GetFieldGradient(const vector<JetNum> &x, const vector<JetNum> &y,
+                        vector<JetComplex> *dx, vector<JetComplex> *dy);
+  void GetFieldPoynting(const vector<JetNum> &x, const vector<JetNum> &y,
+                        vector<JetPoint> *poynting);
+
+  // Compute the radiation pattern at the ABC and store it in this solver,
+  // unless it is already stored. Return false on failure. AntennaAzimuth()
+  // and AntennaField() return the stored arrays of azimuth (in radians) and
+  // associated complex field. Field phase is computed relative to a phase
+  // center at the origin. The azimuth angles will be monotonically increasing
+  // and in the range -pi..pi.
+  bool ComputeAntennaPattern() MUST_USE_RESULT;
+  const vector<double> &AntennaAzimuth() const { return antenna_azimuth_; }
+  const vector<JetComplex> &AntennaField() const { return antenna_field_; }
 
   // Adjust a previously computed antenna pattern for the given phase center.
   void AdjustAntennaPhaseCenter(JetPoint phase_center,
                                 const vector<double> &azimuth,
                                 vector<JetComplex> *field);
 
+  // Compute the directivity of the antenna pattern (max power / average
+  // power). Return 0 if this can not be computed for some reason.
+  JetNum ComputeAntennaDirectivity();
+
   // Look up the radiation pattern for a particular azimuth 'theta' (in
   // radians). This will interpolate the results computed by
   // ComputeAntennaPattern(). Return false on failure.
@@ -249,6 +321,7 @@ class Solver : public Mesh {
   // separately allocated vector that contains a copy of the eigenvector.
   Shape shape_;
   ScriptConfig config_;
+  std::string config_hash_;             // config_.Hash()
   double frequency_;                    // One of the config.frequencies
   vector<JetNum> port_lengths_;         // Lengths of all ports. Slot 0 unused
   typedef FEM::FEMSolver<HelmholtzFEMProblem> EDSolverType;
@@ -257,8 +330,8 @@ class Solver : public Mesh {
   EDSolverType *ed_solver_;             // Electrodynamics solver
   ModeSolverType *mode_solver_;         // Eigenmode solver
   Eigen::VectorXcd *solver_solution_;   // Solution vector to display
-  vector<double> antenna_azimuth_;      // Cached antenna pattern
-  vector<JetComplex> antenna_field_;    // Cached antenna pattern
+  vector<double> antenna_azimuth_;      // Stored antenna pattern, or empty
+  vector<JetComplex> antenna_field_;    // Stored antenna pattern, or empty
 
   // **********
   // The following variables are computed on demand, and have value (or size) 0
@@ -270,9 +343,10 @@ class Solver : public Mesh {
   // the solve failed (e.g. the system matrix can not be factored).
   bool Solve() MUST_USE_RESULT;
 
-  // The derivative (with respect to a parameter) of the solver solution. This
-  // depends on the solver triplets and rhs.
-  Eigen::VectorXcd solution_derivative_;
+  // The derivatives (with respect to the kJetWidth parameters) of the solver
+  // solution, one column per parameter. This depends on the solver system
+  // matrix and rhs.
+  Eigen::MatrixXcd solution_derivative_;
   // Return false on failure.
   bool ComputeDerivatives() MUST_USE_RESULT;
 
@@ -300,6 +374,20 @@ class Solver : public Mesh {
   // return a JetComplex for point i.
   JetComplex SolutionJet(int i) const;
 
+  // The parts of GetField(), GetFieldGradient() and GetFieldPoynting() that
+  // interpolate within triangle t, which contains the point (x,y) or is -1.
+  // The solution, derivatives and spatial gradient must have been computed.
+  void GetFieldInTriangle(int t, JetNum x, JetNum y, JetComplex *value) const;
+  void GetFieldGradientInTriangle(int t, JetNum x, JetNum y,
+                                  JetComplex *dx, JetComplex *dy) const;
+  void GetFieldPoyntingInTriangle(int t, JetNum x, JetNum y,
+                                  JetPoint *poynting) const;
+
+  // Locate all points (x[i],y[i]) in the mesh for the batch versions of
+  // GetField() etc.
+  void LocatePoints(const vector<JetNum> &x, const vector<JetNum> &y,
+                    vector<int> *triangles);
+
   friend struct HelmholtzFEMProblem;
   friend struct WaveguideModeFEMProblem;
   friend class Solvers;
@@ -314,10 +402,16 @@ class Solver : public Mesh {
 
 class Solvers {
  public:
-  ~Solvers() { Clear(); }
+  ~Solvers() {
+    Clear();
+    delete previous_mesh_;
+  }
 
   int Size() const { return solvers_.size(); }
-  void PushBack(Solver *s) { solvers_.push_back(s); }
+  void PushBack(Solver *s) {
+    solvers_.push_back(s);
+    ClearPulseBasis();
+  }
   bool Valid() const { return !solvers_.empty(); }
   Solver *First() const { return solvers_[0]; }
   Solver *At(int i) const {
@@ -330,12 +424,39 @@ class Solvers {
       delete solvers_[i];
     }
     solvers_.clear();
+    basis_.resize(0, 0);
+    ClearPulseBasis();
+  }
+
+  // Like Clear(), but if the first solver's config has incremental_mesh or
+  // morph_mesh set then keep a copy of its mesh. This is passed to the next
+  // first Solver so that it can be created from the previous mesh.
+  void ClearKeepingMesh() {
+    if (Valid() && (solvers_[0]->config_.incremental_mesh ||
+                    solvers_[0]->config_.morph_mesh) &&
+        solvers_[0]->IsValidMesh()) {
+      delete previous_mesh_;
+      previous_mesh_ = new Mesh(*solvers_[0]);
+    }
+    Clear();
   }
+  const Mesh *PreviousMesh() const { return previous_mesh_; }
 
-  // All solvers must be the SameAs:
+  // All solvers must be the SameAs. The shape, config and callback state are
+  // hashed once here, so each solver only has to compare hashes.
   bool SameAs(const Shape &s, const ScriptConfig &config, Lua *lua) {
+    if (solvers_.empty()) {
+      return true;
+    }
+    std::string config_hash = config.Hash();
+    std::string callback_key;
+    if (lua && !solvers_[0]->CallbackKey(lua, &callback_key)) {
+      callback_key.clear();
+    }
     for (int i = 0; i < solvers_.size(); i++) {
-      if (!solvers_[i]->SameAs(s, config, lua)) return false;
+      if (!solvers_[i]->SameAs(s.Hash(), config_hash, callback_key, lua)) {
+        return false;
+      }
     }
     return true;
   }
@@ -348,13 +469,23 @@ class Solvers {
     return true;
   }
 
-  // Solve all solvers (multi-threaded).
+  // Solve all solvers (multi-threaded). If config.fast_sweep is nonzero then
+  // only that many frequencies are solved in full, see FastSweep().
   bool Solve() MUST_USE_RESULT;
 
   // Update all derivatives (multi-threaded).
   bool UpdateDerivatives(const Shape &s) MUST_USE_RESULT;
 
-  // Combine all solver's fields together into single fields.
+  // Compute the antenna patterns of all solvers (multi-threaded) and store
+  // them in each solver, see Solver::ComputeAntennaPattern(). This is faster
+  // than computing them one frequency at a time. Return false if any pattern
+  // could not be computed.
+  bool ComputeAntennaPatterns() MUST_USE_RESULT;
+
+  // Combine all solver's fields together into single fields. For
+  // electrodynamic cavities the solutions and gradients are first reduced to
+  // a low rank basis (see PulseBasis), so that each new phase_offset only
+  // costs a small matrix-vector product.
   void CombinedField(Eigen::VectorXcd *f, double phase_offset);
   bool CombinedSpatialGradient(Eigen::MatrixXcd *f, double phase_offset)
                                MUST_USE_RESULT;
@@ -363,6 +494,67 @@ class Solvers {
 
  private:
   std::vector<Solver*> solvers_;
+  Eigen::MatrixXcd basis_;      // Reduced order basis for FastSweep()
+  Mesh *previous_mesh_ = 0;     // Kept by ClearKeepingMesh()
+
+  // The solution vectors (or stacked gradient columns) of all solvers as
+  // basis * coefficients.col(i), where the basis has orthonormal columns. A
+  // frequency sweep's solutions are usually close to a low dimensional
+  // subspace, so the basis has far fewer columns than there are solvers.
+  // Both matrices are empty until they are needed.
+  struct PulseBasis {
+    Eigen::MatrixXcd basis, coefficients;
+    void Clear() {
+      basis.resize(0, 0);
+      coefficients.resize(0, 0);
+    }
+    // Set the basis and coefficients for the given vectors, which all have
+    // size n.
+    void Create(const vector<const Complex*> &vectors, int n);
+    // Return the combination of the vectors weighted by phasors.
+    void Combine(const vector<Complex> &phasors, Complex *result) const;
+  };
+  PulseBasis field_basis_, gradient_basis_;
+  void ClearPulseBasis() {
+    field_basis_.Clear();
+    gradient_basis_.Clear();
+  }
+
+  // Solve 'num_anchors' evenly spaced frequencies in full, and use their
+  // solutions as a basis for a reduced order model that approximately solves
+  // all the other frequencies. Return true on success.
+  bool FastSweep(int num_anchors) MUST_USE_RESULT;
 };
 
+// The Lua functions that scripts call to look up the solution, e.g. through
+// the 'field' argument of config.optimize(). These are shared by the GUI and
+// ScriptRunner, which bind them to the script's Lua state. Each takes the
+// function call's Lua state, the solvers of the current model and the index
+// of the solver that the script has selected, and returns the number of Lua
+// results. If there are no solvers (e.g. because config.optimize() is being
+// called with dummy arguments without the field having been solved for) then
+// zeros are returned.
+int LuaSolverGetField(lua_State *L, Solvers *solvers,
+                      int solution_index);          // _GetField(x,y)
+int LuaSolverGetFieldPoynting(lua_State *L, Solvers *solvers,
+                              int solution_index);  // _GetFieldPoynting(x,y)
+int LuaSolverPattern(lua_State *L, Solvers *solvers,
+                     int solution_index);           // _Pattern(theta)
+int LuaSolverDirectivity(lua_State *L, Solvers *solvers,
+                         int solution_index);       // _Directivity()
+int LuaSolverSolveAll(lua_State *L, Solvers *solvers);  // _SolveAll()
+
+// _Select(n) sets the solution index to n-1, checking it against the number
+// of frequencies in the config.
+int LuaSolverSelect(lua_State *L, const ScriptConfig &config,
+                    int *solution_index);
+
+// Push the port power and port phase tables that are the first two arguments
+// of config.optimize() and config.test(), and the results of _Ports(). The
+// solvers should already have been created. Return false if the port powers
+// could not be computed, in which case tables of zeros are pushed instead and
+// the caller should report the error.
+bool LuaSolverPushPortPowerAndPhase(lua_State *L, Solvers *solvers,
+                                    int solution_index) MUST_USE_RESULT;
+
 #endif
@@ -247,25 +247,29 @@ __ZeroTable__ = setmetatable({}, {__index = function(T,k) return 0 end,
                                   __len = function(T) return 1 end})
 
 -- The third argument to optimize, a table which contains field lookup
--- functions.
+-- functions. The x,y arguments can be numbers or vectors of the same size, in
+-- which case the results are vectors.
 __Optimize3rdArg__ = {
   Complex = function(x, y)
     return Complex(_GetField(x, y))
   end,
   Magnitude = function(x, y)
     local re,im = _GetField(x, y)
-    return math.sqrt(re * re + im * im)
+    local fn = vec.IsVector(re) and vec or math
+    return fn.sqrt(re * re + im * im)
   end,
   Phase = function(x, y)
     local re,im = _GetField(x, y)
-    return math.atan(im, re)
+    local fn = vec.IsVector(re) and vec or math
+    return fn.atan(im, re)
   end,
   Poynting = function(x, y)
     return _GetFieldPoynting(x, y)
   end,
   Power = function(x, y)
     local px,py = _GetFieldPoynting(x, y)
-    return math.sqrt(px * px + py * py)
+    local fn = vec.IsVector(px) and vec or math
+    return fn.sqrt(px * px + py * py)
   end,
   Pattern = _Pattern,
   Directivity = _Directivity,
@@ -274,14 +278,22 @@ __Optimize3rdArg__ = {
   Ports = _Ports,
 }
 
+-- Return a zero that is the same shape as the x argument of a field function.
+local function DummyZero(x)
+  if vec.IsVector(x) then
+    return Vector():Resize(#x)
+  end
+  return 0
+end
+
 -- A dummy __Optimize3rdArg__ argument that allows trial execution of the
 -- optimizer function but that does not actually do any work.
 __DummyOptimize3rdArg__ = {
-  Complex = function() return Complex(0,0) end,
-  Magnitude = function() return 0 end,
-  Phase = function() return 0 end,
-  Poynting = function() return 0,0 end,
-  Power = function() return 0 end,
+  Complex = function(x) return Complex(DummyZero(x), DummyZero(x)) end,
+  Magnitude = function(x) return DummyZero(x) end,
+  Phase = function(x) return DummyZero(x) end,
+  Poynting = function(x) return DummyZero(x), DummyZero(x) end,
+  Power = function(x) return DummyZero(x) end,
   Pattern = function() return 0 end,
   Directivity = function() return 0 end,
   Select = function() end,
@@ -32,82 +32,231 @@ template<class T> inline pair<T, T> make_sorted_pair(T a, T b) {
   }
 }
 
-// A symmetric 2D matrix of boolean, indexed by AABB box IDs.
-class IDPairSet {
- public:
-  explicit IDPairSet(int num_ids) : n_(num_ids), s_(num_ids * num_ids) {}
-  void Add(int a, int b) {
-    CHECK(a >= 0 && a < n_ && b >= 0 && b < n_);
-    s_[a*n_ + b] = true;
-    s_[b*n_ + a] = true;
-  }
-  bool Contains(int a, int b) {
-    CHECK(a >= 0 && a < n_ && b >= 0 && b < n_);
-    return s_[a*n_ + b];
-  }
-  void swap(IDPairSet &q) {
-    CHECK(n_ == q.n_);
-    s_.swap(q.s_);
-  }
- private:
-  int n_;               // ID range is 0..n_-1
-  vector<bool> s_;      // n_*n_ boolean matrix
-};
-
 template<int D>
 void SweepAndPrune(const vector<AABB<D> > &aabb,
                    set<pair<int, int> > *overlaps) {
-  IDPairSet last_candidates(aabb.size());
+  Broadphase<D> broadphase;
+  const int n = aabb.size();
+  for (int i = 0; i < n; i++) {
+    CHECK(broadphase.Add(aabb[i]) == i);
+  }
+  vector<pair<int, int> > pairs;
+  broadphase.FindOverlaps(&pairs);
+  overlaps->insert(pairs.begin(), pairs.end());
+}
+
+template<int D> int Broadphase<D>::Add(const AABB<D> &box) {
+  int id;
+  if (free_ids_.empty()) {
+    id = boxes_.size();
+    boxes_.push_back(box);
+    alive_.push_back(true);
+  } else {
+    id = free_ids_.back();
+    free_ids_.pop_back();
+    boxes_[id] = box;
+    alive_[id] = true;
+  }
+  Entry e;
+  e.box = box;
+  e.id = id;
+  sorted_.push_back(e);
+  return id;
+}
+
+template<int D> void Broadphase<D>::Remove(int id) {
+  CHECK(id >= 0 && id < int(boxes_.size()) && alive_[id]);
+  alive_[id] = false;
+  // The entry for this ID stays in sorted_ until the next FindOverlaps(), so
+  // the ID can not be reused until then.
+  removed_ids_.push_back(id);
+}
+
+template<int D> void Broadphase<D>::Update(int id, const AABB<D> &box) {
+  CHECK(id >= 0 && id < int(boxes_.size()) && alive_[id]);
+  boxes_[id] = box;
+}
+
+template<int D>
+void Broadphase<D>::FindOverlaps(vector<pair<int, int> > *pairs) {
+  pairs->clear();
+
+  // Drop the entries of removed boxes and copy the current boxes into the
+  // others, keeping their order. Find the variance of the box centers along
+  // each axis.
+  double sum[D], sum2[D], size[D];
   for (int d = 0; d < D; d++) {
-    // For each dimension create a sorted list of the starts and ends of box
-    // edges.
-    struct Edge {
-      double coord;             // coordinate
-      bool start;               // true if a box start, false if a box end
-      int id;                   // index into aabb
-      bool operator<(const Edge &e) const {
-        return coord < e.coord || (coord == e.coord && start > e.start);
+    sum[d] = sum2[d] = size[d] = 0;
+  }
+  int n = 0;
+  for (size_t i = 0; i < sorted_.size(); i++) {
+    int id = sorted_[i].id;
+    if (alive_[id]) {
+      const AABB<D> &b = boxes_[id];
+      sorted_[n].box = b;
+      sorted_[n].id = id;
+      n++;
+      for (int d = 0; d < D; d++) {
+        double c = b.min[d] + b.max[d];
+        sum[d] += c;
+        sum2[d] += c * c;
+        size[d] += b.max[d] - b.min[d];
       }
-    };
-    vector<Edge> e(aabb.size() * 2);
-    for (int i = 0; i < aabb.size(); i++) {
-      e[i*2 + 0].coord = aabb[i].min[d];
-      e[i*2 + 0].start = true;
-      e[i*2 + 0].id = i;
-      e[i*2 + 1].coord = aabb[i].max[d];
-      e[i*2 + 1].start = false;
-      e[i*2 + 1].id = i;
-    }
-    sort(e.begin(), e.end());
-
-    // For all overlapping intervals set a pair of IDs in 'candidates'.
-    IDPairSet candidates(d < D - 1 ? aabb.size() : 0);
-    set<int> active_ids;                        // Started but not ended IDs
-    for (int i = 0; i < e.size(); i++) {
-      if (e[i].start) {
-        int this_id = e[i].id;
-        // This ID and all existing active pairs are candidates for overlap,
-        // but only if they were candidates on the last iteration too.
-        for (auto id : active_ids) {
-          if (d == 0 || last_candidates.Contains(this_id, id)) {
-            if (d == D - 1) {
-              overlaps->insert(make_sorted_pair(this_id, id));
-            } else {
-              candidates.Add(this_id, id);
-            }
-          }
-        }
-        active_ids.insert(this_id);
-      } else {
-        active_ids.erase(e[i].id);
+    }
+  }
+  sorted_.resize(n);
+  free_ids_.insert(free_ids_.end(), removed_ids_.begin(), removed_ids_.end());
+  removed_ids_.clear();
+  if (n == 0) {
+    return;
+  }
+
+  // Switch the sweep axis if another axis has a much larger variance. The
+  // factor of two stops the axis flipping back and forth.
+  int best = axis_;
+  double variance[D];
+  for (int d = 0; d < D; d++) {
+    variance[d] = sum2[d] / n - (sum[d] / n) * (sum[d] / n);
+    if (variance[d] > variance[best]) {
+      best = d;
+    }
+  }
+  bool new_axis = variance[best] > 2 * variance[axis_];
+  if (new_axis) {
+    axis_ = best;
+  }
+  const int a = axis_;
+  auto less = [a](const Entry &e1, const Entry &e2) {
+    return e1.box.min[a] < e2.box.min[a];
+  };
+  if (new_axis) {
+    std::sort(sorted_.begin(), sorted_.end(), less);
+  } else {
+    // Insertion sort, which is O(n) when the order has not changed much. If
+    // many boxes have been added or have moved far then fall back to a full
+    // sort.
+    const long long budget = 8LL * n;
+    long long moves = 0;
+    for (int i = 1; i < n; i++) {
+      Entry e = sorted_[i];
+      int j = i - 1;
+      for (; j >= 0 && less(e, sorted_[j]); j--) {
+        sorted_[j + 1] = sorted_[j];
+      }
+      sorted_[j + 1] = e;
+      moves += i - 1 - j;
+      if (moves > budget) {
+        std::sort(sorted_.begin(), sorted_.end(), less);
+        break;
       }
     }
-    if (d < D - 1) {
-      candidates.swap(last_candidates);
+  }
+
+  // A sweep along one axis compares each box with all the boxes that overlap
+  // it on that axis, which for boxes spread evenly through a large volume is
+  // many more than overlap it in all dimensions. So the space is also divided
+  // into slabs along the axis b with the next largest variance, each box is
+  // put in every slab that it touches, and each slab is swept separately.
+  // Slabs are about four average box sizes wide.
+  int b = a;
+  for (int d = 0; d < D; d++) {
+    if (d != a && (b == a || variance[d] > variance[b])) {
+      b = d;
+    }
+  }
+  int num_slabs = 1;
+  double slab_min = 0, slab_scale = 0;
+  if (b != a) {
+    double lo = __DBL_MAX__, hi = -__DBL_MAX__;
+    for (int i = 0; i < n; i++) {
+      lo = std::min(lo, sorted_[i].box.min[b]);
+      hi = std::max(hi, sorted_[i].box.max[b]);
+    }
+    double width = 4 * size[b] / n;
+    if (width > 0 && hi - lo > 2 * width) {
+      num_slabs = std::min<double>((hi - lo) / width, std::max(1, n / 16));
+      slab_min = lo;
+      slab_scale = num_slabs / (hi - lo);
+    }
+  }
+  auto slab = [&](double x) {
+    return std::max(0, std::min(num_slabs - 1,
+                                int((x - slab_min) * slab_scale)));
+  };
+
+  // Copy the boxes into the slabs, keeping them sorted along the sweep axis.
+  // The coordinates are stored in one array per axis so that the inner loop
+  // of the sweep reads memory sequentially.
+  slab_start_.assign(num_slabs + 1, 0);
+  for (int i = 0; i < n; i++) {
+    const AABB<D> &box = sorted_[i].box;
+    for (int k = slab(box.min[b]); k <= slab(box.max[b]); k++) {
+      slab_start_[k + 1]++;
+    }
+  }
+  for (int k = 0; k < num_slabs; k++) {
+    slab_start_[k + 1] += slab_start_[k];
+  }
+  const int total = slab_start_[num_slabs];
+  slab_fill_.assign(slab_start_.begin(), slab_start_.end() - 1);
+  for (int d = 0; d < D; d++) {
+    sweep_min_[d].resize(total);
+    sweep_max_[d].resize(total);
+  }
+  sweep_id_.resize(total);
+  for (int i = 0; i < n; i++) {
+    const AABB<D> &box = sorted_[i].box;
+    for (int k = slab(box.min[b]); k <= slab(box.max[b]); k++) {
+      int p = slab_fill_[k]++;
+      for (int d = 0; d < D; d++) {
+        sweep_min_[d][p] = box.min[d];
+        sweep_max_[d][p] = box.max[d];
+      }
+      sweep_id_[p] = sorted_[i].id;
+    }
+  }
+
+  // Sweep each slab. Each box is compared with the following boxes that start
+  // before it ends. A pair of boxes that are both in several slabs is only
+  // reported by the slab that contains the larger of their minimum coordinates
+  // on axis b.
+  const double *lo[D], *hi[D];
+  for (int d = 0; d < D; d++) {
+    lo[d] = sweep_min_[d].data();
+    hi[d] = sweep_max_[d].data();
+  }
+  for (int k = 0; k < num_slabs; k++) {
+    const int slab_end = slab_start_[k + 1];
+    for (int i = slab_start_[k]; i < slab_end; i++) {
+      double box_min[D], box_max[D];
+      for (int d = 0; d < D; d++) {
+        box_min[d] = lo[d][i];
+        box_max[d] = hi[d][i];
+      }
+      for (int j = i + 1; j < slab_end && lo[a][j] <= box_max[a]; j++) {
+        bool overlaps = true;
+        for (int d = 0; d < D; d++) {
+          overlaps &= (lo[d][j] <= box_max[d]) & (hi[d][j] >= box_min[d]);
+        }
+        if (overlaps &&
+            (num_slabs == 1 || slab(std::max(lo[b][i], lo[b][j])) == k)) {
+          pairs->push_back(make_sorted_pair(sweep_id_[i], sweep_id_[j]));
+        }
+      }
     }
   }
 }
 
+template void SweepAndPrune<1>(const vector<AABB<1> > &,
+                               set<pair<int, int> > *);
+template void SweepAndPrune<2>(const vector<AABB<2> > &,
+                               set<pair<int, int> > *);
+template void SweepAndPrune<3>(const vector<AABB<3> > &,
+                               set<pair<int, int> > *);
+template class Broadphase<1>;
+template class Broadphase<2>;
+template class Broadphase<3>;
+
 }  // namespace collision
 
 //***************************************************************************
@@ -115,6 +264,7 @@ void SweepAndPrune(const vector<AABB<D> > &aabb,
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
 
 template<int D> void SweepAndPruneTester() {
   const int n = 1000;
@@ -153,3 +303,113 @@ TEST_FUNCTION(SweepAndPrune_2D) {
 TEST_FUNCTION(SweepAndPrune_3D) {
   SweepAndPruneTester<3>();
 }
+
+TEST_FUNCTION(Broadphase) {
+  // Randomly add, remove and move boxes, and compare the overlaps found with
+  // a brute force search.
+  collision::Broadphase<3> broadphase;
+  vector<int> ids;
+  auto random_box = []() {
+    collision::AABB<3> box;
+    for (int j = 0; j < 3; j++) {
+      box.min[j] = RandomDouble();
+      box.max[j] = box.min[j] + 0.2*RandomDouble();
+    }
+    return box;
+  };
+  vector<pair<int, int> > pairs;
+  for (int iteration = 0; iteration < 100; iteration++) {
+    for (int i = RandomInt(20); i > 0; i--) {
+      ids.push_back(broadphase.Add(random_box()));
+    }
+    for (int i = RandomInt(10); i > 0 && !ids.empty(); i--) {
+      int k = RandomInt(ids.size());
+      broadphase.Remove(ids[k]);
+      ids[k] = ids.back();
+      ids.pop_back();
+    }
+    for (size_t i = 0; i < ids.size(); i++) {
+      collision::AABB<3> box = broadphase.Box(ids[i]);
+      double delta = 0.02 * (RandomDouble() - 0.5);
+      box.min[iteration % 3] += delta;
+      box.max[iteration % 3] += delta;
+      broadphase.Update(ids[i], box);
+    }
+    CHECK(broadphase.Size() == int(ids.size()));
+    broadphase.FindOverlaps(&pairs);
+    set<pair<int, int> > found(pairs.begin(), pairs.end());
+    CHECK(found.size() == pairs.size());
+    int count = 0;
+    for (size_t i = 0; i < ids.size(); i++) {
+      for (size_t j = 0; j < ids.size(); j++) {
+        int a = ids[i], b = ids[j];
+        if (a < b) {
+          bool o = broadphase.Box(a).Overlaps(broadphase.Box(b));
+          CHECK(found.count(make_pair(a, b)) == o);
+          count += o;
+        }
+      }
+    }
+    CHECK(count == int(pairs.size()));
+  }
+}
+
+TEST_FUNCTION(BroadphaseBenchmark) {
+  // Boxes moving with random velocities inside a cube, sized so that each box
+  // overlaps about one other. Compare updating a persistent Broadphase with
+  // finding the overlaps from scratch for every step. A second case has all
+  // the boxes in a tall column, as for stacked objects.
+  for (int column = 0; column < 2; column++) {
+    for (int n : {10000, 30000, 100000}) {
+      const double kSide = 1;
+      double width = 2 * pow(n, 1.0 / 3.0) * kSide;
+      double extent[3] = {width, width, width};
+      if (column) {
+        extent[0] = extent[1] = 4 * kSide;
+        extent[2] = n / 2.0 * kSide;
+      }
+      vector<collision::AABB<3> > aabb(n);
+      vector<double> velocity(n * 3);
+      for (int i = 0; i < n; i++) {
+        for (int j = 0; j < 3; j++) {
+          aabb[i].min[j] = RandomDouble() * extent[j];
+          aabb[i].max[j] = aabb[i].min[j] + kSide;
+          velocity[i*3 + j] = 0.02 * kSide * (RandomDouble() - 0.5);
+        }
+      }
+      collision::Broadphase<3> broadphase;
+      for (int i = 0; i < n; i++) {
+        CHECK(broadphase.Add(aabb[i]) == i);
+      }
+      vector<pair<int, int> > pairs;
+      broadphase.FindOverlaps(&pairs);
+
+      const int kNumSteps = 10;
+      double incremental_time = 0, scratch_time = 0;
+      for (int step = 0; step < kNumSteps; step++) {
+        for (int i = 0; i < n; i++) {
+          for (int j = 0; j < 3; j++) {
+            aabb[i].min[j] += velocity[i*3 + j];
+            aabb[i].max[j] += velocity[i*3 + j];
+          }
+        }
+        double start_time = Now();
+        for (int i = 0; i < n; i++) {
+          broadphase.Update(i, aabb[i]);
+        }
+        broadphase.FindOverlaps(&pairs);
+        incremental_time += Now() - start_time;
+
+        start_time = Now();
+        set<pair<int, int> > overlaps;
+        collision::SweepAndPrune(aabb, &overlaps);
+        scratch_time += Now() - start_time;
+        CHECK(overlaps.size() == pairs.size());
+      }
+      printf("%s, %6d boxes, %6d pairs: %7.3fms per step incremental, "
+             "%7.3fms from scratch\n", column ? "Column" : "Cube  ", n,
+             int(pairs.size()), incremental_time / kNumSteps * 1e3,
+             scratch_time / kNumSteps * 1e3);
+    }
+  }
+}
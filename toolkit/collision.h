@@ -15,6 +15,7 @@
 
 #include <vector>
 #include <set>
+#include <utility>
 
 namespace collision {
 
@@ -24,7 +25,7 @@ template<int D> struct AABB {
 
   // Return true if two AABBs overlap, or are only just touching with an
   // overlap distance of zero.
-  bool Overlaps(const AABB &a) {
+  bool Overlaps(const AABB &a) const {
     for (int i = 0; i < D; i++) {
       if (min[i] > a.max[i] || max[i] < a.min[i]) {
         return false;
@@ -36,10 +37,60 @@ template<int D> struct AABB {
 
 // Use the sweep-and-prune algorithm to find the indexes of all pairs of boxes
 // in aabb that overlap. Return them as a set of pairs, with first < second in
-// the pair.
+// the pair. For boxes that move over time use Broadphase instead.
 template<int D> void SweepAndPrune(const std::vector<AABB<D> > &aabb,
                                    std::set<std::pair<int, int> > *overlaps);
 
+// A persistent set of boxes that can be added, removed and moved, and that
+// finds all pairs of overlapping boxes. This uses sweep-and-prune along one
+// axis: the boxes are kept sorted by their minimum coordinate on that axis and
+// are re-sorted by insertion sort, which is fast when the boxes have only
+// moved a little since the last call. The sweep axis is the one along which
+// the box centers are most spread out, so that clustered boxes (e.g. a stack)
+// do not all overlap on the sweep axis. When there are many boxes the space
+// is also cut into slabs along a second axis that are swept separately.
+template<int D> class Broadphase {
+ public:
+  // Add a box and return its ID, which is >= 0. IDs of removed boxes are
+  // reused.
+  int Add(const AABB<D> &box);
+
+  // Remove the box with the given ID.
+  void Remove(int id);
+
+  // Change the box with the given ID.
+  void Update(int id, const AABB<D> &box);
+
+  // Accessors.
+  const AABB<D> &Box(int id) const { return boxes_[id]; }
+  int Size() const {
+    return boxes_.size() - free_ids_.size() - removed_ids_.size();
+  }
+
+  // Find all pairs of IDs of overlapping boxes, with first < second in each
+  // pair, in no particular order. The pairs vector is cleared first, so it can
+  // be reused between calls to avoid allocation.
+  void FindOverlaps(std::vector<std::pair<int, int> > *pairs);
+
+ private:
+  struct Entry {
+    AABB<D> box;                // Copy of boxes_[id]
+    int id;
+  };
+  std::vector<AABB<D> > boxes_;         // Indexed by ID
+  std::vector<bool> alive_;             // Indexed by ID
+  std::vector<int> free_ids_;           // IDs that can be reused
+  std::vector<int> removed_ids_;        // Reusable after the next sort
+  std::vector<Entry> sorted_;           // By box.min[axis_], maybe dead IDs
+  int axis_ = 0;                        // Sweep axis
+  // Temporaries for FindOverlaps(), kept to avoid reallocating them:
+  std::vector<int> slab_start_;         // Index of first box in each slab
+  std::vector<int> slab_fill_;
+  std::vector<double> sweep_min_[D];    // Box coordinates by slab then axis
+  std::vector<double> sweep_max_[D];
+  std::vector<int> sweep_id_;           // Box IDs by slab then axis
+};
+
 }  // namespace collision
 
 #endif
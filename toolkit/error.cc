@@ -104,6 +104,7 @@ void DefaultErrorHandler::HandleError(Type type, const char *msg, va_list ap) {
 static DefaultErrorHandler default_error_handler;
 static ErrorHandler *error_handler = &default_error_handler;
 static std::mutex error_handler_mutex;
+static thread_local ErrorHandler *thread_error_handler = 0;
 
 ErrorHandler *SetErrorHandler(ErrorHandler *e) {
   MutexLock lock(&error_handler_mutex);
@@ -113,10 +114,19 @@ ErrorHandler *SetErrorHandler(ErrorHandler *e) {
 }
 
 ErrorHandler *GetErrorHandler() {
+  if (thread_error_handler) {
+    return thread_error_handler;
+  }
   MutexLock lock(&error_handler_mutex);
   return error_handler;
 }
 
+ErrorHandler *SetThreadErrorHandler(ErrorHandler *e) {
+  ErrorHandler *ret = thread_error_handler;
+  thread_error_handler = e;
+  return ret;
+}
+
 //***************************************************************************
 // Complain-once mechanism.
 
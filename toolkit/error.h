@@ -48,6 +48,12 @@ struct ErrorHandler {
 ErrorHandler *SetErrorHandler(ErrorHandler *e);
 ErrorHandler *GetErrorHandler();
 
+// Set an error handler for the calling thread only, that overrides the global
+// error handler. This allows worker threads that run independent computations
+// to capture their own errors. Pass 0 to go back to the global handler. The
+// previous thread error handler is returned.
+ErrorHandler *SetThreadErrorHandler(ErrorHandler *e);
+
 // An error handler for Qt.
 #ifdef QT_CORE_LIB
 // This must be created after the QApplication is constructed.
@@ -66,7 +72,7 @@ struct qtErrorHandler : public ErrorHandler {
 
 // DBG_CHECK is like CHECK but is only used in debug builds.
 #ifdef NDEBUG
-  #define DBG_CHECK_MSG(cond)
+  #define DBG_CHECK_MSG(cond, msg)
   #define DBG_CHECK(cond)
 #else
   #define DBG_CHECK_MSG(cond, msg) CHECK_MSG(cond, msg)
@@ -62,7 +62,12 @@ Uniaxial PML, for comparison:
 #define _USE_MATH_DEFINES       // For VC++ math.h to define M_PI and friends
 
 #include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
 #include "thread.h"
+#include "testing.h"
+#include "random.h"
 
 #include "fdtd.h"
 
@@ -71,7 +76,6 @@ namespace fdtd {
 //***************************************************************************
 // Misc.
 
-const int kNumThreads = 2;                      // Number of ParallelFor threads
 const double kc = 299792458.130996;             // Speed of light (m/s)
 const double kEpsilon = 8.85418782e-12;         // Permittivity of free space
 const double kMu = 1.25663706e-6;               // Permeability of free space
@@ -181,7 +185,7 @@ void PEC::Set(Range rx, Range ry, Range rz, bool value) {
 
 
 CD::CD(int nx, int ny, int nz, double dx, double dy, double dz,
-       int pml, int pml_depth, int toroid) : ab_(nx, ny, nz) {
+       int pml, int pml_depth, int toroid, int layout) : ab_(nx, ny, nz) {
   // The Field structure is assumed to have this layout:
   static_assert(sizeof(Field) == 12, "struct Field layout");
   static_assert(offsetof(Field, x) == 0, "struct Field layout");
@@ -199,6 +203,8 @@ CD::CD(int nx, int ny, int nz, double dx, double dy, double dz,
   pml_ = pml;
   pml_depth_ = pml_depth;
   toroid_ = toroid;
+  layout_ = layout;
+  num_threads_ = std::max(1, int(std::thread::hardware_concurrency()));
   ab_dt_ = 0;
   Psi_ = 0;
 
@@ -220,6 +226,7 @@ CD::CD(int nx, int ny, int nz, double dx, double dy, double dz,
   CHECK_MSG(((toroid_ & TOROID_Z) == 0) ||
             ((pml_ & (PML_ZMIN | PML_ZMAX)) == 0),
             "Z PML and Z toroid symmetry is probably not what you want");
+  CHECK_MSG(layout_ == LAYOUT_AOS || layout_ == LAYOUT_SOA, "Invalid layout");
 
   // Allocate memory.
   int sz = (nx_+1) * (ny_+1) * (nz_+1);
@@ -241,6 +248,8 @@ CD::CD(const CD &cd, bool E_field_only) : ab_(cd.nx_, cd.ny_, cd.nz_) {
   pml_ = cd.pml_;
   pml_depth_ = cd.pml_depth_;
   toroid_ = cd.toroid_;
+  layout_ = cd.layout_;
+  num_threads_ = cd.num_threads_;
   ab_dt_ = 0;
 
   int sz = (nx_+1) * (ny_+1) * (nz_+1);
@@ -264,8 +273,9 @@ CD::~CD() {
 void CD::operator= (const CD &cd) {
   CHECK_MSG(nx_ == cd.nx_ && ny_ == cd.ny_ && nz_ == cd.nz_ &&
             pml_ == cd.pml_ && pml_depth_ == cd.pml_depth_ &&
-            toroid_ == cd.toroid_,
-            "Size, PML and symmetry of computational domain must be the same");
+            toroid_ == cd.toroid_ && layout_ == cd.layout_,
+            "Size, PML, symmetry and layout of computational domain must be "
+            "the same");
   int sz = (nx_+1) * (ny_+1) * (nz_+1);
   if (E_) {
     memcpy(E_, cd.E_, sz * sizeof(Field));
@@ -287,11 +297,11 @@ float *CD::GetFieldBox(Field *F, int c, Range rx, Range ry, Range rz,
   const int sx = 1;                      // Array skip in the X direction
   const int sy = (nx_ + 1);              // Array skip in the Y direction
   const int sz = (nx_ + 1) * (ny_ + 1);  // Array skip in the Z direction
-  Field *e = F + rx.lo()*sx + ry.lo()*sy + rz.lo()*sz;
-  *sx_ret = 3 * sx;
-  *sy_ret = 3 * sy;
-  *sz_ret = 3 * sz;
-  return (&e->x) + c;
+  const int k = (layout_ == LAYOUT_SOA) ? 1 : 3;  // Floats per grid cell
+  *sx_ret = k * sx;
+  *sy_ret = k * sy;
+  *sz_ret = k * sz;
+  return FieldComponent(F, c, rx.lo()*sx + ry.lo()*sy + rz.lo()*sz);
 }
 
 float *CD::GetEBox(int c, Range rx, Range ry, Range rz,
@@ -306,10 +316,11 @@ float *CD::GetHBox(int c, Range rx, Range ry, Range rz,
 
 float *CD::GetEMatlab(int32_t dims[4]) const {
   if (dims) {
-    dims[0] = 3;
-    dims[1] = nx_ + 1;
-    dims[2] = ny_ + 1;
-    dims[3] = nz_ + 1;
+    int32_t *d = (layout_ == LAYOUT_SOA) ? dims : dims + 1;
+    d[0] = nx_ + 1;
+    d[1] = ny_ + 1;
+    d[2] = nz_ + 1;
+    dims[(layout_ == LAYOUT_SOA) ? 3 : 0] = 3;
   }
   return &E_[0].x;
 }
@@ -324,6 +335,68 @@ void CD::Step(double dt, bool step_H) {
 
 float *CD::StepRanges(double dt, bool step_H, float *starting_Psi,
                       Range rangex, Range rangey, Range rangez) {
+  SetTimestep(dt);
+
+  // Start using 'E' or 'H' part of Psi array.
+  float *Psi = starting_Psi ? starting_Psi :
+               (Psi_ + step_H * (PsiArraySize() / 2));
+
+  // Each Z-slice of Yee cells is processed in parallel. This is limited by
+  // memory bandwidth, StepBlocked() does better for whole-CD steps.
+  vector<SlicePart> parts;
+  vector<int> slices;
+  Psi = PlanSlices(step_H, Psi, rangex, rangey, rangez, &parts, &slices);
+  ParallelFor(0, rangez.size() - 1, num_threads_, [&](int i) {
+    StepSlice(dt, rangez.lo() + i, parts.data() + slices[i],
+              parts.data() + slices[i + 1]);
+  });
+
+  // Make sure we did not overflow the half of the Psi array we are using.
+  CHECK_MSG(Psi <= Psi_ + (1 + step_H) * (PsiArraySize() / 2),
+            "Internal error: Psi array overflow");
+  return Psi;
+}
+
+void CD::StepBlocked(double dt, int num_steps) {
+  SetTimestep(dt);
+  vector<SlicePart> parts[2];           // Indexed by step_H
+  vector<int> slices[2];
+  for (int step_H = 0; step_H < 2; step_H++) {
+    float *Psi = PlanSlices(step_H, Psi_ + step_H * (PsiArraySize() / 2),
+                            Range(0, nx_-1), Range(0, ny_-1), Range(0, nz_-1),
+                            &parts[step_H], &slices[step_H]);
+    CHECK_MSG(Psi <= Psi_ + (1 + step_H) * (PsiArraySize() / 2),
+              "Internal error: Psi array overflow");
+  }
+
+  // The time steps are done in groups. Within a group, half step k updates H
+  // for even k and E for odd k. Half step k of slice z reads half step k-1 of
+  // slices z-1..z+1, and overwrites values that only half step k-1 of those
+  // slices reads. Doing it on wavefront w = z + 2k therefore puts all of its
+  // dependencies on earlier wavefronts, and the updates on each wavefront
+  // (which are at least two slices apart) can run in parallel. A slice is
+  // updated 2*group times by consecutive wavefronts, so it stays in cache.
+  // The group size trades cache footprint (about 4*group slices) against the
+  // number of parallel updates per wavefront (up to 2*group).
+  const int group = std::max(2, (num_threads_ + 1) / 2);
+  for (int step = 0; step < num_steps; step += group) {
+    int half_steps = 2 * std::min(group, num_steps - step);
+    for (int w = 0; w < nz_ + 2*(half_steps - 1); w++) {
+      int k1 = std::max(0, (w - nz_ + 2) / 2);  // First k with z < nz_
+      int k2 = std::min(half_steps - 1, w / 2); // Last k with z >= 0
+      ParallelFor(k1, k2, num_threads_, [&](int k) {
+        int z = w - 2*k;
+        int step_H = (k % 2) == 0;
+        const SlicePart *p = parts[step_H].data();
+        StepSlice(dt, z, p + slices[step_H][z], p + slices[step_H][z + 1]);
+      });
+    }
+  }
+}
+
+float *CD::PlanSlices(bool step_H, float *Psi, Range rangex, Range rangey,
+                      Range rangez, vector<SlicePart> *parts,
+                      vector<int> *slices) {
   // Function dispatch table for Step*_Helper()s for different combinations of
   // stretching parameters and field type.
   static Step_Helper_fn_t helpers[16] = {
@@ -344,67 +417,104 @@ float *CD::StepRanges(double dt, bool step_H, float *starting_Psi,
     &CD::StepH_Helper<false, true,  true >,
     &CD::StepH_Helper<true,  true,  true >
   };
+  static Step_Helper_fn_t soa_helpers[16] = {
+    &CD::StepSoA_Helper<false, false, false, false>,
+    &CD::StepSoA_Helper<false, true,  false, false>,
+    &CD::StepSoA_Helper<false, false, true,  false>,
+    &CD::StepSoA_Helper<false, true,  true,  false>,
+    &CD::StepSoA_Helper<false, false, false, true >,
+    &CD::StepSoA_Helper<false, true,  false, true >,
+    &CD::StepSoA_Helper<false, false, true,  true >,
+    &CD::StepSoA_Helper<false, true,  true,  true >,
+    &CD::StepSoA_Helper<true,  false, false, false>,
+    &CD::StepSoA_Helper<true,  true,  false, false>,
+    &CD::StepSoA_Helper<true,  false, true,  false>,
+    &CD::StepSoA_Helper<true,  true,  true,  false>,
+    &CD::StepSoA_Helper<true,  false, false, true >,
+    &CD::StepSoA_Helper<true,  true,  false, true >,
+    &CD::StepSoA_Helper<true,  false, true,  true >,
+    &CD::StepSoA_Helper<true,  true,  true,  true >
+  };
+  Step_Helper_fn_t *table = (layout_ == LAYOUT_SOA) ? soa_helpers : helpers;
 
-  // Compute 'a' and 'b' arrays for this timestep.
-  if (ab_dt_ != dt) {
-    ab_dt_ = dt;
-    SetupAB(dt, dx_, nx_, 0.0, ab_.axE.data(), ab_.bxE.data());
-    SetupAB(dt, dy_, ny_, 0.0, ab_.ayE.data(), ab_.byE.data());
-    SetupAB(dt, dz_, nz_, 0.0, ab_.azE.data(), ab_.bzE.data());
-    SetupAB(dt, dx_, nx_, 0.5, ab_.axH.data(), ab_.bxH.data());
-    SetupAB(dt, dy_, ny_, 0.5, ab_.ayH.data(), ab_.byH.data());
-    SetupAB(dt, dz_, nz_, 0.5, ab_.azH.data(), ab_.bzH.data());
-  }
-
-  // Start using 'E' or 'H' part of Psi array.
-  float *Psi = starting_Psi ? starting_Psi :
-               (Psi_ + step_H * (PsiArraySize() / 2));
-
-  // Step over the (up to) 3^3 regions that have (potentially) different
+  // Find the (up to) 3^3 regions that have (potentially) different
   // combinations of PML coordinate stretching parameters.
   int xcoords[4], ycoords[4], zcoords[4];
   bool xstretch[3], ystretch[3], zstretch[3];
   int xcount = CoordHelper(PML_XMIN, PML_XMAX, nx_, rangex, xcoords, xstretch);
   int ycount = CoordHelper(PML_YMIN, PML_YMAX, ny_, rangey, ycoords, ystretch);
   int zcount = CoordHelper(PML_ZMIN, PML_ZMAX, nz_, rangez, zcoords, zstretch);
+
+  // Psi variables are allocated region by region, and within each region
+  // slice by slice. The number per slice is constant within a region.
+  // pps = Psi per slice:
+  float *region_Psi[3][3][3];
+  int pps[3][3][3];
   for (int rx = 0; rx < xcount; rx++) {         // rx,ry,rz = region indexes
     for (int ry = 0; ry < ycount; ry++) {
       for (int rz = 0; rz < zcount; rz++) {
-        // Each Z-slice of Yee cells in this region is processed in parallel.
-        // @@@ Currently we only go a little bit faster with multiple threads,
-        // probably because we're saturating memory bandwidth.
-
-        // Because of parallelism we must precompute the offsets into the Psi
-        // array that each slice will use. Fortunately this is constant per
-        // slice within a region. pps = Psi per slice:
-        int pps = 2 * (xstretch[rx] + ystretch[ry] + zstretch[rz]) *
-                      (xcoords[rx + 1] - xcoords[rx]) *
-                      (ycoords[ry + 1] - ycoords[ry]);
-        int z1 = zcoords[rz];
-        int z2 = zcoords[rz + 1];
-        ParallelFor(z1, z2-1, kNumThreads, [&](int z) mutable {
-          float *slice_Psi = Psi + (z - z1)*pps;
-          float *last_Psi = (this->*(helpers[xstretch[rx] + ystretch[ry]*2 +
-                                             zstretch[rz]*4 + step_H*8]))
-            (dt, xcoords[rx], xcoords[rx + 1], ycoords[ry], ycoords[ry + 1],
-             z, z+1, slice_Psi);
-          if (last_Psi > slice_Psi + pps) {
-            // The slice update overran its allocated portion of the Psi
-            // buffer.
-            Panic("INTERNAL ERROR: PER-Z-SLICE PSI ARRAY OVERFLOW");
-          }
-        });
-        Psi += (z2 - z1) * pps;
+        pps[rx][ry][rz] = 2 * (xstretch[rx] + ystretch[ry] + zstretch[rz]) *
+                              (xcoords[rx + 1] - xcoords[rx]) *
+                              (ycoords[ry + 1] - ycoords[ry]);
+        region_Psi[rx][ry][rz] = Psi;
+        Psi += (zcoords[rz + 1] - zcoords[rz]) * pps[rx][ry][rz];
       }
     }
   }
 
-  // Make sure we did not overflow the half of the Psi array we are using.
-  CHECK_MSG(Psi <= Psi_ + (1 + step_H) * (PsiArraySize() / 2),
-            "Internal error: Psi array overflow");
+  // Each slice is updated one region at a time.
+  parts->clear();
+  slices->clear();
+  int rz = 0;
+  for (int z = rangez.lo(); z <= rangez.hi(); z++) {
+    if (z >= zcoords[rz + 1]) {
+      rz++;
+    }
+    slices->push_back(parts->size());
+    for (int rx = 0; rx < xcount; rx++) {
+      for (int ry = 0; ry < ycount; ry++) {
+        SlicePart p;
+        p.helper = table[xstretch[rx] + ystretch[ry]*2 + zstretch[rz]*4 +
+                         step_H*8];
+        p.x1 = xcoords[rx];
+        p.x2 = xcoords[rx + 1];
+        p.y1 = ycoords[ry];
+        p.y2 = ycoords[ry + 1];
+        p.Psi = region_Psi[rx][ry][rz] + (z - zcoords[rz]) * pps[rx][ry][rz];
+        p.Psi_end = p.Psi + pps[rx][ry][rz];
+        parts->push_back(p);
+      }
+    }
+  }
+  slices->push_back(parts->size());
   return Psi;
 }
 
+void CD::StepSlice(double dt, int z, const SlicePart *begin,
+                   const SlicePart *end) {
+  for (const SlicePart *p = begin; p != end; p++) {
+    float *last_Psi = (this->*(p->helper))(dt, p->x1, p->x2, p->y1, p->y2,
+                                           z, z+1, p->Psi);
+    if (last_Psi > p->Psi_end) {
+      // The slice update overran its allocated portion of the Psi buffer.
+      Panic("INTERNAL ERROR: PER-Z-SLICE PSI ARRAY OVERFLOW");
+    }
+  }
+}
+
+void CD::SetTimestep(double dt) {
+  // Compute 'a' and 'b' arrays for this timestep.
+  if (ab_dt_ != dt) {
+    ab_dt_ = dt;
+    SetupAB(dt, dx_, nx_, 0.0, ab_.axE.data(), ab_.bxE.data());
+    SetupAB(dt, dy_, ny_, 0.0, ab_.ayE.data(), ab_.byE.data());
+    SetupAB(dt, dz_, nz_, 0.0, ab_.azE.data(), ab_.bzE.data());
+    SetupAB(dt, dx_, nx_, 0.5, ab_.axH.data(), ab_.bxH.data());
+    SetupAB(dt, dy_, ny_, 0.5, ab_.ayH.data(), ab_.byH.data());
+    SetupAB(dt, dz_, nz_, 0.5, ab_.azH.data(), ab_.bzH.data());
+  }
+}
+
 void CD::PECVoxels(const vector<int> &voxel_indexes) {
   // Total size of E_ array.
   const size_t size = (nx_ + 1)*(ny_ + 1)*(nz_ + 1);
@@ -419,29 +529,32 @@ void CD::PECVoxels(const vector<int> &voxel_indexes) {
     int index = voxel_indexes[i];
     CHECK_MSG(index >= 0 && (index + sx + sy + sz) < size,
               "'voxel_indexes' values out of range");
-    E_[index].x = 0;
-    E_[index].y = 0;
-    E_[index].z = 0;
-    E_[index + sx].y = 0;
-    E_[index + sx].z = 0;
-    E_[index + sy].x = 0;
-    E_[index + sy].z = 0;
-    E_[index + sz].x = 0;
-    E_[index + sz].y = 0;
-    E_[index + sy + sz].x = 0;
-    E_[index + sx + sz].y = 0;
-    E_[index + sx + sy].z = 0;
+    *FieldComponent(E_, 0, index) = 0;
+    *FieldComponent(E_, 1, index) = 0;
+    *FieldComponent(E_, 2, index) = 0;
+    *FieldComponent(E_, 1, index + sx) = 0;
+    *FieldComponent(E_, 2, index + sx) = 0;
+    *FieldComponent(E_, 0, index + sy) = 0;
+    *FieldComponent(E_, 2, index + sy) = 0;
+    *FieldComponent(E_, 0, index + sz) = 0;
+    *FieldComponent(E_, 1, index + sz) = 0;
+    *FieldComponent(E_, 0, index + sy + sz) = 0;
+    *FieldComponent(E_, 1, index + sx + sz) = 0;
+    *FieldComponent(E_, 2, index + sx + sy) = 0;
   }
 }
 
 double CD::EFieldChange(const CD &cd_snapshot) {
+  // The sums don't depend on the order of the field components, so this works
+  // for both layouts (which must be the same for both CDs).
+  CHECK_MSG(layout_ == cd_snapshot.layout_, "Layouts must be the same");
   double Esum = 0, Dsum = 0;
-  int sz = (nx_+1) * (ny_+1) * (nz_+1);
+  int sz = 3 * (nx_+1) * (ny_+1) * (nz_+1);
+  const float *E = &E_[0].x;
+  const float *S = &cd_snapshot.E_[0].x;
   for (int i = 0; i < sz; i++) {
-    Esum += sqr(E_[i].x) + sqr(E_[i].y) + sqr(E_[i].z);
-    Dsum += sqr(E_[i].x - cd_snapshot.E_[i].x) +
-            sqr(E_[i].y - cd_snapshot.E_[i].y) +
-            sqr(E_[i].z - cd_snapshot.E_[i].z);
+    Esum += sqr(E[i]);
+    Dsum += sqr(E[i] - S[i]);
   }
   return sqrt(Dsum) / sqrt(Esum);
 }
@@ -681,4 +794,438 @@ float* CD::StepH_Helper(double dt, int x1, int x2, int y1, int y2,
   return Psi;
 }
 
+//***************************************************************************
+// SIMD field stepping for LAYOUT_SOA.
+//
+// With the structure-of-arrays layout a row of cells along x is a run of
+// consecutive floats in each component array, so the curl updates of W
+// adjacent cells can be done with W-wide vector instructions. The row kernels
+// below are written once using GCC vector extensions and compiled for each
+// instruction set, with a scalar version used for the ends of rows and on
+// other CPUs and compilers. The kernel is selected at run time by CPU feature
+// detection.
+//
+// The Psi variables of a row are stored as 2*(number of stretched axes)
+// arrays of row-length floats, in the same x,y,z axis order that the
+// LAYOUT_AOS code uses per cell. Each row therefore uses the same amount of
+// Psi as it does with LAYOUT_AOS, and the per-slice Psi offsets computed by
+// StepRanges() apply to both layouts.
+
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define __FDTD_X86_SIMD__
+typedef float Float8 __attribute__((vector_size(32)));
+typedef float Float16 __attribute__((vector_size(64)));
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define FDTD_INLINE inline __attribute__((always_inline))
+#else
+#define FDTD_INLINE inline
+#endif
+
+static int simd_limit = CD::SIMD_AVX512;        // Set by LimitSIMD()
+
+int CD::SIMDLevel() {
+#ifdef __FDTD_X86_SIMD__
+  static const int supported = (__builtin_cpu_init(),
+      __builtin_cpu_supports("avx512f") ? SIMD_AVX512 :
+      __builtin_cpu_supports("avx2") ? SIMD_AVX2 : SIMD_NONE);
+  return std::min(supported, simd_limit);
+#else
+  return SIMD_NONE;
+#endif
+}
+
+void CD::LimitSIMD(int level) {
+  simd_limit = level;
+}
+
+namespace {
+
+// Arguments for updating one row of cells. The component arrays are offset to
+// the start of the row, so they are indexed by the x coordinate.
+struct SoARow {
+  float *F[3];                  // Field being updated (E or H)
+  const float *G[3];            // Field whose curl is taken (H or E)
+  int sy, sz;                   // Offsets to the y,z neighbors in G
+  float kx, ky, kz;             // Scale factors for differences along x,y,z
+  const float *ax, *bx;         // Psi filter constants along x
+  float ay, by, az, bz;         // Psi filter constants for this row
+  float *Psi;                   // Psi variables for this row
+  int x1, len;                  // First x coordinate and length of the row
+};
+
+// Unaligned vector loads and stores. V is a vector type or float.
+template<class V> FDTD_INLINE void Load(V *v, const float *p) {
+  memcpy(v, p, sizeof(V));
+}
+template<class V> FDTD_INLINE void Store(float *p, const V &v) {
+  memcpy(p, &v, sizeof(V));
+}
+
+// Coordinate stretch handling, as in HANDLE_STRETCH but for W cells at once.
+template<class V> FDTD_INLINE void Stretch(const V &a, const V &b, float *P,
+                                           int len, V *delta1, V *delta2) {
+  V psi1, psi2;
+  Load(&psi1, P);
+  Load(&psi2, P + len);
+  psi1 = b * psi1 + a * (*delta1);
+  psi2 = b * psi2 + a * (*delta2);
+  Store(P, psi1);
+  Store(P + len, psi2);
+  *delta1 += psi1;
+  *delta2 += psi2;
+}
+
+// Update cells [i1,i2) of a row, which must be a multiple of the vector width
+// in size. For E, 'xskip' is the offset to the lower x neighbor (0 at x=0).
+template<class V, bool step_H, bool x_stretched, bool y_stretched,
+         bool z_stretched>
+FDTD_INLINE void StepSpan(const SoARow &r, int i1, int i2, int xskip) {
+  const int W = sizeof(V) / sizeof(float);
+  const V kx = V{} + r.kx;
+  const V ky = V{} + r.ky;
+  const V kz = V{} + r.kz;
+  const V ay = V{} + r.ay;
+  const V by = V{} + r.by;
+  const V az = V{} + r.az;
+  const V bz = V{} + r.bz;
+  float *Px = r.Psi - r.x1;
+  float *Py = Px + 2 * x_stretched * r.len;
+  float *Pz = Py + 2 * y_stretched * r.len;
+  for (int ix = i1; ix < i2; ix += W) {
+    // Load the G field at the cell and its neighbors, and compute deltas as
+    // in the COMPUTE_{E,H}_DELTAS_AND_HANDLE_STRETCH macros.
+    V Gx, Gy, Gz, Gxy, Gxz, Gyx, Gyz, Gzx, Gzy;
+    const int sx = step_H ? 1 : xskip;
+    Load(&Gx, r.G[0] + ix);
+    Load(&Gy, r.G[1] + ix);
+    Load(&Gz, r.G[2] + ix);
+    Load(&Gxy, r.G[1] + ix + sx);
+    Load(&Gxz, r.G[2] + ix + sx);
+    Load(&Gyx, r.G[0] + ix + r.sy);
+    Load(&Gyz, r.G[2] + ix + r.sy);
+    Load(&Gzx, r.G[0] + ix + r.sz);
+    Load(&Gzy, r.G[1] + ix + r.sz);
+    V Dxy = step_H ? Gxy - Gy : Gy - Gxy;
+    V Dxz = step_H ? Gxz - Gz : Gz - Gxz;
+    V Dyx = step_H ? Gyx - Gx : Gx - Gyx;
+    V Dyz = step_H ? Gyz - Gz : Gz - Gyz;
+    V Dzx = step_H ? Gzx - Gx : Gx - Gzx;
+    V Dzy = step_H ? Gzy - Gy : Gy - Gzy;
+    if (x_stretched) {
+      V ax, bx;
+      Load(&ax, r.ax + ix);
+      Load(&bx, r.bx + ix);
+      Stretch(ax, bx, Px + ix, r.len, &Dxy, &Dxz);
+    }
+    if (y_stretched) {
+      Stretch(ay, by, Py + ix, r.len, &Dyx, &Dyz);
+    }
+    if (z_stretched) {
+      Stretch(az, bz, Pz + ix, r.len, &Dzx, &Dzy);
+    }
+
+    // Update the F field.
+    V Fx, Fy, Fz;
+    Load(&Fx, r.F[0] + ix);
+    Load(&Fy, r.F[1] + ix);
+    Load(&Fz, r.F[2] + ix);
+    if (step_H) {
+      Fx += Dzy * kz - Dyz * ky;
+      Fy += Dxz * kx - Dzx * kz;
+      Fz += Dyx * ky - Dxy * kx;
+    } else {
+      Fx += Dyz * ky - Dzy * kz;
+      Fy += Dzx * kz - Dxz * kx;
+      Fz += Dxy * kx - Dyx * ky;
+    }
+    Store(r.F[0] + ix, Fx);
+    Store(r.F[1] + ix, Fy);
+    Store(r.F[2] + ix, Fz);
+  }
+}
+
+// Update cells [x1,x2) of a row using V-sized vectors where possible.
+template<class V, bool step_H, bool xs, bool ys, bool zs>
+FDTD_INLINE void StepRow(const SoARow &r, int x1, int x2) {
+  if (!step_H && x1 == 0) {
+    // The x=0 E cell has no lower x neighbor, see StepE_Helper().
+    StepSpan<float, step_H, xs, ys, zs>(r, 0, 1, 0);
+    x1 = 1;
+  }
+  const int W = sizeof(V) / sizeof(float);
+  int xv = x1 + (x2 - x1) / W * W;
+  StepSpan<V, step_H, xs, ys, zs>(r, x1, xv, -1);
+  StepSpan<float, step_H, xs, ys, zs>(r, xv, x2, -1);
+}
+
+typedef void (*StepRow_fn_t)(const SoARow &r, int x1, int x2);
+
+template<bool step_H, bool xs, bool ys, bool zs>
+void StepRowScalar(const SoARow &r, int x1, int x2) {
+  StepRow<float, step_H, xs, ys, zs>(r, x1, x2);
+}
+
+#ifdef __FDTD_X86_SIMD__
+template<bool step_H, bool xs, bool ys, bool zs> __attribute__((target("avx2")))
+void StepRowAVX2(const SoARow &r, int x1, int x2) {
+  StepRow<Float8, step_H, xs, ys, zs>(r, x1, x2);
+}
+
+template<bool step_H, bool xs, bool ys, bool zs>
+__attribute__((target("avx512f")))
+void StepRowAVX512(const SoARow &r, int x1, int x2) {
+  StepRow<Float16, step_H, xs, ys, zs>(r, x1, x2);
+}
+#endif
+
+template<bool step_H, bool xs, bool ys, bool zs>
+StepRow_fn_t SelectStepRow() {
+  switch (CD::SIMDLevel()) {
+#ifdef __FDTD_X86_SIMD__
+    case CD::SIMD_AVX512: return StepRowAVX512<step_H, xs, ys, zs>;
+    case CD::SIMD_AVX2: return StepRowAVX2<step_H, xs, ys, zs>;
+#endif
+    default: return StepRowScalar<step_H, xs, ys, zs>;
+  }
+}
+
+}  // namespace
+
+template<bool step_H, bool x_stretched, bool y_stretched, bool z_stretched>
+float* CD::StepSoA_Helper(double dt, int x1, int x2, int y1, int y2,
+        int z1, int z2, float *Psi) {
+  // The boundary and toroid handling here follows StepE_Helper() and
+  // StepH_Helper().
+  if (!step_H) {
+    CHECK_MSG((toroid_ & TOROID_X) == 0, "TOROID_X not fully implemented yet");
+    CHECK_MSG((toroid_ & TOROID_Z) == 0, "TOROID_Z not fully implemented yet");
+  }
+  const double k = step_H ? kMu : kEpsilon;
+  const AB_Arrays &ab = ab_;
+  const float *ay = step_H ? ab.ayH.data() : ab.ayE.data();
+  const float *az = step_H ? ab.azH.data() : ab.azE.data();
+  const float *by = step_H ? ab.byH.data() : ab.byE.data();
+  const float *bz = step_H ? ab.bzH.data() : ab.bzE.data();
+
+  const int sy = (nx_ + 1);             // Array skip in the Y direction
+  const int sz = (nx_ + 1) * (ny_ + 1); // Array skip in the Z direction
+  const size_t n = size_t(sz) * (nz_ + 1);
+  float *F = reinterpret_cast<float*>(step_H ? H_ : E_);
+  const float *G = reinterpret_cast<float*>(step_H ? E_ : H_);
+
+  SoARow r;
+  r.kx = float(dt / k / dx_);
+  r.ky = float(dt / k / dy_);
+  r.kz = float(dt / k / dz_);
+  r.ax = step_H ? ab.axH.data() : ab.axE.data();
+  r.bx = step_H ? ab.bxH.data() : ab.bxE.data();
+  r.x1 = x1;
+  r.len = x2 - x1;
+  const int psi_per_row = 2 * (x_stretched + y_stretched + z_stretched) *
+                          (x2 - x1);
+  StepRow_fn_t step_row =
+      SelectStepRow<step_H, x_stretched, y_stretched, z_stretched>();
+
+  for (int iz = z1; iz < z2; iz++) {
+    if (step_H) {
+      r.sz = sz;
+    } else {
+      r.sz = (iz == 0) ? ((toroid_ & TOROID_Z) ? (sz * (nz_-1)) : 0) : (-sz);
+    }
+    r.az = az[iz];
+    r.bz = bz[iz];
+    for (int iy = y1; iy < y2; iy++) {
+      if (step_H) {
+        r.sy = sy;
+      } else {
+        r.sy = (iy == 0) ? ((toroid_ & TOROID_Y) ? (sy * (ny_-1)) : 0) : (-sy);
+      }
+      r.ay = ay[iy];
+      r.by = by[iy];
+      for (int c = 0; c < 3; c++) {
+        r.F[c] = F + c*n + iy*sy + iz*sz;
+        r.G[c] = G + c*n + iy*sy + iz*sz;
+      }
+      r.Psi = Psi;
+      step_row(r, x1, x2);
+      Psi += psi_per_row;
+    }
+
+    // Copy y=0 E field to the opposite face if necessary.
+    if (!step_H && (toroid_ & TOROID_Y)) {
+      for (int c = 0; c < 3; c++) {
+        memcpy(F + c*n + ny_*sy + iz*sz, F + c*n + iz*sz, nx_ * sizeof(float));
+      }
+    }
+  }
+
+  return Psi;
+}
+
+//***************************************************************************
+// Testing.
+
+// Fill the E and H fields of the CD with random values.
+static void RandomizeFields(CD *cd) {
+  for (int c = 0; c < 3; c++) {
+    for (int z = 0; z < cd->nz(); z++) {
+      for (int y = 0; y < cd->ny(); y++) {
+        for (int x = 0; x < cd->nx(); x++) {
+          int sx, sy, sz;
+          *cd->GetEBox(c, Range(x), Range(y), Range(z), &sx, &sy, &sz) =
+              RandomDouble() - 0.5;
+          *cd->GetHBox(c, Range(x), Range(y), Range(z), &sx, &sy, &sz) =
+              (RandomDouble() - 0.5) * 1e-3;
+        }
+      }
+    }
+  }
+}
+
+TEST_FUNCTION(FDTDLayouts) {
+  // Check that stepping a LAYOUT_SOA CD gives the same fields as stepping a
+  // LAYOUT_AOS CD, for each available SIMD instruction set, with and without
+  // a PML and toroid symmetry.
+  const int nx = 37, ny = 19, nz = 13;
+  for (int config = 0; config < 2; config++) {
+    int pml = config ? CD::PML_ALL : 0;
+    int pml_depth = config ? 4 : 0;
+    int toroid = config ? 0 : CD::TOROID_Y;
+    CD aos(nx, ny, nz, 1e-3, 2e-3, 1.5e-3, pml, pml_depth, toroid);
+    RandomSeed(config);
+    RandomizeFields(&aos);
+    const int kSteps = 20;
+    double dt = aos.GetCourantStep() * 0.9;
+    CD aos_stepped(aos);
+    for (int i = 0; i < kSteps; i++) {
+      aos_stepped.Step(dt, true);
+      aos_stepped.Step(dt, false);
+    }
+
+    for (int level = CD::SIMD_NONE; level <= CD::SIMD_AVX512; level++) {
+      CD::LimitSIMD(level);
+      if (CD::SIMDLevel() != level) {
+        continue;
+      }
+      CD soa(nx, ny, nz, 1e-3, 2e-3, 1.5e-3, pml, pml_depth, toroid,
+             CD::LAYOUT_SOA);
+      for (int c = 0; c < 3; c++) {
+        for (int z = 0; z <= nz; z++) {
+          for (int y = 0; y <= ny; y++) {
+            for (int x = 0; x <= nx; x++) {
+              int sx, sy, sz;
+              Range rx(x), ry(y), rz(z);
+              *soa.GetEBox(c, rx, ry, rz, &sx, &sy, &sz) =
+                  *aos.GetEBox(c, rx, ry, rz, &sx, &sy, &sz);
+              *soa.GetHBox(c, rx, ry, rz, &sx, &sy, &sz) =
+                  *aos.GetHBox(c, rx, ry, rz, &sx, &sy, &sz);
+            }
+          }
+        }
+      }
+      for (int i = 0; i < kSteps; i++) {
+        soa.Step(dt, true);
+        soa.Step(dt, false);
+      }
+      double max_error = 0, max_E = 0;
+      for (int c = 0; c < 3; c++) {
+        for (int z = 0; z <= nz; z++) {
+          for (int y = 0; y <= ny; y++) {
+            for (int x = 0; x <= nx; x++) {
+              float e = aos_stepped.GetE(c, x, y, z);
+              max_error = std::max(max_error,
+                                   double(fabs(e - soa.GetE(c, x, y, z))));
+              max_E = std::max(max_E, double(fabs(e)));
+            }
+          }
+        }
+      }
+      printf("Config %d, SIMD level %d: max error = %g (max E = %g)\n",
+             config, level, max_error, max_E);
+      CHECK(max_E > 0);
+      CHECK(max_error < 1e-5 * max_E);
+    }
+    CD::LimitSIMD(CD::SIMD_AVX512);
+  }
+}
+
+TEST_FUNCTION(FDTDStepBlocked) {
+  // Check that StepBlocked() gives exactly the same fields as Step(), for both
+  // layouts, with and without a PML and toroid symmetry, for various thread
+  // counts and numbers of steps (including partial groups).
+  const int nx = 23, ny = 17, nz = 29;
+  for (int config = 0; config < 4; config++) {
+    int pml = (config & 1) ? CD::PML_ALL : 0;
+    int pml_depth = (config & 1) ? 5 : 0;
+    int toroid = (config & 1) ? 0 : CD::TOROID_Y;
+    int layout = (config & 2) ? CD::LAYOUT_SOA : CD::LAYOUT_AOS;
+    CD cd(nx, ny, nz, 1e-3, 1e-3, 2e-3, pml, pml_depth, toroid, layout);
+    RandomSeed(config);
+    RandomizeFields(&cd);
+    double dt = cd.GetCourantStep() * 0.9;
+    for (int num_threads = 1; num_threads <= 4; num_threads += 3) {
+      for (int num_steps = 1; num_steps <= 7; num_steps += 3) {
+        CD stepped(cd), blocked(cd);
+        for (int i = 0; i < num_steps; i++) {
+          stepped.Step(dt, true);
+          stepped.Step(dt, false);
+        }
+        blocked.SetNumThreads(num_threads);
+        blocked.StepBlocked(dt, num_steps);
+        blocked.Step(dt, true);         // Check Psi is compatible with Step()
+        blocked.Step(dt, false);
+        stepped.Step(dt, true);
+        stepped.Step(dt, false);
+        CHECK(blocked.EFieldChange(stepped) == 0);
+        CHECK(stepped.EFieldChange(cd) > 0);
+      }
+    }
+  }
+}
+
+TEST_FUNCTION(FDTDBenchmark) {
+  // Report Yee cell updates per second (for one E and one H step) for a 256^3
+  // domain with and without a PML, for each layout and SIMD instruction set,
+  // using Step() and StepBlocked().
+  const int n = 256;
+  const int kSteps = 8;
+  for (int with_pml = 0; with_pml < 2; with_pml++) {
+    for (int level = -1; level <= CD::SIMD_AVX512; level++) {
+      // Level -1 means LAYOUT_AOS.
+      CD::LimitSIMD(std::max(level, 0));
+      if (level >= 0 && CD::SIMDLevel() != level) {
+        continue;
+      }
+      CD cd(n, n, n, 1e-3, 1e-3, 1e-3, with_pml ? CD::PML_ALL : 0,
+            with_pml ? 10 : 0, 0, level < 0 ? CD::LAYOUT_AOS : CD::LAYOUT_SOA);
+      double dt = cd.GetCourantStep();
+      int sx, sy, sz;
+      *cd.GetEBox(2, Range(n/2), Range(n/2), Range(n/2), &sx, &sy, &sz) = 1;
+      cd.Step(dt, true);        // Warm up
+      cd.Step(dt, false);
+      for (int blocked = 0; blocked < 2; blocked++) {
+        double start_time = Now();
+        if (blocked) {
+          cd.StepBlocked(dt, kSteps);
+        } else {
+          for (int i = 0; i < kSteps; i++) {
+            cd.Step(dt, true);
+            cd.Step(dt, false);
+          }
+        }
+        double time = Now() - start_time;
+        const char *names[] = {"AoS", "SoA scalar", "SoA AVX2", "SoA AVX-512"};
+        printf("%-12s %s PML, %s: %.1f M cell updates/s\n", names[level + 1],
+               with_pml ? "with   " : "without",
+               blocked ? "StepBlocked" : "Step       ",
+               double(n)*n*n*kSteps/time/1e6);
+      }
+    }
+  }
+  CD::LimitSIMD(CD::SIMD_AVX512);
+}
+
 } // namespace fdtd
@@ -19,6 +19,7 @@
 #define __TOOLKIT_FDTD_H__
 
 #include <vector>
+#include <algorithm>
 #include "error.h"
 
 namespace fdtd {
@@ -120,15 +121,27 @@ class CD {
     TOROID_X = 1,
     TOROID_Y = 2,
     TOROID_Z = 4,
+
+    // Field storage layouts. LAYOUT_AOS interleaves the x,y,z components of
+    // each grid cell, LAYOUT_SOA stores each component in a separate array so
+    // that the field stepping can use SIMD instructions.
+    LAYOUT_AOS = 0,
+    LAYOUT_SOA = 1,
+
+    // SIMD instruction sets used by the LAYOUT_SOA field stepping.
+    SIMD_NONE = 0,
+    SIMD_AVX2 = 1,
+    SIMD_AVX512 = 2,
   };
 
   // Create a new standalone computational domain. The size of the
   // computational domain in Yee cells is nx,ny,nz. The size of each yee cell
   // is dx,dy,dz. The walls that have a PML are indicated by bits in 'pml'. The
   // depth of the PML is cells is 'pml_depth'. Toriodal symmetries are
-  // indicated by bits in 'toroid'.
+  // indicated by bits in 'toroid'. The field storage layout is given by
+  // 'layout', one of the LAYOUT_* constants.
   CD(int nx, int ny, int nz, double dx, double dy, double dz,
-     int pml, int pml_depth, int toroid = 0);
+     int pml, int pml_depth, int toroid = 0, int layout = LAYOUT_AOS);
 
   // Create a copy of a computational domain. If E-only is true then just copy
   // the E-field, don't allocate or copy the H or Psi data (e.g. for
@@ -151,6 +164,12 @@ class CD {
   double dz() const { return dz_; }
   int pml() const { return pml_; }
   int pml_depth() const { return pml_depth_; }
+  int layout() const { return layout_; }
+  int num_threads() const { return num_threads_; }
+
+  // Set the number of threads used for field stepping. The default is the
+  // number of hardware threads.
+  void SetNumThreads(int n) { num_threads_ = std::max(n, 1); }
 
   // Access individual field components. The Yee cell index is (x,y,z), the
   // field component is 'c'.
@@ -158,8 +177,7 @@ class CD {
     DBG_CHECK_MSG(x >= 0 && x <= nx_ && y >= 0 && y <= ny_ &&
                   z >= 0 && z <= nz_ && c >= 0 && c <= 2,
                   "Arguments out of range");
-    Field *e = E_ + x + (nx_+1)*y + (nx_+1)*(ny_+1)*z;
-    return (&e->x)[c];          // Assuming struct Field layout tested in CD::CD
+    return *FieldComponent(E_, c, x + (nx_+1)*y + (nx_+1)*(ny_+1)*z);
   }
 
   // Access one field component in a range of Yee cells. Return an error if the
@@ -172,7 +190,9 @@ class CD {
                  int *sx, int *sy, int *sz) const;
 
   // Access all E field components as a 3D matrix in 'matlab' format, returning
-  // the size of each dimension. This is for export to matlab files only.
+  // the size of each dimension. This is for export to matlab files only. The
+  // component is the first dimension for LAYOUT_AOS and the last dimension for
+  // LAYOUT_SOA.
   float *GetEMatlab(int32_t dims[4]) const;
 
   // Return the step size dictated by the Courant condition. The dt value
@@ -196,6 +216,16 @@ class CD {
   float *StepRanges(double dt, bool step_H, float *starting_Psi,
                     Range rangex, Range rangey, Range rangez);
 
+  // Take 'num_steps' time steps of both fields. This gives the same result as
+  //   for (int i = 0; i < num_steps; i++) {
+  //     Step(dt, true);
+  //     Step(dt, false);
+  //   }
+  // but sweeps a wavefront of z slices through the CD that advances each
+  // slice by several time steps while it is in cache, updating the slices on
+  // the wavefront in parallel. This can be mixed freely with Step().
+  void StepBlocked(double dt, int num_steps);
+
   // Zero out the tangential E field of all the voxels whos linear indexes are
   // mentioned in voxel_indexes.
   void PECVoxels(const vector<int> &voxel_indexes);
@@ -209,6 +239,14 @@ class CD {
   // Compute the size of the Psi array needed for a PML.
   int PsiArraySize();
 
+  // Return the SIMD instruction set (a SIMD_* constant) that LAYOUT_SOA field
+  // stepping uses. This is the best one the CPU supports, unless LimitSIMD()
+  // has lowered it.
+  static int SIMDLevel();
+
+  // Use at most the given SIMD instruction set, for testing and benchmarking.
+  static void LimitSIMD(int level);
+
  private:
   // Size of the computational domain in Yee cells.
   int nx_, ny_, nz_;
@@ -218,7 +256,9 @@ class CD {
 
   // Arrays of [nx+1][ny+1][nz+1] grid cells that store E and H vectors. We
   // store E and H in separate areas of memory. Colocating them slows field
-  // stepping down by about 20%.
+  // stepping down by about 20%. With LAYOUT_SOA the same memory holds three
+  // consecutive arrays of (nx+1)*(ny+1)*(nz+1) floats, one per component, so
+  // Field is just the unit of allocation.
   struct Field {                // Field vector (E or H)
     float x, y, z;
   };
@@ -229,6 +269,8 @@ class CD {
   int pml_;                     // Combination of PML_* constants
   int pml_depth_;               // How deep (in Yee cells) the PML is
   int toroid_;                  // Combination of TOROID_* constants
+  int layout_;                  // LAYOUT_* constant
+  int num_threads_;             // Number of threads used for field stepping
 
   // The cached 'a' and 'b' filter constant arrays for Psi variables.
   struct AB_Arrays {
@@ -247,6 +289,9 @@ class CD {
   // for non-PML cells.
   float *__restrict Psi_;
 
+  // Setup the ab_ arrays for the time step dt, if they are not already.
+  void SetTimestep(double dt);
+
   // Setup the 'a' and 'b' filter constant arrays for Psi variables, for a
   // single axis. The arrays have size 'n'. The coordinate is offset by 'ofs',
   // which is 0 to compute the values for the left side of the cells and 0.5
@@ -278,6 +323,43 @@ class CD {
   float* StepH_Helper(double dt, int x1, int x2, int y1, int y2,
       int z1, int z2, float *Psi);
 
+  // Part of a z slice that is updated by a single Step*_Helper() call, with
+  // the Psi variables allocated to it.
+  struct SlicePart {
+    Step_Helper_fn_t helper;
+    int x1, x2, y1, y2;
+    float *Psi, *Psi_end;
+  };
+
+  // Divide the cells in the ranges into the SliceParts updated by a half
+  // step, allocating Psi variables starting at 'Psi'. The parts for slice
+  // rangez.lo()+i are parts[slices[i]] .. parts[slices[i+1]-1]. The Psi
+  // allocation is the same whichever order the slices are then updated in.
+  // Return the Psi pointer after the last part.
+  float *PlanSlices(bool step_H, float *Psi, Range rangex, Range rangey,
+                    Range rangez, vector<SlicePart> *parts,
+                    vector<int> *slices);
+
+  // Update slice z by calling the helpers for parts [begin,end).
+  void StepSlice(double dt, int z, const SlicePart *begin,
+                 const SlicePart *end);
+
+  // Like StepE_Helper() and StepH_Helper() but for LAYOUT_SOA, where each row
+  // of cells is handed to a SIMD kernel.
+  template<bool step_H, bool x_stretched, bool y_stretched, bool z_stretched>
+  float* StepSoA_Helper(double dt, int x1, int x2, int y1, int y2,
+      int z1, int z2, float *Psi);
+
+  // Return the address of component 'c' of the grid cell at linear index
+  // 'index' in the field F, for either layout.
+  float *FieldComponent(Field *F, int c, size_t index) const {
+    if (layout_ == LAYOUT_SOA) {
+      size_t n = size_t(nx_+1) * (ny_+1) * (nz_+1);
+      return reinterpret_cast<float*>(F) + c*n + index;
+    }
+    return (&F[index].x) + c;   // Assuming struct Field layout tested in CD::CD
+  }
+
   // To support GetEBox(), GetHBox().
   float *GetFieldBox(Field *F, int c, Range rx, Range ry, Range rz,
                      int *sx_ret, int *sy_ret, int *sz_ret) const;
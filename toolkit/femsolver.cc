@@ -200,6 +200,71 @@ TEST_FUNCTION(CreateAndSolveSystem) {
   }
 }
 
+TEST_FUNCTION(ScatterAssembly) {
+  // Check that the system matrices assembled through the scatter map are the
+  // same as the ones assembled from the debugging triplets.
+  for (int create_C = 0; create_C < 2; create_C++) {
+    FEMSolver<ExampleFEMProblem> solver;
+    solver.debug_triplets = true;
+    CHECK(solver.CreateSystem(create_C));
+    CHECK(solver.scatter.size() == solver.NumTriangles() * 9);
+    CHECK(solver.Cvalues.size() == (create_C ? solver.Avalues.size() : 0));
+    for (int k = 0; k < 1 + create_C; k++) {
+      Eigen::SparseMatrix<double> A1, A2;
+      solver.GetSystemMatrix(k ? solver.Cvalues : solver.Avalues, &A1);
+      solver.GetSystemMatrix(k ? solver.Ctriplets : solver.triplets, &A2);
+      CHECK(A1.nonZeros() == A2.nonZeros());
+      CHECK(Eigen::MatrixXd(A1) == Eigen::MatrixXd(A2));
+      for (int i = 0; i <= A1.outerSize(); i++) {
+        CHECK(A1.outerIndexPtr()[i] == A2.outerIndexPtr()[i]);
+      }
+      for (int i = 0; i < A1.nonZeros(); i++) {
+        CHECK(A1.innerIndexPtr()[i] == A2.innerIndexPtr()[i]);
+      }
+    }
+  }
+}
+
+TEST_FUNCTION(ParallelAssembly) {
+  // Check that the triangle coloring is valid, i.e. that every triangle has
+  // exactly one color and triangles of the same color share no points.
+  FEMSolver<ExampleFEMProblem> solver1, solver2;
+  solver1.num_threads = 1;
+  solver2.num_threads = 4;
+  solver2.test_f = solver1.test_f;
+  solver2.test_g = solver1.test_g;
+  solver2.test_a = solver1.test_a;
+  solver2.test_b = solver1.test_b;
+  CHECK(solver1.CreateSystem(false));
+  CHECK(solver2.CreateSystem(false));
+  CHECK(solver1.color_triangles.size() == solver1.NumTriangles());
+  CHECK(solver1.color_start.back() == solver1.NumTriangles());
+  vector<int> seen(solver1.NumTriangles());
+  for (int c = 0; c + 1 < solver1.color_start.size(); c++) {
+    vector<int> point_used(solver1.NumPoints());
+    for (int k = solver1.color_start[c]; k < solver1.color_start[c + 1];
+         k++) {
+      int i = solver1.color_triangles[k];
+      seen[i]++;
+      for (int j = 0; j < 3; j++) {
+        CHECK(point_used[solver1.Triangle(i, j)]++ == 0);
+      }
+    }
+  }
+  for (int i = 0; i < seen.size(); i++) {
+    CHECK(seen[i] == 1);
+  }
+  printf("%d triangles in %d colors\n", solver1.NumTriangles(),
+         int(solver1.color_start.size()) - 1);
+
+  // Check that the system does not depend on the number of threads.
+  CHECK(solver1.Avalues.size() == solver2.Avalues.size());
+  for (int i = 0; i < solver1.Avalues.size(); i++) {
+    CHECK(solver1.Avalues[i] == solver2.Avalues[i]);
+  }
+  CHECK(solver1.rhs == solver2.rhs);
+}
+
 TEST_FUNCTION(RobinBoundary) {
   // Check the sign of beta. The boundary constraint below is du/dnormal=1,
   // with normal pointing out of the boundary. This should ensure the entire
@@ -226,8 +291,7 @@ TEST_FUNCTION(ComputeSolutionDerivative) {
   FEMSolver<ExampleFEMProblem> solver;
   CHECK(solver.SolveSystem());
 
-  // Set random derivatives in triplets and the rhs.
-  vector<ExampleFEMProblem::Triplet> new_triplets;
+  // Set random derivatives in the system matrix and the rhs.
   CHECK(solver.solution.size() == 25);
   const int m = solver.SystemSize();
   CHECK(m == 16);
@@ -235,15 +299,14 @@ TEST_FUNCTION(ComputeSolutionDerivative) {
   Eigen::VectorXd dbdp(m);
   dAdp.setZero();
   dbdp.setZero();
-  for (int i = 0; i < solver.triplets.size(); i++) {
-    ExampleFEMProblem::Number value = solver.triplets[i].value();
-    double deriv = RandomDouble() * 2 - 1;
-    dAdp(solver.triplets[i].row(), solver.triplets[i].col()) += deriv;
-    value.derivative = deriv;
-    new_triplets.push_back(ExampleFEMProblem::Triplet(
-          solver.triplets[i].row(), solver.triplets[i].col(), value));
+  for (int col = 0; col < m; col++) {
+    for (int i = solver.system_outer[col]; i < solver.system_outer[col + 1];
+         i++) {
+      double deriv = RandomDouble() * 2 - 1;
+      dAdp(solver.system_inner[i], col) += deriv;
+      solver.Avalues[i].derivative = deriv;
+    }
   }
-  solver.triplets.swap(new_triplets);
   for (int i = 0; i < solver.rhs.size(); i++) {
     double deriv = RandomDouble() * 2 - 1;
     solver.rhs[i].derivative = deriv;
@@ -267,6 +330,166 @@ TEST_FUNCTION(ComputeSolutionDerivative) {
   }
 }
 
+TEST_FUNCTION(ComputeSolutionDerivatives) {
+  // Check that the batched derivatives are the same as the derivatives
+  // computed one parameter at a time, for both the direct and iterative
+  // solvers.
+  for (int iterative = 0; iterative < 2; iterative++) {
+    FEMSolver<ExampleFEMProblem> solver;
+    solver.use_iterative_solver = iterative;
+    CHECK(solver.SolveSystem());
+    const int kNumParameters = 5;
+    const int m = solver.SystemSize();
+    Eigen::MatrixXd dAvalues(solver.Avalues.size(), kNumParameters);
+    Eigen::MatrixXd drhs(m, kNumParameters);
+    for (int j = 0; j < kNumParameters; j++) {
+      for (int i = 0; i < dAvalues.rows(); i++) {
+        dAvalues(i, j) = RandomDouble() * 2 - 1;
+      }
+      for (int i = 0; i < m; i++) {
+        drhs(i, j) = RandomDouble() * 2 - 1;
+      }
+    }
+    Eigen::MatrixXd derivs;
+    CHECK(solver.ComputeSolutionDerivatives(dAvalues, drhs, &derivs));
+    CHECK(derivs.rows() == solver.NumPoints());
+    CHECK(derivs.cols() == kNumParameters);
+    for (int j = 0; j < kNumParameters; j++) {
+      for (int i = 0; i < dAvalues.rows(); i++) {
+        solver.Avalues[i].derivative = dAvalues(i, j);
+      }
+      for (int i = 0; i < m; i++) {
+        solver.rhs[i].derivative = drhs(i, j);
+      }
+      ExampleFEMProblem::MNumberVector deriv;
+      CHECK(solver.ComputeSolutionDerivative(&deriv));
+      double max_error = (deriv - derivs.col(j)).cwiseAbs().maxCoeff();
+      printf("Parameter %d max error = %e\n", j, max_error);
+      CHECK(max_error < 1e-9);
+    }
+  }
+}
+
+TEST_FUNCTION(ReducedSystem) {
+  // If the solution is in the span of the basis then the reduced solution is
+  // exact.
+  FEMSolver<ExampleFEMProblem> solver1, solver2, solver3;
+  solver2.test_f = solver1.test_f;
+  solver2.test_g = solver1.test_g;
+  solver2.test_a = solver1.test_a;
+  solver2.test_b = solver1.test_b;
+  CHECK(solver1.SolveSystem());
+  Eigen::MatrixXd basis;
+  solver1.AddSolutionToBasis(&basis);
+  solver1.AddSolutionToBasis(&basis);   // Already in the span, not added
+  CHECK(basis.cols() == 1);
+  CHECK(solver2.SolveReducedSystem(&basis));
+  printf("Residual = %e\n", solver2.reduced_residual);
+  CHECK(solver2.reduced_residual < 1e-10);
+  CHECK((solver1.solution - solver2.solution).cwiseAbs().maxCoeff() < 1e-10);
+
+  // If the basis spans the whole space then the reduced solution and its
+  // derivatives are the same as for the full system.
+  CHECK(solver3.SolveSystem());
+  const int m = solver3.SystemSize();
+  Eigen::MatrixXd identity = Eigen::MatrixXd::Identity(m, m);
+  FEMSolver<ExampleFEMProblem> solver4;
+  solver4.test_f = solver3.test_f;
+  solver4.test_g = solver3.test_g;
+  solver4.test_a = solver3.test_a;
+  solver4.test_b = solver3.test_b;
+  CHECK(solver4.SolveReducedSystem(&identity));
+  CHECK((solver3.solution - solver4.solution).cwiseAbs().maxCoeff() < 1e-10);
+  for (int i = 0; i < solver3.Avalues.size(); i++) {
+    double deriv = RandomDouble() * 2 - 1;
+    solver3.Avalues[i].derivative = deriv;
+    solver4.Avalues[i].derivative = deriv;
+  }
+  for (int i = 0; i < solver3.rhs.size(); i++) {
+    double deriv = RandomDouble() * 2 - 1;
+    solver3.rhs[i].derivative = deriv;
+    solver4.rhs[i].derivative = deriv;
+  }
+  ExampleFEMProblem::MNumberVector deriv3, deriv4;
+  CHECK(solver3.ComputeSolutionDerivative(&deriv3));
+  CHECK(solver4.ComputeSolutionDerivative(&deriv4));
+  CHECK((deriv3 - deriv4).cwiseAbs().maxCoeff() < 1e-10);
+}
+
+TEST_FUNCTION(IterativeSolver) {
+  // Check that the iterative solver gets the same solution and solution
+  // derivative as the factorizer.
+  FEMSolver<ExampleFEMProblem> solver1, solver2;
+  solver2.test_f = solver1.test_f;
+  solver2.test_g = solver1.test_g;
+  solver2.test_a = solver1.test_a;
+  solver2.test_b = solver1.test_b;
+  solver2.use_iterative_solver = true;
+  CHECK(solver1.SolveSystem());
+  CHECK(solver2.SolveSystem());
+  CHECK(solver1.factorizer && !solver1.iterative_solver);
+  CHECK(!solver2.factorizer && solver2.iterative_solver);
+  printf("Iterations = %d\n", int(solver2.iterative_solver->iterations()));
+  CHECK(solver1.solution.size() == solver2.solution.size());
+  double max_error =
+      (solver1.solution - solver2.solution).cwiseAbs().maxCoeff();
+  printf("Max solution error = %e\n", max_error);
+  CHECK(max_error < 1e-8);
+
+  // Set the same random derivatives in both systems.
+  CHECK(solver1.Avalues.size() == solver2.Avalues.size());
+  for (int i = 0; i < solver1.Avalues.size(); i++) {
+    double deriv = RandomDouble() * 2 - 1;
+    solver1.Avalues[i].derivative = deriv;
+    solver2.Avalues[i].derivative = deriv;
+  }
+  for (int i = 0; i < solver1.rhs.size(); i++) {
+    double deriv = RandomDouble() * 2 - 1;
+    solver1.rhs[i].derivative = deriv;
+    solver2.rhs[i].derivative = deriv;
+  }
+  ExampleFEMProblem::MNumberVector deriv1, deriv2;
+  CHECK(solver1.ComputeSolutionDerivative(&deriv1));
+  CHECK(solver2.ComputeSolutionDerivative(&deriv2));
+  CHECK(deriv1.size() == deriv2.size());
+  max_error = (deriv1 - deriv2).cwiseAbs().maxCoeff();
+  printf("Max derivative error = %e\n", max_error);
+  CHECK(max_error < 1e-8);
+}
+
+// Check that a solver that copies the symbolic analysis from another solver
+// gets the same solution as one that does its own analysis.
+template<class Problem> static void TestSharedAnalysis() {
+  FEMSolver<Problem> solver1, solver2, solver3;
+  solver3.test_f = solver2.test_f;
+  solver3.test_g = solver2.test_g;
+  solver3.test_a = solver2.test_a;
+  solver3.test_b = solver2.test_b;
+  CHECK(solver1.SolveSystem());
+  solver2.ShareAnalysis(&solver1);
+  CHECK(solver2.SolveSystem());
+  CHECK(solver3.SolveSystem());
+  CHECK(!solver1.analysis_copied);
+  CHECK(solver2.analysis_copied);
+  CHECK(!solver3.analysis_copied);
+  CHECK(solver2.solution.size() == solver3.solution.size());
+  double max_error =
+      (solver2.solution - solver3.solution).cwiseAbs().maxCoeff();
+  printf("Max error = %e\n", max_error);
+  CHECK(max_error < 1e-9);
+  CHECK((solver1.solution - solver3.solution).cwiseAbs().maxCoeff() > 1e-3);
+}
+
+struct ExampleLUFEMProblem : public ExampleFEMProblem {
+  typedef Eigen::SparseLU<Eigen::SparseMatrix<MNumber>,
+                          Eigen::COLAMDOrdering<int> > Factorizer;
+};
+
+TEST_FUNCTION(SharedAnalysis) {
+  TestSharedAnalysis<ExampleFEMProblem>();
+  TestSharedAnalysis<ExampleLUFEMProblem>();
+}
+
 TEST_FUNCTION(EigenSystem) {
   FEMSolver<ExampleFEMProblem> solver;
   for (int i = 0; i < solver.NumTriangles() * 3; i++) {
@@ -286,8 +509,8 @@ TEST_FUNCTION(EigenSystem) {
 
   // Make sure A*x = lambda*B*x for all x,lambda.
   Eigen::SparseMatrix<double> A, B;
-  solver.GetSystemMatrix(solver.triplets, &A);
-  solver.GetSystemMatrix(solver.Ctriplets, &B);
+  solver.GetSystemMatrix(solver.Avalues, &A);
+  solver.GetSystemMatrix(solver.Cvalues, &B);
   for (int i = 0; i < 5; i++) {
     const Eigen::VectorXd vec = solver.GetRawEigenvector(i);
     Eigen::VectorXd error = A*vec - solver.GetEigenvalue(i)*B*vec;
@@ -21,7 +21,6 @@
 // * Interpolate k instead of k^2 ?
 // * Fix the discontinuous gradient stuff
 // * Naming consistency: k^2, g(), C. Rename g as 'k2'?
-// * Is there a way we can avoid the copy of triplets on SolveSystem.
 // * Use an 'Index' type instead of 'int', for when we need more than 2^31
 //   points
 // * Linear interpolation of f,g,u for complex phasor fields is maybe less
@@ -31,11 +30,14 @@
 #define __TOOLKIT_FEMSOLVER_H__
 
 #include <vector>
+#include <algorithm>
+#include <atomic>
 #include "Eigen/Dense"
 #include "Eigen/Sparse"
 #include "error.h"
 #include "eigensolvers.h"
 #include "random.h"
+#include "thread.h"
 
 namespace FEM {
 
@@ -214,6 +216,13 @@ struct ExampleFEMProblem : public FEMProblem {
     return a.derivative;
   }
 
+  // Some Number types carry derivatives with respect to several parameters.
+  // Return how many, and extract derivative k, for ComputeSolutionJacobian().
+  int NumDerivatives() const { return 1; }
+  MNumber Derivative(const Number &a, int k) {
+    return a.derivative;
+  }
+
   // Class for performance tracing. Each instance of the class should measure
   // the amount of time it is alive and associate that with the description.
   struct DoTrace {
@@ -240,6 +249,63 @@ struct ExampleFEMProblem : public FEMProblem {
   };
 };
 
+//***************************************************************************
+// A wrapper for the problem's sparse matrix factorizer that allows the
+// symbolic analysis of a matrix (i.e. the result of analyzePattern(), the fill
+// reducing ordering, elimination tree etc) to be copied from another
+// factorizer that analyzed a matrix 'a' with the same sparsity pattern. Then
+// only the numeric factorize() step is needed. Eigen factorizers are not
+// copyable and keep their analysis in protected members, so this is
+// specialized for the factorizers we actually use. For other factorizers
+// CopyAnalysis() returns false and the caller must call analyzePattern() as
+// usual.
+
+template<class F> class SharedAnalysisFactorizer : public F {
+ public:
+  bool CopyAnalysis(const SharedAnalysisFactorizer &f,
+                    const typename F::MatrixType &a) {
+    return false;
+  }
+};
+
+template<class M, class O>
+class SharedAnalysisFactorizer<Eigen::SparseLU<M, O> >
+    : public Eigen::SparseLU<M, O> {
+ public:
+  bool CopyAnalysis(const SharedAnalysisFactorizer &f, const M &a) {
+    if (!f.m_analysisIsOk) {
+      return false;
+    }
+    this->m_perm_c = f.m_perm_c;
+    this->m_etree = f.m_etree;
+    this->m_analysisIsOk = true;
+    this->m_factorizationIsOk = false;
+    return true;
+  }
+};
+
+// For SimplicialLLT the expensive part of the analysis is the fill reducing
+// ordering, which is copied. The elimination tree and column counts are
+// recomputed (in linear time) as that is the only way to initialize the
+// factorizer through Eigen's interface.
+template<class M, int UpLo, class O>
+class SharedAnalysisFactorizer<Eigen::SimplicialLLT<M, UpLo, O> >
+    : public Eigen::SimplicialLLT<M, UpLo, O> {
+ public:
+  bool CopyAnalysis(const SharedAnalysisFactorizer &f, const M &a) {
+    if (!f.m_analysisIsOk) {
+      return false;
+    }
+    this->m_P = f.m_P;
+    this->m_Pinv = f.m_Pinv;
+    typename SharedAnalysisFactorizer::CholMatrixType ap(a.rows(), a.cols());
+    ap.template selfadjointView<Eigen::Upper>() =
+        a.template selfadjointView<UpLo>().twistedBy(this->m_P);
+    this->analyzePattern_preordered(ap, false);
+    return true;
+  }
+};
+
 //***************************************************************************
 // A solver for FEM problems. T must have the same signature as
 // ExampleFEMProblem. This object is designed to compute one solution to one
@@ -284,13 +350,25 @@ template<class T> class FEMSolver : public FEMSolverBase, public T {
   typedef typename T::GNumber GNumber;
   typedef typename T::NumberVector NumberVector;
   typedef typename T::MNumberVector MNumberVector;
+  typedef Eigen::Matrix<MNumber, Eigen::Dynamic, Eigen::Dynamic> MNumberMatrix;
   typedef typename T::Point Point;
   typedef typename T::Triplet Triplet;
-  typedef typename T::Factorizer Factorizer;
+  typedef SharedAnalysisFactorizer<typename T::Factorizer> Factorizer;
   typedef typename T::DoTrace DoTrace;
 
   typedef eigensolvers::LaplacianEigenSolver EigenSolver;
 
+  // The solver used instead of the factorizer if use_iterative_solver is true.
+  // BiCGSTAB handles general system matrices, e.g. the complex symmetric but
+  // non hermitian ones of the Helmholtz equation. It is preconditioned by an
+  // incomplete LU factorization, which has far less fill-in than a complete
+  // factorization so it needs much less memory for large problems. Entries
+  // smaller than iterative_drop_tolerance (relative to their row) are dropped
+  // from the factors, and each row of L and U keeps at most
+  // iterative_fill_factor times as many entries as the row of the matrix.
+  typedef Eigen::BiCGSTAB<Eigen::SparseMatrix<MNumber>,
+                          Eigen::IncompleteLUT<MNumber> > IterativeSolver;
+
   // Various outputs of the functions below.
   //
   // The index_map_ is a representation of the mesh with all Dirichlet points
@@ -299,12 +377,45 @@ template<class T> class FEMSolver : public FEMSolverBase, public T {
   // value -1. The size of the system matrix and the right hand side is the
   // size of reverse_index_map_.
   //
-  // The factorizer is kept around so that some clients can update derivative
-  // information.
+  // The system matrix A is stored in compressed column form. Its sparsity
+  // pattern (system_outer and system_inner, as in Eigen's compressed
+  // SparseMatrix) is computed once from the mesh connectivity, and
+  // CreateSystem() accumulates each triangle's contributions directly into the
+  // value array Avalues through the 'scatter' map. If C is requested (see
+  // CreateSystem()) it has the same pattern, with values in Cvalues. The
+  // triangles are colored so that no two triangles of the same color share a
+  // point: color_triangles lists the triangles of color c at indexes
+  // color_start[c] to color_start[c+1]-1. CreateSystem() uses num_threads
+  // threads to assemble each color.
+  //
+  // The triplets and Ctriplets are only created if debug_triplets is true.
+  // They are a list of the same contributions in (row, column, value) form,
+  // where repeated (row, column) entries are added together.
+  //
+  // The factorizer (or the iterative solver and its system matrix, or the
+  // factored reduced system) is kept around so that some clients can update
+  // derivative information.
   vector<int> index_map, reverse_index_map;     // Created by CreateIndexMaps()
-  vector<Triplet> triplets, Ctriplets;          // Created by CreateSystem()
+  vector<int> system_outer, system_inner;       // Created by CreateScatterMap()
+  vector<int> scatter;                          // Created by CreateScatterMap()
+  vector<int> color_start, color_triangles;     // Created by CreateScatterMap()
+  int num_threads = 1;                          // Set by the caller
+  NumberVector Avalues, Cvalues;                // Created by CreateSystem()
   NumberVector rhs;                             // Created by CreateSystem()
+  bool debug_triplets = false;                  // Set by the caller
+  vector<Triplet> triplets, Ctriplets;          // Created by CreateSystem()
   Factorizer *factorizer = 0;                   // Created by SolveSystem()
+  bool use_iterative_solver = false;            // Set by the caller
+  double iterative_tolerance = 1e-10;           // Set by the caller
+  double iterative_drop_tolerance = 1e-3;       // Set by the caller
+  int iterative_fill_factor = 2;                // Set by the caller
+  IterativeSolver *iterative_solver = 0;        // Created by SolveSystem()
+  Eigen::SparseMatrix<MNumber> iterative_A;     // Created by SolveSystem()
+  const FEMSolver *analysis_source = 0;         // Set by ShareAnalysis()
+  bool analysis_copied = false;                 // Set by SolveSystem()
+  const MNumberMatrix *reduced_basis = 0;       // Set by SolveReducedSystem()
+  Eigen::PartialPivLU<MNumberMatrix> reduced_lu;  // By SolveReducedSystem()
+  double reduced_residual = -1;                 // Set by SolveReducedSystem()
   MNumberVector solution;                       // Created by SolveSystem()
   int solvesystem_retval = -1;                  // Set by SolveSystem()
   EigenSolver *eigensolver = 0;                 // Created by EigenSystem()
@@ -313,6 +424,7 @@ template<class T> class FEMSolver : public FEMSolverBase, public T {
   FEMSolver() {}
   ~FEMSolver() {
     delete factorizer;
+    delete iterative_solver;
     delete eigensolver;
   }
 
@@ -427,32 +539,183 @@ template<class T> class FEMSolver : public FEMSolverBase, public T {
   }
 
   // Pad a "just solved" solution vector 's' with zeros, as necessary (i.e. if
-  // Dirichlet points were removed from the system then put them back).
-  void PadSolution(MNumberVector *s) {
-    CHECK(s->size() == reverse_index_map.size());
+  // Dirichlet points were removed from the system then put them back). 's' can
+  // also be a matrix whose columns are solution vectors.
+  template<class Tmat> void PadSolution(Tmat *s) {
+    CHECK(s->rows() == reverse_index_map.size());
     if (CreateIndexMapsNeedsCalling()) {
       CreateIndexMaps();
     }
-    if (s->size() < T::NumPoints()) {
-      s->conservativeResize(T::NumPoints());   // Keeps existing values
+    if (s->rows() < T::NumPoints()) {
+      s->conservativeResize(T::NumPoints(), s->cols());  // Keeps values
       for (int i = T::NumPoints() - 1; i >= 0 ; i--) {
         if (index_map[i] == -1) {
-          (*s)[i] = 0;
+          s->row(i).setZero();
         } else {
-          (*s)[i] = (*s)[index_map[i]];
+          s->row(i) = s->row(index_map[i]);
         }
       }
     }
   }
 
-  // Create the system matrix A (as a list in 'triplets') and the right hand
-  // side 'rhs' for the FEM problem. If create_Ctriplets is true, separate out
-  // the contribution of the nonzero g() function into a separate matrix C
-  // stored in Ctriplets, which is useful for solving eigenproblems.
+  // Create the sparsity pattern of the system matrix from the mesh
+  // connectivity, and the scatter map. All pairs of non-Dirichlet points in
+  // each triangle are represented in the pattern. scatter[i*9 + j*3 + k] is
+  // the position in the value array of the system matrix entry for
+  // (row, column) = (point j, point k) of triangle i, or -1 if either point is
+  // a Dirichlet point. This depends only on the mesh, not on the values of the
+  // problem functions.
+  bool CreateScatterMapNeedsCalling() const {
+    return system_outer.empty();
+  }
+  void CreateScatterMap() {
+    DoTrace trace(__func__);
+    if (!CreateScatterMapNeedsCalling()) {
+      return;
+    }
+    if (CreateIndexMapsNeedsCalling()) {
+      CreateIndexMaps();
+    }
+    const int system_size = reverse_index_map.size();
+
+    // Count the (possibly repeated) rows in each column then bucket them.
+    vector<int> start(system_size + 1);
+    for (int i = 0; i < T::NumTriangles(); i++) {
+      for (int k = 0; k < 3; k++) {
+        int col = index_map[T::Triangle(i, k)];
+        if (col >= 0) {
+          for (int j = 0; j < 3; j++) {
+            start[col + 1] += (index_map[T::Triangle(i, j)] >= 0);
+          }
+        }
+      }
+    }
+    for (int i = 0; i < system_size; i++) {
+      start[i + 1] += start[i];
+    }
+    vector<int> rows(start[system_size]);
+    {
+      vector<int> fill(start.begin(), start.end() - 1);
+      for (int i = 0; i < T::NumTriangles(); i++) {
+        for (int k = 0; k < 3; k++) {
+          int col = index_map[T::Triangle(i, k)];
+          if (col >= 0) {
+            for (int j = 0; j < 3; j++) {
+              int row = index_map[T::Triangle(i, j)];
+              if (row >= 0) {
+                rows[fill[col]++] = row;
+              }
+            }
+          }
+        }
+      }
+    }
+
+    // Sort the rows in each column and remove duplicates.
+    system_outer.resize(system_size + 1);
+    system_outer[0] = 0;
+    system_inner.clear();
+    system_inner.reserve(rows.size() / 2);
+    for (int col = 0; col < system_size; col++) {
+      auto first = rows.begin() + start[col];
+      auto last = rows.begin() + start[col + 1];
+      std::sort(first, last);
+      system_inner.insert(system_inner.end(), first, std::unique(first, last));
+      system_outer[col + 1] = system_inner.size();
+    }
+    vector<int>().swap(rows);
+    system_inner.shrink_to_fit();
+
+    // Find the position of each triangle's entries.
+    scatter.resize(T::NumTriangles() * 9);
+    for (int i = 0; i < T::NumTriangles(); i++) {
+      for (int j = 0; j < 3; j++) {
+        int row = index_map[T::Triangle(i, j)];
+        for (int k = 0; k < 3; k++) {
+          int col = index_map[T::Triangle(i, k)];
+          int &pos = scatter[i*9 + j*3 + k];
+          if (row < 0 || col < 0) {
+            pos = -1;
+          } else {
+            auto first = system_inner.begin() + system_outer[col];
+            auto last = system_inner.begin() + system_outer[col + 1];
+            auto it = std::lower_bound(first, last, row);
+            CHECK(it != last && *it == row);
+            pos = it - system_inner.begin();
+          }
+        }
+      }
+    }
+
+    // Greedily color the triangles so that triangles sharing a point have
+    // different colors. Only the mesh connectivity is used so the coloring is
+    // always the same for the same mesh.
+    vector<int> point_start(T::NumPoints() + 1);
+    for (int i = 0; i < T::NumTriangles(); i++) {
+      for (int j = 0; j < 3; j++) {
+        point_start[T::Triangle(i, j) + 1]++;
+      }
+    }
+    for (int i = 0; i < T::NumPoints(); i++) {
+      point_start[i + 1] += point_start[i];
+    }
+    vector<int> point_triangles(point_start.back());
+    {
+      vector<int> fill(point_start.begin(), point_start.end() - 1);
+      for (int i = 0; i < T::NumTriangles(); i++) {
+        for (int j = 0; j < 3; j++) {
+          point_triangles[fill[T::Triangle(i, j)]++] = i;
+        }
+      }
+    }
+    vector<int> color(T::NumTriangles(), -1);
+    vector<int> color_count;
+    vector<int> used_by;      // used_by[c] == i if color c is used near i
+    for (int i = 0; i < T::NumTriangles(); i++) {
+      for (int j = 0; j < 3; j++) {
+        int p = T::Triangle(i, j);
+        for (int k = point_start[p]; k < point_start[p + 1]; k++) {
+          int c = color[point_triangles[k]];
+          if (c >= 0) {
+            used_by[c] = i;
+          }
+        }
+      }
+      int c = 0;
+      while (c < used_by.size() && used_by[c] == i) {
+        c++;
+      }
+      if (c == used_by.size()) {
+        used_by.push_back(-1);
+        color_count.push_back(0);
+      }
+      color[i] = c;
+      color_count[c]++;
+    }
+    color_start.resize(color_count.size() + 1);
+    color_start[0] = 0;
+    for (int c = 0; c < color_count.size(); c++) {
+      color_start[c + 1] = color_start[c] + color_count[c];
+    }
+    color_triangles.resize(T::NumTriangles());
+    {
+      vector<int> fill(color_start.begin(), color_start.end() - 1);
+      for (int i = 0; i < T::NumTriangles(); i++) {
+        color_triangles[fill[color[i]]++] = i;
+      }
+    }
+  }
+
+  // Create the system matrix A (in Avalues) and the right hand side 'rhs' for
+  // the FEM problem. If create_Ctriplets is true, separate out the
+  // contribution of the nonzero g() function into a separate matrix C stored
+  // in Cvalues (and Ctriplets), which is useful for solving eigenproblems.
   bool CreateSystemNeedsCalling() const {
-    return triplets.empty();
+    return Avalues.size() == 0;
   }
   void UnCreateSystem() override {
+    Avalues.resize(0);
+    Cvalues.resize(0);
     triplets.clear();
     Ctriplets.clear();
     rhs.resize(0);
@@ -463,8 +726,8 @@ template<class T> class FEMSolver : public FEMSolverBase, public T {
     if (!CreateSystemNeedsCalling()) {
       return true;
     }
-    if (CreateIndexMapsNeedsCalling()) {
-      CreateIndexMaps();
+    if (CreateScatterMapNeedsCalling()) {
+      CreateScatterMap();
     }
     triplets.clear();
     Ctriplets.clear();
@@ -477,245 +740,314 @@ template<class T> class FEMSolver : public FEMSolverBase, public T {
       return true;
     }
 
-    // We put each triangle's sparse matrix assignments separately into
-    // 'triplets', with the assumption that repeated (row,col) indexes will be
-    // added together. The last entries are reserved for the diagonal, but we
-    // accumulate diagonal values into the 'diagonal' vector first to save
-    // space and time.
+    // We add each triangle's sparse matrix contributions into the value
+    // arrays at the positions given by the scatter map. If debugging, each
+    // off-diagonal contribution is also put separately into 'triplets', with
+    // the assumption that repeated (row,col) indexes will be added together.
+    // The last triplets are reserved for the diagonal.
     int triplets_size = T::NumTriangles() * 6 + system_size;
-    triplets.reserve(triplets_size);
-    vector<Number> diagonal(system_size);
-    vector<Number> Cdiagonal(create_Ctriplets ? system_size : 0);
-    if (create_Ctriplets) {
-      Ctriplets.reserve(triplets_size);
+    const int nnz = system_inner.size();
+    Avalues.resize(nnz);
+    Avalues.setConstant(Number());
+    Cvalues.resize(create_Ctriplets ? nnz : 0);
+    Cvalues.setConstant(Number());
+    Number *A = Avalues.data();
+    Number *C = create_Ctriplets ? Cvalues.data() : Avalues.data();
+    if (debug_triplets) {
+      triplets.reserve(triplets_size);
+      if (create_Ctriplets) {
+        Ctriplets.reserve(triplets_size);
+      }
     }
 
-    // Buffers used below, declared here so we don't keep reallocating.
-    NumberVector sigma_xx(3), sigma_yy(3), sigma_xy(3);
-
-    // Build the triplets and right hand side.
+    // Build the system matrix and right hand side. Triangles are assembled
+    // in color order (see CreateScatterMap()). Triangles of the same color
+    // share no points so they can be assembled in parallel without any two
+    // threads writing the same matrix or rhs entry. Each entry receives its
+    // contributions in the same order whatever the number of threads, so the
+    // result does not depend on num_threads. The debug triplets are always
+    // created by a single thread.
     rhs.resize(system_size);
     rhs.setZero();
-    for (int i = 0; i < T::NumTriangles(); i++) {
-      // Copy triangle points.
-      Point pt[3];
-      for (int j = 0; j < 3; j++) {
-        pt[j] = T::PointXY(T::Triangle(i, j));
+    const int kChunkSize = 256;         // Triangles per ParallelFor item
+    std::atomic<bool> ok(true);
+    for (int color = 0; color + 1 < color_start.size(); color++) {
+      const int first = color_start[color];
+      const int last = color_start[color + 1];
+      const int num_chunks = (last - first + kChunkSize - 1) / kChunkSize;
+      const int n = debug_triplets ? 1 : std::min(num_threads, num_chunks);
+      ParallelFor(0, num_chunks - 1, n,
+                  [&](int chunk) {
+        // Buffers used below, declared here so we don't keep reallocating.
+        NumberVector sigma_xx(3), sigma_yy(3), sigma_xy(3);
+        const int end = std::min(last, first + (chunk + 1) * kChunkSize);
+        for (int k = first + chunk * kChunkSize; k < end; k++) {
+          if (!AssembleTriangle(color_triangles[k], create_Ctriplets, A, C,
+                                &sigma_xx, &sigma_yy, &sigma_xy)) {
+            ok = false;
+          }
+        }
+      });
+    }
+    if (!ok) {
+      return false;
+    }
+
+    // Add diagonal entries to triplets.
+    if (debug_triplets) {
+      for (int i = 0; i < system_size; i++) {
+        int p = std::lower_bound(system_inner.begin() + system_outer[i],
+                                 system_inner.begin() + system_outer[i + 1], i)
+                - system_inner.begin();
+        triplets.push_back(Triplet(i, i, Avalues[p]));
+        if (create_Ctriplets) {
+          Ctriplets.push_back(Triplet(i, i, Cvalues[p]));
+        }
       }
+    }
+    // We may not have used all entries in triplets if we have Dirichlet
+    // boundaries, but check that we didn't use more than we reserved (the
+    // dielectric forcing term adds extra entries).
+    CHECK(T::AddDielectricForcingTerm() || triplets.size() <= triplets_size);
+    return true;
+  }
 
-      // Compute the area (multiplied by 2) of this triangle.
-      GNumber area2;
+  // Utility for CreateSystem(): Add the system matrix and right hand side
+  // contributions of triangle i. A and C are the value arrays of the A and C
+  // matrices (which are the same if C is not being created separately). The
+  // sigma vectors are buffers with 3 slots. Return false on failure.
+  bool AssembleTriangle(int i, bool create_Ctriplets, Number *A, Number *C,
+                        NumberVector *sigma_xx, NumberVector *sigma_yy,
+                        NumberVector *sigma_xy) {
+    // Value array positions for this triangle, pos[row*3 + column].
+    const int *pos = &scatter[i*9];
+
+    // Copy triangle points.
+    Point pt[3];
+    for (int j = 0; j < 3; j++) {
+      pt[j] = T::PointXY(T::Triangle(i, j));
+    }
+
+    // Compute the area (multiplied by 2) of this triangle.
+    GNumber area2;
+    {
+      Point d1 = pt[1] - pt[0];
+      Point d2 = pt[2] - pt[0];
+      area2 = T::Absolute(d1[0]*d2[1] - d1[1]*d2[0]);
+    }
+
+    // Collect the g() values.
+    Number g[3];
+    for (int j = 0; j < 3; j++) {
+      g[j] = T::PointG(i, j);
+    }
+
+    // See if the triangle is anisotropic and collect the sigma values.
+    bool anisotropic = T::AnisotropicSigma(i, sigma_xx, sigma_yy, sigma_xy);
+
+    // Compute system matrix and right hand side contributions for each
+    // vertex and edge of the triangle. The signs of everything that goes in
+    // the system matrix and the right hand side are inverted here compared
+    // to the documented FEM derivation. The reason is so that, in the cases
+    // we end up with symmetric definite matrices, the matrices are positive
+    // (and not negative) definite so that e.g. Cholesky solvers can be used.
+    for (int j0 = 0; j0 < 3; j0++) {
+      // Triangle indexes (j0,j1,j2 has the sequence 0,1,2 -> 1,2,0 ->
+      // 2,0,1).
+      int j1 = (j0 + 1) % 3;
+      int j2 = (j0 + 2) % 3;
+      // Correspond indexes into the system matrix and RHS, or -1 if none.
+      int sj0 = index_map[T::Triangle(i, j0)];
+      int sj1 = index_map[T::Triangle(i, j1)];
+      int sj2 = index_map[T::Triangle(i, j2)];
+
+      // Compute cot(theta) for the triangle internal angle opposite the
+      // j0->j1 edge.
+      GNumber cot;
       {
-        Point d1 = pt[1] - pt[0];
-        Point d2 = pt[2] - pt[0];
-        area2 = T::Absolute(d1[0]*d2[1] - d1[1]*d2[0]);
+        Point d1 = pt[j0] - pt[j2];
+        Point d2 = pt[j1] - pt[j2];
+        cot = d1.dot(d2) / area2;
       }
 
-      // Collect the g() values.
-      Number g[3];
-      for (int j = 0; j < 3; j++) {
-        g[j] = T::PointG(i, j);
-      }
-
-      // See if the triangle is anisotropic and collect the sigma values.
-      bool anisotropic = T::AnisotropicSigma(i, &sigma_xx, &sigma_yy,
-                                             &sigma_xy);
-
-      // Compute system matrix and right hand side contributions for each
-      // vertex and edge of the triangle. The signs of everything that goes in
-      // the system matrix and the right hand side are inverted here compared
-      // to the documented FEM derivation. The reason is so that, in the cases
-      // we end up with symmetric definite matrices, the matrices are positive
-      // (and not negative) definite so that e.g. Cholesky solvers can be used.
-      for (int j0 = 0; j0 < 3; j0++) {
-        // Triangle indexes (j0,j1,j2 has the sequence 0,1,2 -> 1,2,0 ->
-        // 2,0,1).
-        int j1 = (j0 + 1) % 3;
-        int j2 = (j0 + 2) % 3;
-        // Correspond indexes into the system matrix and RHS, or -1 if none.
-        int sj0 = index_map[T::Triangle(i, j0)];
-        int sj1 = index_map[T::Triangle(i, j1)];
-        int sj2 = index_map[T::Triangle(i, j2)];
-
-        // Compute cot(theta) for the triangle internal angle opposite the
-        // j0->j1 edge.
-        GNumber cot;
-        {
-          Point d1 = pt[j0] - pt[j2];
-          Point d2 = pt[j1] - pt[j2];
-          cot = d1.dot(d2) / area2;
-        }
+      // Off-diagonal contribution to the C matrix.
+      Number g0 = g[j0], g1 = g[j1], g2 = g[j2];
+      Number Cij_value = -((g0 + g1) * 2.0 + g2) *
+                          T::GNumberToNumber(area2 / 120.0);
 
-        // Off-diagonal contribution to the C matrix.
-        Number g0 = g[j0], g1 = g[j1], g2 = g[j2];
-        Number Cij_value = -((g0 + g1) * 2.0 + g2) *
-                            T::GNumberToNumber(area2 / 120.0);
+      // Add contribution to on-diagonal entry C(sj2, sj2).
+      GNumber opplen2 = (pt[j0] - pt[j1]).squaredNorm();
+      if (sj2 >= 0) {
+        C[pos[j2*3 + j2]] -=
+            (g0 + g1 + g2 * 3.0) * T::GNumberToNumber(area2 / 60.0);
+      }
 
-        // Add contribution to on-diagonal entry C(sj2, sj2).
-        GNumber opplen2 = (pt[j0] - pt[j1]).squaredNorm();
-        if (sj2 >= 0) {
-          (create_Ctriplets ? Cdiagonal : diagonal)[sj2] -=
-              (g0 + g1 + g2 * 3.0) * T::GNumberToNumber(area2 / 60.0);
+      // Contributions to A(sj0, sj1) and A(sj1, sj0), and the diagonal.
+      Number Aij_value;          // Adds to A(sj0, sj1) and A(sj1, sj0)
+      Number Aji_correction(0);  // Adds only to A(sj1, sj0)
+      Number sigma_xx_avg, sigma_yy_avg, sigma_xy_avg;  // Triangle averages
+      if (!anisotropic) {
+        // Isotropic Laplacian.
+        Aij_value = -T::GNumberToNumber(cot / 2.0);
+        if (sj2 >= 0) {  // Handle diagonal entry at sj2
+          A[pos[j2*3 + j2]] -= T::GNumberToNumber(-opplen2 / (area2 * 2.0));
+        }
+      } else {
+        // Handle the anisotropic Laplacian. Rotate the sigma values so that
+        // the edge j2-->j0 is effectively in the +X direction (to match the
+        // derivation in fem.nb). We take the average of the three vertex
+        // sigmas and assume this applies across the entire triangle. This
+        // approximation is necessary for now to create a symmetric 'A'
+        // matrix.
+        // @@@ TODO interpolate sigmas across the triangle.
+        Point j2j0 = pt[j0] - pt[j2];
+        GNumber j2j0_length2 = j2j0.squaredNorm();  // x1^2 in docs
+        j2j0 = j2j0  / sqrt(j2j0_length2);          // j2j0 is now normalized
+        // Cosine and sine of angle of j2->j0.
+        const Number c = T::GNumberToNumber(j2j0[0]);
+        const Number s = T::GNumberToNumber(j2j0[1]);
+        // Compute sigma averages.
+        sigma_xx_avg = ((*sigma_xx)[0] + (*sigma_xx)[1] + (*sigma_xx)[2]) / 3.0;
+        sigma_yy_avg = ((*sigma_yy)[0] + (*sigma_yy)[1] + (*sigma_yy)[2]) / 3.0;
+        sigma_xy_avg = ((*sigma_xy)[0] + (*sigma_xy)[1] + (*sigma_xy)[2]) / 3.0;
+        // Rotate sigmas.
+        Number a1 = c*sigma_xy_avg - s*sigma_xx_avg;
+        Number a2 = c*sigma_yy_avg - s*sigma_xy_avg;
+        Number rsigma_xy = c*a1 + s*a2;
+        Number rsigma_yy = c*a2 - s*a1;
+        // Compute matrix entries. Aij and Aji are symmetric.
+        const Number x2_by_y2 = T::GNumberToNumber(cot);
+        Aij_value = -( (x2_by_y2 * rsigma_yy)/2.0 - rsigma_xy/2.0 );
+        if (sj1 >= 0) {
+          // Compute diagonal entry at sj1. Note that this is a different
+          // entry than the one computed for the isotropic case above, but
+          // all the entries get covered in the end.
+          // Note that x1/y2 = x1^2 / (x1*y2) == j2j0_length2 / area2
+          A[pos[j1*3 + j1]] -= rsigma_yy *
+              T::GNumberToNumber(-j2j0_length2 / (area2 * 2.0));
         }
+      }
 
-        // Contributions to A(sj0, sj1) and A(sj1, sj0), and the diagonal.
-        Number Aij_value;          // Adds to A(sj0, sj1) and A(sj1, sj0)
-        Number Aji_correction(0);  // Adds only to A(sj1, sj0)
-        Number sigma_xx_avg, sigma_yy_avg, sigma_xy_avg;  // Triangle averages
-        if (!anisotropic) {
-          // Isotropic Laplacian.
-          Aij_value = -T::GNumberToNumber(cot / 2.0);
-          if (sj2 >= 0) {  // Handle diagonal entry at sj2
-            diagonal[sj2] -= T::GNumberToNumber(-opplen2 / (area2 * 2.0));
-          }
-        } else {
-          // Handle the anisotropic Laplacian. Rotate the sigma values so that
-          // the edge j2-->j0 is effectively in the +X direction (to match the
-          // derivation in fem.nb). We take the average of the three vertex
-          // sigmas and assume this applies across the entire triangle. This
-          // approximation is necessary for now to create a symmetric 'A'
-          // matrix.
-          // @@@ TODO interpolate sigmas across the triangle.
-          Point j2j0 = pt[j0] - pt[j2];
-          GNumber j2j0_length2 = j2j0.squaredNorm();  // x1^2 in docs
-          j2j0 = j2j0  / sqrt(j2j0_length2);          // j2j0 is now normalized
-          // Cosine and sine of angle of j2->j0.
-          const Number c = T::GNumberToNumber(j2j0[0]);
-          const Number s = T::GNumberToNumber(j2j0[1]);
-          // Compute sigma averages.
-          sigma_xx_avg = (sigma_xx[0] + sigma_xx[1] + sigma_xx[2]) / 3.0;
-          sigma_yy_avg = (sigma_yy[0] + sigma_yy[1] + sigma_yy[2]) / 3.0;
-          sigma_xy_avg = (sigma_xy[0] + sigma_xy[1] + sigma_xy[2]) / 3.0;
-          // Rotate sigmas.
-          Number a1 = c*sigma_xy_avg - s*sigma_xx_avg;
-          Number a2 = c*sigma_yy_avg - s*sigma_xy_avg;
-          Number rsigma_xy = c*a1 + s*a2;
-          Number rsigma_yy = c*a2 - s*a1;
-          // Compute matrix entries. Aij and Aji are symmetric.
-          const Number x2_by_y2 = T::GNumberToNumber(cot);
-          Aij_value = -( (x2_by_y2 * rsigma_yy)/2.0 - rsigma_xy/2.0 );
-          if (sj1 >= 0) {
-            // Compute diagonal entry at sj1. Note that this is a different
-            // entry than the one computed for the isotropic case above, but
-            // all the entries get covered in the end.
-            // Note that x1/y2 = x1^2 / (x1*y2) == j2j0_length2 / area2
-            diagonal[sj1] -= rsigma_yy *
-                             T::GNumberToNumber(-j2j0_length2 / (area2 * 2.0));
-          }
+      // Contribution of 'f' to right hand side.
+      if (sj0 >= 0) {
+        rhs[sj0] -= (T::PointF(i, j0) * 2.0 + T::PointF(i, j1) +
+                     T::PointF(i, j2)) * T::GNumberToNumber(area2 / 24.0);
+      }
+
+      // Add contributions for triangle edges with robin boundary conditions,
+      // i.e. grad u . n + alpha*u = beta.
+      if (T::EdgeType(i, j0) == T::ROBIN) {
+        // Points j0->j1 are on the boundary.
+        GNumber side_length = sqrt(opplen2);          // Length j0->j1
+        Number alpha0, alpha1, beta0, beta1;
+        T::Robin(i, j0, j0, g0, &alpha0, &beta0);
+        T::Robin(i, j0, j1, g1, &alpha1, &beta1);
+
+        // For anisotropic materials scale alpha so the boundary conditions
+        // make sense. @@@ This currently only results in a well-matched port
+        // in Exy cavities and when the port is aligned with an anisotropy
+        // principle axis.
+        if (anisotropic) {
+          // Use a propagation direction normal to the boundary.
+          Point boundary = (pt[j1] - pt[j0]).normalized();
+          auto px = boundary[1];      // px,py is a unit length vector
+          auto py = -boundary[0];     //   normal to the boundary
+          Number scale = sqrt(T::GNumberToNumber(px*px)*sigma_xx_avg +
+                              T::GNumberToNumber(px*py*2.0)*sigma_xy_avg +
+                              T::GNumberToNumber(py*py)*sigma_yy_avg);
+          alpha0 = alpha0 * scale;
+          alpha1 = alpha1 * scale;
+          beta0 = beta0 * scale;
+          beta1 = beta1 * scale;
         }
 
-        // Contribution of 'f' to right hand side.
+        Number sl = T::GNumberToNumber(side_length);
+        Aij_value += (alpha0 + alpha1) * sl / 12.0;              // L(sj0,sj1)
         if (sj0 >= 0) {
-          rhs[sj0] -= (T::PointF(i, j0) * 2.0 + T::PointF(i, j1) +
-                       T::PointF(i, j2)) * T::GNumberToNumber(area2 / 24.0);
+          // L(sj0,sj0):
+          A[pos[j0*3 + j0]] += (alpha0 / 4.0 + alpha1 / 12.0) * sl;
+          rhs[sj0] += (beta0 * 2.0 + beta1) * sl / 6.0;
         }
-
-        // Add contributions for triangle edges with robin boundary conditions,
-        // i.e. grad u . n + alpha*u = beta.
-        if (T::EdgeType(i, j0) == T::ROBIN) {
-          // Points j0->j1 are on the boundary.
-          GNumber side_length = sqrt(opplen2);          // Length j0->j1
-          Number alpha0, alpha1, beta0, beta1;
-          T::Robin(i, j0, j0, g0, &alpha0, &beta0);
-          T::Robin(i, j0, j1, g1, &alpha1, &beta1);
-
-          // For anisotropic materials scale alpha so the boundary conditions
-          // make sense. @@@ This currently only results in a well-matched port
-          // in Exy cavities and when the port is aligned with an anisotropy
-          // principle axis.
-          if (anisotropic) {
-            // Use a propagation direction normal to the boundary.
-            Point boundary = (pt[j1] - pt[j0]).normalized();
-            auto px = boundary[1];      // px,py is a unit length vector
-            auto py = -boundary[0];     //   normal to the boundary
-            Number scale = sqrt(T::GNumberToNumber(px*px)*sigma_xx_avg +
-                                T::GNumberToNumber(px*py*2.0)*sigma_xy_avg +
-                                T::GNumberToNumber(py*py)*sigma_yy_avg);
-            alpha0 = alpha0 * scale;
-            alpha1 = alpha1 * scale;
-            beta0 = beta0 * scale;
-            beta1 = beta1 * scale;
-          }
-
-          Number sl = T::GNumberToNumber(side_length);
-          Aij_value += (alpha0 + alpha1) * sl / 12.0;              // L(sj0,sj1)
-          if (sj0 >= 0) {
-            diagonal[sj0] += (alpha0 / 4.0 + alpha1 / 12.0) * sl;  // L(sj0,sj0)
-            rhs[sj0] += (beta0 * 2.0 + beta1) * sl / 6.0;
-          }
-          if (sj1 >= 0) {
-            diagonal[sj1] += (alpha1 / 4.0 + alpha0 / 12.0) * sl;  // L(sj1,sj1)
-            rhs[sj1] += (beta0 + beta1 * 2.0) * sl / 6.0;
-          }
+        if (sj1 >= 0) {
+          // L(sj1,sj1):
+          A[pos[j1*3 + j1]] += (alpha1 / 4.0 + alpha0 / 12.0) * sl;
+          rhs[sj1] += (beta0 + beta1 * 2.0) * sl / 6.0;
         }
+      }
 
-        // If requested add the dielectric forcing term. This is one way to get
-        // discontinuous gradients at dielectric boundaries. This triangle must
-        // have all 3 vertices represented in the solution. This does not yet
-        // account for nonisotropic materials.
-        if (T::AddDielectricForcingTerm() &&
-            sj0 >= 0 && sj1 >= 0 && sj2 >= 0) {
-          // This triangle must have a neighbor on edge j0, on the other side
-          // of the dielectric boundary, otherwise there can't be a
-          // discontinuity.
-          int ni = T::Neighbor(i, j0);
-          if (ni != -1) {
-            // Discontinuous gradients are only produced where we have
-            // discontinuities in epsilon. Detect this by looking for step
-            // changes in g() across triangles.
-            Number e1 = T::PointG(i, 0);   // \propto epsilon of this triangle
-            Number e2 = T::PointG(ni, 0);  // \propto epsilon of neighbor
-            // Require that all vertices have the same epsilon, as will happen
-            // when we use Paint().
-            if (e1 != e2 &&
-                e1 == T::PointG(i, 1) && e1 == T::PointG(i, 2) &&
-                e2 == T::PointG(ni, 1) && e2 == T::PointG(ni, 2)) {
-              // Add contributions for the edge j0 --> j1.
-              // Compute q=(e2-e1)/(e2+e1). Only if this edge is at an epsilon
-              // discontinuity (i.e. a dielectric boundary) will q be nonzero.
-              Number qfactor = (e2 - e1) / (e1 + e2);
-              if (qfactor != Number(0)) {
-                // Compute cot(theta) for the triangle internal angle opposite
-                // the j0->j1 edge.
-                Number cot0, cot1;              // cotN is angle at point jN
-                Point d1 = pt[j1] - pt[j0];
-                Point d2 = pt[j2] - pt[j0];
-                cot0 = T::GNumberToNumber(d1.dot(d2) / area2);
-                d1 = pt[j0] - pt[j1];
-                d2 = pt[j2] - pt[j1];
-                cot1 = T::GNumberToNumber(d1.dot(d2) / area2);
-                // Add terms to the system matrix. Note that this is not
-                // symmetric!
-                diagonal[sj0] += qfactor * cot1 / 2.0;
-                diagonal[sj1] += qfactor * cot0 / 2.0;
-                Aij_value += qfactor * cot0 / 2.0;
-                Aji_correction += qfactor * (cot1 - cot0) / 2.0;
-                triplets.push_back(Triplet(sj0, sj2,
-                    qfactor * T::GNumberToNumber(-opplen2 / (area2 * 2.0))));
-                triplets.push_back(Triplet(sj1, sj2,
-                    qfactor * T::GNumberToNumber(-opplen2 / (area2 * 2.0))));
-                triplets_size += 2;     // Ensure check below passes
-                if (create_Ctriplets) {
-                  // @@@ It's not clear how well this works in eigensystems
-                  // when we have to compute a separate matrix for C, since
-                  // it's not clear if these additional terms go in the main
-                  // system matrix or in C.
-                  return false;
-                }
+      // If requested add the dielectric forcing term. This is one way to get
+      // discontinuous gradients at dielectric boundaries. This triangle must
+      // have all 3 vertices represented in the solution. This does not yet
+      // account for nonisotropic materials.
+      if (T::AddDielectricForcingTerm() &&
+          sj0 >= 0 && sj1 >= 0 && sj2 >= 0) {
+        // This triangle must have a neighbor on edge j0, on the other side
+        // of the dielectric boundary, otherwise there can't be a
+        // discontinuity.
+        int ni = T::Neighbor(i, j0);
+        if (ni != -1) {
+          // Discontinuous gradients are only produced where we have
+          // discontinuities in epsilon. Detect this by looking for step
+          // changes in g() across triangles.
+          Number e1 = T::PointG(i, 0);   // \propto epsilon of this triangle
+          Number e2 = T::PointG(ni, 0);  // \propto epsilon of neighbor
+          // Require that all vertices have the same epsilon, as will happen
+          // when we use Paint().
+          if (e1 != e2 &&
+              e1 == T::PointG(i, 1) && e1 == T::PointG(i, 2) &&
+              e2 == T::PointG(ni, 1) && e2 == T::PointG(ni, 2)) {
+            // Add contributions for the edge j0 --> j1.
+            // Compute q=(e2-e1)/(e2+e1). Only if this edge is at an epsilon
+            // discontinuity (i.e. a dielectric boundary) will q be nonzero.
+            Number qfactor = (e2 - e1) / (e1 + e2);
+            if (qfactor != Number(0)) {
+              // Compute cot(theta) for the triangle internal angle opposite
+              // the j0->j1 edge.
+              Number cot0, cot1;              // cotN is angle at point jN
+              Point d1 = pt[j1] - pt[j0];
+              Point d2 = pt[j2] - pt[j0];
+              cot0 = T::GNumberToNumber(d1.dot(d2) / area2);
+              d1 = pt[j0] - pt[j1];
+              d2 = pt[j2] - pt[j1];
+              cot1 = T::GNumberToNumber(d1.dot(d2) / area2);
+              // Add terms to the system matrix. Note that this is not
+              // symmetric!
+              A[pos[j0*3 + j0]] += qfactor * cot1 / 2.0;
+              A[pos[j1*3 + j1]] += qfactor * cot0 / 2.0;
+              Aij_value += qfactor * cot0 / 2.0;
+              Aji_correction += qfactor * (cot1 - cot0) / 2.0;
+              Number value =
+                  qfactor * T::GNumberToNumber(-opplen2 / (area2 * 2.0));
+              A[pos[j0*3 + j2]] += value;
+              A[pos[j1*3 + j2]] += value;
+              if (debug_triplets) {
+                triplets.push_back(Triplet(sj0, sj2, value));
+                triplets.push_back(Triplet(sj1, sj2, value));
+              }
+              if (create_Ctriplets) {
+                // @@@ It's not clear how well this works in eigensystems
+                // when we have to compute a separate matrix for C, since
+                // it's not clear if these additional terms go in the main
+                // system matrix or in C.
+                return false;
               }
             }
           }
         }
+      }
 
-        // Add off-diagonal matrix entries to triplets.
-        if (sj0 >= 0 && sj1 >= 0) {
-          if (!create_Ctriplets) {
-            Aij_value += Cij_value;
-          }
-          // If Number is not the same as MNumber but the problem is
-          // symmetric we might consider creating just a lower triangle here
-          // and converting it to a full matrix in SolveSystem(). However
-          // this is not likely to be a bottleneck.
+      // Add off-diagonal matrix entries.
+      if (sj0 >= 0 && sj1 >= 0) {
+        if (!create_Ctriplets) {
+          Aij_value += Cij_value;
+        }
+        A[pos[j0*3 + j1]] += Aij_value;
+        A[pos[j1*3 + j0]] += Aij_value + Aji_correction;
+        if (create_Ctriplets) {
+          C[pos[j0*3 + j1]] += Cij_value;
+          C[pos[j1*3 + j0]] += Cij_value;
+        }
+        if (debug_triplets) {
           triplets.push_back(Triplet(sj0, sj1, Aij_value));
           triplets.push_back(Triplet(sj1, sj0, Aij_value + Aji_correction));
           if (create_Ctriplets) {
@@ -725,24 +1057,25 @@ template<class T> class FEMSolver : public FEMSolverBase, public T {
         }
       }
     }
-
-    // Add diagonal entries to triplets.
-    for (int i = 0; i < system_size; i++) {
-      triplets.push_back(Triplet(i, i, diagonal[i]));
-      if (create_Ctriplets) {
-        Ctriplets.push_back(Triplet(i, i, Cdiagonal[i]));
-      }
-    }
-    // We may not have used all entries in triplets if we have Dirichlet
-    // boundaries, but check that we didn't use more than we reserved.
-    CHECK(triplets.size() <= triplets_size);
     return true;
   }
 
-  // Factor and solve the system created by CreateSystem(). Return true on
-  // success or false if the factorization failed. This only does work the
-  // first time it is called, subsequent times it simply returns the same
-  // return code as the first time.
+  // Solvers for the same mesh (e.g. the same problem at different
+  // frequencies) usually have system matrices with identical sparsity
+  // patterns, so the symbolic analysis done by the factorizer only needs to be
+  // done once. Calling this before SolveSystem() makes SolveSystem() copy the
+  // analysis from 'source', which must already have called SolveSystem() and
+  // must stay alive until our SolveSystem() is called. If the sparsity
+  // patterns turn out to be different then the analysis is done as usual.
+  void ShareAnalysis(const FEMSolver *source) {
+    analysis_source = (source == this) ? 0 : source;
+  }
+
+  // Factor and solve the system created by CreateSystem(), or solve it with
+  // the iterative solver if use_iterative_solver is true. Return true on
+  // success or false if the factorization failed or the iterative solver did
+  // not converge. This only does work the first time it is called, subsequent
+  // times it simply returns the same return code as the first time.
   bool SolveSystem() override MUST_USE_RESULT {
     // Prerequisites.
     DoTrace trace(__func__);
@@ -754,30 +1087,27 @@ template<class T> class FEMSolver : public FEMSolverBase, public T {
         return (solvesystem_retval = false);
       }
     }
-    CHECK(Ctriplets.empty());   // 'triplets' must contain the whole problem
+    CHECK(Cvalues.size() == 0);   // 'Avalues' must contain the whole problem
 
-    // Initialize the FEM system matrix 'A' from the triplets. Convert from
-    // Number to MNumber if necessary.
+    // Initialize the FEM system matrix 'A' from Avalues. Convert from Number
+    // to MNumber if necessary.
     Eigen::SparseMatrix<MNumber> A;
-    GetSystemMatrix(triplets, &A);
+    GetSystemMatrix(Avalues, &A);
 
     // Convert from Number to MNumber for the right hand side b, if necessary.
-    const int system_size = reverse_index_map.size();
-    const MNumberVector *b = 0;
     MNumberVector bstorage;
-    if ((b = T::CastMNumberToNumberVector(&rhs)) == 0) {
-      b = &bstorage;
-      bstorage.resize(system_size);
-      for (int i = 0; i < system_size; i++) {
-        bstorage[i] = T::MNumberFromNumber(rhs[i]);
-      }
+    const MNumberVector *b = GetRhs(&bstorage);
+
+    if (use_iterative_solver) {
+      analysis_source = 0;              // There is no analysis to share
+      return (solvesystem_retval = SolveIteratively(&A, *b));
     }
 
     // Factor 'A'. Return false if A can not be factored. Then solve.
     CHECK(!factorizer)
     factorizer = new Factorizer;
     CHECK(A.isCompressed());      // Otherwise factorizer might make a copy
-    {
+    if (!CopySharedAnalysis(A)) {
       DoTrace trace("Analyze");
       factorizer->analyzePattern(A);
     }
@@ -799,27 +1129,97 @@ template<class T> class FEMSolver : public FEMSolverBase, public T {
     return (solvesystem_retval = true);
   }
 
+  // Orthogonalize the system-space part of the solution (i.e. without the
+  // Dirichlet points) against the columns of 'basis', normalize it and append
+  // it as a new column. Solutions of the same problem at several frequencies
+  // span a basis for SolveReducedSystem(). The solution is not added if it is
+  // (numerically) already in the span of the basis.
+  void AddSolutionToBasis(MNumberMatrix *basis) const {
+    CHECK(solvesystem_retval == 1);
+    const int system_size = SystemSize();
+    CHECK(basis->cols() == 0 || basis->rows() == system_size);
+    MNumberVector v(system_size);
+    for (int i = 0; i < system_size; i++) {
+      v[i] = solution[reverse_index_map[i]];
+    }
+    const double norm = v.norm();
+    if (norm == 0) {
+      return;
+    }
+    // Gram-Schmidt, twice for numerical stability.
+    for (int pass = 0; pass < 2; pass++) {
+      for (int j = 0; j < basis->cols(); j++) {
+        v -= basis->col(j) * basis->col(j).dot(v);
+      }
+    }
+    if (v.norm() < 1e-10 * norm) {
+      return;
+    }
+    basis->conservativeResize(system_size, basis->cols() + 1);
+    basis->col(basis->cols() - 1) = v / v.norm();
+  }
+
+  // Solve the system created by CreateSystem() approximately, by projecting
+  // it onto the space spanned by the orthonormal columns of 'basis' (as
+  // created by AddSolutionToBasis()) and solving the small dense projected
+  // system. This is much faster than SolveSystem() when the basis is small.
+  // The basis must stay alive while derivatives are computed. Afterwards
+  // 'solution' is set as for SolveSystem() and reduced_residual is the
+  // relative residual norm |A*solution-b|/|b|, which indicates how well the
+  // basis represents this problem. Return true on success.
+  bool SolveReducedSystem(const MNumberMatrix *basis) MUST_USE_RESULT {
+    DoTrace trace(__func__);
+    if (solvesystem_retval >= 0) {
+      return solvesystem_retval;
+    }
+    if (CreateSystemNeedsCalling()) {
+      if (!CreateSystem()) {
+        return (solvesystem_retval = false);
+      }
+    }
+    CHECK(Cvalues.size() == 0);   // 'Avalues' must contain the whole problem
+    CHECK(basis->rows() == SystemSize() && basis->cols() > 0);
+    analysis_source = 0;                // There is no analysis to share
+    Eigen::SparseMatrix<MNumber> A;
+    GetSystemMatrix(Avalues, &A);
+    MNumberVector bstorage;
+    const MNumberVector *b = GetRhs(&bstorage);
+    MNumberMatrix AV = A * (*basis);
+    reduced_lu.compute(basis->adjoint() * AV);
+    MNumberVector xr = reduced_lu.solve(basis->adjoint() * (*b));
+    if (!xr.allFinite()) {
+      return (solvesystem_retval = false);
+    }
+    reduced_basis = basis;
+    reduced_residual = (AV * xr - *b).norm() / b->norm();
+    solution = (*basis) * xr;
+    PadSolution(&solution);
+    return (solvesystem_retval = true);
+  }
+
   // Compute the derivative of the solution with respect to some parameter.
-  // Return true on success or false if factorization failed.
+  // Return true on success or false if factorization failed or the iterative
+  // solver did not converge.
   bool ComputeSolutionDerivative(MNumberVector *solution_derivative)
                                  MUST_USE_RESULT {
     DoTrace trace(__func__);
-    if (!SolveSystem()) {       // Also ensures triplets and RHS created
+    if (!SolveSystem()) {       // Also ensures system and RHS created
       return false;
     }
 
     // Multiply d(system_matrix)/dparameter by the existing solution. We do the
-    // multiplication directly from 'triplets' without converting into sparse
-    // matrix form, since we're just doing it once. Note that we multiply by
+    // multiplication directly from Avalues without converting into an MNumber
+    // sparse matrix, since we're just doing it once. Note that we multiply by
     // the solution vector that is padded with zeros so we need to go through
     // the index map.
     const int system_size = SystemSize();
     MNumberVector tmp(system_size);
     tmp.setZero();
-    for (int i = 0; i < triplets.size(); i++) {
-      MNumber deriv = T::Derivative(triplets[i].value());
-      int col = reverse_index_map[triplets[i].col()];
-      tmp[triplets[i].row()] -= deriv * solution[col];
+    for (int col = 0; col < system_size; col++) {
+      const MNumber &s = solution[reverse_index_map[col]];
+      for (int i = system_outer[col]; i < system_outer[col + 1]; i++) {
+        tmp[system_inner[i]] -= T::Derivative(Avalues[i]) * s;
+      }
     }
 
     // Add in d(right_hand_side)/dparameter.
@@ -828,12 +1228,72 @@ template<class T> class FEMSolver : public FEMSolverBase, public T {
     }
 
     // Solve for the solution derivative.
-    {
-      DoTrace trace("Solve");
-      *solution_derivative = factorizer->solve(tmp);
-      PadSolution(solution_derivative);
+    return SolveWithSystemMatrix(tmp, solution_derivative);
+  }
+
+  // Compute the derivatives of the solution with respect to all the
+  // T::NumDerivatives() parameters that Number carries derivatives for, in one
+  // batched solve. The derivatives are returned in the columns of
+  // solution_derivatives (NumPoints() x T::NumDerivatives()). Return true on
+  // success or false if factorization failed or the iterative solver did not
+  // converge.
+  bool ComputeSolutionJacobian(MNumberMatrix *solution_derivatives)
+                               MUST_USE_RESULT {
+    DoTrace trace(__func__);
+    if (!SolveSystem()) {       // Also ensures system and RHS created
+      return false;
     }
-    return true;
+    const int system_size = SystemSize();
+    const int n = T::NumDerivatives();
+    MNumberMatrix dAvalues(Avalues.size(), n), drhs(system_size, n);
+    for (int j = 0; j < n; j++) {
+      for (int i = 0; i < Avalues.size(); i++) {
+        dAvalues(i, j) = T::Derivative(Avalues[i], j);
+      }
+      for (int i = 0; i < system_size; i++) {
+        drhs(i, j) = T::Derivative(rhs[i], j);
+      }
+    }
+    return ComputeSolutionDerivatives(dAvalues, drhs, solution_derivatives);
+  }
+
+  // Compute the derivatives of the solution with respect to N parameters in
+  // one pass. Column j of dAvalues (Avalues.size() x N) and drhs (SystemSize()
+  // x N) are the derivatives of Avalues and rhs with respect to parameter j.
+  // The derivatives of the solution are returned in the columns of
+  // solution_derivatives (NumPoints() x N). The derivative parts of Avalues
+  // and rhs are ignored. All N right hand sides are solved together so the
+  // factors are only traversed once. Return true on success or false if
+  // factorization failed or the iterative solver did not converge.
+  bool ComputeSolutionDerivatives(const MNumberMatrix &dAvalues,
+                                  const MNumberMatrix &drhs,
+                                  MNumberMatrix *solution_derivatives)
+                                  MUST_USE_RESULT {
+    DoTrace trace(__func__);
+    if (!SolveSystem()) {       // Also ensures system and RHS created
+      return false;
+    }
+    const int system_size = SystemSize();
+    const int n = dAvalues.cols();
+    CHECK(dAvalues.rows() == Avalues.size());
+    CHECK(drhs.rows() == system_size && drhs.cols() == n);
+
+    // Compute drhs - dA*solution for every parameter, as in
+    // ComputeSolutionDerivative().
+    MNumberMatrix tmp = drhs;
+    for (int j = 0; j < n; j++) {
+      const MNumber *dA = dAvalues.col(j).data();
+      MNumber *t = tmp.col(j).data();
+      for (int col = 0; col < system_size; col++) {
+        const MNumber &s = solution[reverse_index_map[col]];
+        for (int i = system_outer[col]; i < system_outer[col + 1]; i++) {
+          t[system_inner[i]] -= dA[i] * s;
+        }
+      }
+    }
+
+    // Solve for all solution derivatives.
+    return SolveWithSystemMatrix(tmp, solution_derivatives);
   }
 
   // Compute eigenvalues and eigenvectors of the system matrix. See
@@ -849,13 +1309,13 @@ template<class T> class FEMSolver : public FEMSolverBase, public T {
     if (!CreateSystem(true)) {
       return (eigensystem_retval = false);
     }
-    CHECK(!Ctriplets.empty());
+    CHECK(Cvalues.size() > 0);
 
-    // Initialize the FEM system matrix 'A' from the triplets. Convert from
-    // Number to MNumber.
+    // Initialize the FEM system matrices 'A' and 'B'. Convert from Number to
+    // MNumber.
     Eigen::SparseMatrix<MNumber> A, B;
-    GetSystemMatrix(triplets, &A);
-    GetSystemMatrix(Ctriplets, &B);
+    GetSystemMatrix(Avalues, &A);
+    GetSystemMatrix(Cvalues, &B);
 
     // Compute the smallest eigenvalues, with eigenvectors.
     eigensolver = new EigenSolver(A, &B, eigenpair_count, sigma);
@@ -918,8 +1378,108 @@ template<class T> class FEMSolver : public FEMSolverBase, public T {
     return eigensolver->GetEigenVectors().col(n);
   }
 
-  // Utility: Initialize the FEM system matrix 'A' from the triplets. Convert
-  // from Number to MNumber.
+  // Utility: Return the right hand side converted from Number to MNumber, in
+  // 'storage' if a conversion is needed.
+  const MNumberVector *GetRhs(MNumberVector *storage) {
+    const MNumberVector *b = T::CastMNumberToNumberVector(&rhs);
+    if (!b) {
+      storage->resize(rhs.size());
+      for (int i = 0; i < rhs.size(); i++) {
+        (*storage)[i] = T::MNumberFromNumber(rhs[i]);
+      }
+      b = storage;
+    }
+    return b;
+  }
+
+  // Utility: Solve A*x=b using the factorizer, iterative solver or reduced
+  // system created by SolveSystem() or SolveReducedSystem(), then pad x with
+  // zeros. 'b' can have several columns, in
+  // which case they are all solved together. Return false if the iterative
+  // solver did not converge.
+  template<class Tmat>
+  bool SolveWithSystemMatrix(const Tmat &b, Tmat *x) {
+    DoTrace trace("Solve");
+    if (reduced_basis) {
+      *x = (*reduced_basis) * reduced_lu.solve(reduced_basis->adjoint() * b);
+    } else if (iterative_solver) {
+      *x = iterative_solver->solve(b);
+      if (iterative_solver->info() != Eigen::Success) {
+        return false;
+      }
+    } else {
+      CHECK(factorizer);
+      *x = factorizer->solve(b);
+    }
+    PadSolution(x);
+    return true;
+  }
+
+  // Utility for SolveSystem(): Solve the system A*solution=b using the
+  // iterative solver. A is moved into iterative_A, since the solver keeps a
+  // reference to it for later derivative solves. Return false if the
+  // preconditioner could not be computed or the iteration did not converge.
+  bool SolveIteratively(Eigen::SparseMatrix<MNumber> *A,
+                        const MNumberVector &b) {
+    CHECK(!iterative_solver);
+    iterative_A.swap(*A);
+    iterative_solver = new IterativeSolver;
+    iterative_solver->setTolerance(iterative_tolerance);
+    iterative_solver->preconditioner().setDroptol(iterative_drop_tolerance);
+    iterative_solver->preconditioner().setFillfactor(iterative_fill_factor);
+    {
+      DoTrace trace("Precondition");
+      iterative_solver->compute(iterative_A);
+    }
+    if (iterative_solver->info() != Eigen::Success) {
+      return false;
+    }
+    {
+      DoTrace trace("Iterate");
+      solution = iterative_solver->solve(b);
+    }
+    if (iterative_solver->info() != Eigen::Success) {
+      return false;
+    }
+    PadSolution(&solution);
+    CHECK(solution.size() == T::NumPoints());
+    return true;
+  }
+
+  // Utility: If ShareAnalysis() was called and the source analyzed a matrix
+  // with the same sparsity pattern as A, copy its analysis to our factorizer
+  // and return true. Otherwise return false.
+  bool CopySharedAnalysis(const Eigen::SparseMatrix<MNumber> &A) {
+    const FEMSolver *source = analysis_source;
+    analysis_source = 0;                // Don't keep a pointer to the source
+    if (!source || !source->factorizer) {
+      return false;
+    }
+    if (source->system_outer != system_outer ||
+        source->system_inner != system_inner) {
+      return false;
+    }
+    return (analysis_copied = factorizer->CopyAnalysis(*source->factorizer, A));
+  }
+
+  // Utility: Initialize the FEM system matrix 'A' from 'values' (Avalues or
+  // Cvalues) and the system matrix sparsity pattern. Convert from Number to
+  // MNumber.
+  void GetSystemMatrix(const NumberVector &values,
+                       Eigen::SparseMatrix<MNumber> *A) {
+    const int system_size = reverse_index_map.size();
+    CHECK(values.size() == system_inner.size());
+    A->resize(system_size, system_size);
+    A->resizeNonZeros(system_inner.size());
+    std::copy(system_outer.begin(), system_outer.end(), A->outerIndexPtr());
+    std::copy(system_inner.begin(), system_inner.end(), A->innerIndexPtr());
+    for (int i = 0; i < values.size(); i++) {
+      A->valuePtr()[i] = T::MNumberFromNumber(values[i]);
+    }
+  }
+
+  // Utility: Initialize the FEM system matrix 'A' from triplets (for
+  // debugging). Convert from Number to MNumber.
   void GetSystemMatrix(const std::vector<Triplet> &triplets,
                        Eigen::SparseMatrix<MNumber> *A) {
     const int system_size = reverse_index_map.size();
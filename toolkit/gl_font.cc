@@ -32,6 +32,9 @@ static std::vector<StringToDraw> strings;
 void DrawString(const char *s, double x, double y, const Font *font,
                 float red, float green, float blue,
                 TextAlignment halign, TextAlignment valign) {
+  #ifndef QT_CORE_LIB
+    return;     // Nothing renders strings without Qt, so don't collect them
+  #endif
   if (!s || !s[0]) {
     return;
   }
@@ -100,4 +103,12 @@ void DrawStringGetSize(const char *s, const Font *font,
   *height = font->fm->height();
 }
 
+#else  // QT_CORE_LIB
+
+void DrawStringGetSize(const char *s, const Font *font,
+                       double *width, double *height) {
+  *width = 0;
+  *height = 0;
+}
+
 #endif  // QT_CORE_LIB
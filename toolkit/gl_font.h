@@ -39,6 +39,10 @@ class QWidget;
     QFont *font;
     QFontMetrics *fm;
   };
+  #else
+  // Without Qt there is no text rendering, e.g. in headless programs that
+  // only run simulations. Strings are accepted but never drawn.
+  struct Font {};
   #endif
 #endif
 
@@ -60,9 +64,11 @@ void DrawStringM(const char *s, double x, double y, double z,
 // Render all text passed to DrawString() and friends since the last call to
 // this function. This should be called at the end of each draw, as it will
 // unpredictably change the opengl state.
+#ifdef QT_CORE_LIB
 void RenderDrawStrings(QWidget *win);
+#endif
 
-// Get the dimensions of the string in the font.
+// Get the dimensions of the string in the font. Without Qt these are zero.
 void DrawStringGetSize(const char *s, const Font *font,
                        double *width, double *height);
 
@@ -376,6 +376,25 @@ void DrawThick(int x_steps, int y_steps, bool full,
   gl::ApplyTransform(P, MV);
 }
 
+//***************************************************************************
+// Texture1D.
+
+Texture1D::Texture1D(int width, const unsigned char *data) {
+  SetNormalPixelPacking();
+  GL(GenTextures)(1, &tex_);
+  GL(ActiveTexture)(GL_TEXTURE0);
+  GL(BindTexture)(GL_TEXTURE_1D, tex_);
+  GL(TexImage1D)(GL_TEXTURE_1D, 0, GL_RGB, width, 0,
+                 GL_RGB, GL_UNSIGNED_BYTE, data);
+  GL(TexParameteri)(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  GL(TexParameteri)(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  GL(TexParameteri)(GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+}
+
+Texture1D::~Texture1D() {
+  GL(DeleteTextures)(1, &tex_);
+}
+
 //***************************************************************************
 // Texture2D.
 
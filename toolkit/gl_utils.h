@@ -57,6 +57,19 @@ namespace gl {
   #endif
   void SetDefaultOpenGLSurfaceFormat();
   void InitializeOpenGLFunctions(QOpenGLContext *context);
+#elif defined(__TOOLKIT_GL_HEADLESS__)
+  // Headless programs never draw, so they are not linked with the OpenGL
+  // library. GL(fn) is instead a function with the same signature as gl##fn
+  // that panics. The OpenGL headers are still needed for the types.
+  template <class F> struct HeadlessFunction;
+  template <class R, class... Args> struct HeadlessFunction<R (*)(Args...)> {
+    static R Call(Args...) {
+      Panic("OpenGL is not available in this headless program");
+    }
+  };
+  #define GL(fn) gl::HeadlessFunction<decltype(&gl##fn)>::Call
+#else
+  #define GL(fn) gl##fn
 #endif
 
 // Return the current program, it's a runtime error if there isn't one.
@@ -255,6 +268,12 @@ class Buffer {
     }
   }
   bool Initialized() const { return ok_; }
+  // Replace 'size' bytes of the buffer at byte 'offset' with new data, e.g.
+  // for data that changes every frame.
+  void Update(int offset, int size, const void *data) {
+    Bind();
+    GL(BufferSubData)(kind_, offset, size, data);
+  }
  private:
   bool ok_;
   int size1_, size2_, kind_, usage_;
@@ -303,6 +322,12 @@ class VertexBuffer {
   void Specify2(const char *name, int T_offset, int count, int type) {
     Specify(name, count, type, sizeof(T2), vertex_count_*sizeof(T1) + T_offset);
   }
+  // Replace the T2 data for all vertices. The T1 data (e.g. positions) is
+  // kept, so a buffer can be created once and only the T2 data (e.g. colors)
+  // changed for each frame.
+  void Update2(const T2 *data2) {
+    buffer_.Update(vertex_count_*sizeof(T1), vertex_count_*sizeof(T2), data2);
+  }
   // Emit geometry in the buffer. The mode is e.g. GL_TRIANGLE_STRIP. The start
   // and count indicate which vertices to emit, the default is all vertices.
   void Draw(int mode, int start = 0, int count = -1) {
@@ -356,6 +381,18 @@ inline void Draw(const std::vector<Eigen::Vector3f> &v,
   buffer.Draw(mode);
 }
 
+// A 1D texture of RGB colors, e.g. a colormap. Colors are linearly
+// interpolated between texels and clamped to the texels at the ends.
+class Texture1D {
+ public:
+  Texture1D(int width, const unsigned char *data);
+  ~Texture1D();
+  void Bind() const { GL(BindTexture)(GL_TEXTURE_1D, tex_); }
+
+ private:
+  GLuint tex_;
+};
+
 // A 2D texture.
 class Texture2D {
  public:
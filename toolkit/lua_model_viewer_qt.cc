@@ -12,6 +12,7 @@
 
 #include <algorithm>
 #include <string>
+#include <thread>
 #include <stdint.h>
 #include "lua_model_viewer_qt.h"
 #include "gl_font.h"
@@ -23,6 +24,8 @@
 #include "platform.h"
 #include "shaders.h"
 #include "testing.h"
+#include "si_prefix.h"
+#include "thread.h"
 
 #include <QCheckBox>
 #include <QLineEdit>
@@ -36,6 +39,7 @@
 #include <QAbstractEventDispatcher>
 #include <QTimer>
 #include <QScreen>
+#include <QThread>
 
 using std::vector;
 using std::string;
@@ -402,6 +406,11 @@ LuaModelViewer::LuaModelViewer(QWidget *parent)
   QObject::connect(this, SIGNAL(AddScriptMessage(QString, int)),
                    this, SLOT(AddScriptMessageNotThreadSafe(QString, int)));
 
+  // Parallel sweep workers emit ParallelSweepPointDone() from their own
+  // threads, which queues idle processing on this thread to collect results.
+  QObject::connect(this, SIGNAL(ParallelSweepPointDone()),
+                   this, SLOT(ScheduleIdleProcessing()));
+
   // Create icons for the script messages window.
   error_icon_ = new QIcon;
   warning_icon_ = new QIcon;
@@ -417,6 +426,7 @@ LuaModelViewer::LuaModelViewer(QWidget *parent)
 }
 
 LuaModelViewer::~LuaModelViewer() {
+  ShutdownParallelSweeps();
   delete lua_;
   //@@@ Deleting this causes a crash, why?: delete parameter_layout_;
   delete error_icon_;
@@ -457,6 +467,7 @@ void LuaModelViewer::IdleProcessing() {
   if (disable_idle_processing_) {
     return;
   }
+  ReapParallelSweeps(false);
   string report;
   TraceReport(&report);
   if (!report.empty() && emit_trace_report_) {
@@ -481,11 +492,15 @@ void LuaModelViewer::IdleProcessing() {
     want_more_idles = OnInvisibleHandOptimize();
   }
   if (want_more_idles) {
-    ScheduleIdleProcessing();
+    // The workers of a parallel sweep schedule idle processing whenever they
+    // finish a point, so there is no need to poll them.
+    if (!parallel_sweep_) {
+      ScheduleIdleProcessing();
+    }
   } else {
-    // ih_.Stop() makes sure that future idle processing does nothing as the
-    // state will be OFF.
-    ih_.Stop();
+    // StopInvisibleHand() makes sure that future idle processing does nothing
+    // as the state will be OFF.
+    StopInvisibleHand();
   }
 }
 
@@ -592,6 +607,10 @@ void LuaModelViewer::Sweep(const string &parameter_name,
       }
     }
   }
+  // Sweep points can be evaluated concurrently unless we need to save images
+  // of the model at each point.
+  ih_.sweep_in_parallel = CanSweepInParallel() && image_filename.empty() &&
+                          ScriptIsThreadSafe();
   ih_.state = InvisibleHand::SWEEPING;
   // Run IdleProcessing() to kick off the actual sweep.
   ScheduleIdleProcessing();
@@ -711,7 +730,7 @@ void LuaModelViewer::StopSweepOrOptimize() {
       return;
     }
   }
-  ih_.Stop();
+  StopInvisibleHand();
 }
 
 void LuaModelViewer::ToggleEmitTraceReport() {
@@ -793,10 +812,11 @@ bool LuaModelViewer::RunScript(const char *script, bool rerun_even_if_same,
 
   // Reset the invisible hand state in case we're in the middle of a sweep or
   // optimizing.
-  ih_.Stop();
+  StopInvisibleHand();
 
-  // Run script.
+  // Run script, in a new lua state since this might be a different script.
   rebuild_parameters_ = true;
+  fresh_lua_state_ = true;
   RerunScript(true, optimize_output);
   rebuild_parameters_ = false;
 
@@ -819,40 +839,7 @@ bool LuaModelViewer::RunScript(const char *script, bool rerun_even_if_same,
   return true;
 }
 
-bool LuaModelViewer::RerunScript(bool refresh_window,
-                                 vector<JetNum> *optimize_output,
-                                 vector<JetNum> *test_output,
-                                 bool only_compute_derivatives) {
-  if (in_rerun_script_) {
-    // The custom controls for parameter changing can sometimes cause this
-    // function to indirectly call itself, e.g. through SelectPane(). Prevent
-    // such recursion.
-    return true;
-  }
-  Trace trace(__func__);
-  in_rerun_script_ = true;
-  num_ticked_count_ = 0;
-  valid_ = false;               // Assumption, updated below
-
-  // optimize_output will be returned empty on any error, e.g. on script error
-  // or if we can't find the optimize function or solve.
-  if (optimize_output) {
-    optimize_output->clear();
-  }
-
-  // If script_ is the empty string then RunScript() might not have been called
-  // but it's possible also that the user tried to run an empty file.
-  if (script_.empty()) {
-    in_rerun_script_ = false;
-    return false;
-  }
-
-  // Reset state, setup lua context. NOTE that MyLua will capture both calls to
-  // lua.Error() and the global Error() function, so lua.ThereWereErrors() can
-  // be used to check for either kind of error.
-  script_messages_->clear();
-  debug_text_.clear();
-  markers_.clear();
+void LuaModelViewer::CreateLuaState() {
   delete lua_;
   lua_ = new MyLua(this);
   lua_->UseStandardLibraries(true);
@@ -896,11 +883,60 @@ bool LuaModelViewer::RerunScript(bool refresh_window,
   }
   lua_setglobal(lua_->L(), "FLAGS");
 
+  // Later runs of the same script start from this state.
+  lua_->SnapshotGlobals();
+}
+
+bool LuaModelViewer::RerunScript(bool refresh_window,
+                                 vector<JetNum> *optimize_output,
+                                 vector<JetNum> *test_output,
+                                 bool only_compute_derivatives) {
+  if (in_rerun_script_) {
+    // The custom controls for parameter changing can sometimes cause this
+    // function to indirectly call itself, e.g. through SelectPane(). Prevent
+    // such recursion.
+    return true;
+  }
+  Trace trace(__func__);
+  in_rerun_script_ = true;
+  num_ticked_count_ = 0;
+  valid_ = false;               // Assumption, updated below
+
+  // optimize_output will be returned empty on any error, e.g. on script error
+  // or if we can't find the optimize function or solve.
+  if (optimize_output) {
+    optimize_output->clear();
+  }
+
+  // If script_ is the empty string then RunScript() might not have been called
+  // but it's possible also that the user tried to run an empty file.
+  if (script_.empty()) {
+    in_rerun_script_ = false;
+    return false;
+  }
+
+  // Reset state, setup lua context. NOTE that MyLua will capture both calls to
+  // lua.Error() and the global Error() function, so lua.ThereWereErrors() can
+  // be used to check for either kind of error.
+  script_messages_->clear();
+  debug_text_.clear();
+  markers_.clear();
+  if (lua_ && !fresh_lua_state_) {
+    // Reuse the lua context from the last run of this script, returning it to
+    // the state it had just before the script utility code was run. This is
+    // much faster than setting up a new context.
+    lua_->RestoreGlobals();
+    ResetModel();
+  } else {
+    CreateLuaState();
+    fresh_lua_state_ = false;
+  }
+
   // Run the script. First load the lua utility functions that are available to
-  // user scripts.
+  // user scripts. The compiled code for both of these is cached by RunString().
   string user_script_util(&user_script_util_dot_lua,
                           user_script_util_dot_lua_length);
-  if (!lua_->RunString(user_script_util.c_str(), true, "user_script_util")) {
+  if (!lua_->RunString(user_script_util, true, "user_script_util")) {
     // On script failure an error message will have been shown. But this should
     // never happen.
     lua_->Error("Internal error in script utility code");
@@ -1071,7 +1107,7 @@ int LuaModelViewer::LuaCreateParameter(lua_State *L) {
     }
     p.the_default = ToDouble(lua_tonumber(L, 4));
   }
-  if (the_min.Derivative() != 0 || the_max.Derivative() != 0) {
+  if (HasDerivative(the_min) || HasDerivative(the_max)) {
     LuaError(L, "Parameter min and max values can not depend on other "
                 "parameters, as this will confuse the optimizer.");
   }
@@ -1080,10 +1116,12 @@ int LuaModelViewer::LuaCreateParameter(lua_State *L) {
   JetNum value = p.value;
 
   // Keep count of the number of checkbox-ticked parameters seen so far. The
-  // n'th checked parameters gets to have a derivative:
+  // n'th checked parameters gets derivative n-derivative_index_, if there is a
+  // JetNum derivative for it:
   if (p.checkbox && p.checkbox->isChecked()) {
-    if (!rebuild_parameters_ && derivative_index_ == num_ticked_count_) {
-      value.Derivative() = 1;
+    int k = num_ticked_count_ - derivative_index_;
+    if (!rebuild_parameters_ && k >= 0 && k < kJetWidth) {
+      value.Derivative(k) = 1;
     }
     num_ticked_count_++;
   }
@@ -1253,31 +1291,7 @@ void LuaModelViewer::SelectPlot(int plot_type) {
 }
 
 double LuaModelViewer::DistanceScale(const char *unit_name) {
-  if (unit_name == 0)
-    return -1;
-  if (strcmp(unit_name, "nm") == 0)
-    return 1e-9;
-  if (strcmp(unit_name, "micron") == 0)
-    return 1e-6;
-  if (strcmp(unit_name, "mm") == 0)
-    return 1e-3;
-  if (strcmp(unit_name, "cm") == 0)
-    return 1e-2;
-  if (strcmp(unit_name, "m") == 0)
-    return 1;
-  if (strcmp(unit_name, "km") == 0)
-    return 1000;
-  if (strcmp(unit_name, "mil") == 0 || strcmp(unit_name, "thou") == 0)
-    return 2.54e-5;
-  if (strcmp(unit_name, "inch") == 0)
-    return 2.54e-2;
-  if (strcmp(unit_name, "foot") == 0)
-    return 0.3048;
-  if (strcmp(unit_name, "yard") == 0)
-    return 0.9144;
-  if (strcmp(unit_name, "mile") == 0)
-    return 1609.344;
-  return -1;
+  return ::DistanceScale(unit_name);
 }
 
 void LuaModelViewer::ExportPlotMatlab(const char *filename) {
@@ -1421,7 +1435,107 @@ bool LuaModelViewer::SetParameter(const string &parameter_name, double value) {
   }
 }
 
+struct LuaModelViewer::ParallelSweep {
+  vector<SweepPoint> points;            // Set before the workers start
+  vector<std::thread> threads;          // Only used by the GUI thread
+  std::mutex mutex;                     // Protects everything below
+  int next_point = 0;                   // Next point for a worker to start
+  int running = 0;                      // Number of workers not yet exited
+  bool stop = false;                    // If true, start no more points
+  vector<char> done, ok;                // For each point
+  vector<vector<JetComplex>> outputs;   // For each point
+  vector<vector<string>> messages;      // For each point
+};
+
+void LuaModelViewer::ParallelSweepWorker(ParallelSweep *sweep) {
+  for (;;) {
+    int i;
+    {
+      MutexLock lock(&sweep->mutex);
+      if (sweep->stop || sweep->next_point >= sweep->points.size()) {
+        // The GUI thread can delete the sweep once running is 0, so it must
+        // not be touched after this.
+        sweep->running--;
+        break;
+      }
+      i = sweep->next_point++;
+    }
+    vector<JetComplex> output;
+    vector<string> messages;
+    bool ok = ComputeSweptOutputInParallel(sweep->points[i], &output,
+                                           &messages);
+    {
+      MutexLock lock(&sweep->mutex);
+      sweep->outputs[i].swap(output);
+      sweep->messages[i].swap(messages);
+      sweep->ok[i] = ok;
+      sweep->done[i] = true;
+    }
+    emit ParallelSweepPointDone();
+  }
+  // Schedule idle processing so that a stopped sweep gets deleted.
+  emit ParallelSweepPointDone();
+}
+
+void LuaModelViewer::StopInvisibleHand() {
+  StopParallelSweep();
+  ih_.Stop();
+}
+
+void LuaModelViewer::StopParallelSweep() {
+  if (parallel_sweep_) {
+    {
+      MutexLock lock(&parallel_sweep_->mutex);
+      parallel_sweep_->stop = true;
+    }
+    stopped_sweeps_.push_back(parallel_sweep_);
+    parallel_sweep_ = 0;
+  }
+}
+
+void LuaModelViewer::ReapParallelSweeps(bool wait) {
+  for (int i = 0; i < stopped_sweeps_.size(); ) {
+    ParallelSweep *sweep = stopped_sweeps_[i];
+    bool running;
+    {
+      MutexLock lock(&sweep->mutex);
+      running = sweep->running > 0;
+    }
+    if (running && !wait) {
+      i++;
+      continue;
+    }
+    for (std::thread &thread : sweep->threads) {
+      thread.join();
+    }
+    delete sweep;
+    stopped_sweeps_.erase(stopped_sweeps_.begin() + i);
+  }
+}
+
+void LuaModelViewer::ShutdownParallelSweeps() {
+  StopParallelSweep();
+  ReapParallelSweeps(true);
+}
+
+bool LuaModelViewer::ScriptIsThreadSafe() {
+  lua_State *L = lua_->L();
+  LuaRawGetGlobal(L, "config");                 // Stack: config
+  if (lua_type(L, -1) != LUA_TTABLE) {
+    lua_pop(L, 1);
+    return true;
+  }
+  lua_getfield(L, -1, "thread_safe");           // Stack: config thread_safe
+  bool thread_safe = lua_type(L, -1) == LUA_TNIL || lua_toboolean(L, -1);
+  lua_pop(L, 2);
+  return thread_safe;
+}
+
 bool LuaModelViewer::OnInvisibleHandSweep() {
+  if (ih_.sweep_in_parallel) {
+    return OnInvisibleHandParallelSweep();
+  }
+
   // Sanity checks, and update the sweep parameter value.
   if (ih_.sweep_index < 0 || ih_.sweep_index >= ih_.sweep_values.size() ||
       ih_.sweep_values.size() != ih_.sweep_output.size() ||
@@ -1494,6 +1608,128 @@ bool LuaModelViewer::OnInvisibleHandSweep() {
   }
 }
 
+bool LuaModelViewer::StartParallelSweep() {
+  Trace trace(__func__);
+  if (ih_.sweep_index != 0 ||
+      ih_.sweep_values.size() != ih_.sweep_output.size()) {
+    Error("Sweep interrupted (internal error)");
+    return false;
+  }
+  if (ih_.sweep_over_test_output && !run_test_after_solve_) {
+    Error("If sweeping over test output, enable 'Run test() after each solve'");
+    return false;
+  }
+
+  // Describe the current model. Parameters get the same derivatives that
+  // LuaCreateParameter() would give them.
+  SweepPoint model;
+  model.script = script_;
+  for (int i = 1; i < copy_of_argc_; i++) {
+    char *arg = copy_of_argv_[i];
+    if (arg[0] == '-') {
+      char *equals = strchr(arg, '=');
+      if (equals && equals >= arg + 2) {
+        model.flags[string(arg + 1, equals - arg - 1)] = equals + 1;
+      }
+    }
+  }
+  for (auto &it : param_map_) {
+    model.parameters[it.first] = it.second.value;
+  }
+  int num_ticked = 0;
+  for (int i = 0; i < current_param_controls_.size(); i++) {
+    const Parameter &p = GetParameter(current_param_controls_[i]);
+    if (p.checkbox && p.checkbox->isChecked()) {
+      int k = num_ticked - derivative_index_;
+      if (k >= 0 && k < kJetWidth) {
+        model.derivatives[p.label] = k;
+      }
+      num_ticked++;
+    }
+  }
+  model.test_output = ih_.sweep_over_test_output;
+  PrepareSweepPoint(&model);
+
+  // Start the workers.
+  const Parameter &swept = GetParameter(ih_.sweep_parameter_name);
+  int n = ih_.sweep_values.size();
+  ParallelSweep *sweep = new ParallelSweep;
+  sweep->points.resize(n, model);
+  for (int i = 0; i < n; i++) {
+    sweep->points[i].parameters[swept.label] = std::max(swept.the_min,
+        std::min(swept.the_max, ih_.sweep_values[i]));
+  }
+  sweep->done.resize(n);
+  sweep->ok.resize(n);
+  sweep->outputs.resize(n);
+  sweep->messages.resize(n);
+  sweep->running = std::min(n, std::max(1, QThread::idealThreadCount()));
+  for (int i = 0; i < sweep->running; i++) {
+    sweep->threads.push_back(std::thread(&LuaModelViewer::ParallelSweepWorker,
+                                         this, sweep));
+  }
+  parallel_sweep_ = sweep;
+  return true;
+}
+
+bool LuaModelViewer::OnInvisibleHandParallelSweep() {
+  Trace trace(__func__);
+  if (!parallel_sweep_) {
+    return StartParallelSweep();
+  }
+
+  // Find the points at the start of the unplotted part of the sweep that the
+  // workers have finished. The workers do not change a point once it is done,
+  // so its results can be read without holding the lock.
+  ParallelSweep *sweep = parallel_sweep_;
+  int first = ih_.sweep_index, end = first;
+  {
+    MutexLock lock(&sweep->mutex);
+    while (end < sweep->points.size() && sweep->done[end]) {
+      end++;
+    }
+  }
+  if (end == first) {
+    return true;
+  }
+
+  // Collect the results in sweep order.
+  for (int i = first; i < end; i++) {
+    for (const string &message : sweep->messages[i]) {
+      AddScriptMessage(message.c_str(), ICON_BLANK);
+    }
+    if (!sweep->ok[i]) {
+      SelectPane(script_messages_pane_);
+      Error("Sweep interrupted at %s = %g", ih_.sweep_parameter_name.c_str(),
+            ih_.sweep_values[i]);
+      return false;
+    }
+    ih_.sweep_output[i] = sweep->outputs[i];
+  }
+  ih_.sweep_index = end;
+
+  // Plot the results so far.
+  vector<double> values(ih_.sweep_values.begin(),
+                        ih_.sweep_values.begin() + end);
+  vector<vector<JetComplex>> output(ih_.sweep_output.begin(),
+                                    ih_.sweep_output.begin() + end);
+  if (!PlotSweepResults(plot_type_, ih_.sweep_parameter_name, values,
+                        output)) {
+    Error("Error during sweep (e.g. nonconstant number of ports or modes)");
+    return false;
+  }
+  if (ih_.sweep_index < ih_.sweep_values.size()) {
+    return true;
+  }
+
+  // We're all done. Show the model for the last sweep point, as a sequential
+  // sweep would.
+  if (SetParameter(ih_.sweep_parameter_name, ih_.sweep_values.back())) {
+    RerunScript(true);
+  }
+  return false;
+}
+
 bool LuaModelViewer::OnInvisibleHandOptimize() {
   Trace trace(__func__);
   CHECK(ih_.optimizer);
@@ -1531,12 +1767,14 @@ bool LuaModelViewer::OnInvisibleHandOptimize() {
     return false;
   }
 
-  // Compute the Jacobian if necessary.
+  // Compute the Jacobian if necessary. Each run of the script computes the
+  // derivatives for kJetWidth parameters.
   //    jacobians[j*num_parameters + i] = d error[j] / d parameter[i]
   vector<double> jacobians;
   if (ih_.optimizer->JacobianRequested()) {
-    jacobians.resize(ih_.opt_parameter_names.size() * num_optimize_outputs_);
-    for (int i = 0; i < ih_.opt_parameter_names.size(); i++) {
+    const int num_parameters = ih_.opt_parameter_names.size();
+    jacobians.resize(num_parameters * num_optimize_outputs_);
+    for (int i = 0; i < num_parameters; i += kJetWidth) {
       // Compute the derivatives for this derivative index. The results for
       // i==0 were already computed above.
       if (i > 0) {
@@ -1549,9 +1787,11 @@ bool LuaModelViewer::OnInvisibleHandOptimize() {
         }
       }
       CHECK(num_optimize_outputs_ == optimize_errors.size());
-      for (int j = 0; j < num_optimize_outputs_; j++) {
-        jacobians[j*ih_.opt_parameter_names.size() + i] =
-          optimize_errors[j].Derivative();
+      for (int k = 0; k < kJetWidth && i + k < num_parameters; k++) {
+        for (int j = 0; j < num_optimize_outputs_; j++) {
+          jacobians[j*num_parameters + i + k] =
+            optimize_errors[j].Derivative(k);
+        }
       }
     }
   }
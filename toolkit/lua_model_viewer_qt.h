@@ -128,9 +128,10 @@ class LuaModelViewer : public GLViewer {
   // Rerun the last script given to RunScript(). This does nothing if
   // RunScript() has not yet been called. Parameter controls are not rebuilt by
   // default, so this is faster than RunScript() in the case where only
-  // parameter values have changed. A new Lua state is created, and this state
-  // will persist until the next time [Re]runScript() is called, so that e.g.
-  // any callback functions created can be called.
+  // parameter values have changed. The Lua state is returned to the pristine
+  // state it had before the script first ran (RunScript() creates a new Lua
+  // state), and this state will persist until the next time [Re]runScript()
+  // is called, so that e.g. any callback functions created can be called.
   //
   // If optimize_output is nonzero return the output of the config.optimize
   // function, emitting an error and setting optimize_output to the empty
@@ -175,6 +176,8 @@ class LuaModelViewer : public GLViewer {
   enum { ICON_BLANK = 0, ICON_INFO, ICON_WARNING, ICON_ERROR };
  signals:
   void AddScriptMessage(QString msg, int icon_number);
+  // Emitted by parallel sweep worker threads when they finish a point.
+  void ParallelSweepPointDone();
  public slots:
   void AddScriptMessageNotThreadSafe(QString msg, int icon_number);
  public:
@@ -248,6 +251,47 @@ class LuaModelViewer : public GLViewer {
   // to do any extra preparation that is necessary.
   virtual void PrepareForOptimize()=0;
 
+  // Everything needed to evaluate a sweep point independently of the displayed
+  // model, by running a separate copy of the script.
+  struct SweepPoint {
+    std::string script;                         // The script to run
+    std::map<std::string, std::string> flags;   // The FLAGS table
+    std::map<std::string, double> parameters;   // All parameter values
+    std::map<std::string, int> derivatives;     // Derivative index of params
+    bool test_output;                           // Output the test() results?
+    int solution_index = 0;                     // Subclass defined
+  };
+
+  // Return true if ComputeSweptOutputInParallel() is implemented, in which
+  // case sweep points are evaluated concurrently by worker threads while the
+  // GUI thread keeps running.
+  virtual bool CanSweepInParallel() { return false; }
+
+  // Called on the GUI thread when a parallel sweep starts, to copy into
+  // 'point' any subclass state (e.g. the displayed solution) that
+  // ComputeSweptOutputInParallel() needs.
+  virtual void PrepareSweepPoint(SweepPoint *point) {}
+
+  // Put into output what ComputeSweptOutput() (or the test() function if
+  // point.test_output is true) would give after running point.script. This is
+  // called from worker threads while the GUI thread keeps running, so it must
+  // not touch the displayed model, the Lua state or the user interface.
+  // Script output and error messages are returned in 'messages'. Return false
+  // on any error. Subclasses that implement this must call
+  // ShutdownParallelSweeps() in their destructor.
+  virtual bool ComputeSweptOutputInParallel(const SweepPoint &point,
+                                            std::vector<JetComplex> *output,
+                                            std::vector<std::string> *messages)
+  {
+    return false;
+  }
+
+ protected:
+  // Stop any parallel sweep and wait for its worker threads to exit, so that
+  // they are not left calling ComputeSweptOutputInParallel() on a partly
+  // destroyed object.
+  void ShutdownParallelSweeps();
+
  private:
   bool valid_;                          // Is the model valid?
   int dragging_marker_;                 // >= 0 if now dragging a marker
@@ -255,6 +299,7 @@ class LuaModelViewer : public GLViewer {
   MyLua *lua_;                          // Lua context for last script, 0=none
   int num_optimize_outputs_;            // Num values returned by optimize()
   bool in_rerun_script_;                // If RerunScript() is running
+  bool fresh_lua_state_ = true;         // Next RerunScript() makes new lua_
   bool emit_trace_report_;              // If printing trace report when idle
   int plot_type_;                       // Given to SelectPlot()
   QIcon *error_icon_, *warning_icon_, *info_icon_;
@@ -287,7 +332,7 @@ class LuaModelViewer : public GLViewer {
   std::vector<std::string> current_param_controls_;  // Current control names
   std::vector<std::string> markers_; // Pairs of controls names shown as markers
   int num_ticked_count_;             // Ticked params seen by CreateParameter()
-  int derivative_index_;             // n'th checked parameter gets derivative
+  int derivative_index_;             // First checked parameter with derivative
   // If true then rebuild parameter controls in RerunScript(). If script
   // execution is triggered by parameter change then this must be false as the
   // user will be currently interacting with the parameter controls.
@@ -308,6 +353,7 @@ class LuaModelViewer : public GLViewer {
     int sweep_index;                          // Current parameter value index
     std::vector<double> sweep_values;         // All values of parameter to use
     bool sweep_over_test_output;              // Plot test() output?
+    bool sweep_in_parallel;                   // Use worker threads?
     std::vector<std::vector<JetComplex> > sweep_output;
     OptimizerType optimizer_type;             // Algorithm to use
     AbstractOptimizer *optimizer;             // Nonzero if currently optimizing
@@ -320,6 +366,7 @@ class LuaModelViewer : public GLViewer {
       optimizer_type = OptimizerType::LEVENBERG_MARQUARDT;
       optimizer = 0;
       sweep_over_test_output = false;
+      sweep_in_parallel = false;
       Start();
     }
 
@@ -343,11 +390,22 @@ class LuaModelViewer : public GLViewer {
   };
   InvisibleHand ih_;
 
+  // The worker threads and results of a parallel sweep. A sweep that is
+  // stopped early is kept in stopped_sweeps_ until its workers have finished
+  // the points they were computing.
+  struct ParallelSweep;
+  ParallelSweep *parallel_sweep_ = 0;           // Nonzero while sweeping
+  std::vector<ParallelSweep*> stopped_sweeps_;
+
   // GLViewer overridden functions.
   void Draw() override;
   void HandleClick(int x, int y, bool button, const Eigen::Vector3d &model_pt) override;
   void HandleDrag(int x, int y, const Eigen::Vector3d &model_pt) override;
 
+  // Create a new lua_ with all our functions and classes registered, then
+  // take a snapshot of its globals for later runs to restore.
+  void CreateLuaState();
+
   // For marker n (offset into the markers_ array) return the x and y
   // coordinates of the marker.
   void GetMarkerPosition(int n, double *x, double *y);
@@ -357,13 +415,40 @@ class LuaModelViewer : public GLViewer {
   // Return true if the parameter name exists or false otherwise.
   bool SetParameter(const std::string &parameter_name, double value);
 
+  // Return false if the last script run set config.thread_safe to false, i.e.
+  // it can not be used for parallel sweeps.
+  bool ScriptIsThreadSafe();
+
   // Called by IdleProcessing() to deal with the current invisible hand state.
   // Return true if there is more work left to do and we need more idle events.
   // If false is returned then the invisible hand state will be reset in
   // IdleProcessing().
+  //
+  // OnInvisibleHandParallelSweep() calls StartParallelSweep() the first time,
+  // which starts one worker thread per core. Each worker solves the next
+  // unstarted sweep point whenever it is free, and schedules idle processing
+  // when the point is done. Later calls collect the points finished so far and
+  // plot the results for the sweep values up to the first unfinished one.
+  // They never wait for the workers.
   bool OnInvisibleHandSweep();
+  bool OnInvisibleHandParallelSweep();
+  bool StartParallelSweep();
   bool OnInvisibleHandOptimize();
   void MessageBestOptimizerParameters();
+
+  // Stop the invisible hand, including the workers of a parallel sweep.
+  void StopInvisibleHand();
+
+  // The main function of each parallel sweep worker thread.
+  void ParallelSweepWorker(ParallelSweep *sweep);
+
+  // Tell the workers of parallel_sweep_ to stop starting new points, and move
+  // it to stopped_sweeps_. This does not wait for them.
+  void StopParallelSweep();
+
+  // Delete the stopped sweeps whose workers have all exited, or wait for all
+  // of them to exit if 'wait' is true.
+  void ReapParallelSweeps(bool wait);
 };
 
 #endif
@@ -15,7 +15,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <functional>
+#include <algorithm>
+#include <map>
+#include <vector>
 #include "md5.h"
+#include "thread.h"
+#include "testing.h"
 
 // The addresses of this object is a unique registry key. The value is the
 // LuaUserClass shared metatable.
@@ -173,6 +179,10 @@ bool LuaUserClass::Operator(lua_State *L, int op, int pos) {
   return false;
 }
 
+bool LuaUserClass::HashContents(md5_state_t *ms) const {
+  return false;
+}
+
 // These functions are called from various lua metamethods for userdata
 // objects.
 
@@ -401,6 +411,293 @@ void LuaHash(lua_State *L, std::string *hash, bool strip) {
   hash->assign((char*) digest, sizeof(digest));
 }
 
+// Tables and functions visited by HashValue(), numbered in visit order.
+typedef std::map<const void*, int> VisitOrder;
+
+// Helper for HashValue(). Append to 'ms' whether the table or function at
+// stack position 'index' has been visited before, and if so its visit number.
+// Return true if it has been visited.
+static bool HashVisit(lua_State *L, int index, md5_state_t *ms,
+                      VisitOrder *visited) {
+  auto it = visited->insert(std::make_pair(lua_topointer(L, index),
+                                           int(visited->size())));
+  md5_byte_t seen = !it.second;
+  md5_append(ms, &seen, 1);
+  if (seen) {
+    md5_append(ms, (const md5_byte_t*) &it.first->second, sizeof(int));
+  }
+  return seen;
+}
+
+// Helper for LuaHashValue(). Append a representation of the value at stack
+// position 'index' to 'ms'. Tables and functions that have already been
+// visited are represented by their visit number only, so that shared and
+// cyclic references terminate, and so that different sharing (e.g. b=a versus
+// b={k=a.k}) gives different hashes. Each value reached decrements 'budget'.
+static bool HashValue(lua_State *L, int index, md5_state_t *ms,
+                      VisitOrder *visited, int *budget) {
+  if (--(*budget) < 0 || !lua_checkstack(L, 4)) {
+    return false;
+  }
+  index = lua_absindex(L, index);
+  md5_byte_t type = lua_type(L, index);
+  md5_append(ms, &type, 1);
+  switch (type) {
+    case LUA_TNIL:
+      return true;
+    case LUA_TBOOLEAN: {
+      md5_byte_t b = lua_toboolean(L, index);
+      md5_append(ms, &b, 1);
+      return true;
+    }
+    case LUA_TNUMBER: {
+      // Numbers are hashed by representation, which is exact for integers and
+      // for floats (including any derivatives that lua_Number carries).
+      md5_byte_t is_int = lua_isinteger(L, index);
+      md5_append(ms, &is_int, 1);
+      if (is_int) {
+        lua_Integer n = lua_tointeger(L, index);
+        md5_append(ms, (const md5_byte_t*) &n, sizeof(n));
+      } else {
+        lua_Number n = lua_tonumber(L, index);
+        md5_append(ms, (const md5_byte_t*) &n, sizeof(n));
+      }
+      return true;
+    }
+    case LUA_TSTRING: {
+      size_t length = 0;
+      const char *s = lua_tolstring(L, index, &length);
+      md5_append(ms, (const md5_byte_t*) &length, sizeof(length));
+      md5_append(ms, (const md5_byte_t*) s, length);
+      return true;
+    }
+    case LUA_TLIGHTUSERDATA: {
+      const void *p = lua_touserdata(L, index);
+      md5_append(ms, (const md5_byte_t*) &p, sizeof(p));
+      return true;
+    }
+    case LUA_TUSERDATA: {
+      // LuaUserClass objects, which have the shared metatable, are hashed by
+      // contents. Other userdata is opaque state belonging to C functions
+      // (e.g. the math.random() state), so like other state hidden inside C
+      // functions it is represented by identity only.
+      bool is_user_class = false;
+      if (lua_getmetatable(L, index)) {
+        lua_rawgetp(L, LUA_REGISTRYINDEX, &lua_registry_metatable_key);
+        is_user_class = lua_rawequal(L, -1, -2);
+        lua_pop(L, 2);
+      }
+      if (is_user_class) {
+        const LuaUserClass *obj =
+            (const LuaUserClass*) lua_touserdata(L, index);
+        return obj->HashContents(ms);
+      }
+      const void *p = lua_touserdata(L, index);
+      md5_append(ms, (const md5_byte_t*) &p, sizeof(p));
+      return true;
+    }
+    case LUA_TFUNCTION: {
+      if (HashVisit(L, index, ms, visited)) {
+        return true;
+      }
+      if (lua_iscfunction(L, index)) {
+        lua_CFunction fn = lua_tocfunction(L, index);
+        md5_append(ms, (const md5_byte_t*) &fn, sizeof(fn));
+      } else {
+        std::string dump;
+        lua_pushvalue(L, index);
+        LuaDump(L, &dump, true);
+        lua_pop(L, 1);
+        md5_append(ms, (const md5_byte_t*) dump.data(), dump.size());
+      }
+      for (int i = 1; lua_getupvalue(L, index, i); i++) {
+        bool ok = HashValue(L, -1, ms, visited, budget);
+        lua_pop(L, 1);
+        if (!ok) {
+          return false;
+        }
+      }
+      return true;
+    }
+    case LUA_TTABLE: {
+      if (HashVisit(L, index, ms, visited)) {
+        return true;
+      }
+      // The traversal order of a table depends on its history, not just its
+      // contents, so visit the entries in the order of their key hashes. This
+      // also makes the visit numbers independent of the history. Table and
+      // function keys are ordered by hashing them as if they were visited
+      // next, which costs a copy of 'visited'.
+      lua_newtable(L);                          // Stack: keys
+      const int keys = lua_gettop(L);
+      std::vector<std::pair<std::string, int>> order;
+      lua_pushnil(L);                           // Stack: keys nil
+      while (lua_next(L, index)) {              // Stack: keys k v
+        lua_pop(L, 1);                          // Stack: keys k
+        md5_state_t key_ms;
+        md5_init(&key_ms);
+        bool ok;
+        int key_type = lua_type(L, -1);
+        if (key_type == LUA_TTABLE || key_type == LUA_TFUNCTION) {
+          *budget -= visited->size();
+          VisitOrder scratch(*visited);
+          ok = HashValue(L, -1, &key_ms, &scratch, budget);
+        } else {
+          ok = HashValue(L, -1, &key_ms, visited, budget);
+        }
+        if (!ok) {
+          lua_settop(L, keys - 1);
+          return false;
+        }
+        md5_byte_t digest[16];
+        md5_finish(&key_ms, digest);
+        order.push_back(std::make_pair(std::string((char*) digest, 16),
+                                       int(order.size()) + 1));
+        lua_pushvalue(L, -1);                   // Stack: keys k k
+        lua_rawseti(L, keys, order.size());     // Stack: keys k
+      }
+      std::sort(order.begin(), order.end());
+      for (int i = 0; i < order.size(); i++) {
+        lua_rawgeti(L, keys, order[i].second);  // Stack: keys k
+        lua_pushvalue(L, -1);                   // Stack: keys k k
+        lua_rawget(L, index);                   // Stack: keys k v
+        bool ok = HashValue(L, -2, ms, visited, budget) &&
+                  HashValue(L, -1, ms, visited, budget);
+        lua_pop(L, 2);                          // Stack: keys
+        if (!ok) {
+          lua_pop(L, 1);
+          return false;
+        }
+      }
+      lua_pop(L, 1);                            // Stack:
+      if (lua_getmetatable(L, index)) {
+        bool ok = HashValue(L, -1, ms, visited, budget);
+        lua_pop(L, 1);
+        return ok;
+      }
+      return true;
+    }
+    default:
+      return false;             // E.g. threads
+  }
+}
+
+bool LuaHashValue(lua_State *L, int index, std::string *hash) {
+  const int kMaxValues = 1000000;
+  int top = lua_gettop(L);
+  VisitOrder visited;
+  int budget = kMaxValues;
+  md5_state_t ms;
+  md5_init(&ms);
+  bool ok = HashValue(L, index, &ms, &visited, &budget);
+  CHECK(lua_gettop(L) == top);
+  if (!ok) {
+    return false;
+  }
+  md5_byte_t digest[16];
+  md5_finish(&ms, digest);
+  hash->assign((char*) digest, sizeof(digest));
+  return true;
+}
+
+// Scripts given to RunString() are often run many times, e.g. every time a
+// model parameter changes. To avoid parsing them each time their compiled
+// chunks are cached here, keyed by the MD5 hash of the name and script. The
+// cache is shared by all Lua contexts, which may be in different threads.
+static std::mutex chunk_cache_mutex;
+static std::map<std::string, std::string> chunk_cache;
+const int kMaxCachedChunks = 20;
+
+// Each Lua context also keeps the functions it has loaded, in a registry
+// table under this key, so rerunning a script in the same context (e.g. after
+// RestoreGlobals()) does not even need to load the chunk. The table maps a
+// fast hash of the script to {script, name, function}.
+static char loaded_chunks_key;
+
+// Like luaL_loadbuffer() but use the chunk caches.
+static int LoadBufferCached(lua_State *L, const std::string &s,
+                            const char *name) {
+  // Look in this context's loaded functions. The hash here is much cheaper
+  // than MD5, so the script and name are checked as well.
+  int top = lua_gettop(L);
+  if (lua_rawgetp(L, LUA_REGISTRYINDEX, &loaded_chunks_key) != LUA_TTABLE) {
+    lua_pop(L, 1);
+    lua_newtable(L);                            // C
+    lua_pushvalue(L, -1);                       // C C
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &loaded_chunks_key);
+  }                                             // C
+  lua_Integer fast_hash = std::hash<std::string>()(s);
+  if (lua_rawgeti(L, -1, fast_hash) == LUA_TTABLE) {    // C E
+    size_t length = 0;
+    lua_rawgeti(L, -1, 1);                      // C E script
+    const char *script = lua_tolstring(L, -1, &length);
+    lua_rawgeti(L, -2, 2);                      // C E script name
+    const char *script_name = lua_tostring(L, -1);
+    if (length == s.size() && memcmp(script, s.data(), length) == 0 &&
+        (name ? (script_name && strcmp(name, script_name) == 0) :
+                !script_name)) {
+      lua_rawgeti(L, -3, 3);                    // C E script name fn
+      lua_replace(L, top + 1);                  // fn E script name
+      lua_settop(L, top + 1);                   // fn
+      return LUA_OK;
+    }
+  }
+  lua_settop(L, top);
+
+  md5_state_t ms;
+  md5_init(&ms);
+  if (name) {
+    md5_append(&ms, (const md5_byte_t*) name, strlen(name) + 1);
+  }
+  md5_append(&ms, (const md5_byte_t*) s.data(), s.size());
+  md5_byte_t digest[16];
+  md5_finish(&ms, digest);
+  std::string key((char*) digest, sizeof(digest));
+
+  std::string chunk;
+  {
+    MutexLock lock(&chunk_cache_mutex);
+    auto it = chunk_cache.find(key);
+    if (it != chunk_cache.end()) {
+      chunk = it->second;
+    }
+  }
+  int err;
+  if (!chunk.empty()) {
+    err = luaL_loadbufferx(L, chunk.data(), chunk.size(), name, "b");
+  } else {
+    // Compile the script and cache the chunk. Debug information is kept so
+    // that error messages are the same as for the original script.
+    err = luaL_loadbuffer(L, s.data(), s.size(), name);
+    if (err == LUA_OK) {
+      LuaDump(L, &chunk, false);
+      MutexLock lock(&chunk_cache_mutex);
+      if (chunk_cache.size() >= kMaxCachedChunks) {
+        chunk_cache.clear();    // Simpler than LRU, the working set is small
+      }
+      chunk_cache[key] = chunk;
+    }
+  }
+
+  // Remember the function in this context. Its only upvalue is the globals
+  // table, which is never replaced.
+  if (err == LUA_OK) {                          // fn
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &loaded_chunks_key);     // fn C
+    lua_createtable(L, 3, 0);                   // fn C E
+    lua_pushlstring(L, s.data(), s.size());     // fn C E script
+    lua_rawseti(L, -2, 1);                      // fn C E
+    if (name) {
+      lua_pushstring(L, name);                  // fn C E name
+      lua_rawseti(L, -2, 2);                    // fn C E
+    }
+    lua_pushvalue(L, -3);                       // fn C E fn
+    lua_rawseti(L, -2, 3);                      // fn C E
+    lua_rawseti(L, -2, fast_hash);              // fn C
+    lua_pop(L, 1);                              // fn
+  }
+  return err;
+}
+
 bool Lua::Run(const std::string &s, bool s_is_filename, bool run_it,
               const char *name) {
   there_were_errors_ = false;
@@ -411,7 +708,7 @@ bool Lua::Run(const std::string &s, bool s_is_filename, bool run_it,
   if (s_is_filename) {
     err = luaL_loadfile(L_, s.c_str());
   } else {
-    err = luaL_loadbuffer(L_, s.data(), s.size(), name);
+    err = LoadBufferCached(L_, s, name);
   }
   if (err != LUA_OK) {
     char buffer[1000];
@@ -452,3 +749,201 @@ int Lua::PCall(int nargs, int nresults) {
   }
   return error;
 }
+
+// The registry key of the snapshot made by SnapshotGlobals(). The snapshot
+// maps each saved table T to {copy of T, metatable of T or false}.
+static char globals_snapshot_key;
+
+// Add the table at the top of the stack to the snapshot table at the given
+// stack index, and pop it.
+static void SnapshotTable(lua_State *L, int snapshot) {
+  lua_newtable(L);                              // T E
+  lua_newtable(L);                              // T E C
+  lua_pushnil(L);                               // T E C nil
+  while (lua_next(L, -4)) {                     // T E C k v
+    lua_pushvalue(L, -2);                       // T E C k v k
+    lua_insert(L, -2);                          // T E C k k v
+    lua_rawset(L, -4);                          // T E C k
+  }
+  lua_rawseti(L, -2, 1);                        // T E
+  if (!lua_getmetatable(L, -2)) {               // T E M
+    lua_pushboolean(L, 0);                      // T E false
+  }
+  lua_rawseti(L, -2, 2);                        // T E
+  lua_rawset(L, snapshot);
+}
+
+void Lua::SnapshotGlobals() {
+  int top = lua_gettop(L_);
+  lua_newtable(L_);                             // S
+  int snapshot = lua_gettop(L_);
+  lua_pushglobaltable(L_);                      // S G
+  lua_pushnil(L_);                              // S G nil
+  while (lua_next(L_, -2)) {                    // S G k v
+    if (lua_type(L_, -1) == LUA_TTABLE && !lua_rawequal(L_, -1, -3)) {
+      SnapshotTable(L_, snapshot);              // S G k
+    } else {
+      lua_pop(L_, 1);                           // S G k
+    }
+  }
+  SnapshotTable(L_, snapshot);                  // S
+  lua_pushliteral(L_, "");                      // S ""
+  if (lua_getmetatable(L_, -1)) {               // S "" M
+    SnapshotTable(L_, snapshot);                // S ""
+  }
+  lua_pop(L_, 1);                               // S
+  lua_pushvalue(L_, LUA_REGISTRYINDEX);         // S R
+  SnapshotTable(L_, snapshot);                  // S
+  lua_rawsetp(L_, LUA_REGISTRYINDEX, &globals_snapshot_key);
+  CHECK(lua_gettop(L_) == top);
+}
+
+void Lua::RestoreGlobals() {
+  int top = lua_gettop(L_);
+  CHECK(lua_rawgetp(L_, LUA_REGISTRYINDEX, &globals_snapshot_key) ==
+        LUA_TTABLE);                            // S
+  lua_pushnil(L_);                              // S nil
+  while (lua_next(L_, -2)) {                    // S T E
+    // Clear the fields of T that are not in the copy. Lua allows existing
+    // fields to be cleared during a traversal.
+    lua_rawgeti(L_, -1, 1);                     // S T E C
+    lua_pushnil(L_);                            // S T E C nil
+    while (lua_next(L_, -4)) {                  // S T E C k v
+      lua_pop(L_, 1);                           // S T E C k
+      lua_pushvalue(L_, -1);                    // S T E C k k
+      bool in_copy = lua_rawget(L_, -3) != LUA_TNIL;    // S T E C k v
+      lua_pop(L_, 1);                           // S T E C k
+      void *p = lua_touserdata(L_, -1);
+      if (!in_copy && p != &globals_snapshot_key && p != &loaded_chunks_key) {
+        lua_pushvalue(L_, -1);                  // S T E C k k
+        lua_pushnil(L_);                        // S T E C k k nil
+        lua_rawset(L_, -6);                     // S T E C k
+      }
+    }
+    // Copy all the saved fields back to T.
+    lua_pushnil(L_);                            // S T E C nil
+    while (lua_next(L_, -2)) {                  // S T E C k v
+      lua_pushvalue(L_, -2);                    // S T E C k v k
+      lua_insert(L_, -2);                       // S T E C k k v
+      lua_rawset(L_, -6);                       // S T E C k
+    }
+    lua_pop(L_, 1);                             // S T E
+    if (lua_rawgeti(L_, -1, 2) == LUA_TBOOLEAN) {       // S T E M
+      lua_pop(L_, 1);                           // S T E
+      lua_pushnil(L_);                          // S T E nil
+    }
+    lua_setmetatable(L_, -3);                   // S T E
+    lua_pop(L_, 1);                             // S T
+  }
+  lua_settop(L_, top);
+  there_were_errors_ = false;
+
+  // Collect everything that the previous script created.
+  lua_gc(L_, LUA_GCCOLLECT);
+}
+
+//***************************************************************************
+// Testing.
+
+namespace {
+
+struct TestLua : public Lua {
+  std::string errors;
+  void HandleStackBacktrace(const char *message) {}
+  void HandleError(const char *message) { errors += message; }
+};
+
+}  // namespace
+
+TEST_FUNCTION(LuaChunkCache) {
+  // Scripts run from the chunk cache must behave the same as when compiled
+  // from source, including having the same line numbers in errors.
+  const char *script = "x = 1.5 * 2\nlocal y = 'abc'\nerror('failed')\n";
+  std::string errors[2];
+  for (int i = 0; i < 2; i++) {
+    TestLua lua;
+    lua.UseStandardLibraries(true);
+    CHECK(!lua.RunString(script, true, "test script"));
+    LuaRawGetGlobal(lua.L(), "x");
+    CHECK(lua_tonumber(lua.L(), -1) == 3);
+    errors[i] = lua.errors;
+  }
+  printf("Error = %s\n", errors[0].c_str());
+  CHECK(errors[0] == errors[1]);
+  CHECK(errors[0].find("test script:3:") != std::string::npos);
+}
+
+TEST_FUNCTION(LuaRestoreGlobals) {
+  TestLua lua;
+  lua.UseStandardLibraries(true);
+  CHECK(lua.RunString("a = 1; T = {x=2}"));
+  lua.SnapshotGlobals();
+  for (int i = 0; i < 3; i++) {
+    // Each run should see the snapshot state and not the changes made by the
+    // previous runs.
+    CHECK(lua.RunString(
+        "assert(a == 1 and rawget(_G, 'b') == nil)\n"
+        "assert(T.x == 2 and T.y == nil and getmetatable(T) == nil)\n"
+        "assert(math.pi > 3 and math.foo == nil and ('x'):upper() == 'X')\n"
+        "a = 10; b = 20; T.x = 3; T.y = 4; math.foo = 1\n"
+        "string.upper = nil\n"
+        "setmetatable(T, {__index = function() return 5 end})\n"));
+    CHECK(lua.errors.empty());
+    lua.RestoreGlobals();
+  }
+}
+
+TEST_FUNCTION(LuaHashValue) {
+  TestLua lua;
+  lua.UseStandardLibraries(true);
+  auto hash_global = [&](const char *name, std::string *hash) {
+    LuaRawGetGlobal(lua.L(), name);
+    bool ok = LuaHashValue(lua.L(), -1, hash);
+    lua_pop(lua.L(), 1);
+    return ok;
+  };
+  std::string h1, h2, h3, h4;
+
+  // Equal tables have equal hashes regardless of how they were built, and
+  // cyclic references terminate.
+  CHECK(lua.RunString(
+      "A = {1, 2, x='a', y={3, 4}}; A.self = A\n"
+      "B = {x='a'}; for i = 1,100 do B[i+10] = i end\n"
+      "for i = 1,100 do B[i+10] = nil end; B[2] = 2; B[1] = 1\n"
+      "B.y = {3, 4}; B.self = B\n"));
+  CHECK(hash_global("A", &h1) && hash_global("B", &h2));
+  CHECK(h1 == h2);
+  CHECK(lua.RunString("B.y[2] = 5"));
+  CHECK(hash_global("B", &h3) && h3 != h1);
+
+  // Tables that share a value differently have different hashes.
+  CHECK(lua.RunString(
+      "local x = {1}\n"
+      "P = {a={k=x}, b=x}\n"
+      "Q = {a={k=x}}; Q.b = Q.a\n"
+      "R = {b=x}; R.a = {k=x}\n"));
+  CHECK(hash_global("P", &h1) && hash_global("Q", &h2) && h1 != h2);
+  CHECK(hash_global("R", &h3) && h3 == h1);
+
+  // The hash of a function covers its upvalues, including the globals it can
+  // see through _ENV.
+  CHECK(lua.RunString(
+      "local k = 2\n"
+      "g = 3\n"
+      "function F(x) return x * k + g end\n"
+      "function SetK(v) k = v end\n"));
+  CHECK(hash_global("F", &h1) && hash_global("F", &h2) && h1 == h2);
+  CHECK(lua.RunString("SetK(2.5)"));
+  CHECK(hash_global("F", &h2) && h2 != h1);
+  CHECK(lua.RunString("SetK(2)"));
+  CHECK(hash_global("F", &h3) && h3 == h1);
+  CHECK(lua.RunString("g = 4"));
+  CHECK(hash_global("F", &h4) && h4 != h1);
+
+  // Coroutines can not be hashed.
+  lua_newthread(lua.L());
+  lua_setglobal(lua.L(), "C");
+  CHECK(!hash_global("C", &h1));
+  CHECK(!hash_global("F", &h1));
+  CHECK(lua.errors.empty());
+}
@@ -19,6 +19,7 @@
 #include "lualib.h"
 #include "lauxlib.h"
 #include "error.h"
+#include "md5.h"
 #include <string>
 #include <map>
 
@@ -71,6 +72,11 @@ class LuaUserClass {
   // tried. If no operands of an operator support the operations then a runtime
   // error results.
   virtual bool Operator(lua_State *L, int op, int pos);
+
+  // Append a representation of this object's contents to 'ms', for
+  // LuaHashValue(). Return false if the contents can not be represented, which
+  // is the default.
+  virtual bool HashContents(md5_state_t *ms) const;
 };
 
 // Convenience class for running lua scripts.
@@ -97,7 +103,10 @@ class Lua {
   // times. For all errors the Error() function will be called once. If run_it
   // is false then the script is not run and the compiled chunk is left at the
   // top of the stack. If the name is provided to RunString() it will used in
-  // error messages.
+  // error messages. The chunks compiled by RunString() are kept in a small
+  // process-wide cache, so that later runs of a recently used name and script
+  // usually reuse the compiled chunk. The cache is emptied when it grows past
+  // a few tens of chunks, after which scripts are compiled again.
   bool RunString(const std::string &script, bool run_it = true,
                  const char *name = 0);
   bool RunFile(const std::string &filename, bool run_it = true);
@@ -105,6 +114,17 @@ class Lua {
   // Like lua_pcall but using the built-in message handler for errors.
   int PCall(int nargs, int nresults);
 
+  // Take a snapshot of the global state, i.e. the contents of the globals
+  // table, the registry, the string metatable and every table that is the
+  // value of a global (such as the standard libraries). RestoreGlobals()
+  // returns all those tables to their snapshot contents and collects the
+  // garbage, which is much cheaper than creating a new context and registering
+  // everything again. Changes to more deeply nested tables and to the upvalues
+  // of functions are not undone, so take the snapshot before running any
+  // script that keeps state in those places.
+  void SnapshotGlobals();
+  void RestoreGlobals();
+
   // Call these functions to display error messages or stack backtraces. These
   // differ from the Handle*() variants only in that they set the
   // ThereWereErrors() flag.
@@ -246,4 +266,17 @@ void LuaDump(lua_State *L, std::string *s, bool strip);
 // from the stack. See the caveat for the LuaDump() function.
 void LuaHash(lua_State *L, std::string *hash, bool strip);
 
+// Return in 'hash' the MD5 hash of the value at stack position 'index' and
+// everything that can be reached from it: the contents and metatables of
+// tables, the code and upvalues of functions (so for the globals table or a
+// function with an _ENV upvalue this covers all globals), and the contents of
+// LuaUserClass objects. Values with equal contents have the same hash, and the
+// hash of e.g. a function will change if anything that it can see changes,
+// except for state that is hidden inside C functions. Userdata that is not a
+// LuaUserClass object is regarded as such state, and is represented only by
+// its identity. Return false if some reachable value can not be hashed (e.g. a
+// coroutine or a LuaUserClass object that does not support HashContents()) or
+// if too many values are reachable. This does not modify the stack.
+bool LuaHashValue(lua_State *L, int index, std::string *hash);
+
 #endif
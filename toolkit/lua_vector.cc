@@ -146,6 +146,13 @@ int LuaVector::Length(lua_State *L) {
   return 1;
 }
 
+bool LuaVector::HashContents(md5_state_t *ms) const {
+  int n = v_.size();
+  md5_append(ms, (const md5_byte_t*) &n, sizeof(n));
+  md5_append(ms, (const md5_byte_t*) v_.data(), n * sizeof(JetNum));
+  return true;
+}
+
 bool LuaVector::Operator(lua_State *L, int op, int pos) {
   // Handle unary operations.
   if (op == LUA_OPUNM) {
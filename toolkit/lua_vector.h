@@ -31,6 +31,7 @@ class LuaVector : public LuaUserClass {
   int NewIndex(lua_State *L);
   int Length(lua_State *L);
   bool Operator(lua_State *L, int op, int pos);
+  bool HashContents(md5_state_t *ms) const;
 
   int LuaResize(lua_State *L);
 
@@ -15,6 +15,8 @@
 #include "testing.h"
 #include "random.h"
 #include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <stdio.h>
 #include <math.h>
 #include <sys/time.h>
@@ -132,6 +134,11 @@ struct InteractiveOptimizer::Implementation {
 
   explicit Implementation(InteractiveOptimizer *optimizer) {
     optimizer_ = optimizer;
+  }
+
+  // Start the optimizer thread. This is not done by the constructor because
+  // Optimize() uses the owning object's impl_, which must be set first.
+  void Start() {
     thread_ = new std::thread(&Implementation::Entry, this);
   }
 
@@ -174,6 +181,7 @@ void InteractiveOptimizer::Initialize2() {
 
   // Start the optimizer thread.
   impl_ = new Implementation(this);
+  impl_->Start();
 
   // Receive the first parameters to evaluate.
   ParametersAndFlag *p = impl_->parameters_pipe_.Receive();
@@ -588,15 +596,22 @@ AbstractOptimizer *OptimizerFactory(OptimizerType type) {
   switch (type) {
     case OptimizerType::UNKNOWN:
       return 0;
+#ifdef __TOOLKIT_USE_CERES__
     case OptimizerType::LEVENBERG_MARQUARDT:
     case OptimizerType::SUBSPACE_DOGLEG:
       return new CeresInteractiveOptimizer(type);
+    case OptimizerType::REPEATED_LEVENBERG_MARQUARDT:
+      return new RepeatedOptimizer(OptimizerType::LEVENBERG_MARQUARDT);
+#else
+    case OptimizerType::LEVENBERG_MARQUARDT:
+    case OptimizerType::SUBSPACE_DOGLEG:
+    case OptimizerType::REPEATED_LEVENBERG_MARQUARDT:
+      return 0;           // Ceres is not available
+#endif
     case OptimizerType::RANDOM_SEARCH:
       return new RandomSearchOptimizer;
     case OptimizerType::NELDER_MEAD:
       return new NelderMeadOptimizer;
-    case OptimizerType::REPEATED_LEVENBERG_MARQUARDT:
-      return new RepeatedOptimizer(OptimizerType::LEVENBERG_MARQUARDT);
   }
   return 0;
 };
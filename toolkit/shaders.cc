@@ -107,6 +107,33 @@ Shader &SmoothShader() {
   return shader;
 }
 
+Shader &ColormapShader() {
+  static Shader shader(
+    // Vertex shader.
+    " #version 330 core\n"
+    " uniform mat4 transform;"
+    " uniform float minval, maxval;"
+    " in vec3 vertex;"
+    " in float value;"
+    " out float x;"                   // Colormap position, 0..1 in range
+    " void main() {"
+    "   gl_Position = transform * vec4(vertex, 1.0);"
+    "   x = (value - minval) / (maxval - minval);"
+    " }",
+    // Fragment shader. Texel centers are at (i+0.5)/n, so map x=0 to the
+    // first texel center and x=1 to the last.
+    " #version 330 core\n"
+    " uniform sampler1D colormap;"
+    " in float x;"
+    " out vec4 fragment_color;"
+    " void main() {"
+    "   float n = float(textureSize(colormap, 0));"
+    "   float t = (clamp(x, 0.0, 1.0) * (n - 1.0) + 0.5) / n;"
+    "   fragment_color = vec4(texture(colormap, t).rgb, 1.0);"
+    " }");
+  return shader;
+}
+
 Shader &PerPixelLightingShader() {
   static Shader shader(
     // Light direction in eye space (unit length vector).
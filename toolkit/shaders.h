@@ -70,6 +70,12 @@ Shader &FlatShader();
 // "vertex_color").
 Shader &SmoothShader();
 
+// A shader that colors each vertex by looking up its value (via a float vertex
+// attribute called "value") in a colormap in a 1D texture (via a uniform
+// sampler1D called "colormap"). Values from the uniform floats "minval" to
+// "maxval" span the whole colormap, values outside that range are clamped.
+Shader &ColormapShader();
+
 // A shader program that does per-pixel lighting for nice looking surfaces.
 // Once this is enabled, just draw your geometry.
 Shader &PerPixelLightingShader();
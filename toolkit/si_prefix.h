@@ -13,6 +13,8 @@
 #ifndef __TOOLKIT_SI_PREFIX_H__
 #define __TOOLKIT_SI_PREFIX_H__
 
+#include <string.h>
+
 // Return an SI prefix character for the number 'n', and an associated scale,
 // such that the number can be displayed as 'n/scale <character>'. The
 // precision is the number of decimal places that will be displayed, e.g. for
@@ -44,4 +46,35 @@ inline char SIPrefix(double n, double precision, double *scale) {
   return ' ';
 }
 
+// Convert a units name ('m', 'mil', etc) to a distance scale in meters or
+// return -1 if the unit name is not known.
+
+inline double DistanceScale(const char *unit_name) {
+  if (unit_name == 0)
+    return -1;
+  if (strcmp(unit_name, "nm") == 0)
+    return 1e-9;
+  if (strcmp(unit_name, "micron") == 0)
+    return 1e-6;
+  if (strcmp(unit_name, "mm") == 0)
+    return 1e-3;
+  if (strcmp(unit_name, "cm") == 0)
+    return 1e-2;
+  if (strcmp(unit_name, "m") == 0)
+    return 1;
+  if (strcmp(unit_name, "km") == 0)
+    return 1000;
+  if (strcmp(unit_name, "mil") == 0 || strcmp(unit_name, "thou") == 0)
+    return 2.54e-5;
+  if (strcmp(unit_name, "inch") == 0)
+    return 2.54e-2;
+  if (strcmp(unit_name, "foot") == 0)
+    return 0.3048;
+  if (strcmp(unit_name, "yard") == 0)
+    return 0.9144;
+  if (strcmp(unit_name, "mile") == 0)
+    return 1609.344;
+  return -1;
+}
+
 #endif
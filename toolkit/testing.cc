@@ -21,6 +21,7 @@ struct TestFunction {
   const char *name = 0, *filename = 0;
   int line_number = 0;
   bool runtest = false;     // True if test was mentioned on the command line
+  bool manual = false;      // True if only run when mentioned
 };
 
 // This should be a pointer to a vector, not the vector itself, because
@@ -29,7 +30,8 @@ struct TestFunction {
 static std::vector<TestFunction> *test_functions;
 
 void testing::__RegisterTest(void (*fn)(), const char *name,
-                             const char *filename, int line_number) {
+                             const char *filename, int line_number,
+                             bool manual) {
   if (!test_functions) {
     test_functions = new std::vector<TestFunction>;
   }
@@ -38,6 +40,7 @@ void testing::__RegisterTest(void (*fn)(), const char *name,
   t.name = name;
   t.filename = filename;
   t.line_number = line_number;
+  t.manual = manual;
   test_functions->push_back(t);
 }
 
@@ -52,15 +55,18 @@ void testing::RunAll() {
     run_subset |= test_functions->at(i).runtest;
   }
 
-  // Run all tests.
+  // Run all tests, except for manual tests that were not mentioned.
+  int count = 0;
   for (int i = 0; i < test_functions->size(); i++) {
-    if (!run_subset || test_functions->at(i).runtest) {
+    if (run_subset ? test_functions->at(i).runtest :
+                     !test_functions->at(i).manual) {
       printf("********** Test %s (%s:%d)\n", test_functions->at(i).name,
             test_functions->at(i).filename, test_functions->at(i).line_number);
       test_functions->at(i).fn();
+      count++;
     }
   }
-  printf("%d tests passed!\n", (int) test_functions->size());
+  printf("%d tests passed!\n", count);
 }
 
 void testing::ProcessCommandLineArguments(int argc, char **argv) {
@@ -24,9 +24,10 @@ namespace testing {
   // "-runtest=name". If any are found, run only those tests.
   void ProcessCommandLineArguments(int argc, char **argv);
 
-  // Internal function called by TEST_FUNCTION.
+  // Internal function called by TEST_FUNCTION and MANUAL_TEST_FUNCTION.
   void __RegisterTest(void (*fn)(), const char *name,
-                      const char *filename, int line_number);
+                      const char *filename, int line_number,
+                      bool manual = false);
 
 }
 
@@ -40,4 +41,16 @@ namespace testing {
   } __register_test_##name; \
   void __RunTest_##name()
 
+// Like TEST_FUNCTION, but the test is only run when it is named with
+// -runtest=name, not by RunAll() on its own. This is for slow benchmarks.
+#define MANUAL_TEST_FUNCTION(name) \
+  void __RunTest_##name(); \
+  static struct __RegisterTest_##name { \
+    __RegisterTest_##name() { \
+      testing::__RegisterTest(__RunTest_##name, #name, __FILE__, __LINE__, \
+                              true); \
+    } \
+  } __register_test_##name; \
+  void __RunTest_##name()
+
 #endif
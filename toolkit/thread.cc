@@ -11,14 +11,125 @@
 // more details.
 
 #include "thread.h"
+#include "testing.h"
+#include "trace.h"
 #include <vector>
 #include <thread>
+#include <atomic>
+#include <algorithm>
+#include <condition_variable>
 
 //***************************************************************************
 // Parallel for loops.
 
+namespace {
+
+// The state of one ParallelFor() call. The range is split into one part per
+// participating thread. Each part has an atomic counter of the next unclaimed
+// item, so that a thread can claim chunks from its own part and steal them
+// from other parts without locking.
+struct Job {
+  struct Part {
+    std::atomic<int> next;
+    int last;
+  };
+  std::function<void(int)> *fn;
+  int chunk_size;
+  int num_parts;
+  Part *parts;
+  int num_helpers = 0;          // Number of pool threads that joined this job
+  TraceParent trace_parent;     // Parent of traces in the pool threads
+  int active_helpers = 0;       // Number of pool threads still running it
+
+  // Claim and run chunks until there are none left, starting with part 'p'.
+  void Run(int p) {
+    for (int k = 0; k < num_parts; k++) {
+      Part &part = parts[(p + k) % num_parts];
+      for (;;) {
+        int i = part.next.fetch_add(chunk_size);
+        if (i > part.last) {
+          break;
+        }
+        int end = std::min(i + chunk_size - 1, part.last);
+        for (; i <= end; i++) {
+          (*fn)(i);
+        }
+      }
+    }
+  }
+};
+
+// A process-wide pool of worker threads. Jobs that want help are in 'jobs_'.
+// Idle workers take the most recently added job (which will be the innermost
+// one if ParallelFor() calls are nested). Threads are created as needed and
+// never exit.
+class ThreadPool {
+ public:
+  static ThreadPool *Get() {
+    static ThreadPool *pool = new ThreadPool;   // Never deleted
+    return pool;
+  }
+
+  void Run(Job *job) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      while (num_threads_ < job->num_parts - 1) {
+        std::thread(&ThreadPool::Worker, this).detach();
+        num_threads_++;
+      }
+      jobs_.push_back(job);
+    }
+    work_cv_.notify_all();
+
+    // The calling thread runs part 0. When it returns every item has been
+    // claimed, but pool threads may still be running some of them.
+    job->Run(0);
+    std::unique_lock<std::mutex> lock(mutex_);
+    RemoveJob(job);
+    done_cv_.wait(lock, [job]() { return job->active_helpers == 0; });
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable work_cv_, done_cv_;
+  std::vector<Job*> jobs_;      // Jobs that can take more helpers
+  int num_threads_ = 0;
+
+  void RemoveJob(Job *job) {
+    auto it = std::find(jobs_.begin(), jobs_.end(), job);
+    if (it != jobs_.end()) {
+      jobs_.erase(it);
+    }
+  }
+
+  void Worker() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      work_cv_.wait(lock, [this]() { return !jobs_.empty(); });
+      Job *job = jobs_.back();
+      int part = ++job->num_helpers;
+      job->active_helpers++;
+      if (job->num_helpers == job->num_parts - 1) {
+        RemoveJob(job);
+      }
+      lock.unlock();
+      {
+        TraceAdopt adopt(job->trace_parent);
+        job->Run(part);
+      }
+      lock.lock();
+      if (--job->active_helpers == 0) {
+        done_cv_.notify_all();
+      }
+    }
+  }
+};
+
+}  // namespace
+
 void ParallelFor(int first, int last, int n, std::function<void(int)> fn) {
   // For a single thread we just call the function directly.
+  n = std::min(n, last - first + 1);
   if (n <= 1) {
     for (int i = first; i <= last; i++) {
       fn(i);
@@ -26,12 +137,36 @@ void ParallelFor(int first, int last, int n, std::function<void(int)> fn) {
     return;
   }
 
-  // Otherwise we have multiple worker threads call the function.
-  std::mutex mutex;             // Protect 'first' and 'last' arguments
+  // Otherwise split the range into n parts, and use chunks that are small
+  // enough to allow for some load balancing by stealing.
+  const int count = last - first + 1;
+  std::vector<Job::Part> parts(n);
+  for (int i = 0; i < n; i++) {
+    parts[i].next = first + int(int64_t(count) * i / n);
+    parts[i].last = first + int(int64_t(count) * (i + 1) / n) - 1;
+  }
+  Job job;
+  job.fn = &fn;
+  job.chunk_size = std::max(1, count / (n * 4));
+  job.num_parts = n;
+  job.parts = parts.data();
+  job.trace_parent = TraceCurrent();
+  ThreadPool::Get()->Run(&job);
+}
 
-  // Worker function.
+int IdealThreadCount() {
+  return std::max(1, int(std::thread::hardware_concurrency()));
+}
+
+//***************************************************************************
+// Testing.
+
+// The previous ParallelFor() implementation, which creates new threads for
+// every call. This is kept for benchmarking.
+static void SpawningParallelFor(int first, int last, int n,
+                                std::function<void(int)> fn) {
+  std::mutex mutex;
   auto worker = [&]() {
-    // Keep calling fn() until there are no more values left.
     for (;;) {
       int item = 0;
       {
@@ -45,16 +180,63 @@ void ParallelFor(int first, int last, int n, std::function<void(int)> fn) {
       fn(item);
     }
   };
-
-  // Start worker threads.
   std::vector<std::thread*> threads;
   for (int i = 0; i < n; i++) {
     threads.push_back(new std::thread(worker));
   }
-
-  // Wait for all worker threads to complete.
   for (int i = 0; i < n; i++) {
     threads[i]->join();
     delete threads[i];
   }
 }
+
+TEST_FUNCTION(ParallelFor) {
+  // Check that every item is visited exactly once, for various range sizes
+  // and thread counts, including nested loops.
+  for (int n = 1; n <= 8; n++) {
+    for (int count = 0; count < 100; count += 7) {
+      std::vector<std::atomic<int>> visits(count * count);
+      for (int i = 0; i < visits.size(); i++) {
+        visits[i] = 0;
+      }
+      ParallelFor(0, count - 1, n, [&](int i) {
+        ParallelFor(0, count - 1, n, [&](int j) {
+          visits[i * count + j]++;
+        });
+      });
+      for (int i = 0; i < visits.size(); i++) {
+        CHECK(visits[i] == 1);
+      }
+    }
+  }
+
+  // Check a range that doesn't start at zero.
+  std::atomic<int> sum(0);
+  ParallelFor(10, 20, 4, [&](int i) { sum += i; });
+  CHECK(sum == 165);
+}
+
+TEST_FUNCTION(ParallelForBenchmark) {
+  // Compare the dispatch overhead of pooled and spawned threads, for small
+  // loops like the ones the FDTD code runs every time step.
+  const int kNumThreads = 4;
+  const int kNumCalls = 2000;
+  const int kNumItems = 64;
+  std::atomic<int> counter(0);
+  auto fn = [&](int i) { counter++; };
+  for (int pooled = 0; pooled < 2; pooled++) {
+    counter = 0;
+    double start_time = Now();
+    for (int i = 0; i < kNumCalls; i++) {
+      if (pooled) {
+        ParallelFor(0, kNumItems - 1, kNumThreads, fn);
+      } else {
+        SpawningParallelFor(0, kNumItems - 1, kNumThreads, fn);
+      }
+    }
+    double time = Now() - start_time;
+    CHECK(counter == kNumCalls * kNumItems);
+    printf("%s: %.3f us per call\n", pooled ? "Pooled" : "Spawning",
+           time * 1e6 / kNumCalls);
+  }
+}
@@ -35,7 +35,15 @@ class MutexLock {
 #define MutexLock(x) static_assert(0, "MutexLock missing variable name");
 
 // Run the function 'fn' from 'n' threads with integer arguments in the range
-// [first..last].
+// [first..last]. The calling thread is one of the 'n' threads, the others come
+// from a process-wide pool of persistent worker threads, so calling this often
+// is cheap. The range is divided between the threads, which process their own
+// part in chunks and then steal chunks from the others when they run out of
+// work. It is safe to call ParallelFor() from within 'fn'.
 void ParallelFor(int first, int last, int n, std::function<void(int)> fn);
 
+// The number of threads that can usefully run at once on this machine, at
+// least 1. This is like QThread::idealThreadCount() but does not need Qt.
+int IdealThreadCount();
+
 #endif
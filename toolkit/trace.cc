@@ -13,9 +13,12 @@
 #include "trace.h"
 #include "thread.h"
 #include "mystring.h"
+#include "testing.h"
 #include <vector>
-#include <map>
+#include <atomic>
+#include <chrono>
 #include <thread>
+#include <string.h>
 
 using std::vector;
 
@@ -24,94 +27,335 @@ using std::vector;
 
 #undef Trace
 
-#ifdef QT_CORE_LIB
-#include <QElapsedTimer>
-static QElapsedTimer stopwatch;
-#define STOPWATCH_START stopwatch.start();
-#define STOPWATCH_MICROSECONDS (stopwatch.nsecsElapsed() / 1000)
-#endif
-
-static std::mutex trace_mutex;          // Protects variables below
+// Time in microseconds since some fixed point.
+static long NowMicroseconds() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
 // Information for each trace object.
 struct TraceInfo {
   const char *what;                     // Description of trace object
-  long time_us;                         // Time taken, not counting sub levels
-  long total_time_us;                   // Total time taken
-  int level;                            // 'Indent' level of this trace
-  bool finalized;                       // time fields have final values
+  long start_us, end_us;                // end_us is -1 if not yet finished
+  TraceParent parent;                   // Parent trace object, if any
 };
 
-// A stack of trace objects, one stack for each thread.
-struct TraceStack {
+// The traces of one thread. Only the owning thread modifies this, except for
+// 'in_use' which is cleared when the thread exits so that the buffer can be
+// reused.
+struct ThreadTrace {
+  int id;                               // Index into all_traces
+  std::atomic<bool> in_use;
+  int epoch = -1;                       // TraceStart() count for 'trace'
   vector<TraceInfo> trace;
-  int trace_level;                      // Current 'indent' level
-  TraceStack() : trace_level(0) {}
+  vector<int> open;                     // Slots of live trace objects
 };
-static std::map<std::thread::id, TraceStack> stack;
+
+static std::mutex trace_mutex;          // Protects all_traces
+static vector<ThreadTrace*> all_traces; // Never shrinks, never deleted
+static std::atomic<int> trace_epoch(0); // Incremented by TraceStart()
+static std::atomic<long> trace_start_us(NowMicroseconds());
+static thread_local TraceParent adopted_parent;
+
+// Get the calling thread's trace buffer, creating it the first time. This is
+// the only place that locks, and only once per thread. When the thread exits
+// its buffer is released for reuse by other threads. Traces made after that
+// (e.g. by the destructors of other thread_local objects) are not recorded,
+// and for them this returns 0.
+static thread_local ThreadTrace *thread_trace = 0;
+static thread_local bool thread_trace_released = false;
+static ThreadTrace *GetThreadTrace() {
+  if (thread_trace || thread_trace_released) {
+    return thread_trace;
+  }
+  struct Holder {
+    ThreadTrace *t = 0;
+    ~Holder() {
+      if (t) {
+        thread_trace = 0;
+        thread_trace_released = true;
+        t->in_use = false;
+      }
+    }
+  };
+  static thread_local Holder holder;
+  {
+    MutexLock lock(&trace_mutex);
+    for (int i = 0; i < all_traces.size() && !holder.t; i++) {
+      if (!all_traces[i]->in_use) {
+        holder.t = all_traces[i];
+      }
+    }
+    if (!holder.t) {
+      holder.t = new ThreadTrace;
+      holder.t->id = all_traces.size();
+      all_traces.push_back(holder.t);
+    }
+    holder.t->in_use = true;
+    holder.t->epoch = -1;
+    holder.t->trace.clear();
+    holder.t->open.clear();
+  }
+  thread_trace = holder.t;
+  return holder.t;
+}
 
 void TraceStart() {
-  MutexLock lock(&trace_mutex);
-  STOPWATCH_START
-  auto &s = stack[std::this_thread::get_id()];
-  s.trace.clear();
-  s.trace_level = 0;
+  trace_start_us = NowMicroseconds();
+  trace_epoch++;
 }
 
 Trace::Trace(const char *what) {
-  MutexLock lock(&trace_mutex);
-  auto &s = stack[std::this_thread::get_id()];
-  slot_ = s.trace.size();
-  s.trace.resize(s.trace.size() + 1);
-  s.trace.back().what = what;
-  s.trace.back().total_time_us = STOPWATCH_MICROSECONDS;
-  s.trace.back().time_us = 0;
-  s.trace.back().level = s.trace_level;
-  s.trace.back().finalized = false;       // total_time_us is just start time
-  s.trace_level++;
+  ThreadTrace *t = GetThreadTrace();
+  if (!t) {
+    slot_ = -1;
+    return;
+  }
+  // Discard traces from before the last TraceStart(), unless some trace
+  // objects are still live.
+  int epoch = trace_epoch.load(std::memory_order_relaxed);
+  if (t->epoch != epoch && t->open.empty()) {
+    t->trace.clear();
+    t->epoch = epoch;
+  }
+  slot_ = t->trace.size();
+  t->trace.resize(t->trace.size() + 1);
+  TraceInfo &info = t->trace.back();
+  info.what = what;
+  info.start_us = NowMicroseconds();
+  info.end_us = -1;
+  info.parent = TraceCurrent();
+  t->open.push_back(slot_);
 }
 
 Trace::~Trace() {
+  ThreadTrace *t = GetThreadTrace();
+  if (!t || slot_ < 0) {
+    return;
+  }
+  CHECK(!t->open.empty() && t->open.back() == slot_);   // Not properly nested
+  t->trace[slot_].end_us = NowMicroseconds();
+  t->open.pop_back();
+}
+
+TraceParent TraceCurrent() {
+  ThreadTrace *t = GetThreadTrace();
+  if (!t || t->open.empty()) {
+    return adopted_parent;
+  }
+  TraceParent p;
+  p.thread = t->id;
+  p.slot = t->open.back();
+  return p;
+}
+
+TraceAdopt::TraceAdopt(TraceParent parent) {
+  saved_ = adopted_parent;
+  adopted_parent = parent;
+}
+
+TraceAdopt::~TraceAdopt() {
+  adopted_parent = saved_;
+}
+
+// A consistent view of all current traces, for reporting. The calling thread
+// is first.
+static void GetCurrentTraces(vector<ThreadTrace*> *traces) {
+  ThreadTrace *self = GetThreadTrace();
+  int epoch = trace_epoch;
   MutexLock lock(&trace_mutex);
-  auto &s = stack[std::this_thread::get_id()];
-  s.trace_level--;
-  CHECK(s.trace_level >= 0);
-  CHECK(slot_ < s.trace.size()); // Likely TraceStart() while trace objects live
-  // Compute total time taken.
-  s.trace[slot_].total_time_us = STOPWATCH_MICROSECONDS -
-                                 s.trace[slot_].total_time_us;
-  s.trace[slot_].finalized = true;
-  // To compute time_us, subtract the time taken by other trace objects
-  // between this object's slot and the end of the trace array.
-  s.trace[slot_].time_us = s.trace[slot_].total_time_us;
-  for (int i = slot_ + 1; i < s.trace.size(); i++) {
-    CHECK(s.trace[i].finalized);  // Likely using threads or recursion
-    s.trace[slot_].time_us -= s.trace[i].time_us;
+  traces->clear();
+  if (self && self->epoch == epoch) {
+    traces->push_back(self);
+  }
+  for (int i = 0; i < all_traces.size(); i++) {
+    if (all_traces[i] != self && all_traces[i]->epoch == epoch) {
+      traces->push_back(all_traces[i]);
+    }
   }
 }
 
 void TraceReport(std::string *report) {
-  MutexLock lock(&trace_mutex);
-  auto &s = stack[std::this_thread::get_id()];
-  if (s.trace.empty()) {
+  vector<ThreadTrace*> traces;
+  GetCurrentTraces(&traces);
+  const long now = NowMicroseconds();
+
+  // Build the tree of call paths. Each trace object is mapped to a node, and
+  // the children of each node are kept in the order they were first seen.
+  struct Node {
+    const char *what;
+    int level, calls = 0;
+    long time_us = 0;                   // Time taken, not counting sub levels
+    long total_time_us = 0;             // Total time taken
+    vector<int> children;
+  };
+  vector<Node> nodes(1);                // Node 0 is the root
+  nodes[0].what = "";
+  nodes[0].level = -1;
+  vector<vector<int>> node_of(all_traces.size());   // [thread][slot] -> node
+  for (int i = 0; i < traces.size(); i++) {
+    node_of[traces[i]->id].resize(traces[i]->trace.size(), -1);
+  }
+  std::function<int(TraceParent)> find_node = [&](TraceParent p) -> int {
+    if (p.thread < 0 || p.thread >= node_of.size() ||
+        p.slot >= node_of[p.thread].size()) {
+      return 0;                         // Root, or parent not reported
+    }
+    int &n = node_of[p.thread][p.slot];
+    if (n < 0) {
+      const TraceInfo &info = all_traces[p.thread]->trace[p.slot];
+      int parent = find_node(info.parent);
+      for (int c : nodes[parent].children) {
+        if (strcmp(nodes[c].what, info.what) == 0) {
+          n = c;
+        }
+      }
+      if (n < 0) {
+        n = nodes.size();
+        nodes.push_back(Node());
+        nodes.back().what = info.what;
+        nodes.back().level = nodes[parent].level + 1;
+        nodes[parent].children.push_back(n);
+      }
+    }
+    return n;
+  };
+
+  // Accumulate times. Time spent in children in the same thread is not
+  // counted as the parent's own time, but time in other threads is since it
+  // runs concurrently.
+  long total = 0;
+  for (int i = 0; i < traces.size(); i++) {
+    for (int j = 0; j < traces[i]->trace.size(); j++) {
+      const TraceInfo &info = traces[i]->trace[j];
+      TraceParent p;
+      p.thread = traces[i]->id;
+      p.slot = j;
+      Node &node = nodes[find_node(p)];
+      long time = (info.end_us >= 0 ? info.end_us : now) - info.start_us;
+      node.calls++;
+      node.total_time_us += time;
+      node.time_us += time;
+      total += time;
+      if (info.parent.thread == traces[i]->id) {
+        nodes[find_node(info.parent)].time_us -= time;
+        total -= time;
+      }
+    }
+  }
+  if (nodes.size() == 1) {
     report->clear();
     return;
   }
-  long total = 0;
-  for (int i = 0; i < s.trace.size(); i++) {
-    total += s.trace[i].time_us;
+
+  // Print the tree depth first.
+  StringPrintf(report, "Trace report. %%total %%parent (of subtree) calls"
+               "\n%10.3fms 100.00%%                Total\n",
+               double(total) / 1e3);
+  nodes[0].total_time_us = total;
+  std::function<void(int)> print = [&](int n) {
+    for (int c : nodes[n].children) {
+      const Node &node = nodes[c];
+      StringAppendF(report, "%10.3fms %6.2f%% %6.2f%% %6d %*c%s\n",
+          double(node.time_us) / 1e3,
+          double(node.time_us) / total * 100.0,
+          double(node.total_time_us) / nodes[n].total_time_us * 100.0,
+          node.calls, (node.level + 1) * 2, ' ', node.what);
+      print(c);
+    }
+  };
+  print(0);
+}
+
+void TraceChromeJSON(std::string *json) {
+  vector<ThreadTrace*> traces;
+  GetCurrentTraces(&traces);
+  const long now = NowMicroseconds();
+  const long start = trace_start_us;
+  *json = "{\"traceEvents\":[";
+  bool first = true;
+  for (int i = 0; i < traces.size(); i++) {
+    for (int j = 0; j < traces[i]->trace.size(); j++) {
+      const TraceInfo &info = traces[i]->trace[j];
+      long end = info.end_us >= 0 ? info.end_us : now;
+      std::string name;
+      for (const char *s = info.what; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+          name += '\\';
+        }
+        name += *s;
+      }
+      StringAppendF(json, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,"
+                    "\"tid\":%d,\"ts\":%ld,\"dur\":%ld}", first ? "" : ",",
+                    name.c_str(), traces[i]->id, info.start_us - start,
+                    end - info.start_us);
+      first = false;
+    }
   }
-  StringPrintf(report, "Trace report. %%total %%parent (of subtree)"
-               "\n%10.3fms 100.00%%         Total\n", double(total) / 1e3);
-  vector<long> stack;
-  stack.push_back(total);   // Stack of total times taken at different levels
-  for (int i = 0; i < s.trace.size(); i++) {
-    stack.resize(s.trace[i].level + 2);
-    stack.back() = s.trace[i].total_time_us;
-    StringAppendF(report, "%10.3fms %6.2f%% %6.2f%% %*c%s\n",
-            double(s.trace[i].time_us) / 1e3,
-            double(s.trace[i].time_us) / total * 100.0,
-            double(s.trace[i].total_time_us) / stack[s.trace[i].level] * 100.0,
-            (s.trace[i].level + 1) * 2, ' ', s.trace[i].what);
+  *json += "\n]}\n";
+}
+
+//***************************************************************************
+// Testing.
+
+TEST_FUNCTION(Trace) {
+  // Traces in worker threads are aggregated under the trace that called
+  // ParallelFor().
+  TraceStart();
+  {
+    Trace trace1("outer");
+    for (int i = 0; i < 2; i++) {
+      Trace trace2("inner");
+    }
+    ParallelFor(0, 99, 4, [](int i) {
+      Trace trace3("worker");
+    });
+  }
+  std::string report;
+  TraceReport(&report);
+  printf("%s", report.c_str());
+  CHECK(report.find("      1   outer\n") != std::string::npos);
+  CHECK(report.find("      2     inner\n") != std::string::npos);
+  CHECK(report.find("    100     worker\n") != std::string::npos);
+
+  std::string json;
+  TraceChromeJSON(&json);
+  int count = 0;
+  for (size_t pos = 0; (pos = json.find("\"ph\":\"X\"", pos)) !=
+       std::string::npos; pos++) {
+    count++;
+  }
+  CHECK(count == 103);
+
+  // Traces from before TraceStart() are not reported.
+  TraceStart();
+  TraceReport(&report);
+  CHECK(report.empty());
+
+  // A trace made by a thread_local destructor after the thread's buffer has
+  // been released is not recorded, as the buffer may now belong to another
+  // thread.
+  struct TraceOnExit {
+    ~TraceOnExit() { Trace trace("on_exit"); }
+  };
+  std::thread([]() {
+    static thread_local TraceOnExit on_exit;    // Destroyed after the buffer
+    (void) on_exit;
+    Trace trace("thread");
+  }).join();
+  TraceReport(&report);
+  printf("%s", report.c_str());
+  CHECK(report.find(" thread\n") != std::string::npos);
+  CHECK(report.find("on_exit") == std::string::npos);
+}
+
+TEST_FUNCTION(TraceBenchmark) {
+  const int kCount = 100000;
+  TraceStart();
+  double start_time = Now();
+  for (int i = 0; i < kCount; i++) {
+    Trace trace("benchmark");
   }
+  printf("%.1f ns per trace\n", (Now() - start_time) * 1e9 / kCount);
+  TraceStart();
 }
@@ -11,19 +11,25 @@
 // more details.
 
 // Simple performance monitoring, for measuring where all the time is spent.
-// This is thread safe, although calling trace functions from multiple threads
-// will not necessarily generate sensible results.
+// Each thread records its traces in its own buffer without any locking, so
+// traces are cheap enough to use in inner loops. Traces made by pool threads
+// inside ParallelFor() are attributed to the trace that was open in the
+// calling thread. TraceReport() and TraceChromeJSON() combine the traces from
+// all threads, they should be called when no other threads are tracing (e.g.
+// not during a ParallelFor()).
 
 #ifndef __TRACE_H__
 #define __TRACE_H__
 
 #include <string>
 
-// Start a new trace.
+// Start a new trace. Trace objects that are live in other threads when this
+// is called will not be reported.
 void TraceStart();
 
 // Measure the time taken during the lifetime of this class, labelling it with
-// 'what'.
+// 'what', which must be a string that lives for the duration of the program
+// (e.g. a string literal or __func__).
 class Trace {
  public:
   explicit Trace(const char *what);
@@ -32,9 +38,36 @@ class Trace {
   int slot_;
 };
 
-// Stop the trace and get the full trace report.
+// Identifies the innermost live Trace object of a thread.
+struct TraceParent {
+  int thread = -1, slot = -1;
+};
+
+// Return the innermost live Trace object of the calling thread, or the
+// adopted parent (see below) if there is none.
+TraceParent TraceCurrent();
+
+// While this object is live, traces in the calling thread that have no other
+// live Trace object as a parent are made children of 'parent' (which should
+// be a TraceCurrent() of another thread). This is used when a thread does work
+// on behalf of another thread.
+class TraceAdopt {
+ public:
+  explicit TraceAdopt(TraceParent parent);
+  ~TraceAdopt();
+ private:
+  TraceParent saved_;
+};
+
+// Stop the trace and get the full trace report. Traces from all threads are
+// aggregated by their call path, i.e. by their own label and the labels of
+// their parents.
 void TraceReport(std::string *report);
 
+// Get all traces since TraceStart() in the Chrome trace event JSON format,
+// for viewing as a timeline in e.g. chrome://tracing or Perfetto.
+void TraceChromeJSON(std::string *json);
+
 // Catch bug where variable name is omitted, e.g. Trace("foo");
 #define Trace(x) static_assert(0, "Trace missing variable name");
 